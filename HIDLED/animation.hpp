@@ -0,0 +1,417 @@
+//
+//  animation.hpp
+//  HIDLED
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+#ifndef animation_hpp
+#define animation_hpp
+
+#include "hid.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <sstream>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace spak {
+
+    /** The timeline of one LED: a sorted list of (offset, value) keyframes,
+     * each holding until the next one. Looping patterns restart after period().
+     */
+    class led_pattern {
+    public:
+        using duration = std::chrono::nanoseconds;
+
+        struct keyframe {
+            duration at;
+            CFIndex value;
+        };
+
+    private:
+        std::vector<keyframe> _frames;
+        duration _period;
+        bool _loop;
+
+        led_pattern(std::vector<keyframe> frames, duration period, bool loop) :
+            _frames(std::move(frames)), _period(period), _loop(loop) {}
+
+        /// Software PWM: @p steps sub-cycles per @p period, each one on for @p duty of its length.
+        static void append_pwm(std::vector<keyframe> &frames, duration start, duration length, CFIndex off, CFIndex on, double duty) {
+            duty = std::min(1.0, std::max(0.0, duty));
+            duration const on_time = std::chrono::duration_cast<duration>(length * duty);
+            if (on_time > duration::zero()) {
+                frames.push_back({start, on});
+            }
+            if (on_time < length) {
+                frames.push_back({start + on_time, off});
+            }
+        }
+
+    public:
+        static led_pattern constant(CFIndex value) {
+            return {{{duration::zero(), value}}, duration::zero(), false};
+        }
+
+        static led_pattern blink(CFIndex off, CFIndex on, duration on_time, duration off_time) {
+            return {{{duration::zero(), on}, {on_time, off}}, on_time + off_time, true};
+        }
+
+        /// Plays each (value, duration) pair in turn.
+        static led_pattern sequence(std::vector<std::pair<CFIndex, duration>> const &steps, bool loop) {
+            std::vector<keyframe> frames;
+            duration at = duration::zero();
+            for (auto const &step : steps) {
+                frames.push_back({at, step.first});
+                at += step.second;
+            }
+            return {std::move(frames), at, loop};
+        }
+
+        /// Holds @p on for @p duty of each @p period, i.e. a slow PWM on an on/off LED.
+        static led_pattern pwm(CFIndex off, CFIndex on, double duty, duration period) {
+            std::vector<keyframe> frames;
+            append_pwm(frames, duration::zero(), period, off, on, duty);
+            return {std::move(frames), period, true};
+        }
+
+        /** Ramps from @p min to @p max and back over @p period in @p steps
+         * steps. When the LED has intermediate levels (logical_max() > 1) each
+         * step is a level; on/off LEDs get the level as the duty cycle of a
+         * PWM sub-cycle instead.
+         */
+        static led_pattern breathe(CFIndex min, CFIndex max, duration period, std::size_t steps) {
+            std::vector<keyframe> frames;
+            steps = std::max<std::size_t>(steps, 2);
+            duration const step = period / static_cast<duration::rep>(steps);
+            for (std::size_t i = 0; i < steps; ++i) {
+                // Triangle wave in [0, 1]
+                double const phase = static_cast<double>(i) / static_cast<double>(steps);
+                double const level = phase < 0.5 ? 2 * phase : 2 * (1 - phase);
+                duration const at = step * static_cast<duration::rep>(i);
+                if (max - min > 1) {
+                    frames.push_back({at, min + static_cast<CFIndex>(level * static_cast<double>(max - min) + 0.5)});
+                } else {
+                    append_pwm(frames, at, step, min, max, level);
+                }
+            }
+            return {std::move(frames), period, true};
+        }
+
+        duration period() const {
+            return _period;
+        }
+
+        bool loop() const {
+            return _loop;
+        }
+
+        std::vector<keyframe> const &frames() const {
+            return _frames;
+        }
+
+        /// True if a non looping pattern has played its last keyframe by @p t.
+        bool finished_at(duration t) const {
+            return not _loop and t >= _period;
+        }
+
+        CFIndex value_at(duration t) const {
+            if (_frames.empty()) {
+                return 0;
+            }
+            if (_loop and _period > duration::zero()) {
+                t %= _period;
+            }
+            auto it = std::upper_bound(_frames.begin(), _frames.end(), t, [](duration at, keyframe const &frame) {
+                return at < frame.at;
+            });
+            return it == _frames.begin() ? _frames.front().value : std::prev(it)->value;
+        }
+
+        /** Parses a pattern description, checking values against [@p min, @p max]:
+         *     on | off | <value>
+         *     blink:<on_ms>:<off_ms>
+         *     pwm:<duty_percent>:<period_ms>
+         *     breathe:<period_ms>[:<steps>]
+         *     seq:<value>@<ms>,<value>@<ms>,...[,loop]
+         */
+        static bool parse(std::string const &spec, CFIndex min, CFIndex max, led_pattern &pattern) {
+            using std::chrono::milliseconds;
+            std::vector<std::string> parts;
+            std::stringstream ss(spec);
+            for (std::string part; std::getline(ss, part, ':');) {
+                parts.push_back(part);
+            }
+            if (parts.empty()) {
+                return false;
+            }
+            auto number = [](std::string const &str, long &value) {
+                char *end = nullptr;
+                value = std::strtol(str.c_str(), &end, 10);
+                return not str.empty() and *end == '\0';
+            };
+            long a = 0, b = 0;
+            if (parts.size() == 1) {
+                if (parts[0] == "on") {
+                    pattern = constant(max);
+                } else if (parts[0] == "off") {
+                    pattern = constant(min);
+                } else if (number(parts[0], a) and a >= min and a <= max) {
+                    pattern = constant(a);
+                } else {
+                    return false;
+                }
+            } else if (parts[0] == "blink" and parts.size() == 3 and number(parts[1], a) and number(parts[2], b) and a >= 0 and b >= 0) {
+                pattern = blink(min, max, milliseconds(a), milliseconds(b));
+            } else if (parts[0] == "pwm" and parts.size() == 3 and number(parts[1], a) and number(parts[2], b) and b > 0) {
+                pattern = pwm(min, max, static_cast<double>(a) / 100.0, milliseconds(b));
+            } else if (parts[0] == "breathe" and (parts.size() == 2 or parts.size() == 3) and number(parts[1], a) and a > 0) {
+                long steps = 32;
+                if (parts.size() == 3 and not (number(parts[2], steps) and steps > 1)) {
+                    return false;
+                }
+                pattern = breathe(min, max, milliseconds(a), static_cast<std::size_t>(steps));
+            } else if (parts[0] == "seq" and parts.size() == 2) {
+                std::vector<std::pair<CFIndex, duration>> steps;
+                bool loop = false;
+                std::stringstream ss_steps(parts[1]);
+                for (std::string step; std::getline(ss_steps, step, ',');) {
+                    std::size_t const at = step.find('@');
+                    if (step == "loop") {
+                        loop = true;
+                    } else if (at != std::string::npos and number(step.substr(0, at), a) and number(step.substr(at + 1), b)
+                               and a >= min and a <= max and b >= 0)
+                    {
+                        steps.emplace_back(a, milliseconds(b));
+                    } else {
+                        return false;
+                    }
+                }
+                if (steps.empty()) {
+                    return false;
+                }
+                pattern = sequence(steps, loop);
+            } else {
+                return false;
+            }
+            return true;
+        }
+    };
+
+
+    struct animation_stats {
+        uint64_t ticks;
+        uint64_t writes;
+        uint64_t skipped_writes;
+        uint64_t missed_deadlines;
+        /// Ticks whose commit failed; their values are written again on the next tick.
+        uint64_t failed_commits;
+        std::chrono::nanoseconds max_lateness;
+    };
+
+
+    /** Plays one led_pattern per track at a fixed tick rate. Deadlines are
+     * absolute (start + n * tick) so that the timing error does not
+     * accumulate; ticks that are already past when the thread wakes up are
+     * counted as missed and skipped rather than played in a burst. Only
+     * tracks whose value changes are written, and all the changes of a tick
+     * are committed together.
+     *
+     * Sink must provide stage(std::size_t track, CFIndex value) and
+     * IOReturn commit(). What a failed commit staged is not taken as written
+     * and goes out again on the next tick; once the patterns are over, that
+     * is tried for max_retries ticks in a row at most.
+     */
+    template <class Sink>
+    class animation_player {
+        using clock = std::chrono::steady_clock;
+        using duration = led_pattern::duration;
+
+        static constexpr unsigned max_retries = 10;
+
+        Sink &_sink;
+        duration _tick;
+        std::vector<led_pattern> _tracks;
+        std::thread _thread;
+        std::atomic<bool> _running;
+        std::atomic<uint64_t> _ticks;
+        std::atomic<uint64_t> _writes;
+        std::atomic<uint64_t> _skipped_writes;
+        std::atomic<uint64_t> _missed_deadlines;
+        std::atomic<uint64_t> _failed_commits;
+        std::atomic<duration::rep> _max_lateness;
+
+        bool finished_at(duration t) const {
+            return std::all_of(_tracks.begin(), _tracks.end(), [=](led_pattern const &track) {
+                return track.finished_at(t);
+            });
+        }
+
+        void loop(clock::time_point stop_at) {
+            std::vector<CFIndex> last(_tracks.size(), 0);
+            std::vector<bool> written(_tracks.size(), false);
+            std::vector<std::size_t> staged;
+            staged.reserve(_tracks.size());
+            unsigned failures_in_a_row = 0;
+            clock::time_point const start = clock::now();
+            for (uint64_t tick = 0; _running.load(std::memory_order_relaxed); ++tick) {
+                clock::time_point const deadline = start + _tick * static_cast<duration::rep>(tick);
+                if (deadline >= stop_at) {
+                    break;
+                }
+                std::this_thread::sleep_until(deadline);
+                duration const lateness = clock::now() - deadline;
+                if (lateness.count() > _max_lateness.load(std::memory_order_relaxed)) {
+                    _max_lateness.store(lateness.count(), std::memory_order_relaxed);
+                }
+                if (lateness >= _tick) {
+                    uint64_t const behind = static_cast<uint64_t>(lateness / _tick);
+                    _missed_deadlines.fetch_add(behind, std::memory_order_relaxed);
+                    tick += behind;
+                }
+                // The timeline advances by the tick, not by the wall clock, so that it is reproducible
+                duration const t = _tick * static_cast<duration::rep>(tick);
+                staged.clear();
+                for (std::size_t i = 0; i < _tracks.size(); ++i) {
+                    CFIndex const value = _tracks[i].value_at(t);
+                    if (written[i] and last[i] == value) {
+                        _skipped_writes.fetch_add(1, std::memory_order_relaxed);
+                        continue;
+                    }
+                    _sink.stage(i, value);
+                    last[i] = value;
+                    staged.push_back(i);
+                }
+                if (not staged.empty()) {
+                    if (_sink.commit() == kIOReturnSuccess) {
+                        for (std::size_t i : staged) {
+                            written[i] = true;
+                        }
+                        _writes.fetch_add(staged.size(), std::memory_order_relaxed);
+                        failures_in_a_row = 0;
+                    } else {
+                        ++failures_in_a_row;
+                        for (std::size_t i : staged) {
+                            written[i] = false;
+                        }
+                        _failed_commits.fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+                _ticks.fetch_add(1, std::memory_order_relaxed);
+                if (finished_at(t) and (failures_in_a_row == 0 or failures_in_a_row > max_retries)) {
+                    break;
+                }
+            }
+            _running.store(false);
+        }
+
+    public:
+        /// @p tick must be positive.
+        animation_player(Sink &sink, duration tick = std::chrono::milliseconds(10)) :
+            _sink(sink), _tick(tick), _running(false), _ticks(0), _writes(0),
+            _skipped_writes(0), _missed_deadlines(0), _failed_commits(0), _max_lateness(0)
+        {
+            assert(tick > duration::zero());
+        }
+
+        animation_player(animation_player const &) = delete;
+        animation_player &operator=(animation_player const &) = delete;
+
+        ~animation_player() {
+            stop();
+        }
+
+        /// Tracks can only be added while the player is stopped.
+        std::size_t add_track(led_pattern pattern) {
+            assert(not _running);
+            _tracks.push_back(std::move(pattern));
+            return _tracks.size() - 1;
+        }
+
+        /// Plays on a dedicated thread until stop(), @p for_at_most elapses or all the tracks are over.
+        void start(duration for_at_most = duration::max()) {
+            stop();
+            _running = true;
+            clock::time_point const now = clock::now();
+            clock::time_point const stop_at = for_at_most >= clock::time_point::max() - now ? clock::time_point::max() : now + for_at_most;
+            _thread = std::thread([=] { loop(stop_at); });
+        }
+
+        /// Like start(), but blocks until playback ends.
+        void run(duration for_at_most = duration::max()) {
+            start(for_at_most);
+            _thread.join();
+        }
+
+        void stop() {
+            _running = false;
+            if (_thread.joinable()) {
+                _thread.join();
+            }
+        }
+
+        bool is_running() const {
+            return _running;
+        }
+
+        animation_stats stats() const {
+            return {_ticks.load(), _writes.load(), _skipped_writes.load(), _missed_deadlines.load(),
+                _failed_commits.load(), duration(_max_lateness.load())};
+        }
+    };
+
+
+    /// Drives the tracks onto elements of one device, one transaction per tick.
+    template <class Backend>
+    class basic_hid_elements_sink {
+        std::vector<basic_hid_device_element<Backend>> _elements;
+        basic_hid_device_transaction<Backend> _transaction;
+        IOReturn _last_error;
+    public:
+        basic_hid_elements_sink(basic_hid_device<Backend> &device, std::vector<basic_hid_device_element<Backend>> elements) :
+            _elements(std::move(elements)), _transaction(device.transaction()), _last_error(kIOReturnSuccess) {}
+
+        void stage(std::size_t track, CFIndex value) {
+            _transaction.stage(_elements[track], value);
+        }
+
+        IOReturn commit() {
+            IOReturn const res = _transaction.commit();
+            if (res != kIOReturnSuccess) {
+                _last_error = res;
+                _transaction.clear();
+            }
+            return res;
+        }
+
+        IOReturn last_error() const {
+            return _last_error;
+        }
+    };
+
+    using hid_elements_sink = basic_hid_elements_sink<native_backend>;
+
+}
+
+#endif /* animation_hpp */
@@ -0,0 +1,446 @@
+//
+//  async.hpp
+//  HIDLED
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+#ifndef async_hpp
+#define async_hpp
+
+#include "hid.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace spak {
+
+    template <class Backend>
+    class basic_hid_io_reactor;
+
+
+    /** The outcome of an operation submitted to a basic_hid_io_reactor.
+     * result() is kIOReturnTimeout if the operation did not complete within
+     * its timeout, kIOReturnAborted if it was cancelled first. Copies share
+     * the same operation.
+     */
+    class hid_io_future {
+    public:
+        /// Called once, on the thread that completes the operation; must not block.
+        using callback = std::function<void(IOReturn result, CFIndex value)>;
+
+    private:
+        template <class>
+        friend class basic_hid_io_reactor;
+
+        struct state {
+            std::mutex mutex;
+            std::condition_variable cv;
+            bool done = false;
+            IOReturn result = kIOReturnSuccess;
+            CFIndex value = 0;
+            callback on_done;
+        };
+
+        std::shared_ptr<state> _state;
+
+        explicit hid_io_future(callback on_done) : _state(std::make_shared<state>()) {
+            _state->on_done = std::move(on_done);
+        }
+
+        /// The first completion wins: the device answering, the timeout or cancel(). Returns false for the others.
+        static bool complete(state &s, IOReturn result, CFIndex value) {
+            callback on_done;
+            {
+                std::lock_guard<std::mutex> lock(s.mutex);
+                if (s.done) {
+                    return false;
+                }
+                s.done = true;
+                s.result = result;
+                s.value = value;
+                on_done.swap(s.on_done);
+            }
+            s.cv.notify_all();
+            if (on_done) {
+                on_done(result, value);
+            }
+            return true;
+        }
+
+    public:
+        hid_io_future() = default;
+
+        bool valid() const {
+            return _state != nullptr;
+        }
+
+        bool ready() const {
+            std::lock_guard<std::mutex> lock(_state->mutex);
+            return _state->done;
+        }
+
+        /// Returns ready().
+        bool wait_for(std::chrono::steady_clock::duration timeout) const {
+            std::unique_lock<std::mutex> lock(_state->mutex);
+            return _state->cv.wait_for(lock, timeout, [&] { return _state->done; });
+        }
+
+        void wait() const {
+            std::unique_lock<std::mutex> lock(_state->mutex);
+            _state->cv.wait(lock, [&] { return _state->done; });
+        }
+
+        /// Waits for the operation to complete, one way or another.
+        IOReturn result() const {
+            wait();
+            return _state->result;
+        }
+
+        /// The value read, or written; meaningful only if result() is kIOReturnSuccess.
+        CFIndex value() const {
+            wait();
+            return _state->value;
+        }
+
+        /** Completes the operation with kIOReturnAborted, unless it is
+         * complete already; returns false then. An operation that the device
+         * is already carrying out is not interrupted, its result is dropped.
+         */
+        bool cancel() {
+            return complete(*_state, kIOReturnAborted, 0);
+        }
+    };
+
+
+    /** Runs element reads and writes in the background, so that any number
+     * of them can be in flight and a keyboard that stops answering holds up
+     * only the operations addressed to it. Each operation has a timeout and
+     * can be cancelled through its hid_io_future.
+     *
+     * Operations on the same device run one at a time, in order, on a small
+     * pool of workers; a device whose operation is running is skipped by the
+     * other workers. The reactor thread keeps the timeouts: an operation
+     * still queued at its deadline is completed with kIOReturnTimeout and
+     * dropped; one still running is completed likewise and its worker is
+     * presumed stuck and replaced, as in device_discovery, by one of at most
+     * @p spares replacement workers. The stuck worker exits whenever the
+     * backend call returns, if ever, and gives its spare back. Once all the
+     * spares are stuck, timed out workers are not replaced: the pool runs
+     * short until one of the calls returns, rather than growing a thread for
+     * every keyboard that stops answering.
+     *
+     * The workers make the same blocking calls as synchronous access. Both
+     * platforms could do without them, IOHIDDeviceSetValueWithCallback and
+     * IOHIDDeviceGetValueWithCallback on a run loop, evdev and hidraw nodes
+     * opened O_NONBLOCK under epoll, but the backends do not offer those
+     * paths yet.
+     *
+     * Operations go through the element's value proxy, like synchronous
+     * ones: reads may be served by the shadow registers of the device, and
+     * writes update them, so that the two kinds of access agree.
+     */
+    template <class Backend = native_backend>
+    class basic_hid_io_reactor {
+    public:
+        using clock = std::chrono::steady_clock;
+
+    private:
+        enum struct op_kind {
+            get,
+            set
+        };
+
+        struct lane;
+
+        struct op {
+            op_kind kind;
+            /// Holds on to the shadow registers of the device it came from.
+            basic_hid_device_element<Backend> element;
+            CFIndex value;
+            clock::time_point deadline;
+            std::shared_ptr<hid_io_future::state> state;
+            lane *owner;
+            bool running;
+            /// Timed out while running; its worker has been replaced.
+            bool abandoned;
+        };
+
+        /// The operations of one device, in submission order.
+        struct lane {
+            typename Backend::device_ref device;
+            std::shared_ptr<void const> retained;
+            std::deque<std::shared_ptr<op>> queue;
+            bool busy;
+        };
+
+        struct deadline_entry {
+            clock::time_point deadline;
+            std::weak_ptr<op> target;
+
+            bool operator<(deadline_entry const &other) const {
+                // Earliest on top of the priority queue
+                return deadline > other.deadline;
+            }
+        };
+
+        /// Shared with the workers, which may outlive the reactor when stuck in a backend call.
+        struct core {
+            std::mutex mutex;
+            std::condition_variable work_cv;
+            std::condition_variable reactor_cv;
+            std::vector<std::unique_ptr<lane>> lanes;
+            std::priority_queue<deadline_entry> deadlines;
+            /// Where workers resume their round over the lanes.
+            std::size_t next_lane = 0;
+            std::size_t spares = 0;
+            /// Replaced workers still in a backend call, at most spares.
+            std::size_t stuck = 0;
+            bool stopping = false;
+        };
+
+        static bool is_done(op const &o) {
+            std::lock_guard<std::mutex> lock(o.state->mutex);
+            return o.state->done;
+        }
+
+        /// Takes the next operation of a lane that is not busy, dropping the cancelled ones on the way.
+        static std::shared_ptr<op> take(core &c) {
+            for (std::size_t n = 0; n < c.lanes.size(); ++n) {
+                lane &l = *c.lanes[(c.next_lane + n) % c.lanes.size()];
+                if (l.busy) {
+                    continue;
+                }
+                while (not l.queue.empty() and is_done(*l.queue.front())) {
+                    l.queue.pop_front();
+                }
+                if (l.queue.empty()) {
+                    continue;
+                }
+                c.next_lane = (c.next_lane + n + 1) % c.lanes.size();
+                std::shared_ptr<op> o = std::move(l.queue.front());
+                l.queue.pop_front();
+                l.busy = true;
+                o->running = true;
+                return o;
+            }
+            return nullptr;
+        }
+
+        /// The proxies retry, and borrow the device from the pool if it is not open.
+        static IOReturn perform(op &o, CFIndex &value) {
+            if (o.kind == op_kind::set) {
+                value = o.value;
+                return o.element.template value<CFIndex>().set(o.value).error();
+            }
+            hid_result<CFIndex> const read = o.element.template value<CFIndex>().get();
+            value = read.value_or(0);
+            return read.error();
+        }
+
+        static void work(std::shared_ptr<core> c) {
+            std::unique_lock<std::mutex> lock(c->mutex);
+            while (true) {
+                std::shared_ptr<op> o = take(*c);
+                if (o == nullptr) {
+                    if (c->stopping) {
+                        return;
+                    }
+                    c->work_cv.wait(lock);
+                    continue;
+                }
+                lock.unlock();
+                CFIndex value = 0;
+                IOReturn res = kIOReturnError;
+                try {
+                    res = perform(*o, value);
+                } catch (...) {
+                }
+                hid_io_future::complete(*o->state, res, value);
+                lock.lock();
+                o->running = false;
+                o->owner->busy = false;
+                if (o->abandoned) {
+                    // Replaced already; the lane is free again, let the others know
+                    --c->stuck;
+                    c->work_cv.notify_one();
+                    return;
+                }
+            }
+        }
+
+        static void react(std::shared_ptr<core> c, std::size_t workers) {
+            for (std::size_t i = 0; i < workers; ++i) {
+                std::thread(work, c).detach();
+            }
+            std::unique_lock<std::mutex> lock(c->mutex);
+            std::vector<std::shared_ptr<hid_io_future::state>> expired;
+            while (true) {
+                auto const now = clock::now();
+                while (not c->deadlines.empty() and c->deadlines.top().deadline <= now) {
+                    std::shared_ptr<op> o = c->deadlines.top().target.lock();
+                    c->deadlines.pop();
+                    if (o == nullptr) {
+                        continue;
+                    }
+                    if (o->running and not is_done(*o) and c->stuck < c->spares) {
+                        o->abandoned = true;
+                        ++c->stuck;
+                        std::thread(work, c).detach();
+                    } else if (not o->running) {
+                        auto &queue = o->owner->queue;
+                        queue.erase(std::remove(queue.begin(), queue.end(), o), queue.end());
+                    }
+                    expired.push_back(o->state);
+                }
+                if (not expired.empty()) {
+                    // Completion callbacks may submit, so they run unlocked
+                    lock.unlock();
+                    for (auto &state : expired) {
+                        hid_io_future::complete(*state, kIOReturnTimeout, 0);
+                    }
+                    expired.clear();
+                    lock.lock();
+                    continue;
+                }
+                if (c->stopping) {
+                    break;
+                }
+                // Let go of the devices nothing is addressed to any more
+                c->lanes.erase(std::remove_if(c->lanes.begin(), c->lanes.end(), [](std::unique_ptr<lane> const &l) {
+                    return not l->busy and l->queue.empty();
+                }), c->lanes.end());
+                if (c->deadlines.empty()) {
+                    c->reactor_cv.wait(lock);
+                } else {
+                    // A copy: submit() may reallocate the heap while this waits
+                    clock::time_point const next = c->deadlines.top().deadline;
+                    c->reactor_cv.wait_until(lock, next);
+                }
+            }
+        }
+
+        hid_io_future submit(op_kind kind, basic_hid_device<Backend> const &device, basic_hid_device_element<Backend> const &element,
+                             CFIndex value, clock::duration timeout, hid_io_future::callback on_done)
+        {
+            hid_io_future future(std::move(on_done));
+            auto o = std::make_shared<op>(op{kind, element, value, clock::now() + timeout, future._state, nullptr, false, false});
+            {
+                std::lock_guard<std::mutex> lock(_core->mutex);
+                if (_core->stopping) {
+                    o = nullptr;
+                } else {
+                    auto it = std::find_if(_core->lanes.begin(), _core->lanes.end(), [&](std::unique_ptr<lane> const &l) {
+                        return l->device == device.native_ref();
+                    });
+                    if (it == _core->lanes.end()) {
+                        _core->lanes.push_back(std::unique_ptr<lane>(new lane{device.native_ref(), device.retain(), {}, false}));
+                        it = _core->lanes.end() - 1;
+                    }
+                    o->owner = it->get();
+                    o->owner->queue.push_back(o);
+                    bool const earliest = _core->deadlines.empty() or o->deadline < _core->deadlines.top().deadline;
+                    _core->deadlines.push(deadline_entry{o->deadline, o});
+                    if (earliest) {
+                        _core->reactor_cv.notify_one();
+                    }
+                }
+            }
+            if (o == nullptr) {
+                hid_io_future::complete(*future._state, kIOReturnAborted, 0);
+            } else {
+                _core->work_cv.notify_one();
+            }
+            return future;
+        }
+
+        std::shared_ptr<core> _core;
+        std::thread _reactor;
+
+    public:
+        /// Starts the reactor thread and @p workers workers; up to @p spares more replace those stuck past a timeout.
+        explicit basic_hid_io_reactor(std::size_t workers = 2, std::size_t spares = 4) : _core(std::make_shared<core>()) {
+            _core->spares = spares;
+            _reactor = std::thread(react, _core, std::max<std::size_t>(workers, 1));
+        }
+
+        basic_hid_io_reactor(basic_hid_io_reactor const &) = delete;
+        basic_hid_io_reactor &operator=(basic_hid_io_reactor const &) = delete;
+
+        /** Completes every operation not complete yet with kIOReturnAborted,
+         * the running ones too, since nothing keeps their timeouts any more:
+         * they go on in the background like cancelled ones, and their results
+         * are dropped.
+         */
+        ~basic_hid_io_reactor() {
+            std::vector<std::shared_ptr<hid_io_future::state>> pending;
+            {
+                std::lock_guard<std::mutex> lock(_core->mutex);
+                _core->stopping = true;
+                for (auto &l : _core->lanes) {
+                    l->queue.clear();
+                }
+                // Every operation not timed out yet has its deadline here, queued or running
+                while (not _core->deadlines.empty()) {
+                    if (std::shared_ptr<op> o = _core->deadlines.top().target.lock()) {
+                        pending.push_back(o->state);
+                    }
+                    _core->deadlines.pop();
+                }
+            }
+            for (auto &state : pending) {
+                hid_io_future::complete(*state, kIOReturnAborted, 0);
+            }
+            _core->work_cv.notify_all();
+            _core->reactor_cv.notify_all();
+            _reactor.join();
+        }
+
+        /// Workers replaced after a timeout and still waiting on the backend.
+        std::size_t stuck_workers() const {
+            std::lock_guard<std::mutex> lock(_core->mutex);
+            return _core->stuck;
+        }
+
+        /// Reads @p element of @p device; the value comes with the future, or the callback.
+        hid_io_future get(basic_hid_device<Backend> const &device, basic_hid_device_element<Backend> const &element,
+                          clock::duration timeout, hid_io_future::callback on_done = nullptr)
+        {
+            return submit(op_kind::get, device, element, 0, timeout, std::move(on_done));
+        }
+
+        hid_io_future set(basic_hid_device<Backend> const &device, basic_hid_device_element<Backend> const &element, CFIndex value,
+                          clock::duration timeout, hid_io_future::callback on_done = nullptr)
+        {
+            return submit(op_kind::set, device, element, value, timeout, std::move(on_done));
+        }
+    };
+
+    using hid_io_reactor = basic_hid_io_reactor<native_backend>;
+
+}
+
+#endif /* async_hpp */
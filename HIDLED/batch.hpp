@@ -0,0 +1,233 @@
+//
+//  batch.hpp
+//  HIDLED
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+#ifndef batch_hpp
+#define batch_hpp
+
+#include "hid.hpp"
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace spak {
+
+    /// Empty fields match any device.
+    struct device_selector {
+        std::string product;
+        std::string manufacturer;
+
+        bool operator==(device_selector const &other) const {
+            return product == other.product and manufacturer == other.manufacturer;
+        }
+    };
+
+    enum struct led_op {
+        set,
+        toggle
+    };
+
+    struct led_command {
+        device_selector selector;
+        std::size_t led;
+        led_op op;
+        CFIndex value;
+    };
+
+    /// The commands for one device; Device is whatever resolves a selector, e.g. a std::unique_ptr<hid_device>.
+    template <class Device>
+    struct led_command_group {
+        Device device;
+        std::vector<led_command> commands;
+    };
+
+
+    /** Splits a script line into tokens on blanks. Double quotes group blanks
+     * into a token (also midway, as in product="USB Keyboard") and '#' starts
+     * a comment.
+     */
+    inline std::vector<std::string> tokenize(std::string const &line) {
+        std::vector<std::string> tokens;
+        std::string token;
+        bool in_token = false;
+        bool in_quotes = false;
+        for (char c : line) {
+            if (in_quotes) {
+                if (c == '"') {
+                    in_quotes = false;
+                } else {
+                    token.push_back(c);
+                }
+            } else if (c == '"') {
+                in_quotes = in_token = true;
+            } else if (c == '#') {
+                break;
+            } else if (c == ' ' or c == '\t' or c == '\r' or c == '\n') {
+                if (in_token) {
+                    tokens.push_back(std::move(token));
+                    token.clear();
+                    in_token = false;
+                }
+            } else {
+                token.push_back(c);
+                in_token = true;
+            }
+        }
+        if (in_token) {
+            tokens.push_back(std::move(token));
+        }
+        return tokens;
+    }
+
+
+    /** Parses the selector starting at @p tokens[@p i]: either '*', which
+     * stands for @p default_selector, or one or more of product=<product>,
+     * manufacturer=<manufacturer>. Leaves @p i past it; returns false if
+     * there is none.
+     */
+    inline bool parse_device_selector(std::vector<std::string> const &tokens, std::size_t &i, device_selector const &default_selector,
+                                      device_selector &selector)
+    {
+        static std::string const product_key = "product=";
+        static std::string const manufacturer_key = "manufacturer=";
+        if (i < tokens.size() and tokens[i] == "*") {
+            selector = default_selector;
+            ++i;
+            return true;
+        }
+        // An explicit selector does not inherit from the default one
+        selector = device_selector();
+        bool has_selector = false;
+        for (; i < tokens.size(); ++i, has_selector = true) {
+            if (tokens[i].compare(0, product_key.size(), product_key) == 0) {
+                selector.product = tokens[i].substr(product_key.size());
+            } else if (tokens[i].compare(0, manufacturer_key.size(), manufacturer_key) == 0) {
+                selector.manufacturer = tokens[i].substr(manufacturer_key.size());
+            } else {
+                break;
+            }
+        }
+        return has_selector;
+    }
+
+
+    /// Reads the whole of @p token into @p number; a stream alone stops at the first character it can't use.
+    template <class Number>
+    inline bool parse_whole_number(std::string const &token, Number &number) {
+        std::stringstream ss(token);
+        return ss >> number and ss.eof();
+    }
+
+
+    /** Parses a sequence of commands, each of the form
+     *     <selector> <led_idx> set <value>
+     *     <selector> <led_idx> toggle
+     * where <selector> is as in parse_device_selector().
+     * On error, returns false and describes the problem in @p error.
+     */
+    inline bool parse_led_commands(std::vector<std::string> const &tokens, device_selector const &default_selector,
+                                   std::vector<led_command> &commands, std::string &error)
+    {
+        std::size_t i = 0;
+        auto fail = [&](std::string const &what) {
+            error = what + " at token " + std::to_string(i + 1);
+            return false;
+        };
+        while (i < tokens.size()) {
+            led_command command{default_selector, 0, led_op::set, 0};
+            if (not parse_device_selector(tokens, i, default_selector, command.selector)) {
+                return fail("Expected a device selector");
+            }
+            if (i >= tokens.size()) {
+                return fail("Missing LED index");
+            }
+            // An unsigned stream read takes "-1" and wraps it around
+            if (tokens[i].empty() or tokens[i][0] == '-' or not parse_whole_number(tokens[i], command.led)) {
+                return fail("Invalid LED index '" + tokens[i] + "'");
+            }
+            if (++i >= tokens.size()) {
+                return fail("Missing operation");
+            }
+            if (tokens[i] == "toggle") {
+                command.op = led_op::toggle;
+                ++i;
+            } else if (tokens[i] == "set") {
+                command.op = led_op::set;
+                if (++i >= tokens.size()) {
+                    return fail("Missing value");
+                }
+                if (not parse_whole_number(tokens[i], command.value)) {
+                    return fail("Invalid value '" + tokens[i] + "'");
+                }
+                ++i;
+            } else {
+                return fail("Unknown operation '" + tokens[i] + "'");
+            }
+            commands.push_back(std::move(command));
+        }
+        return true;
+    }
+
+
+    /** Groups commands by the device their selector designates, in order of
+     * first appearance; within a group the order is preserved. Different
+     * selectors may designate the same keyboard, e.g. '*' and the product it
+     * stands for, hence @p resolve turns each distinct selector into a Device
+     * (false if there is none, and its commands are dropped) and @p same
+     * tells whether two Devices are one.
+     */
+    template <class Device, class Resolve, class Same>
+    inline std::vector<led_command_group<Device>> group_by_device(std::vector<led_command> const &commands, Resolve resolve, Same same) {
+        std::vector<led_command_group<Device>> groups;
+        static std::size_t const none = static_cast<std::size_t>(-1);
+        // Selector to group index, or none
+        std::vector<std::pair<device_selector, std::size_t>> resolved;
+        for (led_command const &command : commands) {
+            auto it = std::find_if(resolved.begin(), resolved.end(), [&](std::pair<device_selector, std::size_t> const &r) {
+                return r.first == command.selector;
+            });
+            if (it == resolved.end()) {
+                Device device = resolve(command.selector);
+                std::size_t group = none;
+                if (device) {
+                    auto const same_group = std::find_if(groups.begin(), groups.end(), [&](led_command_group<Device> const &g) {
+                        return same(g.device, device);
+                    });
+                    group = static_cast<std::size_t>(same_group - groups.begin());
+                    if (same_group == groups.end()) {
+                        groups.push_back(led_command_group<Device>{std::move(device), {}});
+                    }
+                }
+                resolved.emplace_back(command.selector, group);
+                it = resolved.end() - 1;
+            }
+            if (it->second != none) {
+                groups[it->second].commands.push_back(command);
+            }
+        }
+        return groups;
+    }
+
+}
+
+#endif /* batch_hpp */
@@ -0,0 +1,380 @@
+//
+//  broadcast.hpp
+//  HIDLED
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+#ifndef broadcast_hpp
+#define broadcast_hpp
+
+#include "hid.hpp"
+#include "batch.hpp"
+#include "monitor.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace spak {
+
+    /// An LED write addressed to several keyboards at once.
+    struct led_write {
+        /// Index among the LED elements, used only if usage is 0.
+        std::size_t led;
+        /// LED usage, e.g. kHIDUsage_LED_CapsLock; the same LED sits at different indices on different keyboards.
+        uint32_t usage;
+        led_op op;
+        CFIndex value;
+    };
+
+    struct broadcast_result {
+        std::string product;
+        std::string manufacturer;
+        /// kIOReturnTimeout if the device did not finish in time, kIOReturnBadArgument if it has no such LED.
+        IOReturn result;
+    };
+
+
+    /** Writes LEDs on a set of keyboards concurrently. Every keyboard has a
+     * thread of its own that opens it and then writes whatever was posted
+     * since its last write, in a single transaction, so that each device has
+     * at most one report in flight and a slow one holds back nobody else.
+     * Writes posted while a device is busy are merged, the last set of an
+     * LED winning over the earlier ones.
+     */
+    template <class Backend = native_backend>
+    class basic_led_broadcast {
+        struct target {
+            basic_hid_device<Backend> device;
+            std::shared_ptr<void const> retained;
+            std::string product;
+            std::string manufacturer;
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::vector<led_write> pending;
+            /// Ticket of the last writes posted, and of the last ones done.
+            uint64_t requested;
+            uint64_t completed;
+            IOReturn result;
+            bool stopping;
+            bool exited;
+
+            explicit target(basic_hid_device<Backend> const &d) :
+                device(d), retained(d.retain()), product(d.product()), manufacturer(d.manufacturer()),
+                requested(0), completed(0), result(kIOReturnSuccess), stopping(false), exited(false)
+            {}
+        };
+
+        static basic_hid_device_element<Backend> *find_led(basic_hid_device<Backend> &device, basic_hid_device_elements_enumerator<Backend> &elements, led_write const &write) {
+            if (write.usage == 0) {
+                return write.led < elements.size() ? &elements[write.led] : nullptr;
+            }
+            return device.element(kHIDPage_LEDs, write.usage);
+        }
+
+        static IOReturn apply(basic_hid_device<Backend> &device, basic_hid_device_elements_enumerator<Backend> &elements, std::vector<led_write> const &writes) {
+            IOReturn res = kIOReturnSuccess;
+            try {
+                basic_hid_device_transaction<Backend> transaction = device.transaction();
+                for (led_write const &write : writes) {
+                    basic_hid_device_element<Backend> *element = find_led(device, elements, write);
+                    if (element == nullptr) {
+                        res = kIOReturnBadArgument;
+                        continue;
+                    }
+                    CFIndex value = write.value;
+                    if (write.op == led_op::toggle) {
+                        if (not transaction.staged_value_of(*element, value)) {
+                            hid_result<CFIndex> const current = element->template value<CFIndex>().get();
+                            if (not current) {
+                                res = current.error();
+                                continue;
+                            }
+                            value = current.value();
+                        }
+                        value = value == element->logical_min() ? element->logical_max() : element->logical_min();
+                    }
+                    transaction.stage(*element, value);
+                }
+                IOReturn const commit_res = transaction.commit();
+                return commit_res != kIOReturnSuccess ? commit_res : res;
+            } catch (...) {
+                return kIOReturnError;
+            }
+        }
+
+        static void work(std::shared_ptr<target> t) {
+            // Opening can stall as much as writing, so it is done here too
+            basic_hid_device_opener<Backend> opener = t->device.open();
+            basic_hid_device_elements_enumerator<Backend> elements = t->device.elements(kHIDPage_LEDs);
+            std::vector<led_write> writes;
+            std::unique_lock<std::mutex> lock(t->mutex);
+            while (true) {
+                t->cv.wait(lock, [&] { return t->stopping or not t->pending.empty(); });
+                if (t->pending.empty()) {
+                    break;
+                }
+                writes.swap(t->pending);
+                uint64_t const ticket = t->requested;
+                lock.unlock();
+                IOReturn const res = opener.is_open() ? apply(t->device, elements, writes) : opener.result();
+                writes.clear();
+                lock.lock();
+                t->completed = ticket;
+                t->result = res;
+                t->cv.notify_all();
+            }
+            t->exited = true;
+            t->cv.notify_all();
+        }
+
+        std::vector<std::shared_ptr<target>> _targets;
+        uint64_t _ticket;
+        std::chrono::milliseconds _shutdown;
+
+    public:
+        /** Starts a thread for each of @p devices. On destruction, threads
+         * are given @p shutdown to finish their last write; stuck ones are
+         * left behind.
+         */
+        explicit basic_led_broadcast(std::vector<basic_hid_device<Backend>> const &devices, std::chrono::milliseconds shutdown = std::chrono::seconds(2)) :
+            _ticket(0), _shutdown(shutdown)
+        {
+            _targets.reserve(devices.size());
+            for (auto const &device : devices) {
+                _targets.push_back(std::make_shared<target>(device));
+                std::thread(work, _targets.back()).detach();
+            }
+        }
+
+        basic_led_broadcast(basic_led_broadcast const &) = delete;
+        basic_led_broadcast &operator=(basic_led_broadcast const &) = delete;
+
+        ~basic_led_broadcast() {
+            for (auto &t : _targets) {
+                std::lock_guard<std::mutex> lock(t->mutex);
+                t->stopping = true;
+                t->cv.notify_all();
+            }
+            auto const deadline = std::chrono::steady_clock::now() + _shutdown;
+            for (auto &t : _targets) {
+                std::unique_lock<std::mutex> lock(t->mutex);
+                t->cv.wait_until(lock, deadline, [&] { return t->exited; });
+            }
+        }
+
+        std::size_t size() const {
+            return _targets.size();
+        }
+
+        /// Hands @p writes to every device without waiting; the returned ticket is for wait().
+        uint64_t post(std::vector<led_write> const &writes) {
+            uint64_t const ticket = ++_ticket;
+            for (auto &t : _targets) {
+                std::lock_guard<std::mutex> lock(t->mutex);
+                for (led_write const &write : writes) {
+                    auto it = std::find_if(t->pending.begin(), t->pending.end(), [&](led_write const &other) {
+                        return write.op == led_op::set and other.op == led_op::set and other.usage == write.usage and other.led == write.led;
+                    });
+                    if (it != t->pending.end()) {
+                        it->value = write.value;
+                    } else {
+                        t->pending.push_back(write);
+                    }
+                }
+                t->requested = ticket;
+                t->cv.notify_all();
+            }
+            return ticket;
+        }
+
+        uint64_t post(led_write const &write) {
+            return post(std::vector<led_write>{write});
+        }
+
+        /// Waits until every device has written @p ticket, or @p timeout elapses; one result per device, in order.
+        std::vector<broadcast_result> wait(uint64_t ticket, std::chrono::milliseconds timeout) {
+            auto const deadline = std::chrono::steady_clock::now() + timeout;
+            std::vector<broadcast_result> results;
+            results.reserve(_targets.size());
+            for (auto &t : _targets) {
+                std::unique_lock<std::mutex> lock(t->mutex);
+                bool const done = t->cv.wait_until(lock, deadline, [&] { return t->completed >= ticket; });
+                results.push_back(broadcast_result{t->product, t->manufacturer, done ? t->result : kIOReturnTimeout});
+            }
+            return results;
+        }
+    };
+
+    using led_broadcast = basic_led_broadcast<native_backend>;
+
+
+    struct mirror_stats {
+        /// Reads of the source when polling, batches of changes it reported otherwise.
+        std::size_t polls;
+        std::size_t changes;
+        std::size_t failures;
+        std::size_t timeouts;
+        std::chrono::steady_clock::duration max_latency;
+    };
+
+
+    /** Copies the LEDs of one keyboard to others. The source is followed
+     * through a basic_led_monitor where the backend reports its value
+     * changes, and polled every interval otherwise (hidraw, or an evdev node
+     * that could not be opened). Each change is broadcast by usage, so it
+     * reaches the other keyboards within deadline, plus the interval when
+     * polling: writes that take longer count as timed out, and are
+     * superseded by the next change.
+     */
+    template <class Backend = native_backend>
+    class basic_led_mirror {
+        basic_hid_device<Backend> _source;
+        basic_hid_device_opener<Backend> _opener;
+        basic_hid_device_elements_enumerator<Backend> _elements;
+        basic_led_broadcast<Backend> _targets;
+        std::chrono::milliseconds _deadline;
+        std::vector<CFIndex> _last;
+        bool _seeded;
+        std::atomic<bool> _stopping;
+        mirror_stats _stats;
+
+        void broadcast(std::vector<led_write> const &writes, std::chrono::steady_clock::time_point start) {
+            if (writes.empty()) {
+                return;
+            }
+            ++_stats.changes;
+            for (broadcast_result const &result : _targets.wait(_targets.post(writes), _deadline)) {
+                if (result.result == kIOReturnTimeout) {
+                    ++_stats.timeouts;
+                } else if (result.result != kIOReturnSuccess and result.result != kIOReturnBadArgument) {
+                    // Keyboards without one of the LEDs are not a failure
+                    ++_stats.failures;
+                }
+            }
+            _stats.max_latency = std::max(_stats.max_latency, std::chrono::steady_clock::now() - start);
+        }
+
+        /// Watches from this thread: on macOS the value callbacks come through the run loop of the thread that asked for them.
+        void follow() {
+            basic_led_monitor<Backend> monitor(std::vector<basic_hid_device<Backend>>{_source});
+            std::vector<led_change> changes;
+            std::vector<led_write> writes;
+            while (not _stopping.load(std::memory_order_relaxed)) {
+                // Only bounds how late stop() is noticed; signals cut the wait short where they can
+                if (not monitor.poll(changes, std::chrono::seconds(1))) {
+                    continue;
+                }
+                ++_stats.polls;
+                auto const start = std::chrono::steady_clock::now();
+                writes.clear();
+                for (led_change const &change : changes) {
+                    writes.push_back(led_write{change.led, change.usage, led_op::set, change.value});
+                }
+                broadcast(writes, start);
+            }
+        }
+
+    public:
+        basic_led_mirror(basic_hid_device<Backend> const &source, std::vector<basic_hid_device<Backend>> const &targets,
+                         std::chrono::milliseconds deadline = std::chrono::milliseconds(100)) :
+            _source(source), _opener(_source.open()), _elements(_source.elements(kHIDPage_LEDs)),
+            _targets(targets, deadline), _deadline(deadline), _last(_elements.size(), 0), _seeded(false), _stopping(false),
+            _stats{0, 0, 0, 0, std::chrono::steady_clock::duration::zero()}
+        {
+            // Every poll has to see the device, not what we remember of it
+            _source.shadow().set_ttl(std::chrono::steady_clock::duration::zero());
+        }
+
+        IOReturn open_result() const {
+            return _opener.result();
+        }
+
+        std::size_t size() const {
+            return _targets.size();
+        }
+
+        mirror_stats const &stats() const {
+            return _stats;
+        }
+
+        /// Broadcasts what changed on the source since the last poll (everything, the first time), and waits for it.
+        void poll() {
+            ++_stats.polls;
+            auto const start = std::chrono::steady_clock::now();
+            std::vector<led_write> writes;
+            for (std::size_t i = 0; i < _elements.size(); ++i) {
+                hid_result<CFIndex> const read = _elements[i].template value<CFIndex>().get();
+                if (not read) {
+                    // Try again on the next poll; the targets keep the last value meanwhile
+                    ++_stats.failures;
+                    continue;
+                }
+                CFIndex const value = read.value();
+                if (not _seeded or value != _last[i]) {
+                    writes.push_back(led_write{i, _elements[i].usage(), led_op::set, value});
+                    _last[i] = value;
+                }
+            }
+            _seeded = true;
+            broadcast(writes, start);
+        }
+
+        /// Whether run() follows the value changes of the source rather than polling it.
+        bool follows_changes() const {
+            return _opener.is_open() and Backend::can_watch_values(_source.native_ref());
+        }
+
+        /** Mirrors until stop(). When polling, reads the source every
+         * @p interval; a missed interval is skipped, not caught up on.
+         */
+        void run(std::chrono::milliseconds interval) {
+            if (follows_changes()) {
+                follow();
+                return;
+            }
+            auto next = std::chrono::steady_clock::now();
+            while (not _stopping.load(std::memory_order_relaxed)) {
+                poll();
+                next += interval;
+                auto const now = std::chrono::steady_clock::now();
+                if (next < now) {
+                    next = now;
+                }
+                std::this_thread::sleep_until(next);
+            }
+        }
+
+        /// Safe to call from a signal handler.
+        void stop() {
+            _stopping.store(true, std::memory_order_relaxed);
+        }
+    };
+
+    using led_mirror = basic_led_mirror<native_backend>;
+
+}
+
+#endif /* broadcast_hpp */
@@ -0,0 +1,315 @@
+//
+//  command_queue.hpp
+//  HIDLED
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+#ifndef command_queue_hpp
+#define command_queue_hpp
+
+#include "hid.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace spak {
+
+    struct command_queue_stats {
+        /// Calls to submit().
+        std::size_t submitted;
+        /// LED values written, after the writes superseded while pending were dropped.
+        std::size_t written;
+        /// Transactions committed; on a real device, roughly one output report each.
+        std::size_t reports;
+        std::size_t failures;
+    };
+
+
+    /** Sets LEDs of several keyboards on behalf of any number of threads,
+     * writing only the latest value of each LED. Every (device, LED) pair is
+     * a slot holding the last value submitted to it; a slot with a value not
+     * yet written sits once on a lock-free stack, however many times it is
+     * submitted to meanwhile. A single writer thread takes the whole stack,
+     * and writes each device's slots in one transaction, no sooner than
+     * min_interval after the previous one to the same device; slots of a
+     * device that is not due yet stay pending, and keep absorbing writes.
+     *
+     * submit() takes no lock, except to wake the writer up when the stack
+     * goes from empty to not empty. Only sets are queued: a toggle depends on
+     * the value before it and cannot be merged away.
+     */
+    template <class Backend = native_backend>
+    class basic_led_command_queue {
+    public:
+        using clock = std::chrono::steady_clock;
+        static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+    private:
+        struct slot {
+            std::size_t device;
+            std::size_t led;
+            std::atomic<CFIndex> value;
+            /// True from the submit that pushes the slot until the writer takes its value.
+            std::atomic<bool> queued;
+            /// Link in the stack, or in the writer's list of pending slots.
+            slot *next;
+        };
+
+        struct target {
+            basic_hid_device<Backend> device;
+            basic_hid_device_elements_enumerator<Backend> elements;
+            std::size_t first_slot;
+            clock::time_point due;
+
+            explicit target(basic_hid_device<Backend> const &d) :
+                device(d), elements(device.elements(kHIDPage_LEDs)), first_slot(0), due(clock::time_point::min())
+            {}
+        };
+
+        std::vector<target> _targets;
+        std::unique_ptr<slot[]> _slots;
+        std::size_t _slot_count;
+        clock::duration _min_interval;
+
+        std::atomic<slot *> _head;
+        std::atomic<uint64_t> _submitted;
+        std::atomic<std::size_t> _written;
+        std::atomic<std::size_t> _reports;
+        std::atomic<std::size_t> _failures;
+
+        /// Only for sleeping and waking up; the queue itself does not use it.
+        std::mutex _mutex;
+        std::condition_variable _cv;
+        uint64_t _completed;
+        bool _kick;
+        bool _stopping;
+        std::thread _writer;
+
+        void push(slot *s) {
+            slot *head = _head.load(std::memory_order_relaxed);
+            do {
+                s->next = head;
+            } while (not _head.compare_exchange_weak(head, s, std::memory_order_release, std::memory_order_relaxed));
+            if (head == nullptr) {
+                // Lock so that the writer cannot miss it between checking the stack and sleeping
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                }
+                _cv.notify_all();
+            }
+        }
+
+        /// Writes the pending slots of @p t, removing them from @p pending.
+        void write(target &t, std::size_t device, slot *&pending) {
+            basic_hid_device_transaction<Backend> transaction = t.device.transaction();
+            std::size_t staged = 0;
+            for (slot **link = &pending; *link != nullptr;) {
+                slot *s = *link;
+                if (s->device != device) {
+                    link = &s->next;
+                    continue;
+                }
+                *link = s->next;
+                // Clearing first: a submit that still sees the slot queued has stored its value already
+                s->queued.exchange(false, std::memory_order_acq_rel);
+                transaction.stage(t.elements[s->led], s->value.load(std::memory_order_acquire));
+                ++staged;
+            }
+            IOReturn res = kIOReturnError;
+            try {
+                res = transaction.commit();
+            } catch (...) {
+            }
+            _written.fetch_add(staged, std::memory_order_relaxed);
+            _reports.fetch_add(1, std::memory_order_relaxed);
+            if (res != kIOReturnSuccess) {
+                _failures.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        void work() {
+            std::vector<basic_hid_device_opener<Backend>> openers;
+            openers.reserve(_targets.size());
+            for (auto &t : _targets) {
+                openers.push_back(t.device.open());
+            }
+            slot *pending = nullptr;
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (true) {
+                _kick = false;
+                lock.unlock();
+                // Everything counted here has stored its value and is either pushed or pending already
+                uint64_t const seen = _submitted.load(std::memory_order_acquire);
+                slot *taken = _head.exchange(nullptr, std::memory_order_acquire);
+                while (taken != nullptr) {
+                    slot *s = taken;
+                    taken = taken->next;
+                    s->next = pending;
+                    pending = s;
+                }
+                std::vector<bool> has_pending(_targets.size(), false);
+                for (slot *s = pending; s != nullptr; s = s->next) {
+                    has_pending[s->device] = true;
+                }
+                auto const now = clock::now();
+                auto wake = clock::time_point::max();
+                for (std::size_t i = 0; i < _targets.size(); ++i) {
+                    if (not has_pending[i]) {
+                        continue;
+                    }
+                    if (_targets[i].due <= now) {
+                        write(_targets[i], i, pending);
+                        _targets[i].due = now + _min_interval;
+                    } else {
+                        wake = std::min(wake, _targets[i].due);
+                    }
+                }
+                lock.lock();
+                if (pending == nullptr) {
+                    _completed = std::max(_completed, seen);
+                    _cv.notify_all();
+                }
+                if (_stopping and pending == nullptr) {
+                    break;
+                }
+                auto const ready = [&] {
+                    return (_stopping and pending == nullptr) or _kick or _head.load(std::memory_order_relaxed) != nullptr;
+                };
+                if (wake == clock::time_point::max()) {
+                    _cv.wait(lock, ready);
+                } else {
+                    _cv.wait_until(lock, wake, ready);
+                }
+            }
+        }
+
+    public:
+        /** Starts the writer, which opens @p devices and keeps them open. No
+         * device gets output reports closer than @p min_interval apart.
+         */
+        explicit basic_led_command_queue(std::vector<basic_hid_device<Backend>> const &devices,
+                                         clock::duration min_interval = std::chrono::milliseconds(8)) :
+            _slot_count(0), _min_interval(min_interval), _head(nullptr), _submitted(0), _written(0), _reports(0), _failures(0),
+            _completed(0), _kick(false), _stopping(false)
+        {
+            _targets.reserve(devices.size());
+            for (auto const &device : devices) {
+                _targets.emplace_back(device);
+                _targets.back().first_slot = _slot_count;
+                _slot_count += _targets.back().elements.size();
+            }
+            _slots.reset(new slot[_slot_count]);
+            for (std::size_t i = 0; i < _targets.size(); ++i) {
+                for (std::size_t led = 0; led < _targets[i].elements.size(); ++led) {
+                    slot &s = _slots[_targets[i].first_slot + led];
+                    s.device = i;
+                    s.led = led;
+                    s.value.store(0, std::memory_order_relaxed);
+                    s.queued.store(false, std::memory_order_relaxed);
+                    s.next = nullptr;
+                }
+            }
+            _writer = std::thread(&basic_led_command_queue::work, this);
+        }
+
+        basic_led_command_queue(basic_led_command_queue const &) = delete;
+        basic_led_command_queue &operator=(basic_led_command_queue const &) = delete;
+
+        /// Writes what is still pending, waiting out the interval if needed, and stops the writer.
+        ~basic_led_command_queue() {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stopping = true;
+            }
+            _cv.notify_all();
+            _writer.join();
+        }
+
+        std::size_t size() const {
+            return _targets.size();
+        }
+
+        /// Slot of LED @p led of device @p device, in the order of the constructor and of elements(kHIDPage_LEDs); npos if there is none.
+        std::size_t slot_of(std::size_t device, std::size_t led) const {
+            if (device >= _targets.size() or led >= _targets[device].elements.size()) {
+                return npos;
+            }
+            return _targets[device].first_slot + led;
+        }
+
+        /// Slot of the LED with usage @p usage of device @p device, npos if it has none.
+        std::size_t slot_of_usage(std::size_t device, uint32_t usage) {
+            if (device >= _targets.size()) {
+                return npos;
+            }
+            auto &elements = _targets[device].elements;
+            for (std::size_t led = 0; led < elements.size(); ++led) {
+                if (elements[led].usage() == usage) {
+                    return _targets[device].first_slot + led;
+                }
+            }
+            return npos;
+        }
+
+        /// Sets slot @p s to @p value, superseding whatever is still pending there. Lock-free, safe from any thread.
+        void submit(std::size_t s, CFIndex value) {
+            assert(s < _slot_count);
+            slot &target_slot = _slots[s];
+            target_slot.value.store(value, std::memory_order_release);
+            if (not target_slot.queued.exchange(true, std::memory_order_acq_rel)) {
+                push(&target_slot);
+            }
+            _submitted.fetch_add(1, std::memory_order_release);
+        }
+
+        /** Waits until everything submitted before the call is written, or
+         * @p timeout elapses. Returns false on timeout.
+         */
+        bool flush(std::chrono::milliseconds timeout) {
+            uint64_t const ticket = _submitted.load(std::memory_order_acquire);
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_completed >= ticket) {
+                return true;
+            }
+            _kick = true;
+            _cv.notify_all();
+            return _cv.wait_for(lock, timeout, [&] { return _completed >= ticket; });
+        }
+
+        command_queue_stats stats() const {
+            return command_queue_stats{
+                static_cast<std::size_t>(_submitted.load(std::memory_order_relaxed)),
+                _written.load(std::memory_order_relaxed),
+                _reports.load(std::memory_order_relaxed),
+                _failures.load(std::memory_order_relaxed)
+            };
+        }
+    };
+
+    using led_command_queue = basic_led_command_queue<native_backend>;
+
+}
+
+#endif /* command_queue_hpp */
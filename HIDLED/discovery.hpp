@@ -0,0 +1,248 @@
+//
+//  discovery.hpp
+//  HIDLED
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+#ifndef discovery_hpp
+#define discovery_hpp
+
+#include "hid.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace spak {
+
+    struct led_report {
+        std::string name;
+        uint32_t usage_page;
+        uint32_t usage;
+        uint32_t report_id;
+        CFIndex logical_min;
+        CFIndex logical_max;
+        /// False if the value was not asked for, or the device could not be opened or read.
+        bool has_value;
+        CFIndex value;
+    };
+
+    struct device_report {
+        enum struct status {
+            ok,
+            cannot_open,
+            timed_out
+        };
+
+        status result;
+        std::string product;
+        std::string manufacturer;
+        uint32_t vendor_id;
+        uint32_t product_id;
+        uint32_t location_id;
+        /// Only meaningful for status::cannot_open.
+        IOReturn open_result;
+        std::vector<led_report> leds;
+    };
+
+
+    /// Report of @p device with @p result and no LEDs; takes only the properties, which need no open.
+    inline device_report describe_device(hid_device const &device, device_report::status result, IOReturn open_result = kIOReturnSuccess) {
+        hid_device_identity const identity = device.identity();
+        return device_report{result, device.product(), device.manufacturer(),
+            identity.vendor_id, identity.product_id, identity.location_id, open_result, {}};
+    }
+
+
+    /** Reads the LED elements of @p device and, if @p read_values, opens it
+     * and reads their values too; this is the part that can stall. Without
+     * values, the device is never opened, so nothing it does is disturbed.
+     */
+    inline device_report probe_device(hid_device &device, bool read_values = true) {
+        device_report report = describe_device(device, device_report::status::ok);
+        auto const leds = [&](bool open) {
+            for (auto &element : device.elements(kHIDPage_LEDs)) {
+                led_report led{element.name(), element.usage_page(), element.usage(), element.report_id(),
+                    element.logical_min(), element.logical_max(), false, 0};
+                if (open) {
+                    hid_result<CFIndex> const value = element.value<CFIndex>().get();
+                    led.has_value = value.ok();
+                    led.value = value.value_or(0);
+                }
+                report.leds.push_back(std::move(led));
+            }
+        };
+        if (not read_values) {
+            leds(false);
+            return report;
+        }
+        hid_device_opener opener = device.open();
+        if (not opener.is_open()) {
+            report.result = device_report::status::cannot_open;
+            report.open_result = opener.result();
+        }
+        leds(opener.is_open());
+        return report;
+    }
+
+
+    /** Probes devices on a pool of worker threads. Each device gets @p deadline
+     * from the moment a worker picks it up; past that, it is reported as
+     * timed out and a fresh worker takes the place of the stuck one, which
+     * is left to finish (or hang) on its own. Reports come back in the same
+     * order as the devices, whatever the order of completion, and each one
+     * as soon as it and all those before it are done.
+     */
+    class device_discovery {
+        enum struct task_state {
+            queued,
+            running,
+            done
+        };
+
+        struct task {
+            hid_device device;
+            std::shared_ptr<void const> retained;
+            task_state state;
+            std::chrono::steady_clock::time_point started;
+            device_report report;
+        };
+
+        /// Shared with the workers, which may outlive discover().
+        struct job {
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::vector<task> tasks;
+            std::size_t next = 0;
+            bool read_values = true;
+        };
+
+        static void work(std::shared_ptr<job> j) {
+            std::unique_lock<std::mutex> lock(j->mutex);
+            while (j->next < j->tasks.size()) {
+                std::size_t const i = j->next++;
+                j->tasks[i].state = task_state::running;
+                j->tasks[i].started = std::chrono::steady_clock::now();
+                hid_device device = j->tasks[i].device;
+                bool const read_values = j->read_values;
+                lock.unlock();
+                device_report report = probe_device(device, read_values);
+                lock.lock();
+                if (j->tasks[i].state == task_state::running) {
+                    j->tasks[i].report = std::move(report);
+                    j->tasks[i].state = task_state::done;
+                    j->cv.notify_all();
+                } else {
+                    // Timed out meanwhile and replaced by another worker
+                    return;
+                }
+            }
+        }
+
+        static void spawn_worker(std::shared_ptr<job> const &j) {
+            std::thread(work, j).detach();
+        }
+
+        std::size_t _workers;
+        std::chrono::milliseconds _deadline;
+        bool _read_values;
+
+    public:
+        static std::size_t default_workers() {
+            unsigned const n = std::thread::hardware_concurrency();
+            return n > 0 ? n : 4;
+        }
+
+        /// Without @p read_values, devices are not opened and the reports carry no LED values.
+        device_discovery(std::size_t workers = default_workers(), std::chrono::milliseconds deadline = std::chrono::seconds(2),
+                         bool read_values = true) :
+            _workers(workers > 0 ? workers : 1), _deadline(deadline), _read_values(read_values)
+        {}
+
+        /// Calls @p on_report with each report, in the order of the devices, on the calling thread.
+        template <class Callback>
+        void discover(hid_device_enumerator &enumerator, Callback &&on_report) const {
+            auto j = std::make_shared<job>();
+            j->read_values = _read_values;
+            j->tasks.reserve(enumerator.size());
+            for (hid_device &device : enumerator) {
+                j->tasks.push_back(task{device, device.retain(), task_state::queued, {}, {}});
+            }
+            for (std::size_t i = 0; i < std::min(_workers, j->tasks.size()); ++i) {
+                spawn_worker(j);
+            }
+            std::vector<device_report> ready;
+            std::size_t reported = 0;
+            std::unique_lock<std::mutex> lock(j->mutex);
+            while (true) {
+                bool pending = false;
+                auto const now = std::chrono::steady_clock::now();
+                auto next_deadline = now + _deadline;
+                for (task &t : j->tasks) {
+                    if (t.state == task_state::queued) {
+                        pending = true;
+                    } else if (t.state == task_state::running) {
+                        if (now - t.started >= _deadline) {
+                            t.report = describe_device(t.device, device_report::status::timed_out, kIOReturnTimeout);
+                            t.state = task_state::done;
+                            if (j->next < j->tasks.size()) {
+                                spawn_worker(j);
+                            }
+                        } else {
+                            pending = true;
+                            next_deadline = std::min(next_deadline, t.started + _deadline);
+                        }
+                    }
+                }
+                for (; reported < j->tasks.size() and j->tasks[reported].state == task_state::done; ++reported) {
+                    ready.push_back(std::move(j->tasks[reported].report));
+                }
+                if (not ready.empty()) {
+                    // The workers carry on meanwhile; the next round picks up what they finish
+                    lock.unlock();
+                    for (device_report &report : ready) {
+                        on_report(std::move(report));
+                    }
+                    ready.clear();
+                    lock.lock();
+                    continue;
+                }
+                if (not pending) {
+                    break;
+                }
+                j->cv.wait_until(lock, next_deadline);
+            }
+        }
+
+        std::vector<device_report> discover(hid_device_enumerator &enumerator) const {
+            std::vector<device_report> reports;
+            reports.reserve(enumerator.size());
+            discover(enumerator, [&](device_report &&report) { reports.push_back(std::move(report)); });
+            return reports;
+        }
+    };
+
+}
+
+#endif /* discovery_hpp */
@@ -0,0 +1,693 @@
+//
+//  fake_hid.hpp
+//  HIDLED
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+#ifndef fake_hid_hpp
+#define fake_hid_hpp
+
+#include "hid.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace spak {
+
+    struct fake_hid_element {
+        uint32_t usage_page;
+        uint32_t usage;
+        std::string name;
+        uint32_t report_id;
+        CFIndex logical_min;
+        CFIndex logical_max;
+        IOHIDElementType type;
+        CFIndex value;
+    };
+
+    /// One output report as the device received it: the index of each element written and its value.
+    struct fake_hid_report {
+        uint32_t report_id;
+        std::vector<std::pair<std::size_t, CFIndex>> values;
+    };
+
+    enum struct fake_hid_op {
+        open,
+        get,
+        set
+    };
+
+    struct fake_hid_counters {
+        std::size_t opens;
+        std::size_t gets;
+        std::size_t sets;
+        std::size_t reports;
+    };
+
+
+    /** A HID device that lives in memory. Every call costs latency() and
+     * failures are injected by rule, counting calls, so the same sequence of
+     * calls always gives the same results. Output reports are recorded when
+     * asked to. All the handles to the device share it, and it may be used
+     * from several threads.
+     */
+    class fake_hid_device {
+        friend struct fake_backend;
+
+        struct failure {
+            fake_hid_op op;
+            IOReturn code;
+            std::size_t skip;
+            std::size_t count;
+        };
+
+        mutable std::mutex _mutex;
+        uint64_t _native_id;
+        std::string _product;
+        std::string _manufacturer;
+        std::string _serial_number;
+        uint32_t _vendor_id;
+        uint32_t _product_id;
+        uint32_t _location_id;
+        uint32_t _usage_page;
+        uint32_t _usage;
+        std::vector<fake_hid_element> _elements;
+        std::chrono::nanoseconds _latency;
+        std::vector<failure> _failures;
+        bool _recording;
+        std::vector<fake_hid_report> _reports;
+        fake_hid_counters _counters;
+        std::size_t _open_count;
+        std::vector<std::pair<std::size_t, CFIndex>> _input;
+
+        /// Sleeps through most of @p latency and spins the rest, sleep_for() alone overshoots by too much.
+        static void delay(std::chrono::nanoseconds latency) {
+            if (latency <= std::chrono::nanoseconds::zero()) {
+                return;
+            }
+            auto const deadline = std::chrono::steady_clock::now() + latency;
+            auto const slack = std::chrono::microseconds(200);
+            if (latency > slack) {
+                std::this_thread::sleep_until(deadline - slack);
+            }
+            while (std::chrono::steady_clock::now() < deadline) {
+                std::this_thread::yield();
+            }
+        }
+
+        /// Called with the lock held.
+        IOReturn enter(fake_hid_op op) {
+            delay(_latency);
+            switch (op) {
+                case fake_hid_op::open:
+                    ++_counters.opens;
+                    break;
+                case fake_hid_op::get:
+                    ++_counters.gets;
+                    break;
+                case fake_hid_op::set:
+                    ++_counters.sets;
+                    break;
+            }
+            for (auto it = _failures.begin(); it != _failures.end(); ++it) {
+                if (it->op != op) {
+                    continue;
+                }
+                if (it->skip > 0) {
+                    --it->skip;
+                    continue;
+                }
+                IOReturn const code = it->code;
+                if (it->count != std::numeric_limits<std::size_t>::max() and --it->count == 0) {
+                    _failures.erase(it);
+                }
+                return code;
+            }
+            return kIOReturnSuccess;
+        }
+
+    public:
+        fake_hid_device(uint64_t native_id, std::string product, std::string manufacturer = "", uint32_t usage_page = kHIDPage_GenericDesktop, uint32_t usage = kHIDUsage_GD_Keyboard) :
+            _native_id(native_id), _product(std::move(product)), _manufacturer(std::move(manufacturer)),
+            _vendor_id(0), _product_id(0), _location_id(static_cast<uint32_t>(native_id)),
+            _usage_page(usage_page), _usage(usage),
+            _latency(0), _recording(false), _counters{0, 0, 0, 0}, _open_count(0)
+        {}
+
+        fake_hid_device(fake_hid_device const &) = delete;
+        fake_hid_device &operator=(fake_hid_device const &) = delete;
+
+        /// Only before the device is handed out: elements are not guarded by the lock.
+        std::size_t add_element(fake_hid_element element) {
+            _elements.push_back(std::move(element));
+            return _elements.size() - 1;
+        }
+
+        void set_identity(uint32_t vendor_id, uint32_t product_id, uint32_t location_id, std::string serial_number = "") {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _vendor_id = vendor_id;
+            _product_id = product_id;
+            _location_id = location_id;
+            _serial_number = std::move(serial_number);
+        }
+
+        std::chrono::nanoseconds latency() const {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _latency;
+        }
+
+        /// Added to every open, read and write, and to every report of a multiple write.
+        void set_latency(std::chrono::nanoseconds latency) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _latency = latency;
+        }
+
+        /** Lets the next @p skip calls of @p op through, then fails @p count of
+         * them with @p code (forever by default). Rules are checked in the
+         * order they were added.
+         */
+        void fail(fake_hid_op op, IOReturn code, std::size_t skip = 0, std::size_t count = std::numeric_limits<std::size_t>::max()) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (count > 0) {
+                _failures.push_back(failure{op, code, skip, count});
+            }
+        }
+
+        void clear_failures() {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _failures.clear();
+        }
+
+        void set_recording(bool recording) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _recording = recording;
+        }
+
+        std::vector<fake_hid_report> reports() const {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _reports;
+        }
+
+        void clear_reports() {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _reports.clear();
+        }
+
+        fake_hid_counters counters() const {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _counters;
+        }
+
+        void reset_counters() {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _counters = fake_hid_counters{0, 0, 0, 0};
+        }
+
+        uint64_t native_id() const {
+            return _native_id;
+        }
+
+        bool is_open() const {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _open_count > 0;
+        }
+
+        /// Current value of the first element with the given usage, without going through the failure rules.
+        CFIndex peek(uint32_t usage_page, uint32_t usage) const {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (fake_hid_element const &element : _elements) {
+                if (element.usage_page == usage_page and element.usage == usage) {
+                    return element.value;
+                }
+            }
+            return 0;
+        }
+
+        /** Changes a value behind the host's back, like a lock key or another
+         * process would; watchers see it on their next dispatch.
+         */
+        void inject(uint32_t usage_page, uint32_t usage, CFIndex value) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (std::size_t i = 0; i < _elements.size(); ++i) {
+                if (_elements[i].usage_page == usage_page and _elements[i].usage == usage) {
+                    _elements[i].value = value;
+                    _input.emplace_back(i, value);
+                }
+            }
+        }
+    };
+
+
+    /// A keyboard with the five boot protocol LEDs in output report @p report_id.
+    inline std::shared_ptr<fake_hid_device> make_fake_keyboard(uint64_t native_id, std::string product, std::string manufacturer = "", uint32_t report_id = 0) {
+        auto device = std::make_shared<fake_hid_device>(native_id, std::move(product), std::move(manufacturer));
+        struct {
+            uint32_t usage;
+            char const *name;
+        } const leds[] = {
+            {kHIDUsage_LED_NumLock, "NumLock"},
+            {kHIDUsage_LED_CapsLock, "CapsLock"},
+            {kHIDUsage_LED_ScrollLock, "ScrollLock"},
+            {kHIDUsage_LED_Compose, "Compose"},
+            {kHIDUsage_LED_Kana, "Kana"}
+        };
+        for (auto const &led : leds) {
+            device->add_element(fake_hid_element{kHIDPage_LEDs, led.usage, led.name, report_id, 0, 1, kIOHIDElementTypeOutput, 0});
+        }
+        device->add_element(fake_hid_element{kHIDPage_KeyboardOrKeypad, kHIDUsage_KeyboardCapsLock, "Caps Lock", 0, 0, 1, kIOHIDElementTypeInput_Button, 0});
+        return device;
+    }
+
+
+    /** The devices plugged into the fake backend. Managers and monitors use
+     * shared() unless they are given another bus, so that tests can run side
+     * by side.
+     */
+    class fake_hid_bus {
+    public:
+        struct change {
+            bool added;
+            std::shared_ptr<fake_hid_device> device;
+        };
+
+        struct listener {
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::vector<change> pending;
+            bool woken = false;
+        };
+
+    private:
+        mutable std::mutex _mutex;
+        std::vector<std::shared_ptr<fake_hid_device>> _devices;
+        std::vector<std::weak_ptr<listener>> _listeners;
+
+        void post(change const &c) {
+            _listeners.erase(std::remove_if(_listeners.begin(), _listeners.end(), [](std::weak_ptr<listener> const &l) {
+                return l.expired();
+            }), _listeners.end());
+            for (auto const &weak : _listeners) {
+                if (auto l = weak.lock()) {
+                    {
+                        std::lock_guard<std::mutex> lock(l->mutex);
+                        l->pending.push_back(c);
+                    }
+                    l->cv.notify_all();
+                }
+            }
+        }
+
+    public:
+        static fake_hid_bus &shared() {
+            static fake_hid_bus bus;
+            return bus;
+        }
+
+        void plug(std::shared_ptr<fake_hid_device> device) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _devices.push_back(device);
+            post(change{true, std::move(device)});
+        }
+
+        bool unplug(uint64_t native_id) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = std::find_if(_devices.begin(), _devices.end(), [=](std::shared_ptr<fake_hid_device> const &device) {
+                return device->native_id() == native_id;
+            });
+            if (it == _devices.end()) {
+                return false;
+            }
+            std::shared_ptr<fake_hid_device> device = std::move(*it);
+            _devices.erase(it);
+            post(change{false, std::move(device)});
+            return true;
+        }
+
+        void unplug_all() {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (auto &device : _devices) {
+                post(change{false, std::move(device)});
+            }
+            _devices.clear();
+        }
+
+        std::vector<std::shared_ptr<fake_hid_device>> devices() const {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _devices;
+        }
+
+        /// The devices already plugged come first, as additions.
+        std::shared_ptr<listener> listen() {
+            auto l = std::make_shared<listener>();
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (auto const &device : _devices) {
+                l->pending.push_back(change{true, device});
+            }
+            _listeners.push_back(l);
+            return l;
+        }
+    };
+
+
+    /** Backend policy for basic_hid_device and friends on top of
+     * fake_hid_device, with the same semantics as the native ones: values
+     * can only be read and written while the device is open, and a multiple
+     * write sends one report per report ID.
+     */
+    struct fake_backend {
+        using device_ref = std::shared_ptr<fake_hid_device>;
+
+        struct element_ref {
+            device_ref device;
+            std::size_t index;
+
+            fake_hid_element &element() const {
+                return device->_elements[index];
+            }
+
+            bool operator==(element_ref const &other) const {
+                return device == other.device and index == other.index;
+            }
+        };
+
+        class manager {
+            fake_hid_bus *_bus;
+        public:
+            manager(fake_hid_bus &bus = fake_hid_bus::shared()) : _bus(&bus) {}
+
+            fake_hid_bus &bus() const {
+                return *_bus;
+            }
+
+            device_ref resolve(uint64_t native_id) const {
+                for (auto &device : _bus->devices()) {
+                    if (device->_native_id == native_id) {
+                        return device;
+                    }
+                }
+                return nullptr;
+            }
+
+            std::vector<device_ref> copy_devices(uint32_t in_page, uint32_t in_usage_page) const {
+                std::vector<device_ref> devices = _bus->devices();
+                devices.erase(std::remove_if(devices.begin(), devices.end(), [=](device_ref const &device) {
+                    return not conforms_to(device, in_page, in_usage_page);
+                }), devices.end());
+                return devices;
+            }
+        };
+
+        struct device_change {
+            bool added;
+            uint64_t native_id;
+            /// Null for removals.
+            device_ref device;
+        };
+
+        /// Reports the plugs and unplugs of a bus; the first wait() reports all the devices already there.
+        class device_monitor {
+            std::shared_ptr<fake_hid_bus::listener> _listener;
+        public:
+            device_monitor(uint32_t = kHIDPage_Undefined, uint32_t = 0, fake_hid_bus &bus = fake_hid_bus::shared()) :
+                _listener(bus.listen()) {}
+
+            void wait(std::vector<device_change> &changes, std::chrono::milliseconds timeout) {
+                std::unique_lock<std::mutex> lock(_listener->mutex);
+                _listener->cv.wait_for(lock, timeout, [&] {
+                    return not _listener->pending.empty() or _listener->woken;
+                });
+                _listener->woken = false;
+                for (fake_hid_bus::change &c : _listener->pending) {
+                    uint64_t const native_id = c.device->_native_id;
+                    changes.push_back(device_change{c.added, native_id, c.added ? std::move(c.device) : nullptr});
+                }
+                _listener->pending.clear();
+            }
+
+            void wake() {
+                {
+                    std::lock_guard<std::mutex> lock(_listener->mutex);
+                    _listener->woken = true;
+                }
+                _listener->cv.notify_all();
+            }
+        };
+
+        static IOReturn open(device_ref const &device) {
+            std::lock_guard<std::mutex> lock(device->_mutex);
+            IOReturn const res = device->enter(fake_hid_op::open);
+            if (res == kIOReturnSuccess) {
+                ++device->_open_count;
+            }
+            return res;
+        }
+
+        static void close(device_ref const &device) {
+            std::lock_guard<std::mutex> lock(device->_mutex);
+            if (device->_open_count > 0) {
+                --device->_open_count;
+            }
+        }
+
+        static bool conforms_to(device_ref const &device, uint32_t in_page, uint32_t in_usage_page) {
+            if (in_page == kHIDPage_Undefined) {
+                return true;
+            }
+            if (in_page == device->_usage_page and (in_usage_page == 0 or in_usage_page == device->_usage)) {
+                return true;
+            }
+            return std::any_of(device->_elements.begin(), device->_elements.end(), [=](fake_hid_element const &element) {
+                return element.usage_page == in_page and (in_usage_page == 0 or element.usage == in_usage_page);
+            });
+        }
+
+        static std::string manufacturer(device_ref const &device) {
+            return device->_manufacturer;
+        }
+
+        static std::string product(device_ref const &device) {
+            return device->_product;
+        }
+
+        static std::string serial_number(device_ref const &device) {
+            std::lock_guard<std::mutex> lock(device->_mutex);
+            return device->_serial_number;
+        }
+
+        enum struct string_property {
+            manufacturer,
+            product,
+            serial_number
+        };
+
+        using native_string = std::string;
+
+        static native_string intern(std::string const &str) {
+            return str;
+        }
+
+        static bool string_equals(device_ref const &device, string_property prop, native_string const &str) {
+            switch (prop) {
+                case string_property::manufacturer:
+                    return device->_manufacturer == str;
+                case string_property::product:
+                    return device->_product == str;
+                case string_property::serial_number:
+                    return serial_number(device) == str;
+            }
+            return false;
+        }
+
+        static uint32_t vendor_id(device_ref const &device) {
+            std::lock_guard<std::mutex> lock(device->_mutex);
+            return device->_vendor_id;
+        }
+
+        static uint32_t product_id(device_ref const &device) {
+            std::lock_guard<std::mutex> lock(device->_mutex);
+            return device->_product_id;
+        }
+
+        static uint32_t location_id(device_ref const &device) {
+            std::lock_guard<std::mutex> lock(device->_mutex);
+            return device->_location_id;
+        }
+
+        static uint64_t native_id(device_ref const &device) {
+            return device->_native_id;
+        }
+
+        static std::shared_ptr<void const> retain(device_ref const &device) {
+            return device;
+        }
+
+        static std::vector<element_ref> copy_elements(device_ref const &device, uint32_t in_page, uint32_t in_usage_page) {
+            std::vector<element_ref> retval;
+            for (std::size_t i = 0; i < device->_elements.size(); ++i) {
+                fake_hid_element const &element = device->_elements[i];
+                if ((in_page == kHIDPage_Undefined or element.usage_page == in_page) and (in_usage_page == 0 or element.usage == in_usage_page)) {
+                    retval.push_back(element_ref{device, i});
+                }
+            }
+            return retval;
+        }
+
+        static device_ref element_device(element_ref const &element) {
+            return element.device;
+        }
+
+        static uint32_t usage(element_ref const &element) {
+            return element.element().usage;
+        }
+
+        static uint32_t usage_page(element_ref const &element) {
+            return element.element().usage_page;
+        }
+
+        static IOHIDElementType type(element_ref const &element) {
+            return element.element().type;
+        }
+
+        static std::string name(element_ref const &element) {
+            return element.element().name;
+        }
+
+        static uint32_t report_id(element_ref const &element) {
+            return element.element().report_id;
+        }
+
+        static CFIndex logical_min(element_ref const &element) {
+            return element.element().logical_min;
+        }
+
+        static CFIndex logical_max(element_ref const &element) {
+            return element.element().logical_max;
+        }
+
+        static IOReturn get_value(device_ref const &device, element_ref const &element, CFIndex &value) {
+            std::lock_guard<std::mutex> lock(device->_mutex);
+            if (device->_open_count == 0) {
+                return kIOReturnNotOpen;
+            }
+            IOReturn const res = device->enter(fake_hid_op::get);
+            if (res == kIOReturnSuccess) {
+                value = element.element().value;
+            }
+            return res;
+        }
+
+        static IOReturn set_value(device_ref const &device, element_ref const &element, CFIndex value) {
+            return set_values(device, &element, &value, 1);
+        }
+
+        /// One report, one latency() and one failure check per report ID, in the order they first appear.
+        static IOReturn set_values(device_ref const &device, element_ref const *elements, CFIndex const *values, std::size_t count) {
+            std::lock_guard<std::mutex> lock(device->_mutex);
+            if (device->_open_count == 0) {
+                return kIOReturnNotOpen;
+            }
+            std::vector<bool> sent(count, false);
+            for (std::size_t first = 0; first < count; ++first) {
+                if (sent[first]) {
+                    continue;
+                }
+                uint32_t const report_id = elements[first].element().report_id;
+                IOReturn const res = device->enter(fake_hid_op::set);
+                if (res != kIOReturnSuccess) {
+                    return res;
+                }
+                fake_hid_report report{report_id, {}};
+                for (std::size_t i = first; i < count; ++i) {
+                    if (not sent[i] and elements[i].element().report_id == report_id) {
+                        sent[i] = true;
+                        elements[i].element().value = values[i];
+                        if (device->_recording) {
+                            report.values.emplace_back(elements[i].index, values[i]);
+                        }
+                    }
+                }
+                ++device->_counters.reports;
+                if (device->_recording) {
+                    device->_reports.push_back(std::move(report));
+                }
+            }
+            return kIOReturnSuccess;
+        }
+
+        using value_callback = void (*)(void *context, element_ref const &element, CFIndex value);
+
+        struct value_watch {
+            value_callback callback;
+            void *context;
+        };
+
+        static bool can_watch_values(device_ref const &) {
+            return true;
+        }
+
+        /// Injected changes are queued on the device anyway, see fake_hid_device::inject.
+        static void watch_values(device_ref const &, value_watch *) {}
+
+        /// Delivers the injected changes, outside of the device lock so that the callback may call back.
+        static void dispatch_value_changes(device_ref const &device, value_watch *watch) {
+            if (watch == nullptr) {
+                return;
+            }
+            std::vector<std::pair<std::size_t, CFIndex>> input;
+            {
+                std::lock_guard<std::mutex> lock(device->_mutex);
+                input.swap(device->_input);
+            }
+            for (auto const &change : input) {
+                watch->callback(watch->context, element_ref{device, change.first}, change.second);
+            }
+        }
+
+        /// Checks for injected changes every millisecond; good enough for tests.
+        static bool wait_value_changes(device_ref const *devices, std::size_t count, std::chrono::milliseconds timeout) {
+            auto const deadline = std::chrono::steady_clock::now() + timeout;
+            while (true) {
+                for (std::size_t i = 0; i < count; ++i) {
+                    std::lock_guard<std::mutex> lock(devices[i]->_mutex);
+                    if (not devices[i]->_input.empty()) {
+                        return true;
+                    }
+                }
+                if (std::chrono::steady_clock::now() >= deadline) {
+                    return false;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    };
+
+    using fake_hid_device_enumerator = basic_hid_device_enumerator<fake_backend>;
+
+}
+
+#endif /* fake_hid_hpp */
@@ -27,8 +27,26 @@
 #ifndef HIDManager_hpp
 #define HIDManager_hpp
 
+#if defined(__APPLE__)
+#include <IOKit/IOKitLib.h>
 #include <IOKit/hid/IOHIDLib.h>
+#else
+#include "hid_linux.hpp"
+#endif
+#include "trace.hpp"
 #include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <string>
 
@@ -93,46 +111,208 @@ namespace spak {
         }
     }
     
-    std::string copy_cf_string(CFStringRef str) {
+    
+    /** Either a value or the IOReturn explaining why there is none, for the
+     * calls that must not throw. value() on a failed result is a programming
+     * error, check ok() first or use value_or().
+     */
+    template <class T>
+    class hid_result {
+        IOReturn _error;
+        T _value;
+    public:
+        hid_result(T value) : _error(kIOReturnSuccess), _value(std::move(value)) {}
+        
+        /// @p error must not be kIOReturnSuccess.
+        static hid_result failure(IOReturn error) {
+            assert(error != kIOReturnSuccess);
+            hid_result retval{T()};
+            retval._error = error;
+            return retval;
+        }
+        
+        bool ok() const {
+            return _error == kIOReturnSuccess;
+        }
+        
+        explicit operator bool() const {
+            return ok();
+        }
+        
+        IOReturn error() const {
+            return _error;
+        }
+        
+        const char *describe() const {
+            return describe_io_return(_error);
+        }
+        
+        T const &value() const {
+            assert(ok());
+            return _value;
+        }
+        
+        T value_or(T fallback) const {
+            return ok() ? _value : fallback;
+        }
+    };
+    
+    template <>
+    class hid_result<void> {
+        IOReturn _error;
+    public:
+        hid_result(IOReturn error = kIOReturnSuccess) : _error(error) {}
+        
+        bool ok() const {
+            return _error == kIOReturnSuccess;
+        }
+        
+        explicit operator bool() const {
+            return ok();
+        }
+        
+        IOReturn error() const {
+            return _error;
+        }
+        
+        const char *describe() const {
+            return describe_io_return(_error);
+        }
+    };
+    
+    
+    /** How often, and how patiently, a device call failing with a transient
+     * error is tried again: a device that is momentarily busy, grabbed by
+     * another process or not answering. The wait doubles after every
+     * attempt, up to max_backoff.
+     */
+    struct hid_retry_policy {
+        /// Calls in all, the first one included; 1 disables retrying.
+        unsigned attempts;
+        std::chrono::microseconds initial_backoff;
+        std::chrono::microseconds max_backoff;
+        
+        static hid_retry_policy none() {
+            return {1, std::chrono::microseconds::zero(), std::chrono::microseconds::zero()};
+        }
+        
+        /// Four attempts over about 35 ms, enough for a keyboard waking up or a brief exclusive grab.
+        static hid_retry_policy standard() {
+            return {4, std::chrono::milliseconds(5), std::chrono::milliseconds(20)};
+        }
+        
+        static bool is_transient(IOReturn res) {
+            return res == kIOReturnNotResponding or res == kIOReturnBusy or res == kIOReturnExclusiveAccess;
+        }
+        
+        /// Calls @p call, which returns an IOReturn, until it succeeds, fails for good or runs out of attempts.
+        template <class Call>
+        IOReturn run(Call &&call) const {
+            IOReturn res = call();
+            std::chrono::microseconds backoff = initial_backoff;
+            for (unsigned attempt = 1; attempt < attempts and is_transient(res); ++attempt) {
+                std::this_thread::sleep_for(backoff);
+                backoff = std::min(backoff * 2, max_backoff);
+                res = call();
+            }
+            return res;
+        }
+    };
+    
+    
+    namespace detail {
+        inline hid_retry_policy &retry_policy() {
+            static hid_retry_policy policy = hid_retry_policy::standard();
+            return policy;
+        }
+    }
+    
+    /// The policy of every element read and write and of every transaction; not thread safe, set it before starting any I/O.
+    inline hid_retry_policy const &default_retry_policy() {
+        return detail::retry_policy();
+    }
+    
+    inline void set_default_retry_policy(hid_retry_policy const &policy) {
+        detail::retry_policy() = policy;
+    }
+    
+#if defined(__APPLE__)
+    /// POSIX failures (sockets, files) in the same terms as the device ones; see hid_linux.hpp for the other platforms.
+    inline IOReturn io_return_from_errno(int err) {
+        switch (err) {
+            case 0:         return kIOReturnSuccess;
+            case ENOENT:
+            case ENXIO:
+            case ENODEV:    return kIOReturnNoDevice;
+            case EPERM:     return kIOReturnNotPermitted;
+            case EACCES:    return kIOReturnNotPrivileged;
+            case EBUSY:     return kIOReturnBusy;
+            case EINVAL:    return kIOReturnBadArgument;
+            case ENOMEM:    return kIOReturnNoMemory;
+            case ETIMEDOUT: return kIOReturnTimeout;
+            case EAGAIN:    return kIOReturnNotReady;
+            case EBADF:     return kIOReturnNotOpen;
+            case ENOTTY:
+            case EOPNOTSUPP: return kIOReturnUnsupported;
+            case ENOSPC:    return kIOReturnNoSpace;
+            default:        return kIOReturnIOError;
+        }
+    }
+    
+    /** Converts @p str to UTF-8 into @p buffer, which receives at most
+     * @p size - 1 bytes and a terminating NUL. Returns false, leaving
+     * @p length at the size needed, if it does not fit; a buffer of
+     * CFStringGetMaximumSizeForEncoding(CFStringGetLength(str), kCFStringEncodingUTF8) + 1
+     * bytes always does.
+     */
+    inline bool copy_cf_string(CFStringRef str, char *buffer, std::size_t size, std::size_t &length) {
+        length = 0;
+        if (str == nullptr) {
+            if (size > 0) {
+                buffer[0] = '\0';
+            }
+            return size > 0;
+        }
+        CFIndex const chars = CFStringGetLength(str);
+        CFIndex used = 0;
+        CFIndex const converted = CFStringGetBytes(str, CFRangeMake(0, chars), kCFStringEncodingUTF8, 0, FALSE,
+                                                   reinterpret_cast<UInt8 *>(buffer), size > 0 ? static_cast<CFIndex>(size) - 1 : 0, &used);
+        if (converted < chars) {
+            // Ask for the exact size this time
+            CFStringGetBytes(str, CFRangeMake(0, chars), kCFStringEncodingUTF8, 0, FALSE, nullptr, 0, &used);
+            length = static_cast<std::size_t>(used);
+            return false;
+        }
+        length = static_cast<std::size_t>(used);
+        if (size == 0) {
+            // Even an empty string needs room for the NUL
+            return false;
+        }
+        buffer[length] = '\0';
+        return true;
+    }
+    
+    /// The contents of @p str in UTF-8, the encoding used for all the strings on our side.
+    inline std::string copy_cf_string(CFStringRef str) {
         if (str == nullptr) {
             return "";
         }
-        const char *c_str = CFStringGetCStringPtr(str, CFStringGetSystemEncoding());
-        if (c_str != nullptr) {
+        // Strings stored as ASCII or UTF-8 need no conversion at all
+        if (char const *c_str = CFStringGetCStringPtr(str, kCFStringEncodingUTF8)) {
             return c_str;
         }
-        // Fallback
-        std::string retval;
-        std::size_t bufsize = 1024;
-        char *buf = nullptr;
-        do {
-            try {
-                void *old_buf = buf;
-                if (buf == nullptr) {
-                    buf = reinterpret_cast<char *>(malloc(bufsize));
-                } else {
-                    buf = reinterpret_cast<char *>(realloc(buf, bufsize));
-                }
-                if (buf == nullptr) {
-                    std::cerr << "Not enough memory." << std::endl;
-                    if (old_buf != nullptr) {
-                        free(old_buf);
-                    }
-                    break;
-                }
-                if (CFStringGetCString(str, buf, bufsize, CFStringGetSystemEncoding()) == TRUE) {
-                    retval = buf;
-                    break;
-                }
-            } catch (std::exception e) {
-                std::cerr << "Caught unexpected exception: " << e.what() << std::endl;
-                break;
-            }
-            bufsize *= 2;
-        } while (bufsize < 1024 * 1024);
-        if (buf != nullptr) {
-            free(buf);
+        CFIndex const chars = CFStringGetLength(str);
+        CFIndex const max_size = CFStringGetMaximumSizeForEncoding(chars, kCFStringEncodingUTF8);
+        CFIndex used = 0;
+        if (max_size < 128) {
+            // Product names are short, convert them on the stack
+            char small[128];
+            CFStringGetBytes(str, CFRangeMake(0, chars), kCFStringEncodingUTF8, 0, FALSE, reinterpret_cast<UInt8 *>(small), max_size, &used);
+            return std::string(small, static_cast<std::size_t>(used));
         }
+        std::string retval(static_cast<std::size_t>(max_size), '\0');
+        CFStringGetBytes(str, CFRangeMake(0, chars), kCFStringEncodingUTF8, 0, FALSE, reinterpret_cast<UInt8 *>(&retval[0]), max_size, &used);
+        retval.resize(static_cast<std::size_t>(used));
         return retval;
     }
     
@@ -151,6 +331,7 @@ namespace spak {
         cf_wrap &operator=(cf_wrap &&rval) {
             release();
             std::swap(_ref, rval._ref);
+            return *this;
         }
         void release() {
             if (_ref != nullptr) {
@@ -196,24 +377,360 @@ namespace spak {
             }
         }
     };
+
     
     
-    class hid_device_opener {
-        IOHIDDeviceRef _device;
+    /** Native primitives on top of IOKit's IOHIDManager/IOHIDDevice API.
+     * All the classes below only talk to the hardware through one of these
+     * backends, see also linux_backend in hid_linux.hpp.
+     */
+    struct iokit_backend {
+        using device_ref = IOHIDDeviceRef;
+        using element_ref = IOHIDElementRef;
+        
+        class manager {
+            cf_wrap<IOHIDManagerRef> _mgr;
+            std::vector<cf_wrap<IOHIDDeviceRef>> _resolved;
+        public:
+            manager() : _mgr(IOHIDManagerCreate(kCFAllocatorDefault, kIOHIDOptionsTypeNone)) {}
+            
+            /// Looks up a device by registry entry ID, without going through the matching machinery.
+            device_ref resolve(uint64_t native_id) {
+                io_service_t service = IOServiceGetMatchingService(kIOMasterPortDefault, IORegistryEntryIDMatching(native_id));
+                if (service == 0) {
+                    return nullptr;
+                }
+                IOHIDDeviceRef device = IOHIDDeviceCreate(kCFAllocatorDefault, service);
+                IOObjectRelease(service);
+                if (device != nullptr) {
+                    _resolved.emplace_back(device);
+                }
+                return device;
+            }
+            
+            std::vector<device_ref> copy_devices(uint32_t in_page, uint32_t in_usage_page) {
+                matching_dict match_keyboards(false, in_page, in_usage_page);
+                IOHIDManagerSetDeviceMatching(_mgr, match_keyboards);
+                // No need to call "open", device is already open here
+                std::vector<device_ref> devices;
+                cf_wrap<CFSetRef> devices_set(IOHIDManagerCopyDevices(_mgr));
+                assert(devices_set != nullptr);
+                devices.reserve(CFSetGetCount(devices_set));
+                CFSetApplyFunction(devices_set, [](void const *item, void *context) {
+                    assert(context != nullptr);
+                    reinterpret_cast<std::vector<device_ref> *>(context)->push_back(reinterpret_cast<IOHIDDeviceRef>(const_cast<void *>(item)));
+                }, &devices);
+                return devices;
+            }
+        };
+        
+        struct device_change {
+            bool added;
+            uint64_t native_id;
+            device_ref device;
+        };
+        
+        /** Reports devices as they are matched and removed, through the
+         * callbacks of a dedicated IOHIDManager. Callbacks are delivered by
+         * the run loop of the thread calling wait(), which is where the
+         * manager gets scheduled the first time. The first wait() reports all
+         * the devices already present.
+         */
+        class device_monitor {
+            cf_wrap<IOHIDManagerRef> _mgr;
+            std::vector<device_change> _pending;
+            std::atomic<CFRunLoopRef> _run_loop;
+            
+            static void on_change(void *context, bool added, IOHIDDeviceRef device) {
+                device_monitor &monitor = *reinterpret_cast<device_monitor *>(context);
+                monitor._pending.push_back(device_change{added, native_id(device), device});
+            }
+            
+        public:
+            device_monitor(uint32_t in_page = kHIDPage_Undefined, uint32_t in_usage_page = 0) :
+                _mgr(IOHIDManagerCreate(kCFAllocatorDefault, kIOHIDOptionsTypeNone)), _run_loop(nullptr)
+            {
+                matching_dict match(false, in_page, in_usage_page);
+                IOHIDManagerSetDeviceMatching(_mgr, match);
+                IOHIDManagerRegisterDeviceMatchingCallback(_mgr, [](void *context, IOReturn, void *, IOHIDDeviceRef device) {
+                    on_change(context, true, device);
+                }, this);
+                IOHIDManagerRegisterDeviceRemovalCallback(_mgr, [](void *context, IOReturn, void *, IOHIDDeviceRef device) {
+                    on_change(context, false, device);
+                }, this);
+            }
+            
+            device_monitor(device_monitor const &) = delete;
+            device_monitor &operator=(device_monitor const &) = delete;
+            
+            ~device_monitor() {
+                if (CFRunLoopRef run_loop = _run_loop.load()) {
+                    IOHIDManagerUnscheduleFromRunLoop(_mgr, run_loop, kCFRunLoopDefaultMode);
+                }
+            }
+            
+            /// Blocks until something changed, wake() is called or @p timeout expires.
+            void wait(std::vector<device_change> &changes, std::chrono::milliseconds timeout) {
+                CFTimeInterval seconds = std::chrono::duration<CFTimeInterval>(timeout).count();
+                if (_run_loop.load() == nullptr) {
+                    _run_loop = CFRunLoopGetCurrent();
+                    IOHIDManagerScheduleWithRunLoop(_mgr, _run_loop.load(), kCFRunLoopDefaultMode);
+                    // Matching callbacks for the devices already present fire right away
+                    seconds = 0;
+                }
+                if (CFRunLoopRunInMode(kCFRunLoopDefaultMode, seconds, TRUE) == kCFRunLoopRunHandledSource) {
+                    while (CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0, TRUE) == kCFRunLoopRunHandledSource) {}
+                }
+                changes.insert(changes.end(), _pending.begin(), _pending.end());
+                _pending.clear();
+            }
+            
+            /// Interrupts a wait() in progress on another thread.
+            void wake() {
+                if (CFRunLoopRef run_loop = _run_loop.load()) {
+                    CFRunLoopStop(run_loop);
+                }
+            }
+        };
+        
+        static IOReturn open(device_ref device) {
+            return IOHIDDeviceOpen(device, kIOHIDOptionsTypeNone);
+        }
+        
+        static void close(device_ref device) {
+            IOHIDDeviceClose(device, kIOHIDOptionsTypeNone);
+        }
+        
+        static bool conforms_to(device_ref device, uint32_t in_page, uint32_t in_usage_page) {
+            return IOHIDDeviceConformsTo(device, in_page, in_usage_page) == TRUE;
+        }
+        
+        static std::string manufacturer(device_ref device) {
+            return copy_cf_string(reinterpret_cast<CFStringRef>(IOHIDDeviceGetProperty(device, CFSTR(kIOHIDManufacturerKey))));
+        }
+        
+        static std::string product(device_ref device) {
+            return copy_cf_string(reinterpret_cast<CFStringRef>(IOHIDDeviceGetProperty(device, CFSTR(kIOHIDProductKey))));
+        }
+        
+        static std::string serial_number(device_ref device) {
+            return copy_cf_string(reinterpret_cast<CFStringRef>(IOHIDDeviceGetProperty(device, CFSTR(kIOHIDSerialNumberKey))));
+        }
+        
+        enum struct string_property {
+            manufacturer,
+            product,
+            serial_number
+        };
+        
+        /// A selector converted once to the device's own string representation.
+        using native_string = cf_wrap<CFStringRef>;
+        
+        static native_string intern(std::string const &str) {
+            return CFStringCreateWithCString(kCFAllocatorDefault, str.c_str(), kCFStringEncodingUTF8);
+        }
+        
+        /// Compares the CFString properties in place, thus without copying anything.
+        static bool string_equals(device_ref device, string_property prop, native_string const &str) {
+            CFStringRef key = nullptr;
+            switch (prop) {
+                case string_property::manufacturer:
+                    key = CFSTR(kIOHIDManufacturerKey);
+                    break;
+                case string_property::product:
+                    key = CFSTR(kIOHIDProductKey);
+                    break;
+                case string_property::serial_number:
+                    key = CFSTR(kIOHIDSerialNumberKey);
+                    break;
+            }
+            CFTypeRef value = IOHIDDeviceGetProperty(device, key);
+            if (value == nullptr or CFGetTypeID(value) != CFStringGetTypeID()) {
+                return CFStringGetLength(str) == 0;
+            }
+            return CFStringCompare(reinterpret_cast<CFStringRef>(value), str, 0) == kCFCompareEqualTo;
+        }
+        
+        static uint32_t vendor_id(device_ref device) {
+            return get_int_property(device, CFSTR(kIOHIDVendorIDKey));
+        }
+        
+        static uint32_t product_id(device_ref device) {
+            return get_int_property(device, CFSTR(kIOHIDProductIDKey));
+        }
+        
+        static uint32_t location_id(device_ref device) {
+            return get_int_property(device, CFSTR(kIOHIDLocationIDKey));
+        }
+        
+        /// Keeps @p device alive for as long as the returned handle.
+        static std::shared_ptr<void const> retain(device_ref device) {
+            CFRetain(device);
+            return std::shared_ptr<void const>(device, [](void const *ref) {
+                CFRelease(ref);
+            });
+        }
+        
+        static uint64_t native_id(device_ref device) {
+            uint64_t entry_id = 0;
+            IORegistryEntryGetRegistryEntryID(IOHIDDeviceGetService(device), &entry_id);
+            return entry_id;
+        }
+        
+        static std::vector<element_ref> copy_elements(device_ref device, uint32_t in_page, uint32_t in_usage_page) {
+            std::vector<element_ref> retval;
+            matching_dict match_elements(true, in_page, in_usage_page);
+            cf_wrap<CFArrayRef> elements(IOHIDDeviceCopyMatchingElements(device, match_elements, kIOHIDOptionsTypeNone));
+            if (elements != nullptr) {
+                CFIndex const length = CFArrayGetCount(elements);
+                retval.reserve(length);
+                CFArrayApplyFunction(elements, CFRangeMake(0, length), [](void const *item, void *context) {
+                    assert(context != nullptr);
+                    reinterpret_cast<std::vector<element_ref> *>(context)->push_back(reinterpret_cast<IOHIDElementRef>(const_cast<void *>(item)));
+                }, &retval);
+            }
+            return retval;
+        }
+        
+        static device_ref element_device(element_ref element) {
+            return IOHIDElementGetDevice(element);
+        }
+        
+        static uint32_t usage(element_ref element) {
+            return IOHIDElementGetUsage(element);
+        }
+        
+        static uint32_t usage_page(element_ref element) {
+            return IOHIDElementGetUsagePage(element);
+        }
+        
+        static IOHIDElementType type(element_ref element) {
+            return IOHIDElementGetType(element);
+        }
+        
+        static std::string name(element_ref element) {
+            return copy_cf_string(reinterpret_cast<CFStringRef>(IOHIDElementGetName(element)));
+        }
+        
+        static uint32_t report_id(element_ref element) {
+            return IOHIDElementGetReportID(element);
+        }
+        
+        static CFIndex logical_min(element_ref element) {
+            return IOHIDElementGetLogicalMin(element);
+        }
+        
+        static CFIndex logical_max(element_ref element) {
+            return IOHIDElementGetLogicalMax(element);
+        }
+        
+        static IOReturn get_value(device_ref device, element_ref element, CFIndex &value) {
+            IOHIDValueRef value_ref = nullptr;
+            IOReturn const res = IOHIDDeviceGetValue(device, element, &value_ref);
+            if (res == kIOReturnSuccess) {
+                value = IOHIDValueGetIntegerValue(value_ref);
+            }
+            return res;
+        }
+        
+        static IOReturn set_value(device_ref device, element_ref element, CFIndex value) {
+            cf_wrap<IOHIDValueRef> cf_value(IOHIDValueCreateWithIntegerValue(kCFAllocatorDefault, element, std::time(nullptr), value));
+            return IOHIDDeviceSetValue(device, element, cf_value);
+        }
+        
+        /// An output transaction lets IOKit pack all the values in the report they belong to, and send it once.
+        static IOReturn set_values(device_ref device, element_ref const *elements, CFIndex const *values, std::size_t count) {
+            cf_wrap<IOHIDTransactionRef> transaction(IOHIDTransactionCreate(kCFAllocatorDefault, device, kIOHIDTransactionDirectionTypeOutput, kIOHIDOptionsTypeNone));
+            if (transaction == nullptr) {
+                return kIOReturnNoMemory;
+            }
+            for (std::size_t i = 0; i < count; ++i) {
+                cf_wrap<IOHIDValueRef> cf_value(IOHIDValueCreateWithIntegerValue(kCFAllocatorDefault, elements[i], std::time(nullptr), values[i]));
+                IOHIDTransactionAddElement(transaction, elements[i]);
+                IOHIDTransactionSetValue(transaction, elements[i], cf_value, kIOHIDOptionsTypeNone);
+            }
+            return IOHIDTransactionCommit(transaction);
+        }
+        
+        using value_callback = void (*)(void *context, element_ref const &element, CFIndex value);
+        
+        struct value_watch {
+            value_callback callback;
+            void *context;
+        };
+        
+        static bool can_watch_values(device_ref) {
+            return true;
+        }
+        
+        /// Input value callbacks are delivered by the current run loop, see dispatch_value_changes.
+        static void watch_values(device_ref device, value_watch *watch) {
+            if (watch != nullptr) {
+                IOHIDDeviceRegisterInputValueCallback(device, [](void *context, IOReturn, void *, IOHIDValueRef value) {
+                    value_watch const *watch = reinterpret_cast<value_watch const *>(context);
+                    watch->callback(watch->context, IOHIDValueGetElement(value), IOHIDValueGetIntegerValue(value));
+                }, watch);
+                IOHIDDeviceScheduleWithRunLoop(device, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+            } else {
+                IOHIDDeviceUnscheduleFromRunLoop(device, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+                IOHIDDeviceRegisterInputValueCallback(device, nullptr, nullptr);
+            }
+        }
+        
+        static void dispatch_value_changes(device_ref, value_watch *watch) {
+            if (watch != nullptr) {
+                while (CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0, TRUE) == kCFRunLoopRunHandledSource) {}
+            }
+        }
+        
+        /// Runs the current run loop until it delivers something, which calls the watches of the devices scheduled on it.
+        static bool wait_value_changes(device_ref const *, std::size_t, std::chrono::milliseconds timeout) {
+            return CFRunLoopRunInMode(kCFRunLoopDefaultMode, std::chrono::duration<CFTimeInterval>(timeout).count(), TRUE) == kCFRunLoopRunHandledSource;
+        }
+        
+    private:
+        static uint32_t get_int_property(device_ref device, CFStringRef prop_name) {
+            CFTypeRef prop = IOHIDDeviceGetProperty(device, prop_name);
+            int32_t value = 0;
+            if (prop != nullptr and CFGetTypeID(prop) == CFNumberGetTypeID()) {
+                CFNumberGetValue(reinterpret_cast<CFNumberRef>(prop), kCFNumberSInt32Type, &value);
+            }
+            return static_cast<uint32_t>(value);
+        }
+    };
+    
+    using native_backend = iokit_backend;
+#else
+    using native_backend = linux_backend;
+#endif
+    
+    
+    template <class Backend>
+    class basic_hid_device_opener {
+        typename Backend::device_ref _device;
         IOReturn _open_res;
         
-        hid_device_opener() : _device(nullptr), _open_res(kIOReturnSuccess) {}
+        basic_hid_device_opener() : _device(nullptr), _open_res(kIOReturnSuccess) {}
     public:
-        hid_device_opener(IOHIDDeviceRef device) : _device(device), _open_res(kIOReturnSuccess) {
-            _open_res = IOHIDDeviceOpen(device, kIOHIDOptionsTypeNone);
+        basic_hid_device_opener(typename Backend::device_ref device) : _device(device), _open_res(kIOReturnSuccess) {
+            HIDLED_TRACE_SCOPE(trace_probe::open);
+            _open_res = Backend::open(device);
             if (_open_res != kIOReturnSuccess) {
                 _device = nullptr;
             }
         }
-        hid_device_opener(hid_device_opener const &) = delete;
-        hid_device_opener &operator=(hid_device_opener const &) = delete;
-        hid_device_opener(hid_device_opener &&rval) = default;
-        hid_device_opener &operator=(hid_device_opener &&rval) = default;
+        basic_hid_device_opener(basic_hid_device_opener const &) = delete;
+        basic_hid_device_opener &operator=(basic_hid_device_opener const &) = delete;
+        basic_hid_device_opener(basic_hid_device_opener &&rval) : basic_hid_device_opener() {
+            std::swap(_device, rval._device);
+            std::swap(_open_res, rval._open_res);
+        }
+        basic_hid_device_opener &operator=(basic_hid_device_opener &&rval) {
+            close();
+            std::swap(_device, rval._device);
+            std::swap(_open_res, rval._open_res);
+            return *this;
+        }
         
         IOReturn result() const {
             return _open_res;
@@ -223,147 +740,655 @@ namespace spak {
         }
         void close() {
             if (_device != nullptr) {
-                IOHIDDeviceClose(_device, kIOHIDOptionsTypeNone);
+                Backend::close(_device);
                 _device = nullptr;
             }
         }
-        ~hid_device_opener() {
+        ~basic_hid_device_opener() {
             close();
         }
     };
     
-    class cannot_open_device: public std::runtime_error {
+    using hid_device_opener = basic_hid_device_opener<native_backend>;
+    
+    
+    template <class Backend>
+    class basic_hid_device_pool;
+    
+    /// A device borrowed open from a basic_hid_device_pool; gives it back on destruction.
+    template <class Backend>
+    class basic_hid_device_handle {
+        basic_hid_device_pool<Backend> *_pool;
+        typename Backend::device_ref _device;
+        IOReturn _open_res;
+    public:
+        basic_hid_device_handle(basic_hid_device_pool<Backend> *pool, typename Backend::device_ref device, IOReturn open_res) :
+            _pool(pool), _device(device), _open_res(open_res) {}
+        basic_hid_device_handle(basic_hid_device_handle const &) = delete;
+        basic_hid_device_handle &operator=(basic_hid_device_handle const &) = delete;
+        basic_hid_device_handle(basic_hid_device_handle &&rval) : _pool(nullptr), _device(nullptr), _open_res(kIOReturnSuccess) {
+            std::swap(_pool, rval._pool);
+            std::swap(_device, rval._device);
+            std::swap(_open_res, rval._open_res);
+        }
+        basic_hid_device_handle &operator=(basic_hid_device_handle &&rval) {
+            release();
+            std::swap(_pool, rval._pool);
+            std::swap(_device, rval._device);
+            std::swap(_open_res, rval._open_res);
+            return *this;
+        }
+        
+        IOReturn result() const {
+            return _open_res;
+        }
+        bool is_open() const {
+            return _pool != nullptr;
+        }
+        void release();
+        ~basic_hid_device_handle() {
+            release();
+        }
+    };
+    
+    /** Open handles shared by whoever needs a device open only for a moment,
+     * e.g. to read an element of a device nobody opened. A device stays open
+     * while it is borrowed and for idle_timeout() after that, so a burst of
+     * reads and writes costs one open and one close instead of one per
+     * access. Idle devices are closed by a thread started on first use,
+     * possibly while another thread reads an element of the device without
+     * borrowing it: backends serialize their I/O with open() and close(), so
+     * that such a read either finds the device open or fails with
+     * kIOReturnNotOpen, and then borrows it.
+     */
+    template <class Backend>
+    class basic_hid_device_pool {
+        using clock = std::chrono::steady_clock;
+        
+        struct entry {
+            typename Backend::device_ref device;
+            /// The pool may outlive whoever handed the device in.
+            std::shared_ptr<void const> retained;
+            std::size_t borrowers;
+            clock::time_point idle_since;
+        };
+        
+        std::mutex _mutex;
+        std::condition_variable _cv;
+        std::vector<entry> _entries;
+        /// Devices being opened by a borrower, outside of the lock.
+        std::vector<typename Backend::device_ref> _opening;
+        clock::duration _idle_timeout;
+        std::thread _reaper;
+        bool _stopping;
+        
+        typename std::vector<entry>::iterator find(typename Backend::device_ref const &device) {
+            return std::find_if(_entries.begin(), _entries.end(), [&](entry const &e) {
+                return e.device == device;
+            });
+        }
+        
+        /// Closes the devices idle for longer than @p timeout; returns when the next one is due.
+        clock::time_point evict(clock::duration timeout) {
+            clock::time_point const now = clock::now();
+            clock::time_point next = clock::time_point::max();
+            for (auto it = _entries.begin(); it != _entries.end();) {
+                if (it->borrowers == 0 and now - it->idle_since >= timeout) {
+                    Backend::close(it->device);
+                    it = _entries.erase(it);
+                    continue;
+                }
+                if (it->borrowers == 0) {
+                    next = std::min(next, it->idle_since + timeout);
+                }
+                ++it;
+            }
+            return next;
+        }
+        
+        void reap() {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (not _stopping) {
+                clock::time_point const next = evict(_idle_timeout);
+                if (next == clock::time_point::max()) {
+                    _cv.wait(lock);
+                } else {
+                    _cv.wait_until(lock, next);
+                }
+            }
+        }
+        
     public:
-        using std::runtime_error::runtime_error;
+        static clock::duration default_idle_timeout() {
+            return std::chrono::seconds(2);
+        }
+        
+        static basic_hid_device_pool &shared() {
+            static basic_hid_device_pool pool;
+            return pool;
+        }
+        
+        basic_hid_device_pool(clock::duration idle_timeout = default_idle_timeout()) : _idle_timeout(idle_timeout), _stopping(false) {}
+        
+        basic_hid_device_pool(basic_hid_device_pool const &) = delete;
+        basic_hid_device_pool &operator=(basic_hid_device_pool const &) = delete;
+        
+        ~basic_hid_device_pool() {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stopping = true;
+            }
+            _cv.notify_all();
+            if (_reaper.joinable()) {
+                _reaper.join();
+            }
+            for (entry const &e : _entries) {
+                Backend::close(e.device);
+            }
+        }
+        
+        clock::duration idle_timeout() const {
+            return _idle_timeout;
+        }
+        
+        /// A zero timeout closes devices as soon as they are given back.
+        void set_idle_timeout(clock::duration idle_timeout) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _idle_timeout = idle_timeout;
+            _cv.notify_all();
+        }
+        
+        /** Opens @p device unless it already is open in the pool. The open
+         * happens outside of the pool lock, so that a device slow to open
+         * holds up only those borrowing that same device.
+         */
+        basic_hid_device_handle<Backend> borrow(typename Backend::device_ref const &device) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto it = find(device);
+            while (it == _entries.end() and std::find(_opening.begin(), _opening.end(), device) != _opening.end()) {
+                _cv.wait(lock);
+                it = find(device);
+            }
+            if (it == _entries.end()) {
+                _opening.push_back(device);
+                lock.unlock();
+                IOReturn res = kIOReturnSuccess;
+                {
+                    HIDLED_TRACE_SCOPE(trace_probe::open);
+                    res = Backend::open(device);
+                }
+                lock.lock();
+                _opening.erase(std::find(_opening.begin(), _opening.end(), device));
+                _cv.notify_all();
+                if (res != kIOReturnSuccess) {
+                    return {nullptr, nullptr, res};
+                }
+                _entries.push_back(entry{device, Backend::retain(device), 0, clock::time_point()});
+                it = _entries.end() - 1;
+                if (not _reaper.joinable()) {
+                    _reaper = std::thread(&basic_hid_device_pool::reap, this);
+                }
+            }
+            ++it->borrowers;
+            return {this, device, kIOReturnSuccess};
+        }
+        
+        void give_back(typename Backend::device_ref const &device) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = find(device);
+            if (it == _entries.end() or it->borrowers == 0 or --it->borrowers > 0) {
+                return;
+            }
+            it->idle_since = clock::now();
+            if (_idle_timeout <= clock::duration::zero()) {
+                Backend::close(it->device);
+                _entries.erase(it);
+            } else {
+                _cv.notify_all();
+            }
+        }
+        
+        /// Closes every device nobody is borrowing, e.g. before handing them over to another process.
+        void close_idle() {
+            std::lock_guard<std::mutex> lock(_mutex);
+            evict(clock::duration::zero());
+        }
+        
+        /// Devices held open, borrowed or idle.
+        std::size_t size() {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _entries.size();
+        }
+    };
+    
+    template <class Backend>
+    void basic_hid_device_handle<Backend>::release() {
+        if (_pool != nullptr) {
+            _pool->give_back(_device);
+            _pool = nullptr;
+            _device = nullptr;
+        }
+    }
+    
+    using hid_device_pool = basic_hid_device_pool<native_backend>;
+    
+    /// Thrown by the value proxies, which have no other way to report a failure; get() and set() return it instead.
+    class hid_io_error: public std::runtime_error {
+        IOReturn _code;
+    public:
+        explicit hid_io_error(IOReturn code) : std::runtime_error(describe_io_return(code)), _code(code) {}
+        
+        IOReturn code() const {
+            return _code;
+        }
+    };
+    
+    class cannot_open_device: public hid_io_error {
+    public:
+        using hid_io_error::hid_io_error;
     };
     
 
-    template <class T>
+    /** Last known values of the output elements of a device, so that a
+     * read-modify-write such as a toggle costs a single write. Entries are
+     * seeded by the first read, refreshed by every successful write and
+     * expire after ttl(); once watch() is called, changes made elsewhere
+     * (lock keys, other processes) are picked up by sync().
+     *
+     * Every copy of a device shares its registers, and copies go to worker
+     * threads (broadcasts, command queues, animations, discovery), so the
+     * entries are guarded by a lock. watch() and sync() are meant for the
+     * one thread that dispatches the device's value changes.
+     */
+    template <class Backend>
+    class basic_hid_shadow_registers {
+    public:
+        using clock = std::chrono::steady_clock;
+        
+    private:
+        struct entry {
+            typename Backend::element_ref element;
+            CFIndex value;
+            clock::time_point stamp;
+        };
+        
+        typename Backend::device_ref _device;
+        mutable std::mutex _mutex;
+        std::vector<entry> _entries;
+        clock::duration _ttl;
+        typename Backend::value_watch _watch;
+        bool _watching;
+        
+        static bool is_lock_key(uint32_t usage) {
+            return usage == kHIDUsage_KeyboardCapsLock or usage == kHIDUsage_KeypadNumLock or usage == kHIDUsage_KeyboardScrollLock;
+        }
+        
+        static void on_value(void *context, typename Backend::element_ref const &element, CFIndex value) {
+            basic_hid_shadow_registers &shadow = *reinterpret_cast<basic_hid_shadow_registers *>(context);
+            uint32_t const usage_page = Backend::usage_page(element);
+            if (usage_page == kHIDPage_LEDs) {
+                shadow.update(element, value);
+            } else if (usage_page == kHIDPage_KeyboardOrKeypad and is_lock_key(Backend::usage(element))) {
+                // The system will flip a LED in response, we do not know which one
+                shadow.invalidate_all();
+            }
+        }
+        
+    public:
+        static clock::duration default_ttl() {
+            return std::chrono::seconds(5);
+        }
+        
+        basic_hid_shadow_registers(typename Backend::device_ref device, clock::duration ttl = default_ttl()) :
+            _device(device), _ttl(ttl), _watch{&on_value, this}, _watching(false) {}
+        
+        basic_hid_shadow_registers(basic_hid_shadow_registers const &) = delete;
+        basic_hid_shadow_registers &operator=(basic_hid_shadow_registers const &) = delete;
+        
+        ~basic_hid_shadow_registers() {
+            if (_watching) {
+                Backend::watch_values(_device, nullptr);
+            }
+        }
+        
+        clock::duration ttl() const {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _ttl;
+        }
+        
+        /// A zero TTL disables the cache.
+        void set_ttl(clock::duration ttl) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _ttl = ttl;
+            if (_ttl <= clock::duration::zero()) {
+                _entries.clear();
+            }
+        }
+        
+        bool lookup(typename Backend::element_ref const &element, CFIndex &value) const {
+            clock::time_point const now = clock::now();
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (entry const &e : _entries) {
+                if (e.element == element) {
+                    if (now - e.stamp >= _ttl) {
+                        return false;
+                    }
+                    value = e.value;
+                    return true;
+                }
+            }
+            return false;
+        }
+        
+        void update(typename Backend::element_ref const &element, CFIndex value) {
+            clock::time_point const now = clock::now();
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_ttl <= clock::duration::zero()) {
+                return;
+            }
+            for (entry &e : _entries) {
+                if (e.element == element) {
+                    e.value = value;
+                    e.stamp = now;
+                    return;
+                }
+            }
+            _entries.push_back(entry{element, value, now});
+        }
+        
+        void invalidate(typename Backend::element_ref const &element) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _entries.erase(std::remove_if(_entries.begin(), _entries.end(), [&](entry const &e) {
+                return e.element == element;
+            }), _entries.end());
+        }
+        
+        void invalidate_all() {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _entries.clear();
+        }
+        
+        /// Subscribes to value changes; they are applied on sync().
+        void watch() {
+            if (not _watching) {
+                Backend::watch_values(_device, &_watch);
+                _watching = true;
+            }
+        }
+        
+        void sync() {
+            if (_watching) {
+                Backend::dispatch_value_changes(_device, &_watch);
+            }
+        }
+    };
+    
+    using hid_shadow_registers = basic_hid_shadow_registers<native_backend>;
+    
+    
+    template <class T, class Backend = native_backend>
     class hid_device_element_const_value {};
     
-    template <class T>
-    class hid_device_element_value : public hid_device_element_const_value<T> {};
+    template <class T, class Backend = native_backend>
+    class hid_device_element_value : public hid_device_element_const_value<T, Backend> {};
     
-    template <>
-    class hid_device_element_const_value<CFIndex> {
+    template <class Backend>
+    class hid_device_element_const_value<CFIndex, Backend> {
     protected:
-        IOHIDDeviceRef _device;
-        IOHIDElementRef _element;
+        typename Backend::device_ref _device;
+        typename Backend::element_ref _element;
+        basic_hid_shadow_registers<Backend> *_shadow;
     public:
-        hid_device_element_const_value(IOHIDDeviceRef device, IOHIDElementRef element) : _device(device), _element(element) {}
-        hid_device_element_const_value(IOHIDElementRef element) : hid_device_element_const_value(IOHIDElementGetDevice(element), element) {}
+        hid_device_element_const_value(typename Backend::device_ref device, typename Backend::element_ref element, basic_hid_shadow_registers<Backend> *shadow = nullptr) :
+            _device(device), _element(element), _shadow(shadow) {}
+        hid_device_element_const_value(typename Backend::element_ref element, basic_hid_shadow_registers<Backend> *shadow = nullptr) :
+            hid_device_element_const_value(Backend::element_device(element), element, shadow) {}
         
-        operator CFIndex() const {
-            IOHIDValueRef value = nullptr;
-            IOReturn res = IOHIDDeviceGetValue(_device, _element, &value);
+        /// Reads the value, from the shadow registers if they have it. Transient failures are retried as per default_retry_policy().
+        hid_result<CFIndex> get() const {
+            HIDLED_TRACE_SCOPE(trace_probe::get_value);
+            CFIndex value = 0;
+            if (_shadow != nullptr and _shadow->lookup(_element, value)) {
+                return value;
+            }
+            auto const read = [&] { return Backend::get_value(_device, _element, value); };
+            IOReturn res = default_retry_policy().run(read);
             if (res == kIOReturnNotOpen) {
-                // Let's open it ourselves
-                hid_device_opener opener(_device);
-                if (not opener.is_open()) {
-                    throw cannot_open_device(describe_io_return(opener.result()));
-                }
-                res = IOHIDDeviceGetValue(_device, _element, &value);
+                // Borrow it open, the next access will likely find it still open
+                basic_hid_device_handle<Backend> handle = basic_hid_device_pool<Backend>::shared().borrow(_device);
+                res = handle.is_open() ? default_retry_policy().run(read) : handle.result();
             }
-            assert(res == kIOReturnSuccess);
-            return IOHIDValueGetIntegerValue(value);
+            if (res != kIOReturnSuccess) {
+                return hid_result<CFIndex>::failure(res);
+            }
+            if (_shadow != nullptr) {
+                _shadow->update(_element, value);
+            }
+            return value;
+        }
+        
+        /// Like get(), throwing hid_io_error on failure.
+        operator CFIndex() const {
+            hid_result<CFIndex> const res = get();
+            if (not res) {
+                throw hid_io_error(res.error());
+            }
+            return res.value();
         }
         
     };
     
-    template <>
-    class hid_device_element_value<CFIndex> final : public hid_device_element_const_value<CFIndex> {
+    template <class Backend>
+    class hid_device_element_value<CFIndex, Backend> final : public hid_device_element_const_value<CFIndex, Backend> {
+        using base = hid_device_element_const_value<CFIndex, Backend>;
     public:
-        using hid_device_element_const_value<CFIndex>::hid_device_element_const_value;
+        using base::base;
         
-        hid_device_element_value &operator=(CFIndex value) {
-            cf_wrap<IOHIDValueRef> cf_value(IOHIDValueCreateWithIntegerValue(kCFAllocatorDefault, _element, std::time(nullptr), value));
-            IOReturn res = IOHIDDeviceSetValue(_device, _element, cf_value);
+        /// Writes @p value; transient failures are retried as per default_retry_policy().
+        hid_result<void> set(CFIndex value) {
+            HIDLED_TRACE_SCOPE(trace_probe::set_value);
+            auto const write = [&] { return Backend::set_value(this->_device, this->_element, value); };
+            IOReturn res = default_retry_policy().run(write);
             if (res == kIOReturnNotOpen) {
-                // Let's open it ourselves
-                hid_device_opener opener(_device);
-                res = IOHIDDeviceSetValue(_device, _element, cf_value);
+                // Borrow it open, the next access will likely find it still open
+                basic_hid_device_handle<Backend> handle = basic_hid_device_pool<Backend>::shared().borrow(this->_device);
+                res = handle.is_open() ? default_retry_policy().run(write) : handle.result();
+            }
+            if (this->_shadow != nullptr) {
+                if (res == kIOReturnSuccess) {
+                    this->_shadow->update(this->_element, value);
+                } else {
+                    this->_shadow->invalidate(this->_element);
+                }
+            }
+            return res;
+        }
+        
+        /// Like set(), throwing hid_io_error on failure.
+        hid_device_element_value &operator=(CFIndex value) {
+            hid_result<void> const res = set(value);
+            if (not res) {
+                throw hid_io_error(res.error());
             }
-            assert(res == kIOReturnSuccess);
             return *this;
         }
     };
     
     
-    class hid_device_element {
-        IOHIDElementRef _element;
+    template <class Backend>
+    class basic_hid_device_transaction;
+    
+    template <class Backend>
+    class basic_hid_device_element {
+        friend class basic_hid_device_transaction<Backend>;
+        typename Backend::element_ref _element;
+        std::shared_ptr<basic_hid_shadow_registers<Backend>> _shadow;
     public:
-        hid_device_element(IOHIDElementRef element) : _element(element) {}
+        basic_hid_device_element(typename Backend::element_ref element, std::shared_ptr<basic_hid_shadow_registers<Backend>> shadow = nullptr) :
+            _element(element), _shadow(std::move(shadow)) {}
         
         uint32_t usage() const {
-            return IOHIDElementGetUsage(_element);
+            return Backend::usage(_element);
         }
         
         uint32_t usage_page() const {
-            return IOHIDElementGetUsagePage(_element);
+            return Backend::usage_page(_element);
         }
         
         IOHIDElementType type() const {
-            return IOHIDElementGetType(_element);
+            return Backend::type(_element);
         }
         
         std::string name() const {
-            return copy_cf_string(reinterpret_cast<CFStringRef>(IOHIDElementGetName(_element)));
+            return Backend::name(_element);
+        }
+        
+        uint32_t report_id() const {
+            return Backend::report_id(_element);
         }
         
         CFIndex logical_min() const {
-            return IOHIDElementGetLogicalMin(_element);
+            return Backend::logical_min(_element);
         }
         
         CFIndex logical_max() const {
-            return IOHIDElementGetLogicalMax(_element);
+            return Backend::logical_max(_element);
+        }
+        
+        /// Backend handle, for the calls made outside of the value proxies, see basic_hid_io_reactor.
+        typename Backend::element_ref const &native_ref() const {
+            return _element;
         }
         
         template <class T>
-        hid_device_element_const_value<T> value() const {
-            return {_element};
+        hid_device_element_const_value<T, Backend> value() const {
+            return {_element, _shadow.get()};
         }
         
         template <class T>
-        hid_device_element_value<T> value() {
-            return {_element};
+        hid_device_element_value<T, Backend> value() {
+            return {_element, _shadow.get()};
         }
     };
     
+    using hid_device_element = basic_hid_device_element<native_backend>;
+    
+    
+    /** Every element of a device, copied from the backend the first time it
+     * is needed and then kept for as long as the device object lives: a
+     * device that goes away gets a new object, and with it a new index.
+     * Lookups by (usage page, usage[, report ID]) take constant time.
+     */
+    template <class Backend>
+    class basic_hid_element_index {
+        static constexpr uint32_t any_report_id = 0x100;
+        
+        typename Backend::device_ref _device;
+        std::shared_ptr<basic_hid_shadow_registers<Backend>> _shadow;
+        std::once_flag _built;
+        std::vector<basic_hid_device_element<Backend>> _elements;
+        /// Position of the first element with each key, see key().
+        std::unordered_map<uint64_t, std::size_t> _positions;
+        
+        static uint64_t key(uint32_t page, uint32_t usage, uint32_t report_id) {
+            return (static_cast<uint64_t>(page & 0xFFFF) << 48) | (static_cast<uint64_t>(report_id & 0x1FF) << 32) | usage;
+        }
+        
+        void build() {
+            std::call_once(_built, [this] {
+                HIDLED_TRACE_SCOPE(trace_probe::elements);
+                std::vector<typename Backend::element_ref> const elements = Backend::copy_elements(_device, kHIDPage_Undefined, 0);
+                _elements.reserve(elements.size());
+                for (auto const &element : elements) {
+                    uint32_t const page = Backend::usage_page(element);
+                    uint32_t const usage = Backend::usage(element);
+                    // emplace() leaves the first element with a key in place
+                    _positions.emplace(key(page, usage, Backend::report_id(element)), _elements.size());
+                    _positions.emplace(key(page, usage, any_report_id), _elements.size());
+                    _elements.emplace_back(element, _shadow);
+                }
+            });
+        }
+        
+        basic_hid_device_element<Backend> *lookup(uint64_t k) {
+            build();
+            auto const it = _positions.find(k);
+            return it != _positions.end() ? &_elements[it->second] : nullptr;
+        }
+        
+    public:
+        basic_hid_element_index(typename Backend::device_ref device, std::shared_ptr<basic_hid_shadow_registers<Backend>> shadow) :
+            _device(device), _shadow(std::move(shadow)) {}
+        
+        basic_hid_element_index(basic_hid_element_index const &) = delete;
+        basic_hid_element_index &operator=(basic_hid_element_index const &) = delete;
+        
+        /// All the elements, in device order.
+        std::vector<basic_hid_device_element<Backend>> const &elements() {
+            build();
+            return _elements;
+        }
+        
+        /// Same selection and order as Backend::copy_elements, without asking the backend.
+        std::vector<basic_hid_device_element<Backend>> matching(uint32_t in_page, uint32_t in_usage_page) {
+            build();
+            std::vector<basic_hid_device_element<Backend>> retval;
+            for (auto const &element : _elements) {
+                if ((in_page == kHIDPage_Undefined or element.usage_page() == in_page) and (in_usage_page == 0 or element.usage() == in_usage_page)) {
+                    retval.push_back(element);
+                }
+            }
+            return retval;
+        }
+        
+        /// First element with @p usage on @p usage_page, or nullptr; valid for the lifetime of the index.
+        basic_hid_device_element<Backend> *find(uint32_t usage_page, uint32_t usage) {
+            return lookup(key(usage_page, usage, any_report_id));
+        }
+        
+        basic_hid_device_element<Backend> *find(uint32_t usage_page, uint32_t usage, uint8_t report_id) {
+            return lookup(key(usage_page, usage, report_id));
+        }
+    };
     
     
-    class hid_device_const_elements_enumerator {
+    template <class Backend>
+    class basic_hid_device_const_elements_enumerator {
     protected:
-        IOHIDDeviceRef _device;
-        std::vector<hid_device_element> _elements;
+        typename Backend::device_ref _device;
+        std::vector<basic_hid_device_element<Backend>> _elements;
     private:
-        void copy_elements(uint32_t in_page, uint32_t in_usage_page) {
-            matching_dict match_elements(true, in_page, in_usage_page);
-            cf_wrap<CFArrayRef> elements(IOHIDDeviceCopyMatchingElements(_device, match_elements, kIOHIDOptionsTypeNone));
-            if (elements != nullptr) {
-                CFIndex const length = CFArrayGetCount(elements);
-                _elements.clear();
-                _elements.reserve(length);
-                CFArrayApplyFunction(elements, CFRangeMake(0, length), [](void const *item, void *context) {
-                    assert(context != nullptr);
-                    reinterpret_cast<std::vector<hid_device_element> *>(context)->emplace_back(reinterpret_cast<IOHIDElementRef>(const_cast<void *>(item)));
-                }, &_elements);
+        void copy_elements(uint32_t in_page, uint32_t in_usage_page, std::shared_ptr<basic_hid_shadow_registers<Backend>> const &shadow) {
+            std::vector<typename Backend::element_ref> const elements = Backend::copy_elements(_device, in_page, in_usage_page);
+            _elements.clear();
+            _elements.reserve(elements.size());
+            for (auto const &element : elements) {
+                _elements.emplace_back(element, shadow);
             }
         }
     public:
         
-        using value_type = std::vector<hid_device_element>::value_type;
-        using reference = std::vector<hid_device_element>::const_reference;
-        using const_reference = std::vector<hid_device_element>::const_reference;
-        using pointer = std::vector<hid_device_element>::const_pointer;
-        using const_pointer = std::vector<hid_device_element>::const_pointer;
+        using value_type = typename std::vector<basic_hid_device_element<Backend>>::value_type;
+        using reference = typename std::vector<basic_hid_device_element<Backend>>::const_reference;
+        using const_reference = typename std::vector<basic_hid_device_element<Backend>>::const_reference;
+        using pointer = typename std::vector<basic_hid_device_element<Backend>>::const_pointer;
+        using const_pointer = typename std::vector<basic_hid_device_element<Backend>>::const_pointer;
         
-        hid_device_const_elements_enumerator(IOHIDDeviceRef device, uint32_t in_page = kHIDPage_Undefined, uint32_t in_usage_page = 0) :
+        basic_hid_device_const_elements_enumerator(typename Backend::device_ref device, uint32_t in_page = kHIDPage_Undefined, uint32_t in_usage_page = 0,
+                                             std::shared_ptr<basic_hid_shadow_registers<Backend>> const &shadow = nullptr) :
             _device(device)
         {
-            copy_elements(in_page, in_usage_page);
+            HIDLED_TRACE_SCOPE(trace_probe::elements);
+            copy_elements(in_page, in_usage_page, shadow);
         }
         
-        std::vector<hid_device_element> const &elements() const {
+        /// Takes the elements from @p index rather than from the backend.
+        basic_hid_device_const_elements_enumerator(typename Backend::device_ref device, uint32_t in_page, uint32_t in_usage_page,
+                                             basic_hid_element_index<Backend> &index) :
+            _device(device), _elements(index.matching(in_page, in_usage_page))
+        {}
+        
+        std::vector<basic_hid_device_element<Backend>> const &elements() const {
             return _elements;
         }
         
@@ -384,109 +1409,453 @@ namespace spak {
         }
     };
     
+    using hid_device_const_elements_enumerator = basic_hid_device_const_elements_enumerator<native_backend>;
     
-    class hid_device_elements_enumerator : public hid_device_const_elements_enumerator {
+    
+    template <class Backend>
+    class basic_hid_device_elements_enumerator : public basic_hid_device_const_elements_enumerator<Backend> {
     public:
         
-        using value_type = std::vector<hid_device_element>::value_type;
-        using reference = std::vector<hid_device_element>::reference;
-        using const_reference = std::vector<hid_device_element>::const_reference;
-        using pointer = std::vector<hid_device_element>::pointer;
-        using const_pointer = std::vector<hid_device_element>::const_pointer;
+        using value_type = typename std::vector<basic_hid_device_element<Backend>>::value_type;
+        using reference = typename std::vector<basic_hid_device_element<Backend>>::reference;
+        using const_reference = typename std::vector<basic_hid_device_element<Backend>>::const_reference;
+        using pointer = typename std::vector<basic_hid_device_element<Backend>>::pointer;
+        using const_pointer = typename std::vector<basic_hid_device_element<Backend>>::const_pointer;
         
-        using hid_device_const_elements_enumerator::hid_device_const_elements_enumerator;
+        using basic_hid_device_const_elements_enumerator<Backend>::basic_hid_device_const_elements_enumerator;
         
         auto begin() {
-            return _elements.begin();
+            return this->_elements.begin();
         }
         
         auto end() {
-            return _elements.end();
+            return this->_elements.end();
         }
         
         reference operator[](std::size_t i) {
-            return _elements[i];
+            return this->_elements[i];
+        }
+    };
+    
+    using hid_device_elements_enumerator = basic_hid_device_elements_enumerator<native_backend>;
+    
+    
+    /** Stages values for several elements of one device and writes them on
+     * commit(), one report at a time: elements sharing a report ID (e.g. the
+     * LEDs of a keyboard) end up in the same output report instead of costing
+     * one transfer each.
+     */
+    template <class Backend>
+    class basic_hid_device_transaction {
+        struct staged_value {
+            typename Backend::element_ref element;
+            uint32_t report_id;
+            CFIndex value;
+        };
+        
+        typename Backend::device_ref _device;
+        std::vector<staged_value> _staged;
+        basic_hid_shadow_registers<Backend> *_shadow;
+        
+        IOReturn commit_reports() const {
+            std::vector<typename Backend::element_ref> elements;
+            std::vector<CFIndex> values;
+            elements.reserve(_staged.size());
+            values.reserve(_staged.size());
+            for (std::size_t i = 0; i < _staged.size(); ++i) {
+                elements.push_back(_staged[i].element);
+                values.push_back(_staged[i].value);
+                // _staged is kept sorted by report ID
+                if (i + 1 == _staged.size() or _staged[i + 1].report_id != _staged[i].report_id) {
+                    IOReturn const res = default_retry_policy().run([&] {
+                        return Backend::set_values(_device, elements.data(), values.data(), elements.size());
+                    });
+                    if (res != kIOReturnSuccess) {
+                        return res;
+                    }
+                    elements.clear();
+                    values.clear();
+                }
+            }
+            return kIOReturnSuccess;
+        }
+    public:
+        basic_hid_device_transaction(typename Backend::device_ref device, basic_hid_shadow_registers<Backend> *shadow = nullptr) : _device(device), _shadow(shadow) {}
+        
+        /// Replaces any value previously staged for the same element.
+        basic_hid_device_transaction &stage(basic_hid_device_element<Backend> const &element, CFIndex value) {
+            for (staged_value &staged : _staged) {
+                if (staged.element == element._element) {
+                    staged.value = value;
+                    return *this;
+                }
+            }
+            uint32_t const report_id = element.report_id();
+            auto it = std::upper_bound(_staged.begin(), _staged.end(), report_id, [](uint32_t id, staged_value const &staged) {
+                return id < staged.report_id;
+            });
+            _staged.insert(it, staged_value{element._element, report_id, value});
+            return *this;
+        }
+        
+        /// The value that commit() would write for @p element, if any.
+        bool staged_value_of(basic_hid_device_element<Backend> const &element, CFIndex &value) const {
+            for (staged_value const &staged : _staged) {
+                if (staged.element == element._element) {
+                    value = staged.value;
+                    return true;
+                }
+            }
+            return false;
+        }
+        
+        std::size_t size() const {
+            return _staged.size();
+        }
+        
+        void clear() {
+            _staged.clear();
+        }
+        
+        /// Writes and clears the staged values. Opens the device for the time being if needed.
+        IOReturn commit() {
+            if (_staged.empty()) {
+                return kIOReturnSuccess;
+            }
+            HIDLED_TRACE_SCOPE(trace_probe::commit);
+            IOReturn res = commit_reports();
+            if (res == kIOReturnNotOpen) {
+                // Borrow it open, the next access will likely find it still open
+                basic_hid_device_handle<Backend> handle = basic_hid_device_pool<Backend>::shared().borrow(_device);
+                res = handle.is_open() ? commit_reports() : handle.result();
+            }
+            for (staged_value const &staged : _staged) {
+                if (_shadow == nullptr) {
+                    break;
+                } else if (res == kIOReturnSuccess) {
+                    _shadow->update(staged.element, staged.value);
+                } else {
+                    _shadow->invalidate(staged.element);
+                }
+            }
+            if (res == kIOReturnSuccess) {
+                _staged.clear();
+            }
+            return res;
         }
     };
     
+    using hid_device_transaction = basic_hid_device_transaction<native_backend>;
+    
     
-    class hid_device {
-        IOHIDDeviceRef _device;
-        std::string get_string_property(CFStringRef prop_name) const {
-            return copy_cf_string(reinterpret_cast<CFStringRef>(IOHIDDeviceGetProperty(_device, prop_name)));
+    /** Identifies a physical device across processes; unlike the native
+     * handles, it stays the same until the device is unplugged.
+     */
+    struct hid_device_identity {
+        uint32_t vendor_id;
+        uint32_t product_id;
+        uint32_t location_id;
+        std::string serial_number;
+        
+        bool operator==(hid_device_identity const &other) const {
+            return vendor_id == other.vendor_id and product_id == other.product_id
+                and location_id == other.location_id and serial_number == other.serial_number;
+        }
+        
+        bool operator!=(hid_device_identity const &other) const {
+            return not operator==(other);
         }
+    };
+    
+    
+    /** Device selector, checked against the native properties without
+     * copying them. Selectors are converted once when they are set, hence
+     * matches() does not allocate; unset selectors match anything.
+     */
+    template <class Backend>
+    class basic_hid_device_matcher {
+        enum : unsigned {
+            has_vendor_id       = 1 << 0,
+            has_product_id      = 1 << 1,
+            has_location_id     = 1 << 2,
+            has_manufacturer    = 1 << 3,
+            has_product         = 1 << 4,
+            has_serial_number   = 1 << 5
+        };
+        
+        unsigned _set;
+        uint32_t _vendor_id;
+        uint32_t _product_id;
+        uint32_t _location_id;
+        typename Backend::native_string _manufacturer;
+        typename Backend::native_string _product;
+        typename Backend::native_string _serial_number;
+        
     public:
+        basic_hid_device_matcher() : _set(0), _vendor_id(0), _product_id(0), _location_id(0) {}
+        
+        /// Empty strings are ignored, as with --product and --manufacturer.
+        basic_hid_device_matcher(std::string const &match_prod, std::string const &match_manu) : basic_hid_device_matcher() {
+            if (not match_prod.empty()) {
+                product(match_prod);
+            }
+            if (not match_manu.empty()) {
+                manufacturer(match_manu);
+            }
+        }
         
-        hid_device(IOHIDDeviceRef device) : _device(device) {}
+        basic_hid_device_matcher &vendor_id(uint32_t id) {
+            _vendor_id = id;
+            _set |= has_vendor_id;
+            return *this;
+        }
         
-        bool conforms_to(uint32_t in_page, uint32_t in_usage_page = 0) const {
-            return IOHIDDeviceConformsTo(_device, in_page, in_usage_page) == TRUE;
+        basic_hid_device_matcher &product_id(uint32_t id) {
+            _product_id = id;
+            _set |= has_product_id;
+            return *this;
         }
         
-        std::string manufacturer() const {
-            return get_string_property(CFSTR(kIOHIDManufacturerKey));
+        basic_hid_device_matcher &location_id(uint32_t id) {
+            _location_id = id;
+            _set |= has_location_id;
+            return *this;
         }
         
-        std::string product() const {
-            return get_string_property(CFSTR(kIOHIDProductKey));
+        basic_hid_device_matcher &manufacturer(std::string const &str) {
+            _manufacturer = Backend::intern(str);
+            _set |= has_manufacturer;
+            return *this;
         }
         
-        hid_device_elements_enumerator elements(uint32_t in_page = kHIDPage_Undefined, uint32_t in_usage_page = 0) {
-            return {_device, in_page, in_usage_page};
+        basic_hid_device_matcher &product(std::string const &str) {
+            _product = Backend::intern(str);
+            _set |= has_product;
+            return *this;
         }
         
-        hid_device_const_elements_enumerator elements(uint32_t in_page = kHIDPage_Undefined, uint32_t in_usage_page = 0) const {
-            return {_device, in_page, in_usage_page};
+        basic_hid_device_matcher &serial_number(std::string const &str) {
+            _serial_number = Backend::intern(str);
+            _set |= has_serial_number;
+            return *this;
         }
         
-        hid_device_opener open() {
-            return hid_device_opener(_device);
+        bool matches(typename Backend::device_ref const &device) const {
+            using prop = typename Backend::string_property;
+            // Integers first, they are the cheapest to compare
+            if ((_set & has_vendor_id) and Backend::vendor_id(device) != _vendor_id) {
+                return false;
+            }
+            if ((_set & has_product_id) and Backend::product_id(device) != _product_id) {
+                return false;
+            }
+            if ((_set & has_location_id) and Backend::location_id(device) != _location_id) {
+                return false;
+            }
+            if ((_set & has_manufacturer) and not Backend::string_equals(device, prop::manufacturer, _manufacturer)) {
+                return false;
+            }
+            if ((_set & has_product) and not Backend::string_equals(device, prop::product, _product)) {
+                return false;
+            }
+            if ((_set & has_serial_number) and not Backend::string_equals(device, prop::serial_number, _serial_number)) {
+                return false;
+            }
+            return true;
         }
     };
     
+    using hid_device_matcher = basic_hid_device_matcher<native_backend>;
     
-    class hid_device_enumerator {
-        cf_wrap<IOHIDManagerRef> _mgr;
-        std::vector<hid_device> _devices;
+    
+    template <class Backend>
+    class basic_hid_device {
+        typename Backend::device_ref _device;
+        std::shared_ptr<basic_hid_shadow_registers<Backend>> _shadow;
+        std::shared_ptr<basic_hid_element_index<Backend>> _index;
+        
+        /// Property strings, converted once per device on first use.
+        struct strings {
+            std::once_flag copied;
+            std::string manufacturer;
+            std::string product;
+            std::string serial_number;
+        };
+        std::shared_ptr<strings> _strings;
         
-        void setup_device_filter(uint32_t in_page, uint32_t in_usage_page) {
-            matching_dict match_keyboards(false, in_page, in_usage_page);
-            IOHIDManagerSetDeviceMatching(_mgr, match_keyboards);
+        strings const &copied_strings() const {
+            std::call_once(_strings->copied, [this] {
+                _strings->manufacturer = Backend::manufacturer(_device);
+                _strings->product = Backend::product(_device);
+                _strings->serial_number = Backend::serial_number(_device);
+            });
+            return *_strings;
         }
-        void open() {
-            IOReturn const res = IOHIDManagerOpen(_mgr, kIOHIDOptionsTypeNone);
-            assert(res == kIOReturnSuccess);
+    public:
+        
+        basic_hid_device(typename Backend::device_ref device) :
+            _device(device),
+            _shadow(std::make_shared<basic_hid_shadow_registers<Backend>>(device)),
+            _index(std::make_shared<basic_hid_element_index<Backend>>(device, _shadow)),
+            _strings(std::make_shared<strings>())
+        {}
+        
+        bool conforms_to(uint32_t in_page, uint32_t in_usage_page = 0) const {
+            return Backend::conforms_to(_device, in_page, in_usage_page);
         }
-        void copy_devices() {
-            cf_wrap<CFSetRef> devices_set(IOHIDManagerCopyDevices(_mgr));
-            assert(devices_set != nullptr);
-            _devices.clear();
-            _devices.reserve(CFSetGetCount(devices_set));
-            CFSetApplyFunction(devices_set, [](void const *item, void *context) {
-                assert(context != nullptr);
-                reinterpret_cast<std::vector<hid_device> *>(context)->emplace_back(reinterpret_cast<IOHIDDeviceRef>(const_cast<void *>(item)));
-            }, &_devices);
+        
+        std::string const &manufacturer() const {
+            return copied_strings().manufacturer;
+        }
+        
+        std::string const &product() const {
+            return copied_strings().product;
+        }
+        
+        std::string const &serial_number() const {
+            return copied_strings().serial_number;
+        }
+        
+        hid_device_identity identity() const {
+            return {Backend::vendor_id(_device), Backend::product_id(_device),
+                Backend::location_id(_device), serial_number()};
+        }
+        
+        bool matches(basic_hid_device_matcher<Backend> const &matcher) const {
+            return matcher.matches(_device);
+        }
+        
+        /// Backend handle, for the backend calls that span several devices.
+        typename Backend::device_ref const &native_ref() const {
+            return _device;
+        }
+        
+        /// Backend specific handle that can be used to find the device again, see basic_hid_device_enumerator<Backend>::attach.
+        uint64_t native_id() const {
+            return Backend::native_id(_device);
+        }
+        
+        /// Served from the element index, which is shared by all the copies of this device.
+        basic_hid_device_elements_enumerator<Backend> elements(uint32_t in_page = kHIDPage_Undefined, uint32_t in_usage_page = 0) {
+            return {_device, in_page, in_usage_page, *_index};
+        }
+        
+        basic_hid_device_const_elements_enumerator<Backend> elements(uint32_t in_page = kHIDPage_Undefined, uint32_t in_usage_page = 0) const {
+            return {_device, in_page, in_usage_page, *_index};
+        }
+        
+        /// First element with @p usage on @p usage_page (e.g. kHIDPage_LEDs, kHIDUsage_LED_CapsLock), or nullptr. Constant time.
+        basic_hid_device_element<Backend> *element(uint32_t usage_page, uint32_t usage) const {
+            return _index->find(usage_page, usage);
+        }
+        
+        basic_hid_device_element<Backend> *element(uint32_t usage_page, uint32_t usage, uint8_t report_id) const {
+            return _index->find(usage_page, usage, report_id);
+        }
+        
+        /// Keeps the underlying device valid, e.g. for work that may outlive the enumerator.
+        std::shared_ptr<void const> retain() const {
+            return Backend::retain(_device);
         }
+        
+        /// Shared by all the copies of this device and by the elements they return.
+        basic_hid_shadow_registers<Backend> &shadow() const {
+            return *_shadow;
+        }
+        
+        basic_hid_device_opener<Backend> open() {
+            return basic_hid_device_opener<Backend>(_device);
+        }
+        
+        /// Like open(), but shares the open device through basic_hid_device_pool<Backend>::shared().
+        basic_hid_device_handle<Backend> borrow() {
+            return basic_hid_device_pool<Backend>::shared().borrow(_device);
+        }
+        
+        basic_hid_device_transaction<Backend> transaction() {
+            return {_device, _shadow.get()};
+        }
+    };
+    
+    using hid_device = basic_hid_device<native_backend>;
+    
+    
+    struct defer_scan_t {};
+    static constexpr defer_scan_t defer_scan{};
+    
+    template <class Backend>
+    class basic_hid_device_enumerator {
+        typename Backend::manager _mgr;
+        std::vector<basic_hid_device<Backend>> _devices;
     public:
         
-        using value_type = std::vector<hid_device>::value_type;
-        using reference = std::vector<hid_device>::reference;
-        using const_reference = std::vector<hid_device>::const_reference;
-        using pointer = std::vector<hid_device>::pointer;
-        using const_pointer = std::vector<hid_device>::const_pointer;
+        using value_type = typename std::vector<basic_hid_device<Backend>>::value_type;
+        using reference = typename std::vector<basic_hid_device<Backend>>::reference;
+        using const_reference = typename std::vector<basic_hid_device<Backend>>::const_reference;
+        using pointer = typename std::vector<basic_hid_device<Backend>>::pointer;
+        using const_pointer = typename std::vector<basic_hid_device<Backend>>::const_pointer;
         
-        hid_device_enumerator(uint32_t in_page = kHIDPage_Undefined, uint32_t in_usage_page = 0) :
-            _mgr(IOHIDManagerCreate(kCFAllocatorDefault, kIOHIDOptionsTypeNone))
+        basic_hid_device_enumerator(uint32_t in_page = kHIDPage_Undefined, uint32_t in_usage_page = 0, typename Backend::manager mgr = {}) :
+            _mgr(std::move(mgr))
         {
-            setup_device_filter(in_page, in_usage_page);
-            // No need to call "open", device is already open here
-            copy_devices();
+            scan(in_page, in_usage_page);
+        }
+        
+        /// Does not look for devices until scan() or attach() are called.
+        basic_hid_device_enumerator(defer_scan_t, typename Backend::manager mgr = {}) :
+            _mgr(std::move(mgr))
+        {}
+        
+        void scan(uint32_t in_page = kHIDPage_Undefined, uint32_t in_usage_page = 0) {
+            HIDLED_TRACE_SCOPE(trace_probe::enumerate);
+            std::vector<typename Backend::device_ref> const devices = _mgr.copy_devices(in_page, in_usage_page);
+            _devices.clear();
+            _devices.reserve(devices.size());
+            for (auto const &device : devices) {
+                _devices.emplace_back(device);
+            }
+        }
+        
+        /** Adds the device with the given native_id(), if it still exists.
+         * The returned pointer is valid until the next scan() or attach().
+         */
+        basic_hid_device<Backend> *attach(uint64_t native_id) {
+            HIDLED_TRACE_SCOPE(trace_probe::enumerate);
+            typename Backend::device_ref device = _mgr.resolve(native_id);
+            if (device == nullptr) {
+                return nullptr;
+            }
+            _devices.emplace_back(device);
+            return &_devices.back();
         }
         
-        std::vector<hid_device> const &devices() const {
+        std::vector<basic_hid_device<Backend>> const &devices() const {
             return _devices;
         }
         
+        /// First device accepted by @p matcher, in scan order, or nullptr. Neither copies devices nor allocates.
+        basic_hid_device<Backend> *find(basic_hid_device_matcher<Backend> const &matcher) {
+            auto it = std::find_if(_devices.begin(), _devices.end(), [&](basic_hid_device<Backend> const &device) {
+                return device.matches(matcher);
+            });
+            return it != _devices.end() ? &*it : nullptr;
+        }
+        
+        basic_hid_device<Backend> const *find(basic_hid_device_matcher<Backend> const &matcher) const {
+            return const_cast<basic_hid_device_enumerator *>(this)->find(matcher);
+        }
+        
+        /// All the devices accepted by @p matcher, in scan order.
+        std::vector<basic_hid_device<Backend>> find_all(basic_hid_device_matcher<Backend> const &matcher) const {
+            std::vector<basic_hid_device<Backend>> matches;
+            for (auto const &device : _devices) {
+                if (device.matches(matcher)) {
+                    matches.push_back(device);
+                }
+            }
+            return matches;
+        }
+        
         auto size() const {
             return _devices.size();
         }
@@ -516,6 +1885,8 @@ namespace spak {
         }
     };
     
+    using hid_device_enumerator = basic_hid_device_enumerator<native_backend>;
+    
         
 }
 
@@ -0,0 +1,307 @@
+//
+//  hid_index.hpp
+//  HIDLED
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+#ifndef hid_index_hpp
+#define hid_index_hpp
+
+#include "hid.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+namespace spak {
+
+    /** On-disk record for one device, as found by the last full scan. The
+     * LED usages are listed in the same order as elements(kHIDPage_LEDs).
+     */
+    struct hid_index_record {
+        static constexpr std::size_t max_leds = 16;
+
+        uint64_t native_id;
+        uint32_t vendor_id;
+        uint32_t product_id;
+        uint32_t location_id;
+        uint32_t led_count;
+        uint32_t led_usages[max_leds];
+        char serial_number[64];
+        char product[128];
+        char manufacturer[128];
+    };
+
+    struct hid_index_header {
+        static constexpr uint32_t expected_version = 1;
+
+        static char const *expected_magic() {
+            return "HIDLEDIX";
+        }
+
+        char magic[8];
+        uint32_t version;
+        uint32_t record_size;
+        uint32_t record_count;
+        uint32_t reserved;
+    };
+
+
+    /** Memory mapped cache of the devices matched by a full scan, so that a
+     * selector can be resolved with hid_device_enumerator::attach instead of
+     * enumerating every device and reading its strings. A record is stale
+     * when attach fails or the identity of the attached device differs; the
+     * caller then rescans and calls rebuild().
+     */
+    class hid_device_index {
+        std::string _path;
+        void *_map;
+        std::size_t _size;
+
+        static bool copy_field(char *dst, std::size_t dst_size, std::string const &src) {
+            if (src.size() >= dst_size) {
+                return false;
+            }
+            std::memset(dst, 0, dst_size);
+            std::memcpy(dst, src.data(), src.size());
+            return true;
+        }
+
+        static bool field_equals(char const *field, std::size_t field_size, std::string const &str) {
+            return str.size() < field_size and std::strncmp(field, str.c_str(), field_size) == 0;
+        }
+
+        hid_index_header const *header() const {
+            return reinterpret_cast<hid_index_header const *>(_map);
+        }
+
+        hid_index_record const *records() const {
+            return reinterpret_cast<hid_index_record const *>(header() + 1);
+        }
+
+        void map() {
+            unmap();
+            int const fd = ::open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                return;
+            }
+            struct stat st;
+            if (::fstat(fd, &st) == 0 and static_cast<std::size_t>(st.st_size) >= sizeof(hid_index_header)) {
+                void *map = ::mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+                if (map != MAP_FAILED) {
+                    _map = map;
+                    _size = static_cast<std::size_t>(st.st_size);
+                }
+            }
+            ::close(fd);
+            if (not is_valid()) {
+                unmap();
+            }
+        }
+
+        /// Creates the directories leading to @p path that are missing, private to the user like a cache should be.
+        static bool make_parent_directories(std::string const &path) {
+            std::size_t const slash = path.find_last_of('/');
+            if (slash == std::string::npos or slash == 0) {
+                return true;
+            }
+            std::string const parent = path.substr(0, slash);
+            if (::mkdir(parent.c_str(), 0700) == 0 or errno == EEXIST) {
+                return true;
+            }
+            return errno == ENOENT and make_parent_directories(parent) and (::mkdir(parent.c_str(), 0700) == 0 or errno == EEXIST);
+        }
+
+        void unmap() {
+            if (_map != nullptr) {
+                ::munmap(_map, _size);
+                _map = nullptr;
+                _size = 0;
+            }
+        }
+
+    public:
+        static std::string default_path() {
+            if (char const *path = std::getenv("HIDLED_INDEX")) {
+                return path;
+            }
+            char const *home = std::getenv("HOME");
+            if (home == nullptr) {
+                return "";
+            }
+#if defined(__APPLE__)
+            return std::string(home) + "/Library/Caches/hidled.index";
+#else
+            if (char const *cache = std::getenv("XDG_CACHE_HOME")) {
+                return std::string(cache) + "/hidled.index";
+            }
+            return std::string(home) + "/.cache/hidled.index";
+#endif
+        }
+
+        hid_device_index(std::string path = default_path()) : _path(std::move(path)), _map(nullptr), _size(0) {
+            if (not _path.empty()) {
+                map();
+            }
+        }
+        hid_device_index(hid_device_index const &) = delete;
+        hid_device_index &operator=(hid_device_index const &) = delete;
+
+        ~hid_device_index() {
+            unmap();
+        }
+
+        std::string const &path() const {
+            return _path;
+        }
+
+        bool is_valid() const {
+            if (_map == nullptr or _size < sizeof(hid_index_header)) {
+                return false;
+            }
+            hid_index_header const &hdr = *header();
+            return std::memcmp(hdr.magic, hid_index_header::expected_magic(), sizeof(hdr.magic)) == 0
+                and hdr.version == hid_index_header::expected_version
+                and hdr.record_size == sizeof(hid_index_record)
+                and _size >= sizeof(hid_index_header) + hdr.record_count * sizeof(hid_index_record);
+        }
+
+        std::size_t size() const {
+            return is_valid() ? header()->record_count : 0;
+        }
+
+        /// First record matching the selector, in scan order, like match_keyboard. Empty strings match anything.
+        hid_index_record const *find(std::string const &match_prod, std::string const &match_manu) const {
+            for (std::size_t i = 0; i < size(); ++i) {
+                hid_index_record const &record = records()[i];
+                if (not match_manu.empty() and not field_equals(record.manufacturer, sizeof(record.manufacturer), match_manu)) {
+                    continue;
+                }
+                if (not match_prod.empty() and not field_equals(record.product, sizeof(record.product), match_prod)) {
+                    continue;
+                }
+                return &record;
+            }
+            return nullptr;
+        }
+
+        /// Attaches the device of @p record to @p enumerator; nullptr if it is gone or it is a different device.
+        static hid_device *attach(hid_index_record const &record, hid_device_enumerator &enumerator) {
+            hid_device *device = enumerator.attach(record.native_id);
+            if (device == nullptr) {
+                return nullptr;
+            }
+            hid_device_identity const identity = device->identity();
+            if (identity.vendor_id != record.vendor_id or identity.product_id != record.product_id
+                or identity.location_id != record.location_id
+                or not field_equals(record.serial_number, sizeof(record.serial_number), identity.serial_number))
+            {
+                return nullptr;
+            }
+            return device;
+        }
+
+        /** Fetches only the LED at position @p led_idx, by usage. Returns nullptr
+         * if @p led_idx is out of range or the element table changed.
+         */
+        static std::unique_ptr<hid_device_element> find_led(hid_index_record const &record, hid_device &device, std::size_t led_idx) {
+            if (led_idx >= record.led_count) {
+                return nullptr;
+            }
+            uint32_t const usage = record.led_usages[led_idx];
+            // Elements sharing the same usage are told apart by their order
+            std::size_t const nth = static_cast<std::size_t>(std::count(record.led_usages, record.led_usages + led_idx, usage));
+            hid_device_elements_enumerator elements = device.elements(kHIDPage_LEDs, usage);
+            if (nth >= elements.size()) {
+                return nullptr;
+            }
+            return std::make_unique<hid_device_element>(elements[nth]);
+        }
+
+        /// Replaces the index with the devices in @p enumerator. Devices that do not fit a record are left out.
+        bool rebuild(hid_device_enumerator &enumerator) {
+            if (_path.empty()) {
+                return false;
+            }
+            std::vector<hid_index_record> records;
+            records.reserve(enumerator.size());
+            for (auto &device : enumerator) {
+                hid_index_record record;
+                std::memset(&record, 0, sizeof(record));
+                hid_device_identity const identity = device.identity();
+                record.native_id = device.native_id();
+                record.vendor_id = identity.vendor_id;
+                record.product_id = identity.product_id;
+                record.location_id = identity.location_id;
+                if (not copy_field(record.serial_number, sizeof(record.serial_number), identity.serial_number)
+                    or not copy_field(record.product, sizeof(record.product), device.product())
+                    or not copy_field(record.manufacturer, sizeof(record.manufacturer), device.manufacturer()))
+                {
+                    continue;
+                }
+                hid_device_elements_enumerator elements = device.elements(kHIDPage_LEDs);
+                if (elements.size() > hid_index_record::max_leds) {
+                    continue;
+                }
+                record.led_count = static_cast<uint32_t>(elements.size());
+                for (std::size_t i = 0; i < elements.size(); ++i) {
+                    record.led_usages[i] = elements[i].usage();
+                }
+                records.push_back(record);
+            }
+            hid_index_header hdr;
+            std::memset(&hdr, 0, sizeof(hdr));
+            std::memcpy(hdr.magic, hid_index_header::expected_magic(), sizeof(hdr.magic));
+            hdr.version = hid_index_header::expected_version;
+            hdr.record_size = sizeof(hid_index_record);
+            hdr.record_count = static_cast<uint32_t>(records.size());
+
+            // Write aside and rename, so that concurrent readers see either index in full
+            std::string const tmp_path = _path + "." + std::to_string(::getpid());
+            if (not make_parent_directories(_path)) {
+                return false;
+            }
+            int const fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                return false;
+            }
+            std::size_t const records_size = records.size() * sizeof(hid_index_record);
+            bool ok = ::write(fd, &hdr, sizeof(hdr)) == static_cast<ssize_t>(sizeof(hdr));
+            if (ok and records_size > 0) {
+                ok = ::write(fd, records.data(), records_size) == static_cast<ssize_t>(records_size);
+            }
+            ::close(fd);
+            if (not ok or ::rename(tmp_path.c_str(), _path.c_str()) != 0) {
+                ::unlink(tmp_path.c_str());
+                return false;
+            }
+            map();
+            return true;
+        }
+    };
+
+}
+
+#endif /* hid_index_hpp */
@@ -0,0 +1,995 @@
+//
+//  hid_linux.hpp
+//  HIDLED
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+#ifndef hid_linux_hpp
+#define hid_linux_hpp
+
+#include <linux/input.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// The subset of the IOKit/HID types and constants that the shared code in
+// hid.hpp and main.cpp relies upon. Values match the ones in IOReturn.h and
+// IOHIDUsageTables.h so that codes can be exchanged between platforms.
+
+using CFIndex = long;
+using IOReturn = int;
+using IOHIDElementType = uint32_t;
+
+enum : IOReturn {
+    kIOReturnSuccess            = 0,
+    kIOReturnError              = static_cast<IOReturn>(0xe00002bc),
+    kIOReturnNoMemory           = static_cast<IOReturn>(0xe00002bd),
+    kIOReturnNoResources        = static_cast<IOReturn>(0xe00002be),
+    kIOReturnIPCError           = static_cast<IOReturn>(0xe00002bf),
+    kIOReturnNoDevice           = static_cast<IOReturn>(0xe00002c0),
+    kIOReturnNotPrivileged      = static_cast<IOReturn>(0xe00002c1),
+    kIOReturnBadArgument        = static_cast<IOReturn>(0xe00002c2),
+    kIOReturnLockedRead         = static_cast<IOReturn>(0xe00002c3),
+    kIOReturnLockedWrite        = static_cast<IOReturn>(0xe00002c4),
+    kIOReturnExclusiveAccess    = static_cast<IOReturn>(0xe00002c5),
+    kIOReturnBadMessageID       = static_cast<IOReturn>(0xe00002c6),
+    kIOReturnUnsupported        = static_cast<IOReturn>(0xe00002c7),
+    kIOReturnVMError            = static_cast<IOReturn>(0xe00002c8),
+    kIOReturnInternalError      = static_cast<IOReturn>(0xe00002c9),
+    kIOReturnIOError            = static_cast<IOReturn>(0xe00002ca),
+    kIOReturnCannotLock         = static_cast<IOReturn>(0xe00002cc),
+    kIOReturnNotOpen            = static_cast<IOReturn>(0xe00002cd),
+    kIOReturnNotReadable        = static_cast<IOReturn>(0xe00002ce),
+    kIOReturnNotWritable        = static_cast<IOReturn>(0xe00002cf),
+    kIOReturnNotAligned         = static_cast<IOReturn>(0xe00002d0),
+    kIOReturnBadMedia           = static_cast<IOReturn>(0xe00002d1),
+    kIOReturnStillOpen          = static_cast<IOReturn>(0xe00002d2),
+    kIOReturnRLDError           = static_cast<IOReturn>(0xe00002d3),
+    kIOReturnDMAError           = static_cast<IOReturn>(0xe00002d4),
+    kIOReturnBusy               = static_cast<IOReturn>(0xe00002d5),
+    kIOReturnTimeout            = static_cast<IOReturn>(0xe00002d6),
+    kIOReturnOffline            = static_cast<IOReturn>(0xe00002d7),
+    kIOReturnNotReady           = static_cast<IOReturn>(0xe00002d8),
+    kIOReturnNotAttached        = static_cast<IOReturn>(0xe00002d9),
+    kIOReturnNoChannels         = static_cast<IOReturn>(0xe00002da),
+    kIOReturnNoSpace            = static_cast<IOReturn>(0xe00002db),
+    kIOReturnPortExists         = static_cast<IOReturn>(0xe00002dd),
+    kIOReturnCannotWire         = static_cast<IOReturn>(0xe00002de),
+    kIOReturnNoInterrupt        = static_cast<IOReturn>(0xe00002df),
+    kIOReturnNoFrames           = static_cast<IOReturn>(0xe00002e0),
+    kIOReturnMessageTooLarge    = static_cast<IOReturn>(0xe00002e1),
+    kIOReturnNotPermitted       = static_cast<IOReturn>(0xe00002e2),
+    kIOReturnNoPower            = static_cast<IOReturn>(0xe00002e3),
+    kIOReturnNoMedia            = static_cast<IOReturn>(0xe00002e4),
+    kIOReturnUnformattedMedia   = static_cast<IOReturn>(0xe00002e5),
+    kIOReturnUnsupportedMode    = static_cast<IOReturn>(0xe00002e6),
+    kIOReturnUnderrun           = static_cast<IOReturn>(0xe00002e7),
+    kIOReturnOverrun            = static_cast<IOReturn>(0xe00002e8),
+    kIOReturnDeviceError        = static_cast<IOReturn>(0xe00002e9),
+    kIOReturnNoCompletion       = static_cast<IOReturn>(0xe00002ea),
+    kIOReturnAborted            = static_cast<IOReturn>(0xe00002eb),
+    kIOReturnNoBandwidth        = static_cast<IOReturn>(0xe00002ec),
+    kIOReturnNotResponding      = static_cast<IOReturn>(0xe00002ed),
+    kIOReturnIsoTooOld          = static_cast<IOReturn>(0xe00002ee),
+    kIOReturnIsoTooNew          = static_cast<IOReturn>(0xe00002ef),
+    kIOReturnNotFound           = static_cast<IOReturn>(0xe00002f0),
+    kIOReturnInvalid            = static_cast<IOReturn>(0xe0000001)
+};
+
+enum : uint32_t {
+    kHIDPage_Undefined          = 0x00,
+    kHIDPage_GenericDesktop     = 0x01,
+    kHIDPage_KeyboardOrKeypad   = 0x07,
+    kHIDPage_LEDs               = 0x08
+};
+
+enum : uint32_t {
+    kHIDUsage_GD_Pointer        = 0x01,
+    kHIDUsage_GD_Mouse          = 0x02,
+    kHIDUsage_GD_Joystick       = 0x04,
+    kHIDUsage_GD_GamePad        = 0x05,
+    kHIDUsage_GD_Keyboard       = 0x06,
+    kHIDUsage_GD_Keypad         = 0x07,
+    kHIDUsage_GD_MultiAxisController = 0x08,
+    kHIDUsage_GD_SystemControl  = 0x80
+};
+
+enum : uint32_t {
+    kHIDUsage_KeyboardCapsLock          = 0x39,
+    kHIDUsage_KeyboardScrollLock        = 0x47,
+    kHIDUsage_KeypadNumLock             = 0x53
+};
+
+enum : uint32_t {
+    kHIDUsage_LED_NumLock               = 0x01,
+    kHIDUsage_LED_CapsLock              = 0x02,
+    kHIDUsage_LED_ScrollLock            = 0x03,
+    kHIDUsage_LED_Compose               = 0x04,
+    kHIDUsage_LED_Kana                  = 0x05,
+    kHIDUsage_LED_Power                 = 0x06,
+    kHIDUsage_LED_Shift                 = 0x07,
+    kHIDUsage_LED_DoNotDisturb          = 0x08,
+    kHIDUsage_LED_Mute                  = 0x09,
+    kHIDUsage_LED_OffHook               = 0x17,
+    kHIDUsage_LED_Ring                  = 0x18,
+    kHIDUsage_LED_MessageWaiting        = 0x19,
+    kHIDUsage_LED_BatteryOperation      = 0x1B,
+    kHIDUsage_LED_BatteryOK             = 0x1C,
+    kHIDUsage_LED_BatteryLow            = 0x1D,
+    kHIDUsage_LED_Speaker               = 0x1E,
+    kHIDUsage_LED_HeadSet               = 0x1F,
+    kHIDUsage_LED_Hold                  = 0x20,
+    kHIDUsage_LED_Microphone            = 0x21,
+    kHIDUsage_LED_StandBy               = 0x27,
+    kHIDUsage_LED_CameraOn              = 0x28,
+    kHIDUsage_LED_CameraOff             = 0x29,
+    kHIDUsage_LED_OnLine                = 0x2A,
+    kHIDUsage_LED_OffLine               = 0x2B,
+    kHIDUsage_LED_Busy                  = 0x2C,
+    kHIDUsage_LED_Ready                 = 0x2D,
+    kHIDUsage_LED_Error                 = 0x39,
+    kHIDUsage_LED_GenericIndicator      = 0x4B,
+    kHIDUsage_LED_SystemSuspend         = 0x4C,
+    kHIDUsage_LED_ExternalPowerConnected = 0x4D
+};
+
+enum : IOHIDElementType {
+    kIOHIDElementTypeInput_Misc     = 1,
+    kIOHIDElementTypeInput_Button   = 2,
+    kIOHIDElementTypeOutput         = 129
+};
+
+
+namespace spak {
+
+    inline IOReturn io_return_from_errno(int err) {
+        switch (err) {
+            case 0:         return kIOReturnSuccess;
+            case ENOENT:
+            case ENXIO:
+            case ENODEV:    return kIOReturnNoDevice;
+            case EPERM:     return kIOReturnNotPermitted;
+            case EACCES:    return kIOReturnNotPrivileged;
+            case EBUSY:     return kIOReturnBusy;
+            case EINVAL:    return kIOReturnBadArgument;
+            case ENOMEM:    return kIOReturnNoMemory;
+            case ETIMEDOUT: return kIOReturnTimeout;
+            case EAGAIN:    return kIOReturnNotReady;
+            case EBADF:     return kIOReturnNotOpen;
+            case ENOTTY:
+            case EOPNOTSUPP: return kIOReturnUnsupported;
+            case ENOSPC:    return kIOReturnNoSpace;
+            default:        return kIOReturnIOError;
+        }
+    }
+
+
+    /** Maps an evdev LED code onto the HID usage on the LEDs page, mirroring
+     * the table used by the kernel's hid-input driver. The name is the suffix
+     * of the matching LED class device, e.g. "input3::capslock".
+     */
+    struct linux_led_usage {
+        uint16_t code;
+        uint32_t usage;
+        const char *name;
+    };
+
+    static constexpr linux_led_usage linux_led_usages[] = {
+        {LED_NUML,     kHIDUsage_LED_NumLock,                "numlock"},
+        {LED_CAPSL,    kHIDUsage_LED_CapsLock,               "capslock"},
+        {LED_SCROLLL,  kHIDUsage_LED_ScrollLock,             "scrolllock"},
+        {LED_COMPOSE,  kHIDUsage_LED_Compose,                "compose"},
+        {LED_KANA,     kHIDUsage_LED_Kana,                   "kana"},
+        {LED_SLEEP,    kHIDUsage_LED_StandBy,                "sleep"},
+        {LED_SUSPEND,  kHIDUsage_LED_SystemSuspend,          "suspend"},
+        {LED_MUTE,     kHIDUsage_LED_Mute,                   "mute"},
+        {LED_MISC,     kHIDUsage_LED_GenericIndicator,       "misc"},
+        {LED_MAIL,     kHIDUsage_LED_MessageWaiting,         "mail"},
+        {LED_CHARGING, kHIDUsage_LED_ExternalPowerConnected, "charging"}
+    };
+
+    inline linux_led_usage const *find_linux_led_by_code(uint16_t code) {
+        for (auto const &led : linux_led_usages) {
+            if (led.code == code) {
+                return &led;
+            }
+        }
+        return nullptr;
+    }
+
+    inline linux_led_usage const *find_linux_led_by_name(std::string const &name) {
+        for (auto const &led : linux_led_usages) {
+            if (name == led.name) {
+                return &led;
+            }
+        }
+        return nullptr;
+    }
+
+    inline linux_led_usage const *find_linux_led_by_usage(uint32_t usage) {
+        for (auto const &led : linux_led_usages) {
+            if (led.usage == usage) {
+                return &led;
+            }
+        }
+        return nullptr;
+    }
+
+
+    class unique_fd {
+        int _fd;
+    public:
+        unique_fd() : _fd(-1) {}
+        explicit unique_fd(int fd) : _fd(fd) {}
+        unique_fd(unique_fd const &) = delete;
+        unique_fd &operator=(unique_fd const &) = delete;
+        unique_fd(unique_fd &&rval) : unique_fd() {
+            std::swap(_fd, rval._fd);
+        }
+        unique_fd &operator=(unique_fd &&rval) {
+            reset();
+            std::swap(_fd, rval._fd);
+            return *this;
+        }
+        void reset(int fd = -1) {
+            if (_fd >= 0) {
+                ::close(_fd);
+            }
+            _fd = fd;
+        }
+        int get() const {
+            return _fd;
+        }
+        bool is_valid() const {
+            return _fd >= 0;
+        }
+        ~unique_fd() {
+            reset();
+        }
+    };
+
+
+    namespace sysfs {
+
+        inline std::string read_string(std::string const &path) {
+            unique_fd fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+            if (not fd.is_valid()) {
+                return "";
+            }
+            char buf[256];
+            ssize_t const n = ::read(fd.get(), buf, sizeof(buf));
+            if (n <= 0) {
+                return "";
+            }
+            std::string retval(buf, static_cast<std::size_t>(n));
+            while (not retval.empty() and (retval.back() == '\n' or retval.back() == ' ')) {
+                retval.pop_back();
+            }
+            return retval;
+        }
+
+        /// Whole contents of a binary attribute, such as a report descriptor.
+        inline std::vector<uint8_t> read_bytes(std::string const &path) {
+            std::vector<uint8_t> retval;
+            unique_fd fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+            if (not fd.is_valid()) {
+                return retval;
+            }
+            uint8_t buf[4096];
+            ssize_t n = 0;
+            while ((n = ::read(fd.get(), buf, sizeof(buf))) > 0) {
+                retval.insert(retval.end(), buf, buf + n);
+            }
+            return retval;
+        }
+
+        inline unsigned long read_ulong(std::string const &path, int base = 10, unsigned long fallback = 0) {
+            std::string const str = read_string(path);
+            if (str.empty()) {
+                return fallback;
+            }
+            return std::strtoul(str.c_str(), nullptr, base);
+        }
+
+        /// Parses a "capabilities" bitmask: hex words, most significant first.
+        inline bool test_bit(std::string const &bitmask, std::size_t bit) {
+            std::vector<unsigned long> words;
+            char const *p = bitmask.c_str();
+            while (*p != '\0') {
+                char *end = nullptr;
+                words.push_back(std::strtoul(p, &end, 16));
+                if (end == p) {
+                    break;
+                }
+                p = end;
+            }
+            std::size_t const word_bits = 8 * sizeof(unsigned long);
+            std::size_t const word = bit / word_bits;
+            if (word >= words.size()) {
+                return false;
+            }
+            return ((words[words.size() - 1 - word] >> (bit % word_bits)) & 1) != 0;
+        }
+
+        inline std::vector<std::string> list_dir(std::string const &path) {
+            std::vector<std::string> entries;
+            DIR *dir = ::opendir(path.c_str());
+            if (dir == nullptr) {
+                return entries;
+            }
+            while (dirent *entry = ::readdir(dir)) {
+                if (entry->d_name[0] != '.') {
+                    entries.emplace_back(entry->d_name);
+                }
+            }
+            ::closedir(dir);
+            return entries;
+        }
+
+        /// Orders "input2" before "input10".
+        inline bool natural_less(std::string const &l, std::string const &r) {
+            return l.size() != r.size() ? l.size() < r.size() : l < r;
+        }
+    }
+
+
+    /** One LED of an input device. It is driven through the LED class node
+     * (<sysfs>/inputN/inputN::name/brightness) when the kernel exposes one,
+     * otherwise through EV_LED events on the device's event node.
+     */
+    struct linux_led {
+        uint16_t code;
+        uint32_t usage;
+        std::string name;
+        std::string brightness_path;
+        CFIndex max_brightness;
+        unique_fd brightness_fd;
+    };
+
+
+    /** State shared by all the handles to one input device: the sysfs paths
+     * collected at enumeration time and the file descriptors cached while the
+     * device is open, so that a value change costs a single write().
+     */
+    class linux_input_device {
+        friend struct linux_backend;
+
+        std::string _sysfs_path;
+        std::string _event_path;
+        std::string _name;
+        std::string _manufacturer;
+        std::string _phys;
+        std::string _uniq;
+        uint32_t _vendor_id;
+        uint32_t _product_id;
+        uint64_t _input_number;
+        std::string _ev_bits;
+        std::vector<linux_led> _leds;
+        unique_fd _event_fd;
+        std::atomic<std::size_t> _open_count{0};
+        /** Held by open() and close(), and by every read and write for as
+         * long as it uses the descriptors: the device pool closes idle
+         * devices from its own thread, and an fd closed under a read could
+         * be reused by another file before the read gets to it.
+         */
+        std::mutex _open_mutex;
+
+    public:
+        linux_input_device(std::string const &root, std::string const &input_name) :
+            _sysfs_path(root + "/sys/class/input/" + input_name)
+        {
+            _name = sysfs::read_string(_sysfs_path + "/name");
+            _manufacturer = sysfs::read_string(_sysfs_path + "/device/../../manufacturer");
+            _phys = sysfs::read_string(_sysfs_path + "/phys");
+            _uniq = sysfs::read_string(_sysfs_path + "/uniq");
+            _vendor_id = static_cast<uint32_t>(sysfs::read_ulong(_sysfs_path + "/id/vendor", 16));
+            _product_id = static_cast<uint32_t>(sysfs::read_ulong(_sysfs_path + "/id/product", 16));
+            _input_number = std::strtoull(input_name.c_str() + 5, nullptr, 10);
+            _ev_bits = sysfs::read_string(_sysfs_path + "/capabilities/ev");
+            std::string const led_bits = sysfs::read_string(_sysfs_path + "/capabilities/led");
+            std::vector<std::string> entries = sysfs::list_dir(_sysfs_path);
+            std::sort(entries.begin(), entries.end(), sysfs::natural_less);
+            for (std::string const &entry : entries) {
+                if (entry.compare(0, 5, "event") == 0 and _event_path.empty()) {
+                    _event_path = root + "/dev/input/" + entry;
+                }
+            }
+            // Evdev LEDs first, in code order, like hid-input declares them
+            for (auto const &usage : linux_led_usages) {
+                if (sysfs::test_bit(led_bits, usage.code)) {
+                    _leds.push_back(linux_led{usage.code, usage.usage, usage.name, "", 1, unique_fd()});
+                }
+            }
+            // Then attach the LED class nodes, adding those not advertised in the capabilities
+            std::string const prefix = input_name + "::";
+            for (std::string const &entry : entries) {
+                if (entry.compare(0, prefix.size(), prefix) != 0) {
+                    continue;
+                }
+                std::string const led_name = entry.substr(prefix.size());
+                linux_led_usage const *usage = find_linux_led_by_name(led_name);
+                std::string const led_path = _sysfs_path + "/" + entry;
+                auto it = std::find_if(_leds.begin(), _leds.end(), [&](linux_led const &led) { return led.name == led_name; });
+                if (it == _leds.end()) {
+                    _leds.push_back(linux_led{
+                        static_cast<uint16_t>(usage != nullptr ? usage->code : LED_MAX),
+                        usage != nullptr ? usage->usage : kHIDUsage_LED_GenericIndicator,
+                        led_name, "", 1, unique_fd()});
+                    it = _leds.end() - 1;
+                }
+                it->brightness_path = led_path + "/brightness";
+                it->max_brightness = static_cast<CFIndex>(sysfs::read_ulong(led_path + "/max_brightness", 10, 1));
+            }
+        }
+
+        linux_input_device(linux_input_device const &) = delete;
+        linux_input_device &operator=(linux_input_device const &) = delete;
+
+        std::string const &sysfs_path() const {
+            return _sysfs_path;
+        }
+
+        std::string const &event_path() const {
+            return _event_path;
+        }
+
+        std::vector<linux_led> const &leds() const {
+            return _leds;
+        }
+
+        bool has_ev_bit(unsigned bit) const {
+            return sysfs::test_bit(_ev_bits, bit);
+        }
+    };
+
+
+    /** Native primitives on top of sysfs and evdev. The root path prefixes
+     * both /sys and /dev, so a fake tree in a temporary directory can stand
+     * in for the real one; it defaults to the HIDLED_ROOT environment variable.
+     */
+    struct linux_backend {
+        using device_ref = std::shared_ptr<linux_input_device>;
+
+        struct element_ref {
+            device_ref device;
+            std::size_t index;
+
+            linux_led &led() const {
+                return device->_leds[index];
+            }
+
+            bool operator==(element_ref const &other) const {
+                return device == other.device and index == other.index;
+            }
+        };
+
+        class manager {
+            std::string _root;
+        public:
+            manager(std::string root = default_root()) : _root(std::move(root)) {}
+
+            static std::string default_root() {
+                char const *root = std::getenv("HIDLED_ROOT");
+                return root != nullptr ? root : "";
+            }
+
+            std::string const &root() const {
+                return _root;
+            }
+
+            /// Looks up /sys/class/input/input<native_id> directly.
+            device_ref resolve(uint64_t native_id) const {
+                std::string const input_name = "input" + std::to_string(native_id);
+                if (::access((_root + "/sys/class/input/" + input_name).c_str(), F_OK) != 0) {
+                    return nullptr;
+                }
+                return std::make_shared<linux_input_device>(_root, input_name);
+            }
+
+            std::vector<device_ref> copy_devices(uint32_t in_page, uint32_t in_usage_page) const {
+                std::vector<device_ref> devices;
+                std::vector<std::string> entries = sysfs::list_dir(_root + "/sys/class/input");
+                std::sort(entries.begin(), entries.end(), sysfs::natural_less);
+                for (std::string const &entry : entries) {
+                    if (entry.compare(0, 5, "input") != 0) {
+                        continue;
+                    }
+                    auto device = std::make_shared<linux_input_device>(_root, entry);
+                    if (conforms_to(device, in_page, in_usage_page)) {
+                        devices.push_back(std::move(device));
+                    }
+                }
+                return devices;
+            }
+        };
+
+        struct device_change {
+            bool added;
+            uint64_t native_id;
+            /// Null for removals.
+            device_ref device;
+        };
+
+        /** Reports input devices as they come and go. Device nodes appear in
+         * /dev/input only once udev is done with them, so the directory is
+         * watched with inotify and /sys/class/input is diffed against the
+         * devices seen so far on every change. The first wait() reports all
+         * the devices already present.
+         */
+        class device_monitor {
+            std::string _root;
+            unique_fd _inotify;
+            unique_fd _wake;
+            std::vector<uint64_t> _known;
+            bool _primed;
+
+            static bool parse_input_number(std::string const &entry, uint64_t &number) {
+                if (entry.compare(0, 5, "input") != 0 or entry.size() == 5) {
+                    return false;
+                }
+                char *end = nullptr;
+                number = std::strtoull(entry.c_str() + 5, &end, 10);
+                return *end == '\0';
+            }
+
+            void diff(std::vector<device_change> &changes) {
+                std::vector<uint64_t> present;
+                for (std::string const &entry : sysfs::list_dir(_root + "/sys/class/input")) {
+                    uint64_t number = 0;
+                    if (parse_input_number(entry, number)) {
+                        present.push_back(number);
+                    }
+                }
+                std::sort(present.begin(), present.end());
+                std::vector<uint64_t> gone;
+                std::set_difference(_known.begin(), _known.end(), present.begin(), present.end(), std::back_inserter(gone));
+                for (uint64_t number : gone) {
+                    changes.push_back(device_change{false, number, nullptr});
+                }
+                std::vector<uint64_t> added;
+                std::set_difference(present.begin(), present.end(), _known.begin(), _known.end(), std::back_inserter(added));
+                for (uint64_t number : added) {
+                    changes.push_back(device_change{true, number, std::make_shared<linux_input_device>(_root, "input" + std::to_string(number))});
+                }
+                _known = std::move(present);
+            }
+
+        public:
+            device_monitor(uint32_t = kHIDPage_Undefined, uint32_t = 0, std::string root = manager::default_root()) :
+                _root(std::move(root)),
+                _inotify(::inotify_init1(IN_CLOEXEC | IN_NONBLOCK)),
+                _wake(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+                _primed(false)
+            {
+                if (_inotify.is_valid()) {
+                    ::inotify_add_watch(_inotify.get(), (_root + "/dev/input").c_str(), IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+                }
+            }
+
+            /// Blocks until something changed, wake() is called or @p timeout expires.
+            void wait(std::vector<device_change> &changes, std::chrono::milliseconds timeout) {
+                if (not _primed) {
+                    _primed = true;
+                    diff(changes);
+                    return;
+                }
+                pollfd fds[2] = {{_inotify.get(), POLLIN, 0}, {_wake.get(), POLLIN, 0}};
+                if (::poll(fds, 2, static_cast<int>(timeout.count())) <= 0) {
+                    return;
+                }
+                char buf[4096];
+                if (fds[1].revents & POLLIN) {
+                    while (::read(_wake.get(), buf, sizeof(uint64_t)) > 0) {}
+                }
+                if (fds[0].revents & POLLIN) {
+                    while (::read(_inotify.get(), buf, sizeof(buf)) > 0) {}
+                    diff(changes);
+                }
+            }
+
+            /// Interrupts a wait() in progress on another thread.
+            void wake() {
+                uint64_t const one = 1;
+                if (::write(_wake.get(), &one, sizeof(one)) < 0) {
+                    // The counter is already non-zero
+                }
+            }
+        };
+
+        static IOReturn open(device_ref const &device) {
+            // The device pool may close devices from its own thread
+            std::lock_guard<std::mutex> lock(device->_open_mutex);
+            if (device->_open_count++ > 0) {
+                return kIOReturnSuccess;
+            }
+            bool need_event_fd = false;
+            for (linux_led &led : device->_leds) {
+                if (led.brightness_path.empty()) {
+                    need_event_fd = true;
+                    continue;
+                }
+                led.brightness_fd.reset(::open(led.brightness_path.c_str(), O_RDWR | O_CLOEXEC));
+                if (not led.brightness_fd.is_valid()) {
+                    IOReturn const res = io_return_from_errno(errno);
+                    close_all(*device);
+                    return res;
+                }
+            }
+            // The event node is also used to change several LEDs at once, but it is optional if sysfs covers all of them
+            if (not device->_event_path.empty()) {
+                device->_event_fd.reset(::open(device->_event_path.c_str(), O_RDWR | O_CLOEXEC | O_NONBLOCK));
+            }
+            if (need_event_fd and not device->_event_fd.is_valid()) {
+                IOReturn const res = device->_event_path.empty() ? kIOReturnNoDevice : io_return_from_errno(errno);
+                close_all(*device);
+                return res;
+            }
+            return kIOReturnSuccess;
+        }
+
+        static void close(device_ref const &device) {
+            std::lock_guard<std::mutex> lock(device->_open_mutex);
+            if (device->_open_count > 0 and --device->_open_count == 0) {
+                close_all(*device);
+            }
+        }
+
+        static bool conforms_to(device_ref const &device, uint32_t in_page, uint32_t in_usage_page) {
+            switch (in_page) {
+                case kHIDPage_Undefined:
+                    return true;
+                case kHIDPage_GenericDesktop:
+                    if (in_usage_page != 0 and in_usage_page != kHIDUsage_GD_Keyboard and in_usage_page != kHIDUsage_GD_Keypad) {
+                        return false;
+                    }
+                    return device->has_ev_bit(EV_KEY) and (device->has_ev_bit(EV_LED) or not device->_leds.empty());
+                case kHIDPage_LEDs:
+                    return std::any_of(device->_leds.begin(), device->_leds.end(), [=](linux_led const &led) {
+                        return in_usage_page == 0 or led.usage == in_usage_page;
+                    });
+                default:
+                    return false;
+            }
+        }
+
+        static std::string manufacturer(device_ref const &device) {
+            return device->_manufacturer;
+        }
+
+        static std::string product(device_ref const &device) {
+            return device->_name;
+        }
+
+        static std::string serial_number(device_ref const &device) {
+            return device->_uniq;
+        }
+
+        enum struct string_property {
+            manufacturer,
+            product,
+            serial_number
+        };
+
+        /// Strings are read from sysfs once per device, selectors can be compared to them as they are.
+        using native_string = std::string;
+
+        static native_string intern(std::string const &str) {
+            return str;
+        }
+
+        static bool string_equals(device_ref const &device, string_property prop, native_string const &str) {
+            switch (prop) {
+                case string_property::manufacturer:
+                    return device->_manufacturer == str;
+                case string_property::product:
+                    return device->_name == str;
+                case string_property::serial_number:
+                    return device->_uniq == str;
+            }
+            return false;
+        }
+
+        static uint32_t vendor_id(device_ref const &device) {
+            return device->_vendor_id;
+        }
+
+        static uint32_t product_id(device_ref const &device) {
+            return device->_product_id;
+        }
+
+        /// The physical path ("usb-0000:00:14.0-1/input0") hashed with FNV-1a, which is what IOKit's location ID stands for.
+        static uint32_t location_id(device_ref const &device) {
+            uint32_t hash = 2166136261u;
+            for (char c : device->_phys) {
+                hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+            }
+            return hash;
+        }
+
+        static uint64_t native_id(device_ref const &device) {
+            return device->_input_number;
+        }
+
+        /// Keeps @p device alive for as long as the returned handle.
+        static std::shared_ptr<void const> retain(device_ref const &device) {
+            return device;
+        }
+
+        static std::vector<element_ref> copy_elements(device_ref const &device, uint32_t in_page, uint32_t in_usage_page) {
+            std::vector<element_ref> retval;
+            if (in_page != kHIDPage_Undefined and in_page != kHIDPage_LEDs) {
+                return retval;
+            }
+            for (std::size_t i = 0; i < device->_leds.size(); ++i) {
+                if (in_usage_page == 0 or device->_leds[i].usage == in_usage_page) {
+                    retval.push_back(element_ref{device, i});
+                }
+            }
+            return retval;
+        }
+
+        static device_ref element_device(element_ref const &element) {
+            return element.device;
+        }
+
+        static uint32_t usage(element_ref const &element) {
+            return element.led().usage;
+        }
+
+        static uint32_t usage_page(element_ref const &) {
+            return kHIDPage_LEDs;
+        }
+
+        static IOHIDElementType type(element_ref const &) {
+            return kIOHIDElementTypeOutput;
+        }
+
+        static std::string name(element_ref const &element) {
+            return element.led().name;
+        }
+
+        /// evdev does not expose reports; the kernel packs all the LEDs changed before a SYN_REPORT into one.
+        static uint32_t report_id(element_ref const &) {
+            return 0;
+        }
+
+        static CFIndex logical_min(element_ref const &) {
+            return 0;
+        }
+
+        static CFIndex logical_max(element_ref const &element) {
+            return element.led().max_brightness;
+        }
+
+        static IOReturn get_value(device_ref const &device, element_ref const &element, CFIndex &value) {
+            std::lock_guard<std::mutex> lock(device->_open_mutex);
+            if (device->_open_count == 0) {
+                return kIOReturnNotOpen;
+            }
+            linux_led const &led = element.led();
+            if (led.brightness_fd.is_valid()) {
+                char buf[32];
+                ssize_t const n = ::pread(led.brightness_fd.get(), buf, sizeof(buf) - 1, 0);
+                if (n < 0) {
+                    return io_return_from_errno(errno);
+                }
+                buf[n] = '\0';
+                value = std::strtol(buf, nullptr, 10);
+                return kIOReturnSuccess;
+            }
+            unsigned char bits[(LED_MAX + 7) / 8] = {};
+            if (::ioctl(device->_event_fd.get(), EVIOCGLED(sizeof(bits)), bits) < 0) {
+                return io_return_from_errno(errno);
+            }
+            value = (bits[led.code / 8] >> (led.code % 8)) & 1;
+            return kIOReturnSuccess;
+        }
+
+        static IOReturn set_value(device_ref const &device, element_ref const &element, CFIndex value) {
+            std::lock_guard<std::mutex> lock(device->_open_mutex);
+            if (device->_open_count == 0) {
+                return kIOReturnNotOpen;
+            }
+            return write_value(*device, element.led(), value);
+        }
+
+        /** Writes all the standard LEDs as EV_LED events followed by a single
+         * SYN_REPORT, in one write(). Falls back to one write per LED without
+         * an event node.
+         */
+        static IOReturn set_values(device_ref const &device, element_ref const *elements, CFIndex const *values, std::size_t count) {
+            std::lock_guard<std::mutex> lock(device->_open_mutex);
+            if (device->_open_count == 0) {
+                return kIOReturnNotOpen;
+            }
+            std::vector<input_event> events;
+            events.reserve(count + 1);
+            for (std::size_t i = 0; i < count; ++i) {
+                linux_led const &led = elements[i].led();
+                if (device->_event_fd.is_valid() and led.code < LED_MAX) {
+                    input_event event = {};
+                    event.type = EV_LED;
+                    event.code = led.code;
+                    event.value = values[i] != 0 ? 1 : 0;
+                    events.push_back(event);
+                } else {
+                    IOReturn const res = write_value(*device, led, values[i]);
+                    if (res != kIOReturnSuccess) {
+                        return res;
+                    }
+                }
+            }
+            if (events.empty()) {
+                return kIOReturnSuccess;
+            }
+            input_event syn = {};
+            syn.type = EV_SYN;
+            syn.code = SYN_REPORT;
+            events.push_back(syn);
+            if (::write(device->_event_fd.get(), events.data(), events.size() * sizeof(input_event)) < 0) {
+                return io_return_from_errno(errno);
+            }
+            return kIOReturnSuccess;
+        }
+
+        using value_callback = void (*)(void *context, element_ref const &element, CFIndex value);
+
+        struct value_watch {
+            value_callback callback;
+            void *context;
+        };
+
+        /** Only while the event node is open, which sysfs-only LEDs and
+         * unprivileged users may not have, and is an actual device: a plain
+         * file standing in for it under HIDLED_ROOT would always be readable.
+         */
+        static bool can_watch_values(device_ref const &device) {
+            std::lock_guard<std::mutex> lock(device->_open_mutex);
+            struct stat st;
+            return device->_event_fd.is_valid() and ::fstat(device->_event_fd.get(), &st) == 0 and S_ISCHR(st.st_mode);
+        }
+
+        /// Nothing to register: LED changes are queued as EV_LED events on the event node anyway.
+        static void watch_values(device_ref const &, value_watch *) {}
+
+        /** Drains the event node without blocking and reports the LED changes
+         * in it, outside of the device lock so that the callback may call back.
+         */
+        static void dispatch_value_changes(device_ref const &device, value_watch *watch) {
+            if (watch == nullptr) {
+                return;
+            }
+            std::vector<std::pair<std::size_t, CFIndex>> changes;
+            {
+                std::lock_guard<std::mutex> lock(device->_open_mutex);
+                if (not device->_event_fd.is_valid()) {
+                    return;
+                }
+                input_event events[16];
+                ssize_t n = 0;
+                while ((n = ::read(device->_event_fd.get(), events, sizeof(events))) > 0) {
+                    for (std::size_t i = 0; i < static_cast<std::size_t>(n) / sizeof(input_event); ++i) {
+                        if (events[i].type != EV_LED) {
+                            continue;
+                        }
+                        for (std::size_t idx = 0; idx < device->_leds.size(); ++idx) {
+                            if (device->_leds[idx].code == events[i].code) {
+                                changes.emplace_back(idx, events[i].value);
+                            }
+                        }
+                    }
+                }
+            }
+            for (auto const &change : changes) {
+                watch->callback(watch->context, element_ref{device, change.first}, change.second);
+            }
+        }
+
+        /** Blocks until one of @p devices has events queued on its event node,
+         * or @p timeout elapses. The event node of a device that went away is
+         * closed, so that it does not wake us up again. The devices are not
+         * locked while polling, hence a descriptor closed meanwhile is only
+         * reset if it is still the one polled.
+         */
+        static bool wait_value_changes(device_ref const *devices, std::size_t count, std::chrono::milliseconds timeout) {
+            std::vector<pollfd> fds;
+            std::vector<std::size_t> owners;
+            fds.reserve(count);
+            owners.reserve(count);
+            for (std::size_t i = 0; i < count; ++i) {
+                std::lock_guard<std::mutex> lock(devices[i]->_open_mutex);
+                if (devices[i]->_event_fd.is_valid()) {
+                    fds.push_back(pollfd{devices[i]->_event_fd.get(), POLLIN, 0});
+                    owners.push_back(i);
+                }
+            }
+            if (::poll(fds.data(), fds.size(), static_cast<int>(timeout.count())) <= 0) {
+                return false;
+            }
+            bool ready = false;
+            for (std::size_t i = 0; i < fds.size(); ++i) {
+                if ((fds[i].revents & (POLLERR | POLLHUP)) != 0) {
+                    linux_input_device &device = *devices[owners[i]];
+                    std::lock_guard<std::mutex> lock(device._open_mutex);
+                    if (device._event_fd.get() == fds[i].fd) {
+                        device._event_fd.reset();
+                    }
+                } else if ((fds[i].revents & POLLIN) != 0) {
+                    ready = true;
+                }
+            }
+            return ready;
+        }
+
+    private:
+        /// Called with the device lock held.
+        static IOReturn write_value(linux_input_device &device, linux_led const &led, CFIndex value) {
+            if (led.brightness_fd.is_valid()) {
+                char buf[32];
+                int const len = std::snprintf(buf, sizeof(buf), "%ld\n", value);
+                if (::pwrite(led.brightness_fd.get(), buf, static_cast<std::size_t>(len), 0) < 0) {
+                    return io_return_from_errno(errno);
+                }
+                return kIOReturnSuccess;
+            }
+            input_event events[2] = {};
+            events[0].type = EV_LED;
+            events[0].code = led.code;
+            events[0].value = value != 0 ? 1 : 0;
+            events[1].type = EV_SYN;
+            events[1].code = SYN_REPORT;
+            if (::write(device._event_fd.get(), events, sizeof(events)) < 0) {
+                return io_return_from_errno(errno);
+            }
+            return kIOReturnSuccess;
+        }
+
+        static void close_all(linux_input_device &device) {
+            for (linux_led &led : device._leds) {
+                led.brightness_fd.reset();
+            }
+            device._event_fd.reset();
+            device._open_count = 0;
+        }
+    };
+
+}
+
+#endif /* hid_linux_hpp */
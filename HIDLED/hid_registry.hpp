@@ -0,0 +1,289 @@
+//
+//  hid_registry.hpp
+//  HIDLED
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+#ifndef hid_registry_hpp
+#define hid_registry_hpp
+
+#include "hid.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace spak {
+
+    /** Source of device changes fed by hand, for exercising a registry
+     * without plugging anything. Has the same interface as
+     * Backend::device_monitor.
+     */
+    template <class Backend>
+    class basic_hid_simulated_device_source {
+        std::mutex _mutex;
+        std::condition_variable _cv;
+        std::vector<typename Backend::device_change> _pending;
+        bool _woken;
+
+        void post(typename Backend::device_change change) {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _pending.push_back(std::move(change));
+            }
+            _cv.notify_all();
+        }
+
+    public:
+        basic_hid_simulated_device_source(uint32_t = kHIDPage_Undefined, uint32_t = 0) : _woken(false) {}
+
+        void add(typename Backend::device_ref device) {
+            uint64_t const native_id = Backend::native_id(device);
+            post(typename Backend::device_change{true, native_id, std::move(device)});
+        }
+
+        void remove(uint64_t native_id) {
+            post(typename Backend::device_change{false, native_id, nullptr});
+        }
+
+        void wait(std::vector<typename Backend::device_change> &changes, std::chrono::milliseconds timeout) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait_for(lock, timeout, [&] {
+                return _woken or not _pending.empty();
+            });
+            changes.insert(changes.end(), _pending.begin(), _pending.end());
+            _pending.clear();
+            _woken = false;
+        }
+
+        void wake() {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _woken = true;
+            }
+            _cv.notify_all();
+        }
+    };
+
+    using hid_simulated_device_source = basic_hid_simulated_device_source<native_backend>;
+
+
+    template <class Backend>
+    struct basic_hid_registry_entry {
+        uint64_t native_id;
+        basic_hid_device<Backend> device;
+        /// Keeps the device valid while some snapshot still refers to it.
+        std::shared_ptr<void const> retained;
+    };
+
+    using hid_registry_entry = basic_hid_registry_entry<native_backend>;
+
+
+    /** Devices currently connected, kept up to date from a Source of
+     * hot-plug changes (Backend::device_monitor by default). The
+     * changes are applied by pump(), or by a background thread after
+     * start(); either way readers get immutable snapshots that stay valid
+     * however long they are held.
+     *
+     * LED values passed to remember() are written again to a device with the
+     * same identity whenever it reconnects, before it shows up in a snapshot.
+     */
+    template <class Backend = native_backend, class Source = typename Backend::device_monitor>
+    class basic_hid_device_registry {
+    public:
+        using entry = basic_hid_registry_entry<Backend>;
+        using snapshot = std::vector<entry>;
+        using snapshot_ptr = std::shared_ptr<snapshot const>;
+        /// Called on the thread running pump(), after the snapshot is published.
+        using listener = std::function<void(bool added, entry const &entry)>;
+
+    private:
+        struct desired_state {
+            hid_device_identity identity;
+            std::vector<std::pair<std::size_t, CFIndex>> leds;
+        };
+
+        Source _source;
+        uint32_t _page;
+        uint32_t _usage;
+        snapshot_ptr _snapshot;
+        std::mutex _desired_mutex;
+        std::vector<desired_state> _desired;
+        listener _listener;
+        std::thread _thread;
+        std::atomic<bool> _running;
+
+        void reapply(basic_hid_device<Backend> &device) {
+            std::vector<std::pair<std::size_t, CFIndex>> leds;
+            hid_device_identity const identity = device.identity();
+            {
+                std::lock_guard<std::mutex> lock(_desired_mutex);
+                auto it = std::find_if(_desired.begin(), _desired.end(), [&](desired_state const &state) {
+                    return state.identity == identity;
+                });
+                if (it == _desired.end()) {
+                    return;
+                }
+                leds = it->leds;
+            }
+            basic_hid_device_opener<Backend> opener = device.open();
+            if (not opener.is_open()) {
+                return;
+            }
+            basic_hid_device_elements_enumerator<Backend> elements = device.elements(kHIDPage_LEDs);
+            basic_hid_device_transaction<Backend> transaction = device.transaction();
+            for (auto const &led : leds) {
+                if (led.first < elements.size()) {
+                    transaction.stage(elements[led.first], led.second);
+                }
+            }
+            transaction.commit();
+        }
+
+    public:
+        template <class ...Args>
+        basic_hid_device_registry(uint32_t in_page = kHIDPage_Undefined, uint32_t in_usage_page = 0, Args &&...args) :
+            _source(in_page, in_usage_page, std::forward<Args>(args)...),
+            _page(in_page),
+            _usage(in_usage_page),
+            _snapshot(std::make_shared<snapshot const>()),
+            _running(false)
+        {}
+
+        basic_hid_device_registry(basic_hid_device_registry const &) = delete;
+        basic_hid_device_registry &operator=(basic_hid_device_registry const &) = delete;
+
+        ~basic_hid_device_registry() {
+            stop();
+        }
+
+        Source &source() {
+            return _source;
+        }
+
+        /// Must be set before start().
+        void set_listener(listener l) {
+            _listener = std::move(l);
+        }
+
+        snapshot_ptr devices() const {
+            return std::atomic_load(&_snapshot);
+        }
+
+        void remember(hid_device_identity const &identity, std::size_t led_idx, CFIndex value) {
+            std::lock_guard<std::mutex> lock(_desired_mutex);
+            auto it = std::find_if(_desired.begin(), _desired.end(), [&](desired_state const &state) {
+                return state.identity == identity;
+            });
+            if (it == _desired.end()) {
+                _desired.push_back(desired_state{identity, {}});
+                it = _desired.end() - 1;
+            }
+            auto led = std::find_if(it->leds.begin(), it->leds.end(), [&](std::pair<std::size_t, CFIndex> const &l) {
+                return l.first == led_idx;
+            });
+            if (led == it->leds.end()) {
+                it->leds.emplace_back(led_idx, value);
+            } else {
+                led->second = value;
+            }
+        }
+
+        void forget(hid_device_identity const &identity) {
+            std::lock_guard<std::mutex> lock(_desired_mutex);
+            _desired.erase(std::remove_if(_desired.begin(), _desired.end(), [&](desired_state const &state) {
+                return state.identity == identity;
+            }), _desired.end());
+        }
+
+        /** Waits up to @p timeout for changes and publishes a new snapshot if
+         * there were any. Returns the number of devices added or removed.
+         */
+        std::size_t pump(std::chrono::milliseconds timeout) {
+            std::vector<typename Backend::device_change> changes;
+            _source.wait(changes, timeout);
+            if (changes.empty()) {
+                return 0;
+            }
+            snapshot next = *devices();
+            std::vector<std::pair<bool, entry>> notifications;
+            for (typename Backend::device_change &change : changes) {
+                auto it = std::find_if(next.begin(), next.end(), [&](entry const &existing) {
+                    return existing.native_id == change.native_id;
+                });
+                if (it != next.end()) {
+                    notifications.emplace_back(false, std::move(*it));
+                    next.erase(it);
+                }
+                if (change.added and Backend::conforms_to(change.device, _page, _usage)) {
+                    entry added{change.native_id, basic_hid_device<Backend>(change.device), Backend::retain(change.device)};
+                    reapply(added.device);
+                    next.push_back(added);
+                    notifications.emplace_back(true, std::move(added));
+                }
+            }
+            std::atomic_store(&_snapshot, std::make_shared<snapshot const>(std::move(next)));
+            if (_listener) {
+                for (auto const &notification : notifications) {
+                    _listener(notification.first, notification.second);
+                }
+            }
+            return notifications.size();
+        }
+
+        /// Pumps on a background thread; returns once the devices already present are in the snapshot.
+        void start() {
+            if (_running.exchange(true)) {
+                return;
+            }
+            // The first pump happens on the thread, where some sources need to be set up
+            std::promise<void> primed;
+            std::future<void> is_primed = primed.get_future();
+            _thread = std::thread([this, &primed] {
+                pump(std::chrono::milliseconds(0));
+                primed.set_value();
+                while (_running) {
+                    pump(std::chrono::milliseconds(500));
+                }
+            });
+            is_primed.wait();
+        }
+
+        void stop() {
+            if (_running.exchange(false)) {
+                _source.wake();
+                _thread.join();
+            }
+        }
+    };
+
+    template <class Source = native_backend::device_monitor>
+    using hid_device_registry = basic_hid_device_registry<native_backend, Source>;
+
+}
+
+#endif /* hid_registry_hpp */
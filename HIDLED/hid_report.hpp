@@ -0,0 +1,477 @@
+//
+//  hid_report.hpp
+//  HIDLED
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+#ifndef hid_report_hpp
+#define hid_report_hpp
+
+#include "hid.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace spak {
+
+    /// Where one LED sits in its output report, in bits from the end of the report ID byte.
+    struct hid_led_field {
+        uint32_t usage;
+        uint8_t report_id;
+        uint16_t bit_offset;
+        uint8_t bit_size;
+        int32_t logical_min;
+        int32_t logical_max;
+    };
+
+    /// An output report carrying LEDs; its fields are a contiguous range of hid_led_layout::fields().
+    struct hid_led_report {
+        uint8_t report_id;
+        /// Report ID byte included.
+        std::size_t size;
+        std::size_t first_field;
+        std::size_t field_count;
+    };
+
+
+    /** Walks the items of a HID report descriptor and hands each LED field
+     * (kHIDPage_LEDs, variable output items) to a sink, keeping track of how
+     * many bits every output report takes. Everything happens in a constexpr
+     * function over fixed-size state, so that the descriptors of known
+     * devices can be laid out at compile time.
+     */
+    class hid_descriptor_parser {
+    public:
+        static constexpr std::size_t max_usages = 32;
+        static constexpr std::size_t max_depth = 8;
+
+    private:
+        struct globals {
+            uint32_t usage_page;
+            int32_t logical_min;
+            int32_t logical_max;
+            uint32_t report_size;
+            uint32_t report_count;
+            uint8_t report_id;
+        };
+
+        struct locals {
+            uint32_t usages[max_usages];
+            std::size_t usage_count;
+            uint32_t usage_min;
+            uint32_t usage_max;
+            bool has_range;
+        };
+
+        /// Bits used so far by each output report, by report ID.
+        uint32_t _output_bits[256];
+        bool _numbered;
+
+        static constexpr uint32_t unsigned_data(uint8_t const *data, std::size_t size) {
+            uint32_t value = 0;
+            for (std::size_t i = 0; i < size; ++i) {
+                value |= static_cast<uint32_t>(data[i]) << (8 * i);
+            }
+            return value;
+        }
+
+        static constexpr int32_t signed_data(uint8_t const *data, std::size_t size) {
+            uint32_t const value = unsigned_data(data, size);
+            return size == 1 ? static_cast<int32_t>(static_cast<int8_t>(value & 0xFF))
+                : size == 2 ? static_cast<int32_t>(static_cast<int16_t>(value & 0xFFFF))
+                : static_cast<int32_t>(value);
+        }
+
+        /// Usages without a page (up to 2 bytes) take the current one.
+        static constexpr uint32_t full_usage(uint32_t usage, std::size_t size, uint32_t usage_page) {
+            return size == 4 ? usage : (usage_page << 16) | usage;
+        }
+
+        /// Usage of the @p i-th field of a main item; the last one repeats when there are fewer usages than fields.
+        static constexpr bool usage_of(locals const &loc, uint32_t i, uint32_t &usage) {
+            if (loc.usage_count > 0) {
+                usage = loc.usages[i < loc.usage_count ? i : loc.usage_count - 1];
+                return true;
+            }
+            if (loc.has_range) {
+                usage = loc.usage_min + i < loc.usage_max ? loc.usage_min + i : loc.usage_max;
+                return true;
+            }
+            return false;
+        }
+
+        template <class Sink>
+        constexpr void add_output(globals const &glob, locals const &loc, uint32_t flags, Sink &sink) {
+            bool const constant = (flags & 0x01) != 0;
+            bool const variable = (flags & 0x02) != 0;
+            uint32_t &bits = _output_bits[glob.report_id];
+            for (uint32_t i = 0; i < glob.report_count; ++i) {
+                uint32_t usage = 0;
+                uint32_t const bit_offset = bits + i * glob.report_size;
+                if (not constant and variable and usage_of(loc, i, usage) and (usage >> 16) == kHIDPage_LEDs
+                    and glob.report_size > 0 and glob.report_size <= 32 and bit_offset <= UINT16_MAX) {
+                    int32_t logical_max = glob.logical_max;
+                    if (logical_max < glob.logical_min) {
+                        // Unsigned maximum written without the extra byte, e.g. 0xFF for 255
+                        logical_max = static_cast<int32_t>(static_cast<uint32_t>(logical_max) & ((uint64_t(1) << glob.report_size) - 1));
+                    }
+                    sink.add(hid_led_field{usage & 0xFFFF, glob.report_id, static_cast<uint16_t>(bit_offset),
+                        static_cast<uint8_t>(glob.report_size), glob.logical_min, logical_max});
+                }
+            }
+            bits += glob.report_count * glob.report_size;
+        }
+
+    public:
+        constexpr hid_descriptor_parser() : _output_bits{}, _numbered(false) {}
+
+        /// Returns false if the descriptor is truncated or otherwise malformed.
+        template <class Sink>
+        constexpr bool parse(uint8_t const *descriptor, std::size_t length, Sink &sink) {
+            globals glob{0, 0, 0, 0, 0, 0};
+            locals loc{{}, 0, 0, 0, false};
+            globals stack[max_depth] = {};
+            std::size_t depth = 0;
+            std::size_t pos = 0;
+            while (pos < length) {
+                uint8_t const prefix = descriptor[pos++];
+                if (prefix == 0xFE) {
+                    // Long item: size, tag, data; none are defined
+                    if (pos + 2 > length or pos + 2 + descriptor[pos] > length) {
+                        return false;
+                    }
+                    pos += 2 + descriptor[pos];
+                    continue;
+                }
+                std::size_t const size = (prefix & 0x03) == 3 ? 4 : (prefix & 0x03);
+                if (pos + size > length) {
+                    return false;
+                }
+                uint8_t const *data = descriptor + pos;
+                pos += size;
+                uint8_t const type = (prefix >> 2) & 0x03;
+                uint8_t const tag = prefix >> 4;
+                if (type == 0) {
+                    // Main items
+                    if (tag == 0x9) {
+                        add_output(glob, loc, unsigned_data(data, size), sink);
+                    }
+                    loc = locals{{}, 0, 0, 0, false};
+                } else if (type == 1) {
+                    switch (tag) {
+                        case 0x0: glob.usage_page = unsigned_data(data, size); break;
+                        case 0x1: glob.logical_min = signed_data(data, size); break;
+                        case 0x2: glob.logical_max = signed_data(data, size); break;
+                        case 0x7: glob.report_size = unsigned_data(data, size); break;
+                        case 0x8:
+                            glob.report_id = static_cast<uint8_t>(unsigned_data(data, size));
+                            _numbered = true;
+                            break;
+                        case 0x9: glob.report_count = unsigned_data(data, size); break;
+                        case 0xA:
+                            if (depth == max_depth) {
+                                return false;
+                            }
+                            stack[depth++] = glob;
+                            break;
+                        case 0xB:
+                            if (depth == 0) {
+                                return false;
+                            }
+                            glob = stack[--depth];
+                            break;
+                        default: break;
+                    }
+                } else if (type == 2) {
+                    switch (tag) {
+                        case 0x0:
+                            // Past the capacity, the last usage repeats anyway
+                            if (loc.usage_count < max_usages) {
+                                loc.usages[loc.usage_count++] = full_usage(unsigned_data(data, size), size, glob.usage_page);
+                            }
+                            break;
+                        case 0x1:
+                            loc.usage_min = full_usage(unsigned_data(data, size), size, glob.usage_page);
+                            loc.has_range = true;
+                            break;
+                        case 0x2:
+                            loc.usage_max = full_usage(unsigned_data(data, size), size, glob.usage_page);
+                            loc.has_range = true;
+                            break;
+                        default: break;
+                    }
+                }
+            }
+            return true;
+        }
+
+        /// Size of output report @p report_id once encoded, report ID byte included.
+        constexpr std::size_t report_size(uint8_t report_id) const {
+            return 1 + (_output_bits[report_id] + 7) / 8;
+        }
+
+        /// Whether the device uses report IDs at all.
+        constexpr bool numbered() const {
+            return _numbered;
+        }
+    };
+
+
+    /** Writes report @p report into @p buffer, which must hold report.size
+     * bytes, taking the value of each of its fields from @p values, indexed
+     * like @p fields. Values are clamped to the logical range; bits that are
+     * not LEDs are left at zero.
+     */
+    constexpr std::size_t encode_led_report(hid_led_field const *fields, hid_led_report const &report, CFIndex const *values, uint8_t *buffer) {
+        for (std::size_t i = 0; i < report.size; ++i) {
+            buffer[i] = 0;
+        }
+        buffer[0] = report.report_id;
+        uint8_t *const payload = buffer + 1;
+        for (std::size_t i = report.first_field; i < report.first_field + report.field_count; ++i) {
+            hid_led_field const &f = fields[i];
+            CFIndex const value = values[i] < f.logical_min ? f.logical_min : values[i] > f.logical_max ? f.logical_max : values[i];
+            if (f.bit_size == 1) {
+                payload[f.bit_offset / 8] |= static_cast<uint8_t>((value & 1) << (f.bit_offset % 8));
+                continue;
+            }
+            uint32_t const bits = static_cast<uint32_t>(value);
+            for (unsigned b = 0; b < f.bit_size; ++b) {
+                unsigned const bit = f.bit_offset + b;
+                payload[bit / 8] |= static_cast<uint8_t>(((bits >> b) & 1) << (bit % 8));
+            }
+        }
+        return report.size;
+    }
+
+
+    /** The LED fields of a HID report descriptor, parsed once so that
+     * writing any combination of LED values is a matter of setting bits in
+     * a buffer. Encoded reports always start with the report ID byte, 0 for
+     * devices without numbered reports, which is what hidraw and SetReport
+     * expect.
+     */
+    class hid_led_layout {
+        std::vector<hid_led_field> _fields;
+        std::vector<hid_led_report> _reports;
+        bool _numbered;
+
+        struct sink {
+            std::vector<hid_led_field> &fields;
+
+            void add(hid_led_field const &field) {
+                fields.push_back(field);
+            }
+        };
+
+    public:
+        hid_led_layout() : _numbered(false) {}
+
+        /** Reads a report descriptor. Returns false if it is truncated or
+         * otherwise malformed, in which case the layout is left empty.
+         */
+        bool parse(uint8_t const *descriptor, std::size_t length) {
+            _fields.clear();
+            _reports.clear();
+            hid_descriptor_parser parser;
+            sink s{_fields};
+            if (not parser.parse(descriptor, length, s)) {
+                *this = hid_led_layout();
+                return false;
+            }
+            _numbered = parser.numbered();
+            // Group the fields by report, and lay out each report once
+            std::stable_sort(_fields.begin(), _fields.end(), [](hid_led_field const &l, hid_led_field const &r) {
+                return l.report_id < r.report_id;
+            });
+            for (std::size_t i = 0; i < _fields.size(); ++i) {
+                if (_reports.empty() or _reports.back().report_id != _fields[i].report_id) {
+                    _reports.push_back(hid_led_report{_fields[i].report_id, parser.report_size(_fields[i].report_id), i, 0});
+                }
+                ++_reports.back().field_count;
+            }
+            return true;
+        }
+
+        bool parse(std::vector<uint8_t> const &descriptor) {
+            return parse(descriptor.data(), descriptor.size());
+        }
+
+        std::vector<hid_led_field> const &fields() const {
+            return _fields;
+        }
+
+        std::vector<hid_led_report> const &reports() const {
+            return _reports;
+        }
+
+        /// Whether the device uses report IDs at all.
+        bool numbered() const {
+            return _numbered;
+        }
+
+        /// Largest encoded report, for sizing buffers once.
+        std::size_t max_report_size() const {
+            std::size_t size = 0;
+            for (hid_led_report const &report : _reports) {
+                size = std::max(size, report.size);
+            }
+            return size;
+        }
+
+        /// Index in fields() of the first LED with @p usage, or fields().size().
+        std::size_t find(uint32_t usage) const {
+            for (std::size_t i = 0; i < _fields.size(); ++i) {
+                if (_fields[i].usage == usage) {
+                    return i;
+                }
+            }
+            return _fields.size();
+        }
+
+        /// Index in reports() of the report holding field @p field.
+        std::size_t report_of(std::size_t field) const {
+            for (std::size_t i = 0; i < _reports.size(); ++i) {
+                if (field < _reports[i].first_field + _reports[i].field_count) {
+                    return i;
+                }
+            }
+            return _reports.size();
+        }
+
+        /// See encode_led_report(); @p report is an index in reports().
+        std::size_t encode(std::size_t report, CFIndex const *values, uint8_t *buffer) const {
+            return encode_led_report(_fields.data(), _reports[report], values, buffer);
+        }
+
+        /// The reverse of encode(): reads the fields of report @p report from @p buffer into @p values.
+        void decode(std::size_t report, uint8_t const *buffer, CFIndex *values) const {
+            hid_led_report const &r = _reports[report];
+            uint8_t const *const payload = buffer + 1;
+            for (std::size_t i = r.first_field; i < r.first_field + r.field_count; ++i) {
+                hid_led_field const &f = _fields[i];
+                uint32_t bits = 0;
+                for (unsigned b = 0; b < f.bit_size; ++b) {
+                    unsigned const bit = f.bit_offset + b;
+                    bits |= static_cast<uint32_t>((payload[bit / 8] >> (bit % 8)) & 1) << b;
+                }
+                if (f.logical_min < 0 and f.bit_size < 32 and (bits >> (f.bit_size - 1)) != 0) {
+                    // Sign extend
+                    bits |= ~uint32_t(0) << f.bit_size;
+                }
+                values[i] = f.logical_min < 0 ? static_cast<CFIndex>(static_cast<int32_t>(bits)) : static_cast<CFIndex>(bits);
+            }
+        }
+    };
+
+
+    /** A hid_led_layout fixed at compile time, for devices whose report
+     * descriptor is known in advance: no allocation, and encoding a report
+     * is a constant expression when the values are.
+     */
+    template <std::size_t MaxFields, std::size_t MaxReports = 4>
+    struct hid_static_led_layout {
+        hid_led_field fields[MaxFields];
+        hid_led_report reports[MaxReports];
+        std::size_t field_count;
+        std::size_t report_count;
+        bool numbered;
+        /// False if the descriptor is malformed or has more fields or reports than fit.
+        bool valid;
+
+        constexpr hid_static_led_layout() : fields{}, reports{}, field_count(0), report_count(0), numbered(false), valid(true) {}
+
+        /// Parser sink; fields past the capacity invalidate the layout.
+        constexpr void add(hid_led_field const &field) {
+            if (field_count == MaxFields) {
+                valid = false;
+                return;
+            }
+            // Insertion sort by report ID, stable like hid_led_layout
+            std::size_t i = field_count++;
+            for (; i > 0 and fields[i - 1].report_id > field.report_id; --i) {
+                fields[i] = fields[i - 1];
+            }
+            fields[i] = field;
+        }
+
+        constexpr std::size_t find(uint32_t usage) const {
+            for (std::size_t i = 0; i < field_count; ++i) {
+                if (fields[i].usage == usage) {
+                    return i;
+                }
+            }
+            return field_count;
+        }
+
+        /// See encode_led_report(); @p report is an index in reports.
+        constexpr std::size_t encode(std::size_t report, CFIndex const *values, uint8_t *buffer) const {
+            return encode_led_report(fields, reports[report], values, buffer);
+        }
+    };
+
+    template <std::size_t MaxFields, std::size_t MaxReports = 4, std::size_t N>
+    constexpr hid_static_led_layout<MaxFields, MaxReports> make_static_led_layout(uint8_t const (&descriptor)[N]) {
+        hid_static_led_layout<MaxFields, MaxReports> layout;
+        hid_descriptor_parser parser;
+        if (not parser.parse(descriptor, N, layout)) {
+            layout.valid = false;
+        }
+        layout.numbered = parser.numbered();
+        for (std::size_t i = 0; i < layout.field_count; ++i) {
+            uint8_t const report_id = layout.fields[i].report_id;
+            if (layout.report_count == 0 or layout.reports[layout.report_count - 1].report_id != report_id) {
+                if (layout.report_count == MaxReports) {
+                    layout.valid = false;
+                    break;
+                }
+                layout.reports[layout.report_count++] = hid_led_report{report_id, parser.report_size(report_id), i, 0};
+            }
+            ++layout.reports[layout.report_count - 1].field_count;
+        }
+        return layout;
+    }
+
+
+    /// Report descriptor of the boot protocol keyboard (HID 1.11, appendix B.1).
+    static constexpr uint8_t hid_boot_keyboard_descriptor[] = {
+        0x05, 0x01, 0x09, 0x06, 0xA1, 0x01,                 // Usage Page (GD), Usage (Keyboard), Collection (Application)
+        0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7, 0x15, 0x00,     //   Modifiers
+        0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02,
+        0x95, 0x01, 0x75, 0x08, 0x81, 0x01,                 //   Reserved byte
+        0x95, 0x05, 0x75, 0x01, 0x05, 0x08, 0x19, 0x01,     //   LEDs: Num Lock to Kana
+        0x29, 0x05, 0x91, 0x02,
+        0x95, 0x01, 0x75, 0x03, 0x91, 0x01,                 //   LED padding
+        0x95, 0x06, 0x75, 0x08, 0x15, 0x00, 0x25, 0x65,     //   Key codes
+        0x05, 0x07, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00,
+        0xC0                                                // End Collection
+    };
+
+    static constexpr auto hid_boot_keyboard_leds = make_static_led_layout<8>(hid_boot_keyboard_descriptor);
+
+    static_assert(hid_boot_keyboard_leds.valid and hid_boot_keyboard_leds.field_count == 5, "the boot keyboard has 5 LEDs");
+    static_assert(hid_boot_keyboard_leds.report_count == 1 and hid_boot_keyboard_leds.reports[0].size == 2, "in one unnumbered byte");
+    static_assert(hid_boot_keyboard_leds.fields[hid_boot_keyboard_leds.find(kHIDUsage_LED_CapsLock)].bit_offset == 1, "Caps Lock is bit 1");
+
+}
+
+#endif /* hid_report_hpp */
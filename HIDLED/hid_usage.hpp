@@ -0,0 +1,147 @@
+//
+//  hid_usage.hpp
+//  HIDLED
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+#ifndef hid_usage_hpp
+#define hid_usage_hpp
+
+#include "hid.hpp"
+#include <cstddef>
+#include <cstdint>
+
+namespace spak {
+
+    /// Symbolic name of a usage, as accepted on the command line (e.g. "caps_lock").
+    struct hid_usage_name {
+        uint32_t usage;
+        char const *name;
+    };
+
+    static constexpr hid_usage_name hid_led_usage_names[] = {
+        {kHIDUsage_LED_NumLock,                 "num_lock"},
+        {kHIDUsage_LED_CapsLock,                "caps_lock"},
+        {kHIDUsage_LED_ScrollLock,              "scroll_lock"},
+        {kHIDUsage_LED_Compose,                 "compose"},
+        {kHIDUsage_LED_Kana,                    "kana"},
+        {kHIDUsage_LED_Power,                   "power"},
+        {kHIDUsage_LED_Shift,                   "shift"},
+        {kHIDUsage_LED_DoNotDisturb,            "do_not_disturb"},
+        {kHIDUsage_LED_Mute,                    "mute"},
+        {kHIDUsage_LED_OffHook,                 "off_hook"},
+        {kHIDUsage_LED_Ring,                    "ring"},
+        {kHIDUsage_LED_MessageWaiting,          "message_waiting"},
+        {kHIDUsage_LED_BatteryOperation,        "battery_operation"},
+        {kHIDUsage_LED_BatteryOK,               "battery_ok"},
+        {kHIDUsage_LED_BatteryLow,              "battery_low"},
+        {kHIDUsage_LED_Speaker,                 "speaker"},
+        {kHIDUsage_LED_HeadSet,                 "headset"},
+        {kHIDUsage_LED_Hold,                    "hold"},
+        {kHIDUsage_LED_Microphone,              "microphone"},
+        {kHIDUsage_LED_StandBy,                 "stand_by"},
+        {kHIDUsage_LED_CameraOn,                "camera_on"},
+        {kHIDUsage_LED_CameraOff,               "camera_off"},
+        {kHIDUsage_LED_OnLine,                  "online"},
+        {kHIDUsage_LED_OffLine,                 "offline"},
+        {kHIDUsage_LED_Busy,                    "busy"},
+        {kHIDUsage_LED_Ready,                   "ready"},
+        {kHIDUsage_LED_Error,                   "error"},
+        {kHIDUsage_LED_GenericIndicator,        "generic_indicator"},
+        {kHIDUsage_LED_SystemSuspend,           "system_suspend"},
+        {kHIDUsage_LED_ExternalPowerConnected,  "external_power_connected"}
+    };
+
+    static constexpr hid_usage_name hid_generic_desktop_usage_names[] = {
+        {kHIDUsage_GD_Pointer,              "pointer"},
+        {kHIDUsage_GD_Mouse,                "mouse"},
+        {kHIDUsage_GD_Joystick,             "joystick"},
+        {kHIDUsage_GD_GamePad,              "game_pad"},
+        {kHIDUsage_GD_Keyboard,             "keyboard"},
+        {kHIDUsage_GD_Keypad,               "keypad"},
+        {kHIDUsage_GD_MultiAxisController,  "multi_axis_controller"},
+        {kHIDUsage_GD_SystemControl,        "system_control"}
+    };
+
+
+    namespace detail {
+
+        constexpr bool usage_name_equals(char const *l, char const *r) {
+            while (*l != '\0' and *l == *r) {
+                ++l;
+                ++r;
+            }
+            return *l == *r;
+        }
+
+        template <std::size_t N>
+        constexpr char const *usage_name(hid_usage_name const (&table)[N], uint32_t usage) {
+            for (std::size_t i = 0; i < N; ++i) {
+                if (table[i].usage == usage) {
+                    return table[i].name;
+                }
+            }
+            return nullptr;
+        }
+
+        template <std::size_t N>
+        constexpr uint32_t usage_by_name(hid_usage_name const (&table)[N], char const *name) {
+            for (std::size_t i = 0; i < N; ++i) {
+                if (usage_name_equals(table[i].name, name)) {
+                    return table[i].usage;
+                }
+            }
+            return 0;
+        }
+
+    }
+
+
+    /// Name of an LED usage, or nullptr if it is not in the table.
+    constexpr char const *hid_led_usage_name(uint32_t usage) {
+        return detail::usage_name(hid_led_usage_names, usage);
+    }
+
+    /// LED usage called @p name, or 0 (undefined on that page) if there is none.
+    constexpr uint32_t hid_led_usage_by_name(char const *name) {
+        return detail::usage_by_name(hid_led_usage_names, name);
+    }
+
+    constexpr char const *hid_generic_desktop_usage_name(uint32_t usage) {
+        return detail::usage_name(hid_generic_desktop_usage_names, usage);
+    }
+
+    constexpr uint32_t hid_generic_desktop_usage_by_name(char const *name) {
+        return detail::usage_by_name(hid_generic_desktop_usage_names, name);
+    }
+
+    /// Name of @p usage on @p usage_page, for the pages with a table.
+    constexpr char const *hid_usage_name_of(uint32_t usage_page, uint32_t usage) {
+        return usage_page == kHIDPage_LEDs ? hid_led_usage_name(usage)
+            : usage_page == kHIDPage_GenericDesktop ? hid_generic_desktop_usage_name(usage)
+            : nullptr;
+    }
+
+    static_assert(hid_led_usage_by_name("caps_lock") == kHIDUsage_LED_CapsLock, "LED names are looked up at compile time");
+    static_assert(hid_generic_desktop_usage_by_name("keyboard") == kHIDUsage_GD_Keyboard, "Generic Desktop names are looked up at compile time");
+
+}
+
+#endif /* hid_usage_hpp */
@@ -0,0 +1,512 @@
+//
+//  hidraw.hpp
+//  HIDLED
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+#ifndef hidraw_hpp
+#define hidraw_hpp
+
+#if not defined(__APPLE__)
+
+#include "hid.hpp"
+#include "hid_report.hpp"
+#include <linux/hidraw.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace spak {
+
+    /** A device node /dev/hidrawN with the LED layout of its report
+     * descriptor. Output reports are written whole, so changing one LED
+     * rewrites the others with it: their values are read back first, see
+     * hidraw_backend::set_values.
+     */
+    class hidraw_device {
+        friend struct hidraw_backend;
+
+        std::string _sysfs_path;
+        std::string _dev_path;
+        /// The evdev node the input layer made of the same device, if any.
+        std::string _event_path;
+        std::string _name;
+        std::string _manufacturer;
+        std::string _phys;
+        std::string _uniq;
+        uint32_t _vendor_id;
+        uint32_t _product_id;
+        uint64_t _number;
+        hid_led_layout _layout;
+        std::vector<CFIndex> _state;
+        /// The state being written, which becomes _state report by report.
+        std::vector<CFIndex> _pending;
+        std::vector<uint8_t> _buffer;
+        /// Fields given a value by the set_values() in progress.
+        std::vector<bool> _written;
+        unique_fd _fd;
+        unique_fd _event_fd;
+        std::atomic<std::size_t> _open_count{0};
+        /// Held by open(), close() and every read and write, as in linux_input_device; guards the state too.
+        std::mutex _open_mutex;
+
+        void parse_uevent() {
+            std::vector<uint8_t> const bytes = sysfs::read_bytes(_sysfs_path + "/device/uevent");
+            std::string const uevent(bytes.begin(), bytes.end());
+            std::size_t pos = 0;
+            while (pos < uevent.size()) {
+                std::size_t end = uevent.find('\n', pos);
+                if (end == std::string::npos) {
+                    end = uevent.size();
+                }
+                std::string const line = uevent.substr(pos, end - pos);
+                pos = end + 1;
+                if (line.compare(0, 7, "HID_ID=") == 0) {
+                    // bus:vendor:product, in hex
+                    char const *p = line.c_str() + 7;
+                    char *next = nullptr;
+                    std::strtoul(p, &next, 16);
+                    if (*next == ':') {
+                        _vendor_id = static_cast<uint32_t>(std::strtoul(next + 1, &next, 16));
+                    }
+                    if (*next == ':') {
+                        _product_id = static_cast<uint32_t>(std::strtoul(next + 1, &next, 16));
+                    }
+                } else if (line.compare(0, 9, "HID_NAME=") == 0) {
+                    _name = line.substr(9);
+                } else if (line.compare(0, 9, "HID_PHYS=") == 0) {
+                    _phys = line.substr(9);
+                } else if (line.compare(0, 9, "HID_UNIQ=") == 0) {
+                    _uniq = line.substr(9);
+                }
+            }
+        }
+
+        /** Reads into _state the fields of report @p report that _written
+         * leaves alone, with HIDIOCGOUTPUT, or else with EVIOCGLED on the
+         * evdev node for the LEDs the input layer knows. Returns false if
+         * some of them could not be read.
+         */
+        bool read_back(std::size_t report) {
+            hid_led_report const &r = _layout.reports()[report];
+            bool const whole = std::all_of(_written.begin() + static_cast<std::ptrdiff_t>(r.first_field),
+                _written.begin() + static_cast<std::ptrdiff_t>(r.first_field + r.field_count), [](bool written) {
+                return written;
+            });
+            if (whole) {
+                return true;
+            }
+#if defined(HIDIOCGOUTPUT)
+            _buffer[0] = r.report_id;
+            if (::ioctl(_fd.get(), HIDIOCGOUTPUT(r.size), _buffer.data()) >= 0) {
+                _layout.decode(report, _buffer.data(), _state.data());
+                return true;
+            }
+#endif
+            uint8_t leds[(LED_MAX + 7) / 8] = {};
+            if (not _event_fd.is_valid() or ::ioctl(_event_fd.get(), EVIOCGLED(sizeof(leds)), leds) < 0) {
+                return false;
+            }
+            for (std::size_t i = r.first_field; i < r.first_field + r.field_count; ++i) {
+                if (_written[i]) {
+                    continue;
+                }
+                hid_led_field const &field = _layout.fields()[i];
+                linux_led_usage const *led = find_linux_led_by_usage(field.usage);
+                if (led == nullptr) {
+                    return false;
+                }
+                _state[i] = (leds[led->code / 8] >> (led->code % 8)) & 1 ? field.logical_max : field.logical_min;
+            }
+            return true;
+        }
+
+        /// Writes report @p report of the layout from _pending, in one write().
+        IOReturn write_report(std::size_t report) {
+            std::size_t const size = _layout.encode(report, _pending.data(), _buffer.data());
+            if (::write(_fd.get(), _buffer.data(), size) < 0) {
+                return io_return_from_errno(errno);
+            }
+            hid_led_report const &r = _layout.reports()[report];
+            std::copy(_pending.begin() + static_cast<std::ptrdiff_t>(r.first_field),
+                _pending.begin() + static_cast<std::ptrdiff_t>(r.first_field + r.field_count),
+                _state.begin() + static_cast<std::ptrdiff_t>(r.first_field));
+            return kIOReturnSuccess;
+        }
+
+    public:
+        hidraw_device(std::string const &root, std::string const &hidraw_name) :
+            _sysfs_path(root + "/sys/class/hidraw/" + hidraw_name),
+            _dev_path(root + "/dev/" + hidraw_name),
+            _vendor_id(0), _product_id(0),
+            _number(std::strtoull(hidraw_name.c_str() + 6, nullptr, 10))
+        {
+            parse_uevent();
+            for (std::string const &input : sysfs::list_dir(_sysfs_path + "/device/input")) {
+                for (std::string const &entry : sysfs::list_dir(_sysfs_path + "/device/input/" + input)) {
+                    if (entry.compare(0, 5, "event") == 0 and _event_path.empty()) {
+                        _event_path = root + "/dev/input/" + entry;
+                    }
+                }
+            }
+            _manufacturer = sysfs::read_string(_sysfs_path + "/device/../../manufacturer");
+            _layout.parse(sysfs::read_bytes(_sysfs_path + "/device/report_descriptor"));
+            _state.assign(_layout.fields().size(), 0);
+            _pending = _state;
+            _written.assign(_state.size(), false);
+            _buffer.assign(_layout.max_report_size(), 0);
+        }
+
+        hidraw_device(hidraw_device const &) = delete;
+        hidraw_device &operator=(hidraw_device const &) = delete;
+
+        std::string const &dev_path() const {
+            return _dev_path;
+        }
+
+        hid_led_layout const &layout() const {
+            return _layout;
+        }
+    };
+
+
+    /** Backend policy for basic_hid_device and friends that drives LEDs
+     * with output reports written straight to /dev/hidrawN: one write() per
+     * report, no element lookup and no input layer in between. Elements are
+     * the LED fields of the report descriptor. Output reports cannot be read
+     * back on every kernel, so values start from what HIDIOCGOUTPUT reports
+     * when available and are otherwise those last written (initially 0).
+     *
+     * Writing some of the LEDs of a report rewrites the others, which are
+     * read back just before so as not to undo changes made elsewhere: with
+     * HIDIOCGOUTPUT, or else from the evdev node of the device (EVIOCGLED),
+     * which only knows the standard LEDs. Where neither works such partial
+     * writes fail with kIOReturnUnsupported; writing every LED of a report
+     * always works.
+     */
+    struct hidraw_backend {
+        using device_ref = std::shared_ptr<hidraw_device>;
+
+        struct element_ref {
+            device_ref device;
+            std::size_t index;
+
+            hid_led_field const &field() const {
+                return device->_layout.fields()[index];
+            }
+
+            bool operator==(element_ref const &other) const {
+                return device == other.device and index == other.index;
+            }
+        };
+
+        class manager {
+            std::string _root;
+        public:
+            manager(std::string root = linux_backend::manager::default_root()) : _root(std::move(root)) {}
+
+            std::string const &root() const {
+                return _root;
+            }
+
+            device_ref resolve(uint64_t native_id) const {
+                std::string const hidraw_name = "hidraw" + std::to_string(native_id);
+                if (::access((_root + "/sys/class/hidraw/" + hidraw_name).c_str(), F_OK) != 0) {
+                    return nullptr;
+                }
+                return std::make_shared<hidraw_device>(_root, hidraw_name);
+            }
+
+            std::vector<device_ref> copy_devices(uint32_t in_page, uint32_t in_usage_page) const {
+                std::vector<device_ref> devices;
+                std::vector<std::string> entries = sysfs::list_dir(_root + "/sys/class/hidraw");
+                std::sort(entries.begin(), entries.end(), sysfs::natural_less);
+                for (std::string const &entry : entries) {
+                    if (entry.compare(0, 6, "hidraw") != 0) {
+                        continue;
+                    }
+                    auto device = std::make_shared<hidraw_device>(_root, entry);
+                    if (conforms_to(device, in_page, in_usage_page)) {
+                        devices.push_back(std::move(device));
+                    }
+                }
+                return devices;
+            }
+        };
+
+        static IOReturn open(device_ref const &device) {
+            // The device pool may close devices from its own thread
+            std::lock_guard<std::mutex> lock(device->_open_mutex);
+            if (device->_open_count++ > 0) {
+                return kIOReturnSuccess;
+            }
+            device->_fd.reset(::open(device->_dev_path.c_str(), O_RDWR | O_CLOEXEC));
+            if (not device->_fd.is_valid()) {
+                IOReturn const res = io_return_from_errno(errno);
+                device->_open_count = 0;
+                return res;
+            }
+            if (not device->_event_path.empty()) {
+                // Only to read the LEDs back; hidraw works without it
+                device->_event_fd.reset(::open(device->_event_path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK));
+            }
+#if defined(HIDIOCGOUTPUT)
+            hid_led_layout const &layout = device->_layout;
+            for (std::size_t i = 0; i < layout.reports().size(); ++i) {
+                device->_buffer[0] = layout.reports()[i].report_id;
+                if (::ioctl(device->_fd.get(), HIDIOCGOUTPUT(layout.reports()[i].size), device->_buffer.data()) >= 0) {
+                    layout.decode(i, device->_buffer.data(), device->_state.data());
+                }
+            }
+#endif
+            return kIOReturnSuccess;
+        }
+
+        static void close(device_ref const &device) {
+            std::lock_guard<std::mutex> lock(device->_open_mutex);
+            if (device->_open_count > 0 and --device->_open_count == 0) {
+                device->_fd.reset();
+                device->_event_fd.reset();
+            }
+        }
+
+        /// Anything with LEDs passes for a keyboard: the descriptor's application collections are not kept.
+        static bool conforms_to(device_ref const &device, uint32_t in_page, uint32_t in_usage_page) {
+            std::vector<hid_led_field> const &fields = device->_layout.fields();
+            switch (in_page) {
+                case kHIDPage_Undefined:
+                    return true;
+                case kHIDPage_GenericDesktop:
+                    if (in_usage_page != 0 and in_usage_page != kHIDUsage_GD_Keyboard and in_usage_page != kHIDUsage_GD_Keypad) {
+                        return false;
+                    }
+                    return not fields.empty();
+                case kHIDPage_LEDs:
+                    return std::any_of(fields.begin(), fields.end(), [=](hid_led_field const &field) {
+                        return in_usage_page == 0 or field.usage == in_usage_page;
+                    });
+                default:
+                    return false;
+            }
+        }
+
+        static std::string manufacturer(device_ref const &device) {
+            return device->_manufacturer;
+        }
+
+        static std::string product(device_ref const &device) {
+            return device->_name;
+        }
+
+        static std::string serial_number(device_ref const &device) {
+            return device->_uniq;
+        }
+
+        enum struct string_property {
+            manufacturer,
+            product,
+            serial_number
+        };
+
+        using native_string = std::string;
+
+        static native_string intern(std::string const &str) {
+            return str;
+        }
+
+        static bool string_equals(device_ref const &device, string_property prop, native_string const &str) {
+            switch (prop) {
+                case string_property::manufacturer:
+                    return device->_manufacturer == str;
+                case string_property::product:
+                    return device->_name == str;
+                case string_property::serial_number:
+                    return device->_uniq == str;
+            }
+            return false;
+        }
+
+        static uint32_t vendor_id(device_ref const &device) {
+            return device->_vendor_id;
+        }
+
+        static uint32_t product_id(device_ref const &device) {
+            return device->_product_id;
+        }
+
+        /// Same hash of the physical path as linux_backend::location_id.
+        static uint32_t location_id(device_ref const &device) {
+            uint32_t hash = 2166136261u;
+            for (char c : device->_phys) {
+                hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+            }
+            return hash;
+        }
+
+        static uint64_t native_id(device_ref const &device) {
+            return device->_number;
+        }
+
+        static std::shared_ptr<void const> retain(device_ref const &device) {
+            return device;
+        }
+
+        static std::vector<element_ref> copy_elements(device_ref const &device, uint32_t in_page, uint32_t in_usage_page) {
+            std::vector<element_ref> retval;
+            if (in_page != kHIDPage_Undefined and in_page != kHIDPage_LEDs) {
+                return retval;
+            }
+            std::vector<hid_led_field> const &fields = device->_layout.fields();
+            for (std::size_t i = 0; i < fields.size(); ++i) {
+                if (in_usage_page == 0 or fields[i].usage == in_usage_page) {
+                    retval.push_back(element_ref{device, i});
+                }
+            }
+            return retval;
+        }
+
+        static device_ref element_device(element_ref const &element) {
+            return element.device;
+        }
+
+        static uint32_t usage(element_ref const &element) {
+            return element.field().usage;
+        }
+
+        static uint32_t usage_page(element_ref const &) {
+            return kHIDPage_LEDs;
+        }
+
+        static IOHIDElementType type(element_ref const &) {
+            return kIOHIDElementTypeOutput;
+        }
+
+        /// The LED class name the kernel would use, if there is one.
+        static std::string name(element_ref const &element) {
+            uint32_t const usage = element.field().usage;
+            for (auto const &led : linux_led_usages) {
+                if (led.usage == usage) {
+                    return led.name;
+                }
+            }
+            return "";
+        }
+
+        static uint32_t report_id(element_ref const &element) {
+            return element.field().report_id;
+        }
+
+        static CFIndex logical_min(element_ref const &element) {
+            return element.field().logical_min;
+        }
+
+        static CFIndex logical_max(element_ref const &element) {
+            return element.field().logical_max;
+        }
+
+        static IOReturn get_value(device_ref const &device, element_ref const &element, CFIndex &value) {
+            std::lock_guard<std::mutex> lock(device->_open_mutex);
+            if (device->_open_count == 0) {
+                return kIOReturnNotOpen;
+            }
+            value = device->_state[element.index];
+            return kIOReturnSuccess;
+        }
+
+        static IOReturn set_value(device_ref const &device, element_ref const &element, CFIndex value) {
+            return set_values(device, &element, &value, 1);
+        }
+
+        /** Writes each report touched exactly once; the state only follows the
+         * reports that made it. Nothing is written unless the LEDs left alone
+         * in the touched reports could all be read back, see above.
+         */
+        static IOReturn set_values(device_ref const &device, element_ref const *elements, CFIndex const *values, std::size_t count) {
+            std::lock_guard<std::mutex> lock(device->_open_mutex);
+            if (device->_open_count == 0) {
+                return kIOReturnNotOpen;
+            }
+            hid_led_layout const &layout = device->_layout;
+            std::fill(device->_written.begin(), device->_written.end(), false);
+            for (std::size_t i = 0; i < count; ++i) {
+                device->_written[elements[i].index] = true;
+            }
+            auto const touched = [&](std::size_t r) {
+                return std::any_of(elements, elements + count, [&](element_ref const &element) {
+                    return layout.report_of(element.index) == r;
+                });
+            };
+            for (std::size_t r = 0; r < layout.reports().size(); ++r) {
+                if (touched(r) and not device->read_back(r)) {
+                    return kIOReturnUnsupported;
+                }
+            }
+            std::copy(device->_state.begin(), device->_state.end(), device->_pending.begin());
+            for (std::size_t i = 0; i < count; ++i) {
+                device->_pending[elements[i].index] = values[i];
+            }
+            for (std::size_t r = 0; r < layout.reports().size(); ++r) {
+                if (not touched(r)) {
+                    continue;
+                }
+                IOReturn const res = device->write_report(r);
+                if (res != kIOReturnSuccess) {
+                    return res;
+                }
+            }
+            return kIOReturnSuccess;
+        }
+
+        using value_callback = void (*)(void *context, element_ref const &element, CFIndex value);
+
+        struct value_watch {
+            value_callback callback;
+            void *context;
+        };
+
+        /// hidraw carries input reports only; LED changes made elsewhere are not seen.
+        static bool can_watch_values(device_ref const &) {
+            return false;
+        }
+
+        static void watch_values(device_ref const &, value_watch *) {}
+
+        static void dispatch_value_changes(device_ref const &, value_watch *) {}
+
+        static bool wait_value_changes(device_ref const *, std::size_t, std::chrono::milliseconds timeout) {
+            std::this_thread::sleep_for(timeout);
+            return false;
+        }
+    };
+
+}
+
+#endif
+
+#endif /* hidraw_hpp */
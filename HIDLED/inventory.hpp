@@ -0,0 +1,321 @@
+//
+//  inventory.hpp
+//  HIDLED
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+#ifndef inventory_hpp
+#define inventory_hpp
+
+#include "discovery.hpp"
+#include "hid_usage.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+namespace spak {
+
+    enum struct inventory_format {
+        /// For people; the format of --list so far.
+        text,
+        /// A single object, {"devices":[...]}, one device per line.
+        json,
+        /// One device object per line.
+        ndjson,
+        /// Length-prefixed little-endian records, see inventory_writer.
+        binary
+    };
+
+    inline bool parse_inventory_format(std::string const &name, inventory_format &format) {
+        if (name == "text") {
+            format = inventory_format::text;
+        } else if (name == "json") {
+            format = inventory_format::json;
+        } else if (name == "ndjson") {
+            format = inventory_format::ndjson;
+        } else if (name == "binary") {
+            format = inventory_format::binary;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+
+    /// Appends @p str to @p out as a quoted JSON string.
+    inline void append_json_string(std::string &out, std::string const &str) {
+        static char const hex[] = "0123456789abcdef";
+        out += '"';
+        for (char c : str) {
+            if (c == '"' or c == '\\') {
+                out += '\\';
+                out += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                out += "\\u00";
+                out += hex[(c >> 4) & 0xF];
+                out += hex[c & 0xF];
+            } else {
+                out += c;
+            }
+        }
+        out += '"';
+    }
+
+
+    /** Writes device reports to a stream as they come, in one of the
+     * inventory formats. Each device is formatted into a buffer and goes to
+     * the stream whole, in one write, as soon as it is reported; the stream's
+     * own buffer batches the syscalls, and only finish() flushes it.
+     *
+     * Every device in json and ndjson is an object with the keys
+     *     index, product, manufacturer, vendor_id, product_id, location_id,
+     *     status ("ok", "cannot_open" or "timed_out"), error (cannot_open only),
+     *     elements: [{index, name, usage_page, usage, usage_name, report_id,
+     *                 logical_min, logical_max, value}]
+     * where usage_name and value are null if unknown or not read.
+     *
+     * The binary format is the magic "HLED", a u16 version (1) and a u16 of
+     * zero, then a record per device, then a u32 of zero. Each record is a
+     * u32 length of what follows, then
+     *     u32 vendor_id, u32 product_id, u32 location_id, u8 status (as in
+     *     device_report::status), i32 open_result, str product,
+     *     str manufacturer, u16 element count, and for each element
+     *     u32 usage_page, u32 usage, u32 report_id, i64 logical_min,
+     *     i64 logical_max, u8 has_value, i64 value, str name
+     * where str is a u16 length and as many bytes of UTF-8. All integers are
+     * little-endian; readers skip what follows the fields they know in a
+     * record, so later versions may append fields.
+     */
+    class inventory_writer {
+        std::ostream &_os;
+        inventory_format _format;
+        std::string _buffer;
+        std::size_t _count;
+
+        void put_uint(uint64_t value, std::size_t bytes) {
+            for (std::size_t i = 0; i < bytes; ++i) {
+                _buffer += static_cast<char>((value >> (8 * i)) & 0xFF);
+            }
+        }
+
+        void put_string(std::string const &str) {
+            std::size_t const length = std::min<std::size_t>(str.size(), 0xFFFF);
+            put_uint(length, 2);
+            _buffer.append(str, 0, length);
+        }
+
+        void put_json_uint(char const *key, uint64_t value) {
+            _buffer += ",\"";
+            _buffer += key;
+            _buffer += "\":";
+            _buffer += std::to_string(value);
+        }
+
+        void put_json_int(char const *key, CFIndex value) {
+            _buffer += ",\"";
+            _buffer += key;
+            _buffer += "\":";
+            _buffer += std::to_string(value);
+        }
+
+        static char const *status_name(device_report::status status) {
+            switch (status) {
+                case device_report::status::ok:
+                    return "ok";
+                case device_report::status::cannot_open:
+                    return "cannot_open";
+                case device_report::status::timed_out:
+                    return "timed_out";
+            }
+            return "unknown";
+        }
+
+        void write_text(device_report const &report) {
+            _buffer += "Device ";
+            if (report.product.empty()) {
+                _buffer += "<unknown>";
+            } else {
+                _buffer += "'" + report.product + "'";
+            }
+            _buffer += " by ";
+            if (report.manufacturer.empty()) {
+                _buffer += "<unknown>";
+            } else {
+                _buffer += "'" + report.manufacturer + "'";
+            }
+            if (report.result == device_report::status::cannot_open) {
+                _buffer += std::string(" (can't be opened: ") + describe_io_return(report.open_result) + ")";
+            } else if (report.result == device_report::status::timed_out) {
+                _buffer += " (timed out)";
+            }
+            _buffer += '\n';
+            for (std::size_t i = 0; i < report.leds.size(); ++i) {
+                led_report const &led = report.leds[i];
+                _buffer += "    Element " + std::to_string(i);
+                if (not led.name.empty()) {
+                    _buffer += " \"" + led.name + "\"";
+                }
+                _buffer += " [" + std::to_string(led.logical_min) + ".." + std::to_string(led.logical_max) + "]";
+                if (led.has_value) {
+                    _buffer += ": " + std::to_string(led.value);
+                }
+                _buffer += '\n';
+            }
+        }
+
+        void write_json(device_report const &report) {
+            _buffer += "{\"index\":" + std::to_string(_count);
+            _buffer += ",\"product\":";
+            append_json_string(_buffer, report.product);
+            _buffer += ",\"manufacturer\":";
+            append_json_string(_buffer, report.manufacturer);
+            put_json_uint("vendor_id", report.vendor_id);
+            put_json_uint("product_id", report.product_id);
+            put_json_uint("location_id", report.location_id);
+            _buffer += ",\"status\":\"";
+            _buffer += status_name(report.result);
+            _buffer += '"';
+            if (report.result == device_report::status::cannot_open) {
+                _buffer += ",\"error\":";
+                append_json_string(_buffer, describe_io_return(report.open_result));
+            }
+            _buffer += ",\"elements\":[";
+            for (std::size_t i = 0; i < report.leds.size(); ++i) {
+                led_report const &led = report.leds[i];
+                if (i > 0) {
+                    _buffer += ',';
+                }
+                _buffer += "{\"index\":" + std::to_string(i);
+                _buffer += ",\"name\":";
+                append_json_string(_buffer, led.name);
+                put_json_uint("usage_page", led.usage_page);
+                put_json_uint("usage", led.usage);
+                _buffer += ",\"usage_name\":";
+                if (char const *name = hid_usage_name_of(led.usage_page, led.usage)) {
+                    append_json_string(_buffer, name);
+                } else {
+                    _buffer += "null";
+                }
+                put_json_uint("report_id", led.report_id);
+                put_json_int("logical_min", led.logical_min);
+                put_json_int("logical_max", led.logical_max);
+                if (led.has_value) {
+                    put_json_int("value", led.value);
+                } else {
+                    _buffer += ",\"value\":null";
+                }
+                _buffer += '}';
+            }
+            _buffer += "]}";
+        }
+
+        void write_binary(device_report const &report) {
+            std::size_t const length_at = _buffer.size();
+            put_uint(0, 4);
+            put_uint(report.vendor_id, 4);
+            put_uint(report.product_id, 4);
+            put_uint(report.location_id, 4);
+            put_uint(static_cast<uint8_t>(report.result), 1);
+            put_uint(static_cast<uint32_t>(report.open_result), 4);
+            put_string(report.product);
+            put_string(report.manufacturer);
+            std::size_t const count = std::min<std::size_t>(report.leds.size(), 0xFFFF);
+            put_uint(count, 2);
+            for (std::size_t i = 0; i < count; ++i) {
+                led_report const &led = report.leds[i];
+                put_uint(led.usage_page, 4);
+                put_uint(led.usage, 4);
+                put_uint(led.report_id, 4);
+                put_uint(static_cast<uint64_t>(static_cast<int64_t>(led.logical_min)), 8);
+                put_uint(static_cast<uint64_t>(static_cast<int64_t>(led.logical_max)), 8);
+                put_uint(led.has_value ? 1 : 0, 1);
+                put_uint(static_cast<uint64_t>(static_cast<int64_t>(led.value)), 8);
+                put_string(led.name);
+            }
+            uint32_t const length = static_cast<uint32_t>(_buffer.size() - length_at - 4);
+            for (std::size_t i = 0; i < 4; ++i) {
+                _buffer[length_at + i] = static_cast<char>((length >> (8 * i)) & 0xFF);
+            }
+        }
+
+        void drain() {
+            _os.write(_buffer.data(), static_cast<std::streamsize>(_buffer.size()));
+            _buffer.clear();
+        }
+
+    public:
+        /// Writes the header of @p format, if it has one, to the buffer; @p capacity is that of the buffer, to begin with.
+        inventory_writer(std::ostream &os, inventory_format format, std::size_t capacity = 4 * 1024) :
+            _os(os), _format(format), _count(0)
+        {
+            _buffer.reserve(capacity);
+            if (_format == inventory_format::json) {
+                _buffer += "{\"devices\":[";
+            } else if (_format == inventory_format::binary) {
+                _buffer += "HLED";
+                put_uint(1, 2);
+                put_uint(0, 2);
+            }
+        }
+
+        inventory_writer(inventory_writer const &) = delete;
+        inventory_writer &operator=(inventory_writer const &) = delete;
+
+        void write(device_report const &report) {
+            switch (_format) {
+                case inventory_format::text:
+                    write_text(report);
+                    break;
+                case inventory_format::json:
+                    _buffer += _count == 0 ? "\n" : ",\n";
+                    write_json(report);
+                    break;
+                case inventory_format::ndjson:
+                    write_json(report);
+                    _buffer += '\n';
+                    break;
+                case inventory_format::binary:
+                    write_binary(report);
+                    break;
+            }
+            ++_count;
+            drain();
+        }
+
+        /// Writes the trailer of the format and everything still buffered, and flushes the stream.
+        void finish() {
+            if (_format == inventory_format::json) {
+                _buffer += "\n]}\n";
+            } else if (_format == inventory_format::binary) {
+                put_uint(0, 4);
+            }
+            drain();
+            _os.flush();
+        }
+
+        std::size_t size() const {
+            return _count;
+        }
+    };
+
+}
+
+#endif /* inventory_hpp */
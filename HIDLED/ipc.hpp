@@ -0,0 +1,453 @@
+//
+//  ipc.hpp
+//  HIDLED
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+#ifndef ipc_hpp
+#define ipc_hpp
+
+#include "hid.hpp"
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace spak {
+
+    /** Wire format, in host byte order since both ends live on the same
+     * machine. Requests may be pipelined: the server answers each of them,
+     * in order, with a response carrying the same id.
+     */
+    enum struct ipc_op : uint8_t {
+        get = 1,
+        set = 2,
+        toggle = 3
+    };
+
+    struct ipc_request {
+        uint32_t id;
+        ipc_op op;
+        /// Index among the LED elements of the device, as in --list.
+        uint8_t led;
+        /// Index among the keyboards the server was started with.
+        uint16_t device;
+        int32_t value;
+    };
+
+    struct ipc_response {
+        uint32_t id;
+        /// An IOReturn; kIOReturnBadArgument for unknown devices, LEDs or operations.
+        int32_t status;
+        /// The LED value after the request.
+        int32_t value;
+    };
+
+    static_assert(sizeof(ipc_request) == 12, "ipc_request is part of the wire format");
+    static_assert(sizeof(ipc_response) == 12, "ipc_response is part of the wire format");
+
+
+    inline std::string ipc_default_socket_path() {
+        if (char const *path = std::getenv("HIDLED_SOCKET")) {
+            return path;
+        }
+        if (char const *runtime_dir = std::getenv("XDG_RUNTIME_DIR")) {
+            return std::string(runtime_dir) + "/hidled.sock";
+        }
+        return "/tmp/hidled-" + std::to_string(::getuid()) + ".sock";
+    }
+
+
+    namespace detail {
+
+        inline bool make_address(std::string const &path, sockaddr_un &addr) {
+            std::memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(addr.sun_path)) {
+                return false;
+            }
+            std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+            return true;
+        }
+
+        inline int make_socket() {
+            int const fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd >= 0) {
+                ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+#if defined(SO_NOSIGPIPE)
+                int const on = 1;
+                ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+            }
+            return fd;
+        }
+
+        inline ssize_t send_some(int fd, char const *data, std::size_t size) {
+#if defined(MSG_NOSIGNAL)
+            return ::send(fd, data, size, MSG_NOSIGNAL);
+#else
+            return ::send(fd, data, size, 0);
+#endif
+        }
+
+    }
+
+
+    /** Serves requests from any number of clients on a single thread, with a
+     * poll() loop. Every complete request in a client's buffer is handled
+     * as soon as it arrives and the responses go out with one send, so that
+     * pipelining clients pay one round trip per batch. Each client gets one
+     * read of at most read_size bytes per poll() round, so that one that
+     * keeps its socket full cannot starve the others. A client that does
+     * not read its responses is no longer read from once max_buffered bytes
+     * of them are waiting, so that it cannot grow the server's memory.
+     *
+     * Handler is called as `ipc_response handler(ipc_request const &)`.
+     */
+    template <class Handler>
+    class ipc_server {
+        struct client {
+            int fd;
+            std::vector<char> in;
+            std::vector<char> out;
+        };
+
+        static constexpr std::size_t max_buffered = 64 * 1024;
+        static constexpr std::size_t read_size = 16 * 1024;
+
+        Handler &_handler;
+        std::string _path;
+        int _listen_fd;
+        int _wake_fds[2];
+        std::vector<client> _clients;
+
+        /// Whether complete requests wait in @p c.in with room for their responses, i.e. work that no poll() event announces.
+        static bool has_pending(client const &c) {
+            return c.in.size() >= sizeof(ipc_request) and c.out.size() < max_buffered;
+        }
+
+        /// Answers the complete requests in @p c.in, until max_buffered bytes of responses wait.
+        void handle(client &c) {
+            std::size_t offset = 0;
+            for (; c.in.size() - offset >= sizeof(ipc_request) and c.out.size() < max_buffered; offset += sizeof(ipc_request)) {
+                ipc_request request;
+                std::memcpy(&request, c.in.data() + offset, sizeof(request));
+                ipc_response const response = _handler(request);
+                char const *bytes = reinterpret_cast<char const *>(&response);
+                c.out.insert(c.out.end(), bytes, bytes + sizeof(response));
+            }
+            c.in.erase(c.in.begin(), c.in.begin() + static_cast<std::ptrdiff_t>(offset));
+        }
+
+        /** One round for @p c: the requests held back, then a single read
+         * if there is room for the responses. Returns false if the client
+         * hung up or failed.
+         */
+        bool serve(client &c) {
+            handle(c);
+            bool alive = true;
+            if (c.out.size() < max_buffered) {
+                char buf[read_size];
+                ssize_t const n = ::recv(c.fd, buf, sizeof(buf), 0);
+                if (n > 0) {
+                    c.in.insert(c.in.end(), buf, buf + n);
+                    handle(c);
+                } else {
+                    alive = n < 0 and (errno == EAGAIN or errno == EWOULDBLOCK or errno == EINTR);
+                }
+            }
+            return flush(c) and alive;
+        }
+
+        /** Whether a server answers at @p addr. A socket file nobody listens
+         * on is left behind by a server that did not exit cleanly.
+         */
+        static bool answers(sockaddr_un const &addr) {
+            int const fd = detail::make_socket();
+            if (fd < 0) {
+                return false;
+            }
+            // Non-blocking, so that a server with a full backlog counts as answering instead of hanging
+            ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+            bool const answered = ::connect(fd, reinterpret_cast<sockaddr const *>(&addr), sizeof(addr)) == 0
+                or errno == EAGAIN or errno == EINPROGRESS;
+            ::close(fd);
+            return answered;
+        }
+
+        bool flush(client &c) {
+            std::size_t sent = 0;
+            while (sent < c.out.size()) {
+                ssize_t const n = detail::send_some(c.fd, c.out.data() + sent, c.out.size() - sent);
+                if (n < 0) {
+                    if (errno == EAGAIN or errno == EWOULDBLOCK or errno == EINTR) {
+                        break;
+                    }
+                    return false;
+                }
+                sent += static_cast<std::size_t>(n);
+            }
+            c.out.erase(c.out.begin(), c.out.begin() + static_cast<std::ptrdiff_t>(sent));
+            return true;
+        }
+
+        void accept_all() {
+            int fd = -1;
+            while ((fd = ::accept(_listen_fd, nullptr, nullptr)) >= 0) {
+                ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+                ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+#if defined(SO_NOSIGPIPE)
+                int const on = 1;
+                ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+                _clients.push_back(client{fd, {}, {}});
+            }
+        }
+
+    public:
+        ipc_server(Handler &handler, std::string path = ipc_default_socket_path()) :
+            _handler(handler), _path(std::move(path)), _listen_fd(-1), _wake_fds{-1, -1}
+        {}
+
+        ipc_server(ipc_server const &) = delete;
+        ipc_server &operator=(ipc_server const &) = delete;
+
+        ~ipc_server() {
+            close();
+        }
+
+        std::string const &path() const {
+            return _path;
+        }
+
+        /** Binds the socket, replacing a stale one left behind at the same
+         * path. Returns an IOReturn, kIOReturnExclusiveAccess if another
+         * server answers there.
+         */
+        IOReturn listen() {
+            sockaddr_un addr;
+            if (not detail::make_address(_path, addr)) {
+                return kIOReturnBadArgument;
+            }
+            if (::pipe(_wake_fds) != 0) {
+                return io_return_from_errno(errno);
+            }
+            for (int fd : _wake_fds) {
+                ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+                ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+            }
+            _listen_fd = detail::make_socket();
+            if (_listen_fd < 0) {
+                return io_return_from_errno(errno);
+            }
+            ::fcntl(_listen_fd, F_SETFL, ::fcntl(_listen_fd, F_GETFL) | O_NONBLOCK);
+            struct stat st;
+            if (::lstat(_path.c_str(), &st) == 0 and S_ISSOCK(st.st_mode)) {
+                if (answers(addr)) {
+                    // Not ours to unlink in close()
+                    ::close(_listen_fd);
+                    _listen_fd = -1;
+                    close();
+                    return kIOReturnExclusiveAccess;
+                }
+                ::unlink(_path.c_str());
+            }
+            if (::bind(_listen_fd, reinterpret_cast<sockaddr const *>(&addr), sizeof(addr)) != 0
+                or ::listen(_listen_fd, SOMAXCONN) != 0)
+            {
+                IOReturn const res = io_return_from_errno(errno);
+                close();
+                return res;
+            }
+            return kIOReturnSuccess;
+        }
+
+        /// Serves clients until stop() is called.
+        void run() {
+            std::vector<pollfd> fds;
+            while (true) {
+                fds.clear();
+                fds.push_back(pollfd{_wake_fds[0], POLLIN, 0});
+                fds.push_back(pollfd{_listen_fd, POLLIN, 0});
+                bool pending = false;
+                for (client const &c : _clients) {
+                    short const events = static_cast<short>((c.out.size() < max_buffered ? POLLIN : 0) | (c.out.empty() ? 0 : POLLOUT));
+                    fds.push_back(pollfd{c.fd, events, 0});
+                    pending = pending or has_pending(c);
+                }
+                // Requests left over from the last round are served without waiting, but after a look at the others
+                if (::poll(fds.data(), static_cast<nfds_t>(fds.size()), pending ? 0 : -1) < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    break;
+                }
+                if (fds[0].revents != 0) {
+                    break;
+                }
+                // Clients first: fds[2 + i] refers to _clients[i] only until accept_all appends to it
+                for (std::size_t i = _clients.size(); i-- > 0;) {
+                    short const revents = fds[2 + i].revents;
+                    bool alive = true;
+                    // Once responses drain, serve() takes on the requests held back meanwhile
+                    if ((revents & (POLLIN | POLLOUT | POLLHUP | POLLERR)) or has_pending(_clients[i])) {
+                        alive = serve(_clients[i]);
+                    }
+                    if (not alive) {
+                        ::close(_clients[i].fd);
+                        _clients.erase(_clients.begin() + static_cast<std::ptrdiff_t>(i));
+                    }
+                }
+                if (fds[1].revents & POLLIN) {
+                    accept_all();
+                }
+            }
+        }
+
+        /// Makes run() return; safe to call from another thread or a signal handler.
+        void stop() {
+            char const c = 0;
+            if (::write(_wake_fds[1], &c, 1) < 0) {
+                // Already signaled
+            }
+        }
+
+        void close() {
+            for (client const &c : _clients) {
+                ::close(c.fd);
+            }
+            _clients.clear();
+            if (_listen_fd >= 0) {
+                ::close(_listen_fd);
+                ::unlink(_path.c_str());
+                _listen_fd = -1;
+            }
+            for (int &fd : _wake_fds) {
+                if (fd >= 0) {
+                    ::close(fd);
+                    fd = -1;
+                }
+            }
+        }
+    };
+
+
+    /** Blocking client. Requests can be sent in bulk with send() and the
+     * responses collected later with receive(), or one at a time with the
+     * convenience calls.
+     */
+    class ipc_client {
+        int _fd;
+        uint32_t _next_id;
+
+        bool transfer(char *data, std::size_t size, bool sending) {
+            while (size > 0) {
+                ssize_t const n = sending ? detail::send_some(_fd, data, size) : ::recv(_fd, data, size, 0);
+                if (n < 0 and errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    return false;
+                }
+                data += n;
+                size -= static_cast<std::size_t>(n);
+            }
+            return true;
+        }
+
+        IOReturn call(ipc_op op, uint16_t device, uint8_t led, CFIndex value, CFIndex *result) {
+            ipc_request const request{_next_id++, op, led, device, static_cast<int32_t>(value)};
+            ipc_response response;
+            if (not send(&request, 1) or not receive(&response, 1) or response.id != request.id) {
+                return kIOReturnIPCError;
+            }
+            if (result != nullptr) {
+                *result = response.value;
+            }
+            return response.status;
+        }
+
+    public:
+        ipc_client() : _fd(-1), _next_id(0) {}
+
+        ipc_client(ipc_client const &) = delete;
+        ipc_client &operator=(ipc_client const &) = delete;
+
+        ~ipc_client() {
+            close();
+        }
+
+        IOReturn connect(std::string const &path = ipc_default_socket_path()) {
+            close();
+            sockaddr_un addr;
+            if (not detail::make_address(path, addr)) {
+                return kIOReturnBadArgument;
+            }
+            _fd = detail::make_socket();
+            if (_fd < 0 or ::connect(_fd, reinterpret_cast<sockaddr const *>(&addr), sizeof(addr)) != 0) {
+                IOReturn const res = io_return_from_errno(errno);
+                close();
+                return res;
+            }
+            return kIOReturnSuccess;
+        }
+
+        bool is_connected() const {
+            return _fd >= 0;
+        }
+
+        void close() {
+            if (_fd >= 0) {
+                ::close(_fd);
+                _fd = -1;
+            }
+        }
+
+        bool send(ipc_request const *requests, std::size_t count) {
+            return transfer(reinterpret_cast<char *>(const_cast<ipc_request *>(requests)), count * sizeof(ipc_request), true);
+        }
+
+        bool receive(ipc_response *responses, std::size_t count) {
+            return transfer(reinterpret_cast<char *>(responses), count * sizeof(ipc_response), false);
+        }
+
+        IOReturn get(uint16_t device, uint8_t led, CFIndex &value) {
+            return call(ipc_op::get, device, led, 0, &value);
+        }
+
+        IOReturn set(uint16_t device, uint8_t led, CFIndex value) {
+            return call(ipc_op::set, device, led, value, nullptr);
+        }
+
+        IOReturn toggle(uint16_t device, uint8_t led, CFIndex *new_value = nullptr) {
+            return call(ipc_op::toggle, device, led, 0, new_value);
+        }
+    };
+
+}
+
+#endif /* ipc_hpp */
@@ -0,0 +1,114 @@
+//
+//  led_server.hpp
+//  HIDLED
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+#ifndef led_server_hpp
+#define led_server_hpp
+
+#include "hid.hpp"
+#include "ipc.hpp"
+#include <memory>
+#include <vector>
+
+namespace spak {
+
+    /** Answers IPC requests for the keyboards it holds open: devices are
+     * numbered in the order the enumerator yields the matching ones, LEDs as
+     * in --list. The shadow registers watch every keyboard, so that a get is
+     * answered without a device read once nothing changed underneath.
+     */
+    template <class Backend = native_backend>
+    class basic_led_server {
+        struct keyboard {
+            basic_hid_device<Backend> device;
+            basic_hid_device_opener<Backend> opener;
+            basic_hid_device_elements_enumerator<Backend> elements;
+
+            keyboard(basic_hid_device<Backend> const &d) : device(d), opener(device.open()), elements(device.elements(kHIDPage_LEDs)) {
+                device.shadow().watch();
+            }
+        };
+
+        std::vector<std::unique_ptr<keyboard>> _keyboards;
+
+    public:
+        basic_led_server(basic_hid_device_enumerator<Backend> &enumerator, basic_hid_device_matcher<Backend> const &matcher) {
+            for (basic_hid_device<Backend> const &device : enumerator) {
+                if (device.matches(matcher)) {
+                    _keyboards.push_back(std::make_unique<keyboard>(device));
+                }
+            }
+        }
+
+        basic_led_server(basic_led_server const &) = delete;
+        basic_led_server &operator=(basic_led_server const &) = delete;
+
+        std::size_t size() const {
+            return _keyboards.size();
+        }
+
+        ipc_response operator()(ipc_request const &request) {
+            ipc_response response{request.id, kIOReturnSuccess, 0};
+            if (request.device >= _keyboards.size() or request.led >= _keyboards[request.device]->elements.size()) {
+                response.status = kIOReturnBadArgument;
+                return response;
+            }
+            keyboard &kbd = *_keyboards[request.device];
+            if (not kbd.opener.is_open()) {
+                response.status = kbd.opener.result();
+                return response;
+            }
+            kbd.device.shadow().sync();
+            basic_hid_device_element<Backend> &element = kbd.elements[request.led];
+            hid_result<CFIndex> const current = element.template value<CFIndex>().get();
+            if (not current) {
+                response.status = current.error();
+                return response;
+            }
+            CFIndex value = current.value();
+            switch (request.op) {
+                case ipc_op::get:
+                    break;
+                case ipc_op::set:
+                case ipc_op::toggle: {
+                    CFIndex const new_value = request.op == ipc_op::set ? request.value
+                        : value == element.logical_min() ? element.logical_max() : element.logical_min();
+                    response.status = kbd.device.transaction().stage(element, new_value).commit();
+                    if (response.status == kIOReturnSuccess) {
+                        value = new_value;
+                    }
+                    break;
+                }
+                default:
+                    response.status = kIOReturnBadArgument;
+                    break;
+            }
+            response.value = static_cast<int32_t>(value);
+            return response;
+        }
+    };
+
+    using led_server = basic_led_server<native_backend>;
+
+}
+
+#endif /* led_server_hpp */
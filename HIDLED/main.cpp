@@ -24,76 +24,167 @@
 //  IN THE SOFTWARE.
 //
 
+#include <csignal>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <sstream>
 #include "hid.hpp"
+#include "hid_index.hpp"
+#include "hid_registry.hpp"
+#include "hid_usage.hpp"
+#include "ipc.hpp"
+#include "led_server.hpp"
+#include "batch.hpp"
+#include "discovery.hpp"
+#include "inventory.hpp"
+#include "broadcast.hpp"
+#include "monitor.hpp"
+#include "animation.hpp"
+#include "profile.hpp"
 
-void list(spak::hid_device_enumerator &enumerator) {
-    for (auto &device : enumerator) {
-        std::string const manu = device.manufacturer();
-        std::string const prod = device.product();
-        std::cout << "Device ";
-        if (prod.empty()) {
-            std::cout << "<unknown>";
-        } else {
-            std::cout << "'" << prod << "'";
-        }
-        std::cout << " by ";
-        if (manu.empty()) {
-            std::cout << "<unknown>";
-        } else {
-            std::cout << "'" << manu << "'";
+void list(spak::hid_device_enumerator &enumerator, spak::device_discovery const &discovery, spak::inventory_format format) {
+    spak::inventory_writer writer(std::cout, format);
+    discovery.discover(enumerator, [&](spak::device_report &&report) { writer.write(report); });
+    writer.finish();
+}
+
+std::unique_ptr<spak::hid_device> match_keyboard(spak::hid_device_enumerator &enumerator, std::string const &match_prod = "", std::string const &match_manu = "") {
+    if (spak::hid_device *device = enumerator.find(spak::hid_device_matcher(match_prod, match_manu))) {
+        return std::make_unique<spak::hid_device>(*device);
+    }
+    return nullptr;
+}
+
+
+/** Finds keyboards through the device index first, and falls back to a full
+ * scan (once per process) when the index has no match or a stale one.
+ */
+class keyboard_resolver {
+    spak::hid_device_enumerator _enumerator;
+    spak::hid_device_index _index;
+    bool _scanned;
+public:
+    struct match {
+        std::unique_ptr<spak::hid_device> device;
+        /// Only set if the device was found through the index.
+        std::unique_ptr<spak::hid_index_record> record;
+    };
+    
+    keyboard_resolver() : _enumerator(spak::defer_scan), _scanned(false) {}
+    
+    void rescan() {
+        if (not _scanned) {
+            _enumerator.scan(kHIDPage_GenericDesktop, kHIDUsage_GD_Keyboard);
+            _index.rebuild(_enumerator);
+            _scanned = true;
         }
-        
-        spak::hid_device_opener opener = device.open();
-        if (not opener.is_open()) {
-            std::cout << " (can't be opened: " << spak::describe_io_return(opener.result()) << ")";
-        }
-        std::cout << std::endl;
-        
-        std::size_t elm_idx = 0;
-        for (auto &element : device.elements(kHIDPage_LEDs)) {
-            std::cout << "    Element " << elm_idx ;
-            std::string const name = element.name();
-            if (not name.empty()) {
-                std::cout << " \"" << name << "\"";
-            }
-            std::cout << " [" << element.logical_min() << ".." << element.logical_max() << "]";
-            if (opener.is_open()) {
-                try {
-                    CFIndex const value = element.value<CFIndex>();
-                    std::cout << ": " << value;
-                } catch (...) {
-                    // Pass
+    }
+    
+    match find(std::string const &match_prod, std::string const &match_manu) {
+        if (not _scanned) {
+            if (spak::hid_index_record const *record = _index.find(match_prod, match_manu)) {
+                if (spak::hid_device *device = spak::hid_device_index::attach(*record, _enumerator)) {
+                    return {std::make_unique<spak::hid_device>(*device), std::make_unique<spak::hid_index_record>(*record)};
                 }
             }
-            std::cout << std::endl;
-            ++elm_idx;
         }
+        rescan();
+        return {match_keyboard(_enumerator, match_prod, match_manu), nullptr};
     }
-}
+};
 
-std::unique_ptr<spak::hid_device> match_keyboard(spak::hid_device_enumerator &enumerator, std::string const &match_prod = "", std::string const &match_manu = "") {
-    for (auto device : enumerator) {
-        std::string const manu = device.manufacturer();
-        std::string const prod = device.product();
-        if (not match_manu.empty() and manu != match_manu) {
-            continue;
-        }
-        if (not match_prod.empty() and prod != match_prod) {
-            continue;
-        }
-        return std::make_unique<spak::hid_device>(std::move(device));
+
+void report_keyboard_not_found(std::string const &match_prod, std::string const &match_manu) {
+    std::cerr << "Unable to find a keyboard matching";
+    if (not match_prod.empty()) {
+        std::cerr << " product '" << match_prod << "'";
     }
-    return nullptr;
+    if (not match_manu.empty()) {
+        std::cerr << " manufacturer '" << match_manu << "'";
+    }
+    std::cerr << "." << std::endl;
 }
 
 
 void help() {
     std::cout << "Usage: <program> --help" << std::endl;
-    std::cout << "       <program> [--list]" << std::endl;
-    std::cout << "       <program> [--product <product>] [--manufacturer <manufacturer>] --toggle <led_idx>" << std::endl;
-    std::cout << "       <program> [--product <product>] [--manufacturer <manufacturer>] --set <led_idx> <value>" << std::endl;
+    std::cout << "       <program> [--jobs <n>] [--timeout <ms>] [--format text|json|ndjson|binary] [--values|--no-values] [--list]" << std::endl;
+    std::cout << "       <program> [--product <product>] [--manufacturer <manufacturer>] --toggle <led>" << std::endl;
+    std::cout << "       <program> [--product <product>] [--manufacturer <manufacturer>] --set <led> <value>" << std::endl;
+    std::cout << "       <program> [--product <product>] [--manufacturer <manufacturer>] [--shadow-ttl <ms>] --daemon" << std::endl;
+    std::cout << "       <program> [--product <product>] [--manufacturer <manufacturer>] --batch [<command>...]" << std::endl;
+    std::cout << "       <program> [--product <product>] [--manufacturer <manufacturer>] [--rate <hz>] [--duration <ms>]" << std::endl;
+    std::cout << "                 --animate <led_idx> <pattern> [--animate <led_idx> <pattern>...]" << std::endl;
+    std::cout << "       <program> [--product <product>] [--manufacturer <manufacturer>] [--socket <path>] --serve" << std::endl;
+    std::cout << "       <program> [--product <product>] [--manufacturer <manufacturer>] [--timeout <ms>] --broadcast --toggle <led>" << std::endl;
+    std::cout << "       <program> [--product <product>] [--manufacturer <manufacturer>] [--timeout <ms>] --broadcast --set <led> <value>" << std::endl;
+    std::cout << "       <program> [--product <product>] [--manufacturer <manufacturer>] [--interval <ms>] [--timeout <ms>] --mirror" << std::endl;
+    std::cout << "       <program> [--product <product>] [--manufacturer <manufacturer>] [--coalesce <ms>] --watch" << std::endl;
+    std::cout << "       <program> [--product <product>] [--manufacturer <manufacturer>] [--rate <hz>] [--duration <ms>] --profile <file>" << std::endl;
+    std::cout << std::endl;
+    std::cout << "<led> is either the index of the LED, as shown by --list, or its usage name: num_lock, caps_lock," << std::endl;
+    std::cout << "scroll_lock, compose, kana, mute, microphone, ... (HID LED page, in snake case)." << std::endl;
+    std::cout << std::endl;
+    std::cout << "Any of the above also accepts --stats, to print latency statistics of the device operations" << std::endl;
+    std::cout << "to stderr on exit, and --trace <file>, to save them as a Chrome trace (chrome://tracing)." << std::endl;
+    std::cout << std::endl;
+    std::cout << "Devices are listed in parallel on --jobs threads (default: one per core); a device that takes" << std::endl;
+    std::cout << "longer than --timeout milliseconds (default 2000) is reported as timed out. With --format other" << std::endl;
+    std::cout << "than text, each device is written as it is done, with its vendor and product IDs and, for each" << std::endl;
+    std::cout << "LED, the usage page, usage, report ID and logical range; see inventory.hpp for the schemas." << std::endl;
+    std::cout << "The current values of the LEDs take opening the devices: they are read by default only in" << std::endl;
+    std::cout << "text format, and --values or --no-values override that." << std::endl;
+    std::cout << std::endl;
+    std::cout << "With --broadcast, the LED is written on every matching keyboard at once, rather than on the" << std::endl;
+    std::cout << "first one; keyboards that take longer than --timeout milliseconds are reported as timed out." << std::endl;
+    std::cout << std::endl;
+    std::cout << "In mirror mode, the LEDs of the keyboard selected by --product and --manufacturer are copied" << std::endl;
+    std::cout << "to all the other keyboards until interrupted. The keyboard reports its changes, or where it" << std::endl;
+    std::cout << "cannot, is polled every --interval milliseconds (default 20); each change is given --timeout" << std::endl;
+    std::cout << "milliseconds to propagate." << std::endl;
+    std::cout << std::endl;
+    std::cout << "In watch mode, the LEDs of the matching keyboards are followed until interrupted, and printed" << std::endl;
+    std::cout << "as one JSON object per line: first their current values, then each change, e.g." << std::endl;
+    std::cout << "    {\"time\":1700000000123456,\"device\":0,\"product\":\"USB Keyboard\",\"led\":1,\"usage\":\"caps_lock\",\"value\":1}" << std::endl;
+    std::cout << "where time is in microseconds since the epoch. Changes arriving within --coalesce" << std::endl;
+    std::cout << "milliseconds of each other (default 0, only those arriving together) are reported once." << std::endl;
+    std::cout << std::endl;
+    std::cout << "In daemon mode, the device is kept open and commands are read from stdin, one per line:" << std::endl;
+    std::cout << "    toggle <led_idx>" << std::endl;
+    std::cout << "    set <led_idx> <value>" << std::endl;
+    std::cout << "    quit" << std::endl;
+    std::cout << "Each command is answered with 'ok' or 'error: <reason>'. LED values are remembered for" << std::endl;
+    std::cout << "--shadow-ttl milliseconds (default 5000, 0 to always read them back from the device), unless" << std::endl;
+    std::cout << "the keyboard reports they changed in the meantime." << std::endl;
+    std::cout << "If the keyboard is unplugged, commands fail until it is back; the LED values set so far" << std::endl;
+    std::cout << "are then restored." << std::endl;
+    std::cout << std::endl;
+    std::cout << "In server mode, the matching keyboards are kept open and requests are served over a Unix" << std::endl;
+    std::cout << "socket (default $HIDLED_SOCKET, $XDG_RUNTIME_DIR/hidled.sock or /tmp/hidled-<uid>.sock)," << std::endl;
+    std::cout << "see ipc.hpp for the protocol and a client. Keyboards are numbered in the order of --list." << std::endl;
+    std::cout << std::endl;
+    std::cout << "In batch mode, the commands follow --batch, or are read from stdin if there are none:" << std::endl;
+    std::cout << "    <selector> <led_idx> toggle" << std::endl;
+    std::cout << "    <selector> <led_idx> set <value>" << std::endl;
+    std::cout << "where <selector> is '*' for the keyboard selected by --product and --manufacturer, or" << std::endl;
+    std::cout << "one or both of product=<product> manufacturer=<manufacturer>. Each keyboard is opened" << std::endl;
+    std::cout << "once and its commands are applied in order." << std::endl;
+    std::cout << std::endl;
+    std::cout << "A profile describes the state the LEDs should be in, one rule per line:" << std::endl;
+    std::cout << "    <selector> <led> <pattern>" << std::endl;
+    std::cout << "where <selector> is as in batch mode but applies to every matching keyboard, <led> is a usage" << std::endl;
+    std::cout << "name and <pattern> an animation pattern; later rules override earlier ones. Only the LEDs that" << std::endl;
+    std::cout << "differ from the profile are written. If any LED is animated, the animations then play for" << std::endl;
+    std::cout << "--duration milliseconds, or until interrupted. Read from stdin if <file> is '-'." << std::endl;
+    std::cout << std::endl;
+    std::cout << "Animation patterns (times in milliseconds, default rate 100 Hz, at most 5000 Hz):" << std::endl;
+    std::cout << "    on | off | <value>" << std::endl;
+    std::cout << "    blink:<on>:<off>" << std::endl;
+    std::cout << "    pwm:<duty_percent>:<period>" << std::endl;
+    std::cout << "    breathe:<period>[:<steps>]" << std::endl;
+    std::cout << "    seq:<value>@<time>,<value>@<time>,...[,loop]" << std::endl;
 }
 
 
@@ -103,6 +194,13 @@ struct cmdline {
         list,
         toggle,
         set,
+        daemon,
+        batch,
+        animate,
+        serve,
+        mirror,
+        watch,
+        profile,
         help,
         wrong_cmd_line
     };
@@ -111,17 +209,212 @@ struct cmdline {
     std::string match_manufacturer;
     std::string match_product;
     std::size_t element;
+    /// Set instead of element when the LED is given by name.
+    uint32_t element_usage;
     CFIndex value;
+    std::vector<std::string> batch_tokens;
+    std::vector<std::pair<std::size_t, std::string>> animations;
+    unsigned rate_hz;
+    /// Beyond that the tick is shorter than any LED write.
+    static constexpr long max_rate_hz = 5000;
+    long duration_ms;
+    long shadow_ttl_ms;
+    std::string socket_path;
+    std::size_t jobs;
+    long timeout_ms;
+    bool stats;
+    std::string trace_path;
+    bool broadcast;
+    long interval_ms;
+    long coalesce_ms;
+    std::string profile_path;
+    spak::inventory_format format;
+    /// Whether --list opens the devices to read the LED values; by default only for text.
+    enum struct value_reads {
+        by_format,
+        read,
+        skip
+    } list_values;
     
-    cmdline() : action(actions::list), element(std::numeric_limits<std::size_t>::max()), value(0) {}
+    cmdline() : action(actions::list), element(std::numeric_limits<std::size_t>::max()), element_usage(0), value(0), rate_hz(100), duration_ms(-1), shadow_ttl_ms(-1),
+        jobs(spak::device_discovery::default_workers()), timeout_ms(2000), stats(false),
+        broadcast(false), interval_ms(20), coalesce_ms(0), format(spak::inventory_format::text), list_values(value_reads::by_format) {}
+    
+    bool read_list_values() const {
+        return list_values == value_reads::by_format ? format == spak::inventory_format::text : list_values == value_reads::read;
+    }
+    
+    /// An LED is either its index among the LED elements, or a usage name such as "caps_lock".
+    void parse_led(std::string const &arg, int argn) {
+        std::stringstream ss_idx(arg);
+        if (ss_idx >> element and ss_idx.eof()) {
+            return;
+        }
+        element_usage = spak::hid_led_usage_by_name(arg.c_str());
+        if (element_usage == 0) {
+            std::cerr << "Invalid LED '" << arg << "' at position " << argn << std::endl;
+            action = actions::wrong_cmd_line;
+        }
+    }
     
     void parse(int argc, const char * argv[]) {
+        // An action given after a wrong argument must not hide it
+        bool wrong = false;
         for (int argn = 1; argn < argc; ++argn) {
+            wrong = wrong or action == actions::wrong_cmd_line;
             std::string const arg = argv[argn];
             if (arg == "-h" or arg == "--help") {
                 action = actions::help;
             } else if (arg == "-l" or arg == "--list") {
                 action = actions::list;
+            } else if (arg == "-d" or arg == "--daemon") {
+                action = actions::daemon;
+            } else if (arg == "-j" or arg == "--jobs") {
+                if (argn >= argc - 1) {
+                    std::cerr << "Missing argument 'jobs' at position " << argn + 1 << std::endl;
+                    action = actions::wrong_cmd_line;
+                    continue;
+                }
+                std::stringstream ss_jobs(argv[++argn]);
+                if (not (ss_jobs >> jobs) or jobs == 0) {
+                    std::cerr << "Invalid number of jobs '" << argv[argn] << "' at position " << argn << std::endl;
+                    action = actions::wrong_cmd_line;
+                }
+            } else if (arg == "--timeout") {
+                if (argn >= argc - 1) {
+                    std::cerr << "Missing argument 'timeout' at position " << argn + 1 << std::endl;
+                    action = actions::wrong_cmd_line;
+                    continue;
+                }
+                std::stringstream ss_timeout(argv[++argn]);
+                if (not (ss_timeout >> timeout_ms) or timeout_ms <= 0) {
+                    std::cerr << "Invalid timeout '" << argv[argn] << "' at position " << argn << std::endl;
+                    action = actions::wrong_cmd_line;
+                }
+            } else if (arg == "--format" or arg.compare(0, 9, "--format=") == 0) {
+                std::string name;
+                if (arg.size() > 8) {
+                    name = arg.substr(9);
+                } else if (argn < argc - 1) {
+                    name = argv[++argn];
+                } else {
+                    std::cerr << "Missing argument 'format' at position " << argn + 1 << std::endl;
+                    action = actions::wrong_cmd_line;
+                    continue;
+                }
+                if (not spak::parse_inventory_format(name, format)) {
+                    std::cerr << "Invalid format '" << name << "' at position " << argn << std::endl;
+                    action = actions::wrong_cmd_line;
+                }
+            } else if (arg == "--values") {
+                list_values = value_reads::read;
+            } else if (arg == "--no-values") {
+                list_values = value_reads::skip;
+            } else if (arg == "--stats") {
+                stats = true;
+            } else if (arg == "--trace") {
+                if (argn >= argc - 1) {
+                    std::cerr << "Missing argument 'trace file' at position " << argn + 1 << std::endl;
+                    action = actions::wrong_cmd_line;
+                    continue;
+                }
+                trace_path = argv[++argn];
+            } else if (arg == "--serve") {
+                action = actions::serve;
+            } else if (arg == "--broadcast") {
+                broadcast = true;
+            } else if (arg == "--mirror") {
+                action = actions::mirror;
+            } else if (arg == "-w" or arg == "--watch") {
+                action = actions::watch;
+            } else if (arg == "--profile") {
+                if (argn >= argc - 1) {
+                    std::cerr << "Missing argument 'profile' at position " << argn + 1 << std::endl;
+                    action = actions::wrong_cmd_line;
+                    continue;
+                }
+                action = actions::profile;
+                profile_path = argv[++argn];
+            } else if (arg == "--coalesce") {
+                if (argn >= argc - 1) {
+                    std::cerr << "Missing argument 'coalesce' at position " << argn + 1 << std::endl;
+                    action = actions::wrong_cmd_line;
+                    continue;
+                }
+                std::stringstream ss_coalesce(argv[++argn]);
+                if (not (ss_coalesce >> coalesce_ms) or coalesce_ms < 0) {
+                    std::cerr << "Invalid coalescing window '" << argv[argn] << "' at position " << argn << std::endl;
+                    action = actions::wrong_cmd_line;
+                }
+            } else if (arg == "--interval") {
+                if (argn >= argc - 1) {
+                    std::cerr << "Missing argument 'interval' at position " << argn + 1 << std::endl;
+                    action = actions::wrong_cmd_line;
+                    continue;
+                }
+                std::stringstream ss_interval(argv[++argn]);
+                if (not (ss_interval >> interval_ms) or interval_ms <= 0) {
+                    std::cerr << "Invalid interval '" << argv[argn] << "' at position " << argn << std::endl;
+                    action = actions::wrong_cmd_line;
+                }
+            } else if (arg == "--socket") {
+                if (argn >= argc - 1) {
+                    std::cerr << "Missing argument 'socket path' at position " << argn + 1 << std::endl;
+                    action = actions::wrong_cmd_line;
+                    continue;
+                }
+                socket_path = argv[++argn];
+            } else if (arg == "-a" or arg == "--animate") {
+                if (argn >= argc - 2) {
+                    std::cerr << "Missing arguments 'element index' and 'pattern' at position " << argn + 1 << std::endl;
+                    action = actions::wrong_cmd_line;
+                    continue;
+                }
+                action = actions::animate;
+                std::size_t anim_element = std::numeric_limits<std::size_t>::max();
+                std::stringstream ss_idx(argv[++argn]);
+                ss_idx >> anim_element;
+                animations.emplace_back(anim_element, argv[++argn]);
+            } else if (arg == "-r" or arg == "--rate") {
+                if (argn >= argc - 1) {
+                    std::cerr << "Missing argument 'rate' at position " << argn + 1 << std::endl;
+                    action = actions::wrong_cmd_line;
+                    continue;
+                }
+                std::stringstream ss_rate(argv[++argn]);
+                long rate = 0;
+                if (not (ss_rate >> rate) or not ss_rate.eof() or rate <= 0 or rate > max_rate_hz) {
+                    std::cerr << "Invalid rate '" << argv[argn] << "' at position " << argn << std::endl;
+                    action = actions::wrong_cmd_line;
+                } else {
+                    rate_hz = static_cast<unsigned>(rate);
+                }
+            } else if (arg == "--duration") {
+                if (argn >= argc - 1) {
+                    std::cerr << "Missing argument 'duration' at position " << argn + 1 << std::endl;
+                    action = actions::wrong_cmd_line;
+                    continue;
+                }
+                std::stringstream ss_duration(argv[++argn]);
+                if (not (ss_duration >> duration_ms) or not ss_duration.eof() or duration_ms < 0) {
+                    std::cerr << "Invalid duration '" << argv[argn] << "' at position " << argn << std::endl;
+                    action = actions::wrong_cmd_line;
+                }
+            } else if (arg == "--shadow-ttl") {
+                if (argn >= argc - 1) {
+                    std::cerr << "Missing argument 'ttl' at position " << argn + 1 << std::endl;
+                    action = actions::wrong_cmd_line;
+                    continue;
+                }
+                std::stringstream ss_ttl(argv[++argn]);
+                if (not (ss_ttl >> shadow_ttl_ms) or shadow_ttl_ms < 0) {
+                    std::cerr << "Invalid TTL '" << argv[argn] << "' at position " << argn << std::endl;
+                    action = actions::wrong_cmd_line;
+                }
+            } else if (arg == "-b" or arg == "--batch") {
+                action = actions::batch;
+                batch_tokens.assign(argv + argn + 1, argv + argc);
+                break;
             } else if (arg == "-p" or arg == "--product") {
                 if (argn >= argc - 1) {
                     std::cerr << "Missing argument 'product' at position " << argn + 1 << std::endl;
@@ -143,8 +436,8 @@ struct cmdline {
                     continue;
                 }
                 action = actions::set;
-                std::stringstream ss_idx(argv[++argn]);
-                ss_idx >> element;
+                ++argn;
+                parse_led(argv[argn], argn);
                 if (argn >= argc - 1) {
                     std::cerr << "Missing argument 'value' at position " << argn + 1 << std::endl;
                     action = actions::wrong_cmd_line;
@@ -159,14 +452,16 @@ struct cmdline {
                     continue;
                 }
                 action = actions::toggle;
-                std::stringstream ss_idx(argv[++argn]);
-                ss_idx >> element;
+                ++argn;
+                parse_led(argv[argn], argn);
             } else {
                 std::cerr << "Unknown switch or argument '" << arg << "' at position " << argn << std::endl;
                 action = actions::wrong_cmd_line;
             }
         }
-        
+        if (wrong) {
+            action = actions::wrong_cmd_line;
+        }
     }
 };
 
@@ -178,14 +473,553 @@ namespace return_code {
     static constexpr int cannot_open_device = 3;
     static constexpr int led_not_found = 4;
     static constexpr int unknown_error = 5;
+    static constexpr int write_failed = 6;
+}
+
+
+CFIndex toggled(spak::hid_device_element const &element, CFIndex value) {
+    return value == element.logical_min() ? element.logical_max() : element.logical_min();
+}
+
+
+spak::hid_result<void> apply(spak::hid_device_element &element, cmdline::actions action, CFIndex new_value) {
+    spak::hid_device_element_value<CFIndex> value = element.value<CFIndex>();
+    if (action == cmdline::actions::toggle) {
+        spak::hid_result<CFIndex> const current = value.get();
+        if (not current) {
+            return current.error();
+        }
+        new_value = toggled(element, current.value());
+    }
+    return value.set(new_value);
+}
+
+
+int report_io(spak::hid_result<void> const &res) {
+    if (not res) {
+        std::cerr << "Could not access the device: " << res.describe() << std::endl;
+        return return_code::write_failed;
+    }
+    return return_code::ok;
+}
+
+
+int apply(spak::hid_device_elements_enumerator &elements, cmdline::actions action, std::size_t element_idx, CFIndex new_value) {
+    if (element_idx >= elements.size()) {
+        std::cerr << "Device has only " << elements.size() << " LED elements, cannot find LED number " << element_idx << std::endl;
+        return return_code::led_not_found;
+    }
+    return report_io(apply(elements[element_idx], action, new_value));
+}
+
+
+int apply_usage(spak::hid_device &device, cmdline::actions action, uint32_t usage, CFIndex new_value) {
+    spak::hid_device_element *element = device.element(kHIDPage_LEDs, usage);
+    if (element == nullptr) {
+        std::cerr << "Device has no " << spak::hid_led_usage_name(usage) << " LED" << std::endl;
+        return return_code::led_not_found;
+    }
+    return report_io(apply(*element, action, new_value));
+}
+
+
+/// Position of the first LED with @p usage in @p record, or max_leds if there is none.
+std::size_t find_led_usage(spak::hid_index_record const &record, uint32_t usage) {
+    for (std::size_t i = 0; i < record.led_count; ++i) {
+        if (record.led_usages[i] == usage) {
+            return i;
+        }
+    }
+    return spak::hid_index_record::max_leds;
+}
+
+
+/// The keyboard the daemon is talking to, held open for as long as it stays connected.
+struct daemon_keyboard {
+    spak::hid_device_registry<>::snapshot_ptr snapshot;
+    uint64_t native_id;
+    spak::hid_device device;
+    spak::hid_device_identity identity;
+    spak::hid_device_opener opener;
+    spak::hid_device_elements_enumerator elements;
+    
+    daemon_keyboard(spak::hid_device_registry<>::snapshot_ptr devices, spak::hid_registry_entry const &entry) :
+        snapshot(std::move(devices)),
+        native_id(entry.native_id),
+        device(entry.device),
+        identity(device.identity()),
+        opener(device.open()),
+        elements(device.elements(kHIDPage_LEDs))
+    {
+        // Toggles read the shadow registers unless the keyboard reported a change.
+        device.shadow().watch();
+    }
+};
+
+
+/// Follows the keyboard across reconnections; returns nullptr while none matches.
+daemon_keyboard *connect(spak::hid_device_registry<> &registry, cmdline const &cmd, std::unique_ptr<daemon_keyboard> &keyboard) {
+    spak::hid_device_registry<>::snapshot_ptr devices = registry.devices();
+    if (keyboard != nullptr and keyboard->snapshot == devices) {
+        return keyboard.get();
+    }
+    for (spak::hid_registry_entry const &entry : *devices) {
+        if (keyboard != nullptr and entry.native_id == keyboard->native_id) {
+            keyboard->snapshot = std::move(devices);
+            return keyboard.get();
+        }
+    }
+    keyboard = nullptr;
+    spak::hid_device_matcher const matcher(cmd.match_product, cmd.match_manufacturer);
+    for (spak::hid_registry_entry const &entry : *devices) {
+        if (not entry.device.matches(matcher)) {
+            continue;
+        }
+        keyboard = std::make_unique<daemon_keyboard>(devices, entry);
+        if (cmd.shadow_ttl_ms >= 0) {
+            keyboard->device.shadow().set_ttl(std::chrono::milliseconds(cmd.shadow_ttl_ms));
+        }
+        return keyboard.get();
+    }
+    return nullptr;
 }
 
 
+int run_daemon(cmdline const &cmd) {
+    // Keyboards behind a KVM switch come and go; the registry writes the LED values set here back when they return.
+    spak::hid_device_registry<> registry(kHIDPage_GenericDesktop, kHIDUsage_GD_Keyboard);
+    registry.start();
+    std::unique_ptr<daemon_keyboard> keyboard;
+    if (connect(registry, cmd, keyboard) == nullptr) {
+        report_keyboard_not_found(cmd.match_product, cmd.match_manufacturer);
+        return return_code::keyboard_not_found;
+    }
+    if (not keyboard->opener.is_open()) {
+        std::cerr << "Could not open device: " << spak::describe_io_return(keyboard->opener.result()) << std::endl;
+        return return_code::cannot_open_device;
+    }
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        std::stringstream ss(line);
+        std::string verb;
+        std::size_t element_idx = std::numeric_limits<std::size_t>::max();
+        CFIndex value = 0;
+        cmdline::actions action = cmdline::actions::wrong_cmd_line;
+        if (not (ss >> verb)) {
+            continue;
+        }
+        if (verb == "quit") {
+            break;
+        } else if (verb == "toggle" and ss >> element_idx) {
+            action = cmdline::actions::toggle;
+        } else if (verb == "set" and ss >> element_idx >> value) {
+            action = cmdline::actions::set;
+        } else {
+            std::cout << "error: cannot parse '" << line << "'" << std::endl;
+            continue;
+        }
+        daemon_keyboard *current = connect(registry, cmd, keyboard);
+        if (current == nullptr) {
+            std::cout << "error: keyboard not connected" << std::endl;
+            continue;
+        } else if (not current->opener.is_open()) {
+            std::cout << "error: cannot open device: " << spak::describe_io_return(current->opener.result()) << std::endl;
+            continue;
+        }
+        current->device.shadow().sync();
+        int const res = apply(current->elements, action, element_idx, value);
+        if (res == return_code::led_not_found) {
+            std::cout << "error: no such LED" << std::endl;
+            continue;
+        } else if (res != return_code::ok) {
+            std::cout << "error: cannot write to device" << std::endl;
+            continue;
+        }
+        spak::hid_result<CFIndex> const written = current->elements[element_idx].value<CFIndex>().get();
+        if (written) {
+            registry.remember(current->identity, element_idx, written.value());
+        }
+        std::cout << "ok" << std::endl;
+    }
+    return return_code::ok;
+}
+
+
+int run_batch(keyboard_resolver &resolver, std::vector<spak::led_command> const &commands) {
+    int retval = return_code::ok;
+    using device_ptr = std::unique_ptr<spak::hid_device>;
+    auto resolve = [&](spak::device_selector const &selector) {
+        keyboard_resolver::match match = resolver.find(selector.product, selector.manufacturer);
+        if (match.device == nullptr) {
+            report_keyboard_not_found(selector.product, selector.manufacturer);
+            retval = return_code::keyboard_not_found;
+        }
+        return std::move(match.device);
+    };
+    // Not native_ref(): every lookup through the index attaches a new one
+    auto same = [](device_ptr const &l, device_ptr const &r) {
+        return l->native_id() == r->native_id();
+    };
+    for (spak::led_command_group<device_ptr> const &group : spak::group_by_device<device_ptr>(commands, resolve, same)) {
+        spak::hid_device &device = *group.device;
+        spak::hid_device_opener opener = device.open();
+        if (not opener.is_open()) {
+            std::cerr << "Could not open device: " << spak::describe_io_return(opener.result()) << std::endl;
+            retval = return_code::cannot_open_device;
+            continue;
+        }
+        spak::hid_device_elements_enumerator elements = device.elements(kHIDPage_LEDs);
+        // Stage everything and write once per report, toggles see the values staged before them
+        spak::hid_device_transaction transaction = device.transaction();
+        for (spak::led_command const &command : group.commands) {
+            if (command.led >= elements.size()) {
+                std::cerr << "Device has only " << elements.size() << " LED elements, cannot find LED number " << command.led << std::endl;
+                retval = return_code::led_not_found;
+                continue;
+            }
+            spak::hid_device_element &element = elements[command.led];
+            CFIndex value = command.value;
+            if (command.op == spak::led_op::toggle) {
+                if (not transaction.staged_value_of(element, value)) {
+                    spak::hid_result<CFIndex> const current = element.value<CFIndex>().get();
+                    if (not current) {
+                        std::cerr << "Could not read from device: " << current.describe() << std::endl;
+                        retval = return_code::write_failed;
+                        continue;
+                    }
+                    value = current.value();
+                }
+                value = toggled(element, value);
+            }
+            transaction.stage(element, value);
+        }
+        IOReturn const res = transaction.commit();
+        if (res != kIOReturnSuccess) {
+            std::cerr << "Could not write to device: " << spak::describe_io_return(res) << std::endl;
+            retval = return_code::write_failed;
+        }
+    }
+    return retval;
+}
+
+
+spak::ipc_server<spak::led_server> *p_running_server = nullptr;
+
+
+int run_server(cmdline const &cmd) {
+    spak::hid_device_enumerator enumerator(kHIDPage_GenericDesktop, kHIDUsage_GD_Keyboard);
+    spak::led_server handler(enumerator, spak::hid_device_matcher(cmd.match_product, cmd.match_manufacturer));
+    if (handler.size() == 0) {
+        report_keyboard_not_found(cmd.match_product, cmd.match_manufacturer);
+        return return_code::keyboard_not_found;
+    }
+    spak::ipc_server<spak::led_server> server(handler, cmd.socket_path.empty() ? spak::ipc_default_socket_path() : cmd.socket_path);
+    IOReturn const res = server.listen();
+    if (res != kIOReturnSuccess) {
+        std::cerr << "Could not listen on " << server.path() << ": " << spak::describe_io_return(res) << std::endl;
+        return return_code::unknown_error;
+    }
+    p_running_server = &server;
+    auto on_signal = [](int) {
+        p_running_server->stop();
+    };
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+    std::cerr << "Serving " << handler.size() << " keyboard(s) on " << server.path() << std::endl;
+    server.run();
+    p_running_server = nullptr;
+    return return_code::ok;
+}
+
+
+int run_broadcast(cmdline const &cmd) {
+    spak::hid_device_enumerator enumerator(kHIDPage_GenericDesktop, kHIDUsage_GD_Keyboard);
+    std::vector<spak::hid_device> const devices = enumerator.find_all(spak::hid_device_matcher(cmd.match_product, cmd.match_manufacturer));
+    if (devices.empty()) {
+        report_keyboard_not_found(cmd.match_product, cmd.match_manufacturer);
+        return return_code::keyboard_not_found;
+    }
+    spak::led_broadcast broadcast(devices, std::chrono::milliseconds(cmd.timeout_ms));
+    spak::led_op const op = cmd.action == cmdline::actions::set ? spak::led_op::set : spak::led_op::toggle;
+    uint64_t const ticket = broadcast.post(spak::led_write{cmd.element, cmd.element_usage, op, cmd.value});
+    int retval = return_code::ok;
+    for (spak::broadcast_result const &result : broadcast.wait(ticket, std::chrono::milliseconds(cmd.timeout_ms))) {
+        if (result.result == kIOReturnSuccess) {
+            continue;
+        }
+        std::cerr << "Device '" << result.product << "': ";
+        if (result.result == kIOReturnBadArgument) {
+            std::cerr << "no such LED" << std::endl;
+            retval = std::max(retval, return_code::led_not_found);
+        } else {
+            std::cerr << spak::describe_io_return(result.result) << std::endl;
+            retval = return_code::write_failed;
+        }
+    }
+    return retval;
+}
+
+
+void write_json_string(std::ostream &os, std::string const &str) {
+    std::string quoted;
+    spak::append_json_string(quoted, str);
+    os << quoted;
+}
+
+
+spak::led_monitor *p_running_monitor = nullptr;
+
+
+int run_watch(cmdline const &cmd) {
+    spak::hid_device_enumerator enumerator(kHIDPage_GenericDesktop, kHIDUsage_GD_Keyboard);
+    std::vector<spak::hid_device> const devices = enumerator.find_all(spak::hid_device_matcher(cmd.match_product, cmd.match_manufacturer));
+    if (devices.empty()) {
+        report_keyboard_not_found(cmd.match_product, cmd.match_manufacturer);
+        return return_code::keyboard_not_found;
+    }
+    spak::led_monitor monitor(devices, std::chrono::milliseconds(cmd.coalesce_ms));
+    std::vector<std::string> products;
+    for (std::size_t i = 0; i < monitor.size(); ++i) {
+        products.push_back(monitor.device(i).product());
+        if (monitor.open_result(i) != kIOReturnSuccess) {
+            std::cerr << "Could not open '" << products.back() << "': " << spak::describe_io_return(monitor.open_result(i)) << std::endl;
+        }
+    }
+    p_running_monitor = &monitor;
+    auto on_signal = [](int) {
+        p_running_monitor->stop();
+    };
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+    monitor.run([&](std::vector<spak::led_change> const &changes) {
+        for (spak::led_change const &change : changes) {
+            std::cout << "{\"time\":" << std::chrono::duration_cast<std::chrono::microseconds>(change.time.time_since_epoch()).count()
+                << ",\"device\":" << change.device << ",\"product\":";
+            write_json_string(std::cout, products[change.device]);
+            std::cout << ",\"led\":" << change.led << ",\"usage\":";
+            if (char const *name = spak::hid_led_usage_name(change.usage)) {
+                std::cout << '"' << name << '"';
+            } else {
+                std::cout << change.usage;
+            }
+            std::cout << ",\"value\":" << change.value << "}\n";
+        }
+        // One flush per batch
+        std::cout.flush();
+    });
+    p_running_monitor = nullptr;
+    return return_code::ok;
+}
+
+
+spak::led_mirror *p_running_mirror = nullptr;
+
+
+int run_mirror(cmdline const &cmd) {
+    spak::hid_device_enumerator enumerator(kHIDPage_GenericDesktop, kHIDUsage_GD_Keyboard);
+    spak::hid_device const *source = enumerator.find(spak::hid_device_matcher(cmd.match_product, cmd.match_manufacturer));
+    if (source == nullptr) {
+        report_keyboard_not_found(cmd.match_product, cmd.match_manufacturer);
+        return return_code::keyboard_not_found;
+    }
+    std::vector<spak::hid_device> targets;
+    for (spak::hid_device const &device : enumerator) {
+        if (&device != source) {
+            targets.push_back(device);
+        }
+    }
+    spak::led_mirror mirror(*source, targets, std::chrono::milliseconds(cmd.timeout_ms));
+    if (mirror.open_result() != kIOReturnSuccess) {
+        std::cerr << "Could not open device: " << spak::describe_io_return(mirror.open_result()) << std::endl;
+        return return_code::cannot_open_device;
+    }
+    p_running_mirror = &mirror;
+    auto on_signal = [](int) {
+        p_running_mirror->stop();
+    };
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+    std::cerr << "Mirroring '" << source->product() << "' to " << mirror.size() << " keyboard(s)" << std::endl;
+    mirror.run(std::chrono::milliseconds(cmd.interval_ms));
+    p_running_mirror = nullptr;
+    spak::mirror_stats const &stats = mirror.stats();
+    std::cerr << stats.polls << " polls, " << stats.changes << " changes, " << stats.failures << " failed writes, "
+        << stats.timeouts << " timed out, max latency "
+        << std::chrono::duration_cast<std::chrono::microseconds>(stats.max_latency).count() << " us" << std::endl;
+    return stats.failures + stats.timeouts > 0 ? return_code::write_failed : return_code::ok;
+}
+
+
+int run_animations(spak::hid_device &device, cmdline const &cmd) {
+    spak::hid_device_elements_enumerator all_elements = device.elements(kHIDPage_LEDs);
+    std::vector<spak::hid_device_element> elements;
+    std::vector<spak::led_pattern> patterns;
+    for (auto const &animation : cmd.animations) {
+        if (animation.first >= all_elements.size()) {
+            std::cerr << "Device has only " << all_elements.size() << " LED elements, cannot find LED number " << animation.first << std::endl;
+            return return_code::led_not_found;
+        }
+        spak::hid_device_element const &element = all_elements[animation.first];
+        spak::led_pattern pattern = spak::led_pattern::constant(0);
+        if (not spak::led_pattern::parse(animation.second, element.logical_min(), element.logical_max(), pattern)) {
+            std::cerr << "Invalid pattern '" << animation.second << "' for LED number " << animation.first << std::endl;
+            return return_code::cmdline_error;
+        }
+        elements.push_back(element);
+        patterns.push_back(std::move(pattern));
+    }
+    spak::hid_elements_sink sink(device, std::move(elements));
+    spak::animation_player<spak::hid_elements_sink> player(sink, std::chrono::nanoseconds(std::chrono::seconds(1)) / cmd.rate_hz);
+    for (auto &pattern : patterns) {
+        player.add_track(std::move(pattern));
+    }
+    if (cmd.duration_ms >= 0) {
+        player.run(std::chrono::milliseconds(cmd.duration_ms));
+    } else {
+        player.run();
+    }
+    spak::animation_stats const stats = player.stats();
+    std::cerr << stats.ticks << " ticks, " << stats.writes << " writes, " << stats.skipped_writes << " unchanged, "
+        << stats.missed_deadlines << " missed deadlines, " << stats.failed_commits << " failed writes, max lateness "
+        << std::chrono::duration_cast<std::chrono::microseconds>(stats.max_lateness).count() << " us" << std::endl;
+    if (sink.last_error() != kIOReturnSuccess) {
+        std::cerr << "Could not write to device: " << spak::describe_io_return(sink.last_error()) << std::endl;
+        return return_code::write_failed;
+    }
+    return return_code::ok;
+}
+
+
+/// Plays the animated LEDs of one keyboard of a profile.
+struct profile_animation {
+    spak::hid_device_opener opener;
+    spak::hid_elements_sink sink;
+    spak::animation_player<spak::hid_elements_sink> player;
+
+    static std::vector<spak::hid_device_element> elements_of(spak::led_profile_plan::keyboard &keyboard) {
+        std::vector<spak::hid_device_element> elements;
+        for (auto const &animation : keyboard.animations) {
+            elements.push_back(keyboard.elements[animation.led]);
+        }
+        return elements;
+    }
+
+    profile_animation(spak::led_profile_plan::keyboard &keyboard, spak::led_pattern::duration tick) :
+        opener(keyboard.device.open()), sink(keyboard.device, elements_of(keyboard)), player(sink, tick)
+    {
+        for (auto const &animation : keyboard.animations) {
+            player.add_track(animation.pattern);
+        }
+    }
+};
+
+
+int run_profile(cmdline const &cmd) {
+    std::vector<spak::led_profile_rule> rules;
+    std::string error;
+    spak::device_selector const default_selector{cmd.match_product, cmd.match_manufacturer};
+    bool parsed = false;
+    if (cmd.profile_path == "-") {
+        parsed = spak::parse_led_profile(std::cin, default_selector, rules, error);
+    } else {
+        std::ifstream file(cmd.profile_path);
+        if (not file) {
+            std::cerr << "Could not read the profile " << cmd.profile_path << std::endl;
+            return return_code::cmdline_error;
+        }
+        parsed = spak::parse_led_profile(file, default_selector, rules, error);
+    }
+    if (not parsed) {
+        std::cerr << error << std::endl;
+        return return_code::cmdline_error;
+    }
+    spak::hid_device_enumerator enumerator(kHIDPage_GenericDesktop, kHIDUsage_GD_Keyboard);
+    spak::led_profile_plan plan;
+    std::vector<std::string> warnings;
+    if (not plan.compile(rules, enumerator, warnings, error)) {
+        std::cerr << error << std::endl;
+        return return_code::cmdline_error;
+    }
+    for (std::string const &warning : warnings) {
+        std::cerr << warning << std::endl;
+    }
+    spak::profile_apply_stats const stats = plan.apply();
+    std::cerr << stats.checked << " LEDs checked, " << stats.written << " written, " << stats.failures << " keyboards failed" << std::endl;
+    std::vector<std::unique_ptr<profile_animation>> animations;
+    for (auto &keyboard : plan.keyboards()) {
+        if (not keyboard.animations.empty()) {
+            animations.push_back(std::make_unique<profile_animation>(keyboard, std::chrono::nanoseconds(std::chrono::seconds(1)) / cmd.rate_hz));
+        }
+    }
+    IOReturn animation_error = kIOReturnSuccess;
+    if (not animations.empty()) {
+        for (auto &animation : animations) {
+            if (cmd.duration_ms >= 0) {
+                animation->player.start(std::chrono::milliseconds(cmd.duration_ms));
+            } else {
+                animation->player.start();
+            }
+        }
+        for (auto &animation : animations) {
+            while (animation->player.is_running()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            animation->player.stop();
+            if (animation->sink.last_error() != kIOReturnSuccess) {
+                animation_error = animation->sink.last_error();
+            }
+        }
+    }
+    if (stats.failures > 0 or animation_error != kIOReturnSuccess) {
+        return return_code::write_failed;
+    }
+    return warnings.empty() ? return_code::ok : return_code::led_not_found;
+}
+
+
+/// Turns on the probes requested on the command line and reports on them when the command is over.
+class trace_output {
+    bool _stats;
+    std::string _trace_path;
+public:
+    trace_output(cmdline const &cmd) : _stats(cmd.stats), _trace_path(cmd.trace_path) {
+#if HIDLED_TRACE
+        if (_stats) {
+            spak::tracer::instance().enable_stats();
+        }
+        if (not _trace_path.empty()) {
+            spak::tracer::instance().enable_events();
+        }
+#else
+        if (_stats or not _trace_path.empty()) {
+            std::cerr << "Built without tracing (HIDLED_TRACE=0), ignoring --stats and --trace." << std::endl;
+        }
+#endif
+    }
+    
+    ~trace_output() {
+#if HIDLED_TRACE
+        if (_stats) {
+            spak::tracer::instance().write_stats(std::cerr);
+        }
+        if (not _trace_path.empty()) {
+            std::ofstream file(_trace_path);
+            spak::tracer::instance().write_chrome_trace(file);
+            if (not file) {
+                std::cerr << "Could not write the trace to " << _trace_path << std::endl;
+            }
+        }
+#endif
+    }
+};
+
+
 int main(int argc, const char * argv[]) {
     try {
-        spak::hid_device_enumerator enumerator(kHIDPage_GenericDesktop, kHIDUsage_GD_Keyboard);
         cmdline cmd;
         cmd.parse(argc, argv);
+        trace_output const tracing(cmd);
+        // Only the actions that look a keyboard up have a resolver, which maps the index
         switch (cmd.action) {
             case cmdline::actions::wrong_cmd_line:
                 help();
@@ -193,22 +1027,67 @@ int main(int argc, const char * argv[]) {
             case cmdline::actions::help:
                 help();
                 return return_code::ok;
-            case cmdline::actions::list:
-                list(enumerator);
+            case cmdline::actions::list: {
+                spak::hid_device_enumerator enumerator(kHIDPage_GenericDesktop, kHIDUsage_GD_Keyboard);
+                list(enumerator, spak::device_discovery(cmd.jobs, std::chrono::milliseconds(cmd.timeout_ms), cmd.read_list_values()), cmd.format);
                 return return_code::ok;
+            }
+            case cmdline::actions::batch: {
+                std::vector<spak::led_command> commands;
+                std::string error;
+                spak::device_selector const default_selector{cmd.match_product, cmd.match_manufacturer};
+                bool parsed = true;
+                if (not cmd.batch_tokens.empty()) {
+                    parsed = spak::parse_led_commands(cmd.batch_tokens, default_selector, commands, error);
+                } else {
+                    std::string line;
+                    for (std::size_t line_no = 1; parsed and std::getline(std::cin, line); ++line_no) {
+                        parsed = spak::parse_led_commands(spak::tokenize(line), default_selector, commands, error);
+                        if (not parsed) {
+                            error += " on line " + std::to_string(line_no);
+                        }
+                    }
+                }
+                if (not parsed) {
+                    std::cerr << error << std::endl;
+                    return return_code::cmdline_error;
+                }
+                keyboard_resolver resolver;
+                return run_batch(resolver, commands);
+            }
+            case cmdline::actions::daemon:
+                return run_daemon(cmd);
+            case cmdline::actions::serve:
+                return run_server(cmd);
+            case cmdline::actions::mirror:
+                return run_mirror(cmd);
+            case cmdline::actions::watch:
+                return run_watch(cmd);
+            case cmdline::actions::profile:
+                return run_profile(cmd);
             case cmdline::actions::set:
                 [[fallthrough]];
-            case cmdline::actions::toggle: {
-                auto p_device = match_keyboard(enumerator, cmd.match_product, cmd.match_manufacturer);
-                if (p_device == nullptr) {
-                    std::cerr << "Unable to find a keyboard matching";
-                    if (not cmd.match_product.empty()) {
-                        std::cerr << " product '" << cmd.match_product << "'";
-                    }
-                    if (not cmd.match_manufacturer.empty()) {
-                        std::cerr << " manufacturer '" << cmd.match_manufacturer << "'";
+            case cmdline::actions::toggle:
+                if (cmd.broadcast) {
+                    return run_broadcast(cmd);
+                }
+                [[fallthrough]];
+            case cmdline::actions::animate: {
+                keyboard_resolver resolver;
+                keyboard_resolver::match match = resolver.find(cmd.match_product, cmd.match_manufacturer);
+                std::unique_ptr<spak::hid_device_element> p_led;
+                if (match.record != nullptr and (cmd.action == cmdline::actions::set or cmd.action == cmdline::actions::toggle)) {
+                    // Fetch only the LED we need; if that fails, the index is stale
+                    std::size_t const led_idx = cmd.element_usage == 0 ? cmd.element : find_led_usage(*match.record, cmd.element_usage);
+                    p_led = spak::hid_device_index::find_led(*match.record, *match.device, led_idx);
+                    if (p_led == nullptr) {
+                        resolver.rescan();
+                        match = resolver.find(cmd.match_product, cmd.match_manufacturer);
                     }
-                    std::cerr << "." << std::endl;
+                }
+                spak::hid_device *p_device = match.device.get();
+                if (p_device == nullptr) {
+                    report_keyboard_not_found(cmd.match_product, cmd.match_manufacturer);
                     return return_code::keyboard_not_found;
                 }
                 spak::hid_device_opener opener = p_device->open();
@@ -216,26 +1095,23 @@ int main(int argc, const char * argv[]) {
                     std::cerr << "Could not open device: " << spak::describe_io_return(opener.result()) << std::endl;
                     return return_code::cannot_open_device;
                 }
-                spak::hid_device_elements_enumerator elements = p_device->elements(kHIDPage_LEDs);
-                if (cmd.element >= elements.size()) {
-                    std::cerr << "Device has only " << elements.size() << " LED elements, cannot find LED number " << cmd.element << std::endl;
-                    return return_code::led_not_found;
+                if (cmd.action == cmdline::actions::animate) {
+                    return run_animations(*p_device, cmd);
                 }
-                if (cmd.action == cmdline::actions::set) {
-                    elements[cmd.element].value<CFIndex>() = cmd.value;
-                } else {
-                    spak::hid_device_element &element = elements[cmd.element];
-                    spak::hid_device_element_value<CFIndex> value = element.value<CFIndex>();
-                    if (value == element.logical_min()) {
-                        value = element.logical_max();
-                    } else {
-                        value = element.logical_min();
-                    }
+                if (p_led != nullptr) {
+                    return report_io(apply(*p_led, cmd.action, cmd.value));
                 }
-                return return_code::ok;
+                if (cmd.element_usage != 0) {
+                    return apply_usage(*p_device, cmd.action, cmd.element_usage, cmd.value);
+                }
+                spak::hid_device_elements_enumerator elements = p_device->elements(kHIDPage_LEDs);
+                return apply(elements, cmd.action, cmd.element, cmd.value);
             }
         }
-    } catch (std::exception e) {
+    } catch (spak::hid_io_error const &e) {
+        std::cerr << "Could not access the device: " << e.what() << std::endl;
+        return return_code::write_failed;
+    } catch (std::exception const &e) {
         std::cerr << "Unknown exception: " << e.what() << std::endl;
         return return_code::unknown_error;
     }
@@ -0,0 +1,235 @@
+//
+//  monitor.hpp
+//  HIDLED
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+#ifndef monitor_hpp
+#define monitor_hpp
+
+#include "hid.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+namespace spak {
+
+    struct led_change {
+        /// Index of the keyboard in the monitor.
+        std::size_t device;
+        /// Index among the LED elements of the keyboard.
+        std::size_t led;
+        uint32_t usage;
+        CFIndex value;
+        std::chrono::system_clock::time_point time;
+    };
+
+
+    /** Follows the LEDs of a set of keyboards through the value callbacks of
+     * the backend, sleeping in between: there is no polling, except briefly
+     * after a lock key press on backends that report the key rather than the
+     * LED. Changes that arrive together (or within the coalescing window)
+     * are reported once, with the last value of each LED, and only if it
+     * differs from what was reported before.
+     */
+    template <class Backend = native_backend>
+    class basic_led_monitor {
+        struct keyboard {
+            std::size_t index;
+            basic_hid_device<Backend> device;
+            basic_hid_device_opener<Backend> opener;
+            basic_hid_device_elements_enumerator<Backend> elements;
+            std::vector<uint32_t> usages;
+            std::vector<CFIndex> values;
+            std::vector<CFIndex> reported;
+            std::vector<std::chrono::system_clock::time_point> stamps;
+            typename Backend::value_watch watch;
+            /// Number of polls left that read the LEDs back.
+            unsigned rereads;
+
+            keyboard(std::size_t i, basic_hid_device<Backend> const &d) :
+                index(i), device(d), opener(device.open()), elements(device.elements(kHIDPage_LEDs)), watch{&on_value, this}, rereads(0)
+            {
+                for (auto const &element : elements) {
+                    usages.push_back(element.usage());
+                }
+                values.assign(usages.size(), 0);
+                reported.assign(usages.size(), 0);
+                stamps.assign(usages.size(), std::chrono::system_clock::now());
+                // Reads must reach the device, the shadow registers do not see changes made elsewhere
+                device.shadow().set_ttl(std::chrono::steady_clock::duration::zero());
+            }
+
+            void read_back() {
+                if (not opener.is_open()) {
+                    return;
+                }
+                for (std::size_t i = 0; i < elements.size(); ++i) {
+                    hid_result<CFIndex> const value = elements[i].template value<CFIndex>().get();
+                    if (value and value.value() != values[i]) {
+                        values[i] = value.value();
+                        stamps[i] = std::chrono::system_clock::now();
+                    }
+                }
+            }
+        };
+
+        static bool is_lock_key(uint32_t usage) {
+            return usage == kHIDUsage_KeyboardCapsLock or usage == kHIDUsage_KeypadNumLock or usage == kHIDUsage_KeyboardScrollLock;
+        }
+
+        static void on_value(void *context, typename Backend::element_ref const &element, CFIndex value) {
+            keyboard &kbd = *reinterpret_cast<keyboard *>(context);
+            uint32_t const usage_page = Backend::usage_page(element);
+            if (usage_page == kHIDPage_KeyboardOrKeypad and is_lock_key(Backend::usage(element))) {
+                // The system flips the LED in response, a little later
+                kbd.rereads = 2;
+                return;
+            }
+            if (usage_page != kHIDPage_LEDs) {
+                return;
+            }
+            auto const it = std::find(kbd.usages.begin(), kbd.usages.end(), Backend::usage(element));
+            if (it != kbd.usages.end()) {
+                std::size_t const i = static_cast<std::size_t>(it - kbd.usages.begin());
+                kbd.values[i] = value;
+                kbd.stamps[i] = std::chrono::system_clock::now();
+            }
+        }
+
+        std::vector<std::unique_ptr<keyboard>> _keyboards;
+        std::vector<typename Backend::device_ref> _refs;
+        std::chrono::milliseconds _coalesce;
+        bool _started;
+        std::atomic<bool> _stopping;
+
+        void dispatch() {
+            for (auto &kbd : _keyboards) {
+                Backend::dispatch_value_changes(kbd->device.native_ref(), &kbd->watch);
+            }
+        }
+
+        void collect(std::vector<led_change> &changes, bool all) {
+            for (auto &kbd : _keyboards) {
+                for (std::size_t i = 0; i < kbd->values.size(); ++i) {
+                    if (all or kbd->values[i] != kbd->reported[i]) {
+                        changes.push_back(led_change{kbd->index, i, kbd->usages[i], kbd->values[i], kbd->stamps[i]});
+                        kbd->reported[i] = kbd->values[i];
+                    }
+                }
+            }
+        }
+
+    public:
+        /// How long to wait before reading the LEDs back after a lock key press.
+        static std::chrono::milliseconds settle_time() {
+            return std::chrono::milliseconds(50);
+        }
+
+        explicit basic_led_monitor(std::vector<basic_hid_device<Backend>> const &devices, std::chrono::milliseconds coalesce = std::chrono::milliseconds(0)) :
+            _coalesce(coalesce), _started(false), _stopping(false)
+        {
+            for (auto const &device : devices) {
+                _keyboards.push_back(std::make_unique<keyboard>(_keyboards.size(), device));
+                _refs.push_back(device.native_ref());
+                Backend::watch_values(device.native_ref(), &_keyboards.back()->watch);
+            }
+        }
+
+        basic_led_monitor(basic_led_monitor const &) = delete;
+        basic_led_monitor &operator=(basic_led_monitor const &) = delete;
+
+        ~basic_led_monitor() {
+            for (auto &kbd : _keyboards) {
+                Backend::watch_values(kbd->device.native_ref(), nullptr);
+            }
+        }
+
+        std::size_t size() const {
+            return _keyboards.size();
+        }
+
+        basic_hid_device<Backend> const &device(std::size_t i) const {
+            return _keyboards[i]->device;
+        }
+
+        IOReturn open_result(std::size_t i) const {
+            return _keyboards[i]->opener.result();
+        }
+
+        /** Waits up to @p timeout for changes and puts them in @p changes.
+         * The first call returns at once, with the current value of every LED.
+         */
+        bool poll(std::vector<led_change> &changes, std::chrono::milliseconds timeout) {
+            changes.clear();
+            if (not _started) {
+                for (auto &kbd : _keyboards) {
+                    kbd->read_back();
+                }
+                collect(changes, true);
+                _started = true;
+                return not changes.empty();
+            }
+            bool const rereading = std::any_of(_keyboards.begin(), _keyboards.end(), [](std::unique_ptr<keyboard> const &kbd) {
+                return kbd->rereads > 0;
+            });
+            bool const woken = Backend::wait_value_changes(_refs.data(), _refs.size(), rereading ? std::min(timeout, settle_time()) : timeout);
+            dispatch();
+            if (woken and _coalesce > std::chrono::milliseconds::zero()) {
+                auto const deadline = std::chrono::steady_clock::now() + _coalesce;
+                for (auto now = std::chrono::steady_clock::now(); now < deadline; now = std::chrono::steady_clock::now()) {
+                    Backend::wait_value_changes(_refs.data(), _refs.size(), std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now));
+                    dispatch();
+                }
+            }
+            for (auto &kbd : _keyboards) {
+                if (kbd->rereads > 0) {
+                    kbd->read_back();
+                    --kbd->rereads;
+                }
+            }
+            collect(changes, false);
+            return not changes.empty();
+        }
+
+        /// Calls @p on_changes with each batch of changes until stop(); @p idle bounds how late stop() is noticed.
+        template <class F>
+        void run(F &&on_changes, std::chrono::milliseconds idle = std::chrono::seconds(1)) {
+            std::vector<led_change> changes;
+            while (not _stopping.load(std::memory_order_relaxed)) {
+                if (poll(changes, idle)) {
+                    on_changes(changes);
+                }
+            }
+        }
+
+        /// Safe to call from a signal handler.
+        void stop() {
+            _stopping.store(true, std::memory_order_relaxed);
+        }
+    };
+
+    using led_monitor = basic_led_monitor<native_backend>;
+
+}
+
+#endif /* monitor_hpp */
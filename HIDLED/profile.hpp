@@ -0,0 +1,252 @@
+//
+//  profile.hpp
+//  HIDLED
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+#ifndef profile_hpp
+#define profile_hpp
+
+#include "hid.hpp"
+#include "batch.hpp"
+#include "animation.hpp"
+#include "hid_usage.hpp"
+#include <algorithm>
+#include <istream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace spak {
+
+    /// The LED with @p usage on every keyboard matching @p selector follows @p pattern.
+    struct led_profile_rule {
+        device_selector selector;
+        uint32_t usage;
+        /// As accepted by led_pattern::parse; checked when compiled, against the range of each LED.
+        std::string pattern;
+        std::size_t line;
+    };
+
+
+    /** Parses a profile, one rule per line:
+     *     <selector> <led> <pattern>
+     * where <selector> is as in parse_device_selector(), <led> is a usage name
+     * such as caps_lock and <pattern> is as in led_pattern::parse(). Blank
+     * lines and '#' comments are skipped. On error, returns false and
+     * describes the problem in @p error.
+     */
+    inline bool parse_led_profile(std::istream &is, device_selector const &default_selector,
+                                  std::vector<led_profile_rule> &rules, std::string &error)
+    {
+        std::string line;
+        for (std::size_t line_no = 1; std::getline(is, line); ++line_no) {
+            std::vector<std::string> const tokens = tokenize(line);
+            if (tokens.empty()) {
+                continue;
+            }
+            std::size_t i = 0;
+            led_profile_rule rule{default_selector, 0, "", line_no};
+            if (not parse_device_selector(tokens, i, default_selector, rule.selector)) {
+                error = "Expected a device selector on line " + std::to_string(line_no);
+                return false;
+            }
+            if (i + 2 != tokens.size()) {
+                error = "Expected <led> <pattern> after the selector on line " + std::to_string(line_no);
+                return false;
+            }
+            rule.usage = hid_led_usage_by_name(tokens[i].c_str());
+            if (rule.usage == 0) {
+                error = "Unknown LED '" + tokens[i] + "' on line " + std::to_string(line_no);
+                return false;
+            }
+            rule.pattern = tokens[i + 1];
+            rules.push_back(std::move(rule));
+        }
+        return true;
+    }
+
+
+    struct profile_apply_stats {
+        /// LEDs whose value was compared with the profile.
+        std::size_t checked;
+        /// LEDs that differed and were written.
+        std::size_t written;
+        std::size_t failures;
+    };
+
+
+    /** A profile resolved against the keyboards present: for each of them,
+     * the LED elements it sets and the value of each, and the ones it
+     * animates. Selectors, usages and patterns are resolved once, by
+     * compile(); when several rules name the same LED of a keyboard, the
+     * last one wins. apply() then reads the LEDs it sets and writes only
+     * those that differ, so applying a profile again costs no writes.
+     */
+    template <class Backend = native_backend>
+    class basic_led_profile_plan {
+    public:
+        struct action {
+            /// Index among the LED elements of the keyboard.
+            std::size_t led;
+            CFIndex value;
+        };
+
+        struct animation {
+            std::size_t led;
+            led_pattern pattern;
+        };
+
+        struct keyboard {
+            basic_hid_device<Backend> device;
+            basic_hid_device_elements_enumerator<Backend> elements;
+            std::vector<action> actions;
+            std::vector<animation> animations;
+        };
+
+    private:
+        std::vector<keyboard> _keyboards;
+
+        keyboard &keyboard_for(basic_hid_device<Backend> const &device) {
+            for (keyboard &k : _keyboards) {
+                if (k.device.native_ref() == device.native_ref()) {
+                    return k;
+                }
+            }
+            basic_hid_device<Backend> copy = device;
+            _keyboards.push_back(keyboard{copy, copy.elements(kHIDPage_LEDs), {}, {}});
+            return _keyboards.back();
+        }
+
+        /// Sets the LED @p led of @p k to @p pattern, replacing what an earlier rule put there.
+        static void assign(keyboard &k, std::size_t led, led_pattern pattern) {
+            k.actions.erase(std::remove_if(k.actions.begin(), k.actions.end(), [=](action const &a) { return a.led == led; }), k.actions.end());
+            k.animations.erase(std::remove_if(k.animations.begin(), k.animations.end(), [=](animation const &a) { return a.led == led; }), k.animations.end());
+            if (not pattern.loop() and pattern.frames().size() == 1) {
+                k.actions.push_back(action{led, pattern.frames().front().value});
+            } else {
+                k.animations.push_back(animation{led, std::move(pattern)});
+            }
+        }
+
+    public:
+        /** Resolves @p rules against the keyboards of @p enumerator. Rules
+         * that match no keyboard, or no keyboard with that LED, are skipped
+         * and described in @p warnings; a pattern out of the range of an LED
+         * is an error, described in @p error.
+         */
+        bool compile(std::vector<led_profile_rule> const &rules, basic_hid_device_enumerator<Backend> const &enumerator,
+                     std::vector<std::string> &warnings, std::string &error)
+        {
+            _keyboards.clear();
+            for (led_profile_rule const &rule : rules) {
+                basic_hid_device_matcher<Backend> const matcher(rule.selector.product, rule.selector.manufacturer);
+                std::vector<basic_hid_device<Backend>> const devices = enumerator.find_all(matcher);
+                if (devices.empty()) {
+                    warnings.push_back("No keyboard matches line " + std::to_string(rule.line));
+                    continue;
+                }
+                bool found = false;
+                for (basic_hid_device<Backend> const &device : devices) {
+                    keyboard &k = keyboard_for(device);
+                    for (std::size_t led = 0; led < k.elements.size(); ++led) {
+                        if (k.elements[led].usage() != rule.usage) {
+                            continue;
+                        }
+                        led_pattern pattern = led_pattern::constant(0);
+                        if (not led_pattern::parse(rule.pattern, k.elements[led].logical_min(), k.elements[led].logical_max(), pattern)) {
+                            error = "Invalid pattern '" + rule.pattern + "' on line " + std::to_string(rule.line);
+                            return false;
+                        }
+                        assign(k, led, std::move(pattern));
+                        found = true;
+                        break;
+                    }
+                }
+                if (not found) {
+                    warnings.push_back(std::string("No keyboard matching line ") + std::to_string(rule.line) + " has a "
+                                       + hid_led_usage_name(rule.usage) + " LED");
+                }
+            }
+            // Keyboards met only for LEDs they lack have nothing to do
+            _keyboards.erase(std::remove_if(_keyboards.begin(), _keyboards.end(), [](keyboard const &k) {
+                return k.actions.empty() and k.animations.empty();
+            }), _keyboards.end());
+            return true;
+        }
+
+        std::vector<keyboard> &keyboards() {
+            return _keyboards;
+        }
+
+        /// Number of LED elements the plan sets or animates, over all keyboards.
+        std::size_t size() const {
+            std::size_t retval = 0;
+            for (keyboard const &k : _keyboards) {
+                retval += k.actions.size() + k.animations.size();
+            }
+            return retval;
+        }
+
+        /** Brings the LEDs set by the plan to their values, one transaction
+         * per keyboard, writing only those that differ. Keyboards that cannot
+         * be opened or written count one failure each.
+         */
+        profile_apply_stats apply() {
+            profile_apply_stats stats{0, 0, 0};
+            for (keyboard &k : _keyboards) {
+                if (k.actions.empty()) {
+                    continue;
+                }
+                basic_hid_device_opener<Backend> opener = k.device.open();
+                if (not opener.is_open()) {
+                    ++stats.failures;
+                    continue;
+                }
+                // The LEDs may have changed behind our back since the last apply
+                k.device.shadow().invalidate_all();
+                basic_hid_device_transaction<Backend> transaction = k.device.transaction();
+                for (action const &a : k.actions) {
+                    ++stats.checked;
+                    // An LED that cannot be read is written anyway
+                    hid_result<CFIndex> const current = k.elements[a.led].template value<CFIndex>().get();
+                    if (not current or current.value() != a.value) {
+                        transaction.stage(k.elements[a.led], a.value);
+                    }
+                }
+                std::size_t const staged = transaction.size();
+                if (staged == 0) {
+                    continue;
+                }
+                if (transaction.commit() == kIOReturnSuccess) {
+                    stats.written += staged;
+                } else {
+                    ++stats.failures;
+                }
+            }
+            return stats;
+        }
+    };
+
+    using led_profile_plan = basic_led_profile_plan<native_backend>;
+
+}
+
+#endif /* profile_hpp */
@@ -0,0 +1,333 @@
+//
+//  trace.hpp
+//  HIDLED
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+#ifndef trace_hpp
+#define trace_hpp
+
+/** Build with HIDLED_TRACE=0 to compile the probes out altogether; otherwise
+ * they cost a relaxed load until stats or events are enabled at run time.
+ */
+#ifndef HIDLED_TRACE
+#define HIDLED_TRACE 1
+#endif
+
+#include <cstdint>
+#if HIDLED_TRACE
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <iomanip>
+#include <memory>
+#include <ostream>
+
+#define HIDLED_TRACE_CONCAT_(a, b) a##b
+#define HIDLED_TRACE_CONCAT(a, b) HIDLED_TRACE_CONCAT_(a, b)
+/// Times the rest of the enclosing scope under @p probe, a spak::trace_probe.
+#define HIDLED_TRACE_SCOPE(probe) ::spak::trace_scope HIDLED_TRACE_CONCAT(_trace_scope_, __LINE__)(probe)
+#else
+#define HIDLED_TRACE_SCOPE(probe)
+#endif
+
+namespace spak {
+
+    enum struct trace_probe : uint8_t {
+        enumerate,
+        open,
+        elements,
+        get_value,
+        set_value,
+        commit
+    };
+
+#if HIDLED_TRACE
+    static constexpr std::size_t trace_probe_count = 6;
+
+    inline char const *trace_probe_name(trace_probe probe) {
+        switch (probe) {
+            case trace_probe::enumerate:    return "enumerate";
+            case trace_probe::open:         return "open";
+            case trace_probe::elements:     return "elements";
+            case trace_probe::get_value:    return "get_value";
+            case trace_probe::set_value:    return "set_value";
+            case trace_probe::commit:       return "commit";
+        }
+        return "<unknown>";
+    }
+
+
+    /** Latencies in nanoseconds, in log-linear buckets: exact below 16 ns,
+     * then 16 buckets per power of two, i.e. within 1/16 of the value
+     * everywhere up to 2^64. Recording is a handful of relaxed atomic adds,
+     * so any thread may record while another one reads.
+     */
+    class latency_histogram {
+        static constexpr unsigned sub_bits = 4;
+        static constexpr uint64_t sub_count = uint64_t(1) << sub_bits;
+        static constexpr std::size_t bucket_count = sub_count + (64 - sub_bits) * sub_count;
+
+        std::atomic<uint64_t> _buckets[bucket_count];
+        std::atomic<uint64_t> _count;
+        std::atomic<uint64_t> _sum;
+        std::atomic<uint64_t> _min;
+        std::atomic<uint64_t> _max;
+
+        static std::size_t bucket_of(uint64_t value) {
+            if (value < sub_count) {
+                return static_cast<std::size_t>(value);
+            }
+            unsigned const exp = 63 - static_cast<unsigned>(__builtin_clzll(value));
+            uint64_t const mantissa = (value >> (exp - sub_bits)) & (sub_count - 1);
+            return static_cast<std::size_t>(sub_count + (exp - sub_bits) * sub_count + mantissa);
+        }
+
+        /// Smallest value that falls in @p bucket.
+        static uint64_t lower_bound(std::size_t bucket) {
+            if (bucket < sub_count) {
+                return bucket;
+            }
+            uint64_t const exp = (bucket - sub_count) / sub_count + sub_bits;
+            uint64_t const mantissa = (bucket - sub_count) % sub_count;
+            return (sub_count + mantissa) << (exp - sub_bits);
+        }
+
+    public:
+        latency_histogram() : _count(0), _sum(0), _min(UINT64_MAX), _max(0) {
+            for (auto &bucket : _buckets) {
+                bucket.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        latency_histogram(latency_histogram const &) = delete;
+        latency_histogram &operator=(latency_histogram const &) = delete;
+
+        void record(uint64_t ns) {
+            _buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+            _count.fetch_add(1, std::memory_order_relaxed);
+            _sum.fetch_add(ns, std::memory_order_relaxed);
+            uint64_t prev = _min.load(std::memory_order_relaxed);
+            while (ns < prev and not _min.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {}
+            prev = _max.load(std::memory_order_relaxed);
+            while (ns > prev and not _max.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {}
+        }
+
+        uint64_t count() const {
+            return _count.load(std::memory_order_relaxed);
+        }
+
+        uint64_t min() const {
+            return count() > 0 ? _min.load(std::memory_order_relaxed) : 0;
+        }
+
+        uint64_t max() const {
+            return _max.load(std::memory_order_relaxed);
+        }
+
+        uint64_t mean() const {
+            uint64_t const n = count();
+            return n > 0 ? _sum.load(std::memory_order_relaxed) / n : 0;
+        }
+
+        /// The value below which a fraction @p q of the samples fall, to the bucket precision.
+        uint64_t percentile(double q) const {
+            uint64_t const n = count();
+            if (n == 0) {
+                return 0;
+            }
+            uint64_t const rank = static_cast<uint64_t>(q * static_cast<double>(n - 1)) + 1;
+            uint64_t seen = 0;
+            for (std::size_t i = 0; i < bucket_count; ++i) {
+                seen += _buckets[i].load(std::memory_order_relaxed);
+                if (seen >= rank) {
+                    // Never report outside of what was actually seen
+                    return std::max(min(), std::min(lower_bound(i), max()));
+                }
+            }
+            return max();
+        }
+    };
+
+
+    /** Collects the probes of the whole process: one histogram per probe
+     * with enable_stats(), and up to a fixed number of timed events for a
+     * Chrome trace (chrome://tracing, Perfetto) with enable_events().
+     * Enable them before the work to observe starts.
+     */
+    class tracer {
+        struct event {
+            std::atomic<bool> ready;
+            trace_probe probe;
+            uint32_t thread;
+            uint64_t start;
+            uint64_t duration;
+        };
+
+        std::chrono::steady_clock::time_point const _epoch;
+        std::atomic<bool> _stats;
+        std::atomic<bool> _events_on;
+        latency_histogram _histograms[trace_probe_count];
+        std::unique_ptr<event[]> _events;
+        std::size_t _capacity;
+        std::atomic<uint64_t> _next_event;
+        std::atomic<uint32_t> _next_thread;
+
+        tracer() : _epoch(std::chrono::steady_clock::now()), _stats(false), _events_on(false), _capacity(0), _next_event(0), _next_thread(0) {}
+
+        uint32_t thread_number() {
+            thread_local uint32_t const number = _next_thread.fetch_add(1, std::memory_order_relaxed);
+            return number;
+        }
+
+    public:
+        static tracer &instance() {
+            static tracer t;
+            return t;
+        }
+
+        bool active() const {
+            return _stats.load(std::memory_order_relaxed) or _events_on.load(std::memory_order_relaxed);
+        }
+
+        void enable_stats() {
+            _stats.store(true, std::memory_order_relaxed);
+        }
+
+        /// Events past @p capacity are dropped and counted.
+        void enable_events(std::size_t capacity = 1 << 16) {
+            if (_events == nullptr) {
+                _events.reset(new event[capacity]);
+                for (std::size_t i = 0; i < capacity; ++i) {
+                    _events[i].ready.store(false, std::memory_order_relaxed);
+                }
+                _capacity = capacity;
+            }
+            _events_on.store(true, std::memory_order_release);
+        }
+
+        uint64_t now() const {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _epoch).count());
+        }
+
+        void record(trace_probe probe, uint64_t start, uint64_t end) {
+            if (_stats.load(std::memory_order_relaxed)) {
+                _histograms[static_cast<std::size_t>(probe)].record(end - start);
+            }
+            if (_events_on.load(std::memory_order_acquire)) {
+                uint64_t const idx = _next_event.fetch_add(1, std::memory_order_relaxed);
+                if (idx < _capacity) {
+                    event &e = _events[idx];
+                    e.probe = probe;
+                    e.thread = thread_number();
+                    e.start = start;
+                    e.duration = end - start;
+                    e.ready.store(true, std::memory_order_release);
+                }
+            }
+        }
+
+        latency_histogram const &histogram(trace_probe probe) const {
+            return _histograms[static_cast<std::size_t>(probe)];
+        }
+
+        uint64_t dropped_events() const {
+            uint64_t const n = _next_event.load(std::memory_order_relaxed);
+            return n > _capacity ? n - _capacity : 0;
+        }
+
+        /// One line per probe that fired, times in microseconds.
+        void write_stats(std::ostream &os) const {
+            auto us = [](uint64_t ns) {
+                return static_cast<double>(ns) / 1000.0;
+            };
+            os << std::left << std::setw(10) << "probe" << std::right
+               << std::setw(8) << "count" << std::setw(11) << "min"
+               << std::setw(11) << "mean" << std::setw(11) << "p50"
+               << std::setw(11) << "p90" << std::setw(11) << "p99"
+               << std::setw(11) << "max" << "  (us)" << std::endl;
+            os << std::fixed << std::setprecision(1);
+            for (std::size_t i = 0; i < trace_probe_count; ++i) {
+                latency_histogram const &h = _histograms[i];
+                if (h.count() == 0) {
+                    continue;
+                }
+                os << std::left << std::setw(10) << trace_probe_name(static_cast<trace_probe>(i)) << std::right
+                   << std::setw(8) << h.count() << std::setw(11) << us(h.min())
+                   << std::setw(11) << us(h.mean()) << std::setw(11) << us(h.percentile(0.50))
+                   << std::setw(11) << us(h.percentile(0.90)) << std::setw(11) << us(h.percentile(0.99))
+                   << std::setw(11) << us(h.max()) << std::endl;
+            }
+            os << std::defaultfloat;
+            if (dropped_events() > 0) {
+                os << dropped_events() << " trace events dropped" << std::endl;
+            }
+        }
+
+        /// Trace Event Format, complete ("X") events with microsecond timestamps.
+        void write_chrome_trace(std::ostream &os) const {
+            uint64_t const n = std::min<uint64_t>(_next_event.load(std::memory_order_relaxed), _capacity);
+            os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+            bool first = true;
+            os << std::fixed << std::setprecision(3);
+            for (uint64_t i = 0; i < n; ++i) {
+                event const &e = _events[i];
+                if (not e.ready.load(std::memory_order_acquire)) {
+                    continue;
+                }
+                os << (first ? "" : ",") << "\n{\"name\":\"" << trace_probe_name(e.probe)
+                   << "\",\"cat\":\"hid\",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.thread
+                   << ",\"ts\":" << static_cast<double>(e.start) / 1000.0
+                   << ",\"dur\":" << static_cast<double>(e.duration) / 1000.0 << "}";
+                first = false;
+            }
+            os << std::defaultfloat;
+            os << "\n]}" << std::endl;
+        }
+    };
+
+
+    /// Use through HIDLED_TRACE_SCOPE, so that it disappears with HIDLED_TRACE=0.
+    class trace_scope {
+        trace_probe _probe;
+        bool _active;
+        uint64_t _start;
+    public:
+        explicit trace_scope(trace_probe probe) : _probe(probe), _active(tracer::instance().active()), _start(0) {
+            if (_active) {
+                _start = tracer::instance().now();
+            }
+        }
+
+        trace_scope(trace_scope const &) = delete;
+        trace_scope &operator=(trace_scope const &) = delete;
+
+        ~trace_scope() {
+            if (_active) {
+                tracer::instance().record(_probe, _start, tracer::instance().now());
+            }
+        }
+    };
+#endif
+
+}
+
+#endif /* trace_hpp */
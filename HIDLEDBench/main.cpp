@@ -0,0 +1,1341 @@
+//
+//  main.cpp
+//  HIDLEDBench
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+// Times the stages of a --toggle invocation (manager, device scan, keyboard
+// match, open, element copy, read, write, close) over the fake backend, or the
+// native one with --native, plus the product string fetched vs. cached, the
+// command queue under many producers, copy_cf_string over a corpus of device
+// names on macOS, LED output report encoding from recorded report
+// descriptors and, on Linux, written through hidraw_backend to a made-up
+// hidraw tree, and optionally whole runs of the HIDLED tool. Results are printed as JSON for regression tracking.
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../HIDLED/hid.hpp"
+#include "../HIDLED/fake_hid.hpp"
+#include "../HIDLED/hid_report.hpp"
+#include "../HIDLED/command_queue.hpp"
+#include "../HIDLED/async.hpp"
+#include "../HIDLED/animation.hpp"
+#include "../HIDLED/hid_registry.hpp"
+#include "../HIDLED/hidraw.hpp"
+
+extern char **environ;
+
+using bench_clock = std::chrono::steady_clock;
+
+
+struct options {
+    unsigned iterations = 1000;
+    unsigned warmup = 50;
+    unsigned devices = 8;
+    long latency_us = 0;
+    bool native = false;
+    std::string product;
+    std::string manufacturer;
+    std::string output;
+    /// Program and arguments to run for the end-to-end measure, after "--".
+    std::vector<std::string> exec;
+    /// The hidled binary to run against a made-up sysfs tree.
+    std::string sysfs;
+    bool help = false;
+
+    bool parse(int argc, const char * argv[]) {
+        for (int argn = 1; argn < argc; ++argn) {
+            std::string const arg = argv[argn];
+            if (arg == "--") {
+                exec.assign(argv + argn + 1, argv + argc);
+                break;
+            } else if (arg == "--native") {
+                native = true;
+                continue;
+            } else if (arg == "-h" or arg == "--help") {
+                help = true;
+                return true;
+            }
+            // A switch right after another one means its value was left out
+            if (argn >= argc - 1 or std::string(argv[argn + 1]).compare(0, 2, "--") == 0) {
+                std::cerr << "Missing argument for '" << arg << "'" << std::endl;
+                return false;
+            }
+            std::stringstream ss(argv[++argn]);
+            bool ok = true;
+            if (arg == "--iterations") {
+                ok = static_cast<bool>(ss >> iterations) and iterations > 0;
+            } else if (arg == "--warmup") {
+                ok = static_cast<bool>(ss >> warmup);
+            } else if (arg == "--devices") {
+                ok = static_cast<bool>(ss >> devices) and devices > 0;
+            } else if (arg == "--latency") {
+                ok = static_cast<bool>(ss >> latency_us) and latency_us >= 0;
+            } else if (arg == "--product") {
+                product = ss.str();
+            } else if (arg == "--manufacturer") {
+                manufacturer = ss.str();
+            } else if (arg == "--output") {
+                output = ss.str();
+            } else if (arg == "--sysfs") {
+                sysfs = ss.str();
+            } else {
+                std::cerr << "Unknown switch '" << arg << "'" << std::endl;
+                return false;
+            }
+            if (not ok) {
+                std::cerr << "Invalid value '" << ss.str() << "' for '" << arg << "'" << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+
+/// Samples of one measure, summarized when printed.
+struct measure {
+    std::string name;
+    std::vector<bench_clock::duration> samples;
+    std::string skipped;
+    /// Device operations the samples led to, where that is the point of the measure.
+    std::size_t count = 0;
+};
+
+
+std::string json_string(std::string const &str) {
+    std::string retval = "\"";
+    for (char c : str) {
+        if (c == '"' or c == '\\') {
+            retval += '\\';
+            retval += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", static_cast<unsigned>(c));
+            retval += buf;
+        } else {
+            retval += c;
+        }
+    }
+    return retval + "\"";
+}
+
+
+void write_json(std::ostream &os, options const &opts, std::string const &backend, std::vector<measure> &measures) {
+    os << "{" << std::endl;
+    os << "  \"backend\": " << json_string(backend) << "," << std::endl;
+    os << "  \"iterations\": " << opts.iterations << "," << std::endl;
+    os << "  \"devices\": " << opts.devices << "," << std::endl;
+    os << "  \"latency_us\": " << opts.latency_us << "," << std::endl;
+    os << "  \"results\": [";
+    for (std::size_t i = 0; i < measures.size(); ++i) {
+        measure &m = measures[i];
+        os << (i == 0 ? "" : ",") << std::endl << "    {\"name\": " << json_string(m.name);
+        if (not m.skipped.empty()) {
+            os << ", \"skipped\": " << json_string(m.skipped) << "}";
+            continue;
+        }
+        std::sort(m.samples.begin(), m.samples.end());
+        auto ns = [](bench_clock::duration d) {
+            return static_cast<long long>(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+        };
+        auto percentile = [&](double p) {
+            return ns(m.samples[std::min(m.samples.size() - 1, static_cast<std::size_t>(p * static_cast<double>(m.samples.size())))]);
+        };
+        bench_clock::duration total = bench_clock::duration::zero();
+        for (auto const &s : m.samples) {
+            total += s;
+        }
+        os << ", \"samples\": " << m.samples.size()
+           << ", \"mean_ns\": " << ns(total) / static_cast<long long>(m.samples.size())
+           << ", \"min_ns\": " << ns(m.samples.front())
+           << ", \"p50_ns\": " << percentile(0.50)
+           << ", \"p99_ns\": " << percentile(0.99)
+           << ", \"max_ns\": " << ns(m.samples.back());
+        if (m.count != 0) {
+            os << ", \"count\": " << m.count;
+        }
+        os << "}";
+    }
+    os << std::endl << "  ]" << std::endl << "}" << std::endl;
+}
+
+
+/** One --toggle as main() performs it without the device index, each stage
+ * timed on its own. The shadow registers are off so that the read reaches
+ * the device every time.
+ */
+template <class Backend>
+bool run_pipeline(options const &opts, std::vector<measure> &measures) {
+    char const *const names[] = {"stage.manager", "stage.copy_devices", "stage.match", "stage.open",
+        "stage.copy_elements", "stage.get_value", "stage.set_value", "stage.close", "pipeline.total"};
+    std::size_t const first = measures.size();
+    for (char const *name : names) {
+        measures.push_back(measure{name, {}, ""});
+        measures.back().samples.reserve(opts.iterations);
+    }
+    spak::basic_hid_device_matcher<Backend> const matcher(opts.product, opts.manufacturer);
+    for (unsigned i = 0; i < opts.warmup + opts.iterations; ++i) {
+        bench_clock::time_point stamps[9];
+        std::size_t n = 0;
+        stamps[n++] = bench_clock::now();
+        {
+            typename Backend::manager mgr;
+            stamps[n++] = bench_clock::now();
+            spak::basic_hid_device_enumerator<Backend> enumerator(spak::defer_scan, std::move(mgr));
+            enumerator.scan(kHIDPage_GenericDesktop, kHIDUsage_GD_Keyboard);
+            stamps[n++] = bench_clock::now();
+            spak::basic_hid_device<Backend> *device = enumerator.find(matcher);
+            if (device == nullptr) {
+                std::cerr << "No keyboard matches." << std::endl;
+                return false;
+            }
+            device->shadow().set_ttl(spak::basic_hid_shadow_registers<Backend>::clock::duration::zero());
+            stamps[n++] = bench_clock::now();
+            spak::basic_hid_device_opener<Backend> opener = device->open();
+            if (not opener.is_open()) {
+                std::cerr << "Cannot open the keyboard: " << spak::describe_io_return(opener.result()) << std::endl;
+                return false;
+            }
+            stamps[n++] = bench_clock::now();
+            spak::basic_hid_device_elements_enumerator<Backend> elements = device->elements(kHIDPage_LEDs);
+            if (elements.size() == 0) {
+                std::cerr << "The keyboard has no LEDs." << std::endl;
+                return false;
+            }
+            stamps[n++] = bench_clock::now();
+            CFIndex const value = elements[0].template value<CFIndex>();
+            stamps[n++] = bench_clock::now();
+            elements[0].template value<CFIndex>() = value == elements[0].logical_min() ? elements[0].logical_max() : elements[0].logical_min();
+            stamps[n++] = bench_clock::now();
+        }
+        stamps[n++] = bench_clock::now();
+        if (i < opts.warmup) {
+            continue;
+        }
+        for (std::size_t s = 0; s + 1 < n; ++s) {
+            measures[first + s].samples.push_back(stamps[s + 1] - stamps[s]);
+        }
+        measures[first + n - 1].samples.push_back(stamps[n - 1] - stamps[0]);
+    }
+    return true;
+}
+
+
+/// The keyboard lookup of match_keyboard() before and after hid_device_matcher: copying the strings out vs. comparing in place.
+template <class Backend>
+void run_match(options const &opts, std::vector<measure> &measures) {
+    spak::basic_hid_device_enumerator<Backend> enumerator(kHIDPage_GenericDesktop, kHIDUsage_GD_Keyboard);
+    measure copy{"match.copy_strings", {}, ""};
+    measure matcher{"match.matcher", {}, ""};
+    spak::basic_hid_device_matcher<Backend> const m(opts.product, opts.manufacturer);
+    for (unsigned i = 0; i < opts.warmup + opts.iterations; ++i) {
+        bench_clock::time_point const t0 = bench_clock::now();
+        spak::basic_hid_device<Backend> *found = nullptr;
+        for (auto &device : enumerator) {
+            if ((opts.product.empty() or device.product() == opts.product) and (opts.manufacturer.empty() or device.manufacturer() == opts.manufacturer)) {
+                found = &device;
+                break;
+            }
+        }
+        bench_clock::time_point const t1 = bench_clock::now();
+        spak::basic_hid_device<Backend> *found_too = enumerator.find(m);
+        bench_clock::time_point const t2 = bench_clock::now();
+        if (found != found_too) {
+            std::cerr << "The two lookups disagree." << std::endl;
+        }
+        if (i >= opts.warmup) {
+            copy.samples.push_back(t1 - t0);
+            matcher.samples.push_back(t2 - t1);
+        }
+    }
+    measures.push_back(std::move(copy));
+    measures.push_back(std::move(matcher));
+}
+
+
+/// Product and manufacturer names as keyboards report them, ASCII and not.
+char const *const device_names[] = {
+    "Apple Internal Keyboard / Trackpad",
+    "Magic Keyboard with Numeric Keypad",
+    "Apple Inc.",
+    "G915 TKL LIGHTSPEED Wireless RGB Mechanical Gaming Keyboard",
+    "Logitech",
+    "Microsoft\u00ae Nano Transceiver v2.0",
+    "Microsoft",
+    "HHKB-Hybrid_1",
+    "Topre Corporation",
+    "\u6771\u30d7\u30ec REALFORCE",
+    "\u30c0\u30a4\u30e4\u30c6\u30c3\u30af",
+    "\u041a\u043b\u0430\u0432\u0438\u0430\u0442\u0443\u0440\u0430 Defender",
+    "CHERRY\u00ae KC 6000 SLIM",
+    "Clavier Apple (AZERTY) \u2013 Fran\u00e7ais",
+    "Keychron K2",
+    "Model M \U0001f3b9"
+};
+
+
+#if defined(__APPLE__)
+/// UTF-16 code units of a valid UTF-8 string.
+std::vector<UniChar> utf16_from_utf8(std::string const &str) {
+    std::vector<UniChar> retval;
+    for (std::size_t i = 0; i < str.size();) {
+        unsigned char const lead = static_cast<unsigned char>(str[i]);
+        std::size_t const n = lead < 0x80 ? 1 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : 4;
+        uint32_t cp = n == 1 ? lead : lead & (0x7F >> n);
+        for (std::size_t k = 1; k < n; ++k) {
+            cp = (cp << 6) | (static_cast<unsigned char>(str[i + k]) & 0x3F);
+        }
+        if (cp >= 0x10000) {
+            cp -= 0x10000;
+            retval.push_back(static_cast<UniChar>(0xD800 + (cp >> 10)));
+            retval.push_back(static_cast<UniChar>(0xDC00 + (cp & 0x3FF)));
+        } else {
+            retval.push_back(static_cast<UniChar>(cp));
+        }
+        i += n;
+    }
+    return retval;
+}
+
+
+/** copy_cf_string over device_names, the strings created once from UTF-8
+ * bytes (ASCII ones keep a C string pointer) and once from UTF-16 characters
+ * (none do). Every conversion must give back the UTF-8 it started from.
+ */
+void run_copy_cf_string(options const &opts, std::vector<measure> &measures) {
+    std::vector<spak::cf_wrap<CFStringRef>> strings[2];
+    for (char const *name : device_names) {
+        std::vector<UniChar> const chars = utf16_from_utf8(name);
+        strings[0].emplace_back(CFStringCreateWithCString(kCFAllocatorDefault, name, kCFStringEncodingUTF8));
+        strings[1].emplace_back(CFStringCreateWithCharacters(kCFAllocatorDefault, chars.data(), static_cast<CFIndex>(chars.size())));
+    }
+    char const *const names[] = {"copy_cf_string.utf8", "copy_cf_string.utf16"};
+    std::size_t const count = sizeof(device_names) / sizeof(device_names[0]);
+    for (std::size_t k = 0; k < 2; ++k) {
+        measure m{names[k], {}, ""};
+        m.samples.reserve(opts.iterations * count);
+        for (unsigned i = 0; i < opts.warmup + opts.iterations; ++i) {
+            for (std::size_t j = 0; j < count; ++j) {
+                bench_clock::time_point const t0 = bench_clock::now();
+                std::string const str = spak::copy_cf_string(strings[k][j]);
+                bench_clock::time_point const t1 = bench_clock::now();
+                if (i == 0 and str != device_names[j]) {
+                    std::cerr << "copy_cf_string mangled " << json_string(device_names[j]) << " into " << json_string(str) << std::endl;
+                }
+                if (i >= opts.warmup) {
+                    m.samples.push_back(t1 - t0);
+                }
+            }
+        }
+        measures.push_back(std::move(m));
+    }
+}
+#else
+void run_copy_cf_string(options const &, std::vector<measure> &measures) {
+    measures.push_back(measure{"copy_cf_string.utf8", {}, "CoreFoundation not available"});
+    measures.push_back(measure{"copy_cf_string.utf16", {}, "CoreFoundation not available"});
+}
+#endif
+
+
+/** The product string of a device every time it is asked for, fetched from
+ * the backend vs. served from the per-device cache.
+ */
+template <class Backend>
+void run_device_strings(options const &opts, std::vector<measure> &measures) {
+    spak::basic_hid_device_enumerator<Backend> enumerator(kHIDPage_GenericDesktop, kHIDUsage_GD_Keyboard);
+    measure backend{"strings.backend", {}, ""};
+    measure cached{"strings.cached", {}, ""};
+    if (enumerator.size() == 0) {
+        backend.skipped = cached.skipped = "no keyboard";
+    }
+    for (unsigned i = 0; enumerator.size() != 0 and i < opts.warmup + opts.iterations; ++i) {
+        spak::basic_hid_device<Backend> &device = enumerator[i % enumerator.size()];
+        bench_clock::time_point const t0 = bench_clock::now();
+        std::string const copied = Backend::product(device.native_ref());
+        bench_clock::time_point const t1 = bench_clock::now();
+        std::size_t const size = device.product().size();
+        bench_clock::time_point const t2 = bench_clock::now();
+        if (copied.size() != size) {
+            std::cerr << "The cached product string differs." << std::endl;
+        }
+        if (i >= opts.warmup) {
+            backend.samples.push_back(t1 - t0);
+            cached.samples.push_back(t2 - t1);
+        }
+    }
+    measures.push_back(std::move(backend));
+    measures.push_back(std::move(cached));
+}
+
+
+/** Many threads setting the LEDs of the fake keyboards through
+ * led_command_queue as fast as they can, each submit timed; the count of
+ * queue.submit is the submits, that of queue.flush the reports the devices
+ * actually received.
+ */
+void run_command_queue(options const &opts, std::vector<measure> &measures) {
+    unsigned const producers = 8;
+    spak::basic_hid_device_enumerator<spak::fake_backend> enumerator(kHIDPage_GenericDesktop, kHIDUsage_GD_Keyboard);
+    std::vector<spak::basic_hid_device<spak::fake_backend>> devices(enumerator.begin(), enumerator.end());
+    for (auto &device : devices) {
+        device.native_ref()->reset_counters();
+    }
+    measure submit{"queue.submit", {}, ""};
+    measure flush{"queue.flush", {}, ""};
+    {
+        spak::basic_led_command_queue<spak::fake_backend> queue(devices, std::chrono::milliseconds(1));
+        std::vector<std::size_t> slots;
+        for (std::size_t d = 0; d < queue.size(); ++d) {
+            for (std::size_t led = 0; queue.slot_of(d, led) != queue.npos; ++led) {
+                slots.push_back(queue.slot_of(d, led));
+            }
+        }
+        if (slots.empty()) {
+            submit.skipped = flush.skipped = "no LEDs";
+            measures.push_back(std::move(submit));
+            measures.push_back(std::move(flush));
+            return;
+        }
+        std::vector<std::vector<bench_clock::duration>> samples(producers);
+        std::vector<std::thread> threads;
+        for (unsigned p = 0; p < producers; ++p) {
+            threads.emplace_back([&, p] {
+                samples[p].reserve(opts.iterations);
+                for (unsigned i = 0; i < opts.iterations; ++i) {
+                    std::size_t const s = slots[(p * 7 + i) % slots.size()];
+                    bench_clock::time_point const t0 = bench_clock::now();
+                    queue.submit(s, static_cast<CFIndex>((i + p) & 1));
+                    samples[p].push_back(bench_clock::now() - t0);
+                }
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        bench_clock::time_point const t0 = bench_clock::now();
+        if (not queue.flush(std::chrono::seconds(10))) {
+            std::cerr << "The command queue did not drain." << std::endl;
+        }
+        flush.samples.push_back(bench_clock::now() - t0);
+        for (auto const &s : samples) {
+            submit.samples.insert(submit.samples.end(), s.begin(), s.end());
+        }
+        submit.count = queue.stats().submitted;
+    }
+    for (auto &device : devices) {
+        flush.count += device.native_ref()->counters().reports;
+    }
+    measures.push_back(std::move(submit));
+    measures.push_back(std::move(flush));
+}
+
+
+/** The reactor against the fake keyboards, one round trip per operation
+ * timed, after checking on the way that operations on a device complete in
+ * the order submitted, that the shadow registers see what the reactor sets,
+ * that one on a keyboard slower than its timeout completes with
+ * kIOReturnTimeout in time, that a cancelled one completes with
+ * kIOReturnAborted, that keyboards stuck past their timeouts take no more
+ * replacement workers than the spares, and that destroying the reactor
+ * completes those still running. False if any of that fails.
+ */
+bool run_reactor(options const &opts, std::vector<measure> &measures) {
+    using reactor_type = spak::basic_hid_io_reactor<spak::fake_backend>;
+    auto const slow_latency = std::chrono::milliseconds(300);
+    spak::basic_hid_device_enumerator<spak::fake_backend> enumerator(kHIDPage_GenericDesktop, kHIDUsage_GD_Keyboard);
+    std::vector<spak::basic_hid_device<spak::fake_backend>> devices(enumerator.begin(), enumerator.end());
+    auto slow_keyboard = spak::make_fake_keyboard(opts.devices, "Slow Keyboard", "HIDLED");
+    slow_keyboard->set_latency(slow_latency);
+    spak::basic_hid_device<spak::fake_backend> slow(slow_keyboard);
+    // Open beforehand so that no worker borrows it from the pool, and closed last: that waits for the abandoned calls
+    spak::basic_hid_device_opener<spak::fake_backend> const slow_opener = slow.open();
+    spak::basic_hid_device_elements_enumerator<spak::fake_backend> slow_leds = slow.elements(kHIDPage_LEDs);
+    if (devices.empty() or not slow_opener.is_open() or slow_leds.size() == 0) {
+        std::cerr << "No keyboards for the reactor." << std::endl;
+        return false;
+    }
+    spak::basic_hid_device<spak::fake_backend> &device = devices.front();
+    spak::basic_hid_device_elements_enumerator<spak::fake_backend> leds = device.elements(kHIDPage_LEDs);
+    device.shadow().set_ttl(std::chrono::hours(1));
+    measure round_trip{"reactor.round_trip", {}, ""};
+    {
+        reactor_type reactor;
+        // The shadow register gets the value first, so that a reactor going around it would leave it stale
+        CFIndex const before = leds[0].template value<CFIndex>().get().value_or(0) == 0 ? 0 : 1;
+        std::mutex mutex;
+        std::vector<unsigned> order;
+        // An odd count, so that the last value differs from the one in the shadow register
+        unsigned const sets = 63;
+        spak::hid_io_future last;
+        for (unsigned i = 0; i < sets; ++i) {
+            last = reactor.set(device, leds[0], i % 2 == 0 ? 1 - before : before, std::chrono::seconds(10),
+                               [&, i](IOReturn, CFIndex) {
+                std::lock_guard<std::mutex> lock(mutex);
+                order.push_back(i);
+            });
+        }
+        CFIndex const expected = 1 - before;
+        if (last.result() != kIOReturnSuccess or device.native_ref()->peek(kHIDPage_LEDs, leds[0].usage()) != expected) {
+            std::cerr << "The reactor did not set the LED: " << spak::describe_io_return(last.result()) << std::endl;
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (unsigned i = 0; i < order.size(); ++i) {
+                if (order[i] != i) {
+                    std::cerr << "Operation " << order[i] << " on a device completed in place of " << i << "." << std::endl;
+                    return false;
+                }
+            }
+        }
+        if (leds[0].template value<CFIndex>().get().value_or(-1) != expected) {
+            std::cerr << "The shadow registers missed a set through the reactor." << std::endl;
+            return false;
+        }
+        bench_clock::time_point const t0 = bench_clock::now();
+        spak::hid_io_future const timed_out = reactor.get(slow, slow_leds[0], std::chrono::milliseconds(20));
+        spak::hid_io_future const other = reactor.get(device, leds[1], std::chrono::seconds(10));
+        if (other.result() != kIOReturnSuccess) {
+            std::cerr << "An operation waited for another device." << std::endl;
+            return false;
+        }
+        if (timed_out.result() != kIOReturnTimeout or bench_clock::now() - t0 > slow_latency / 2) {
+            std::cerr << "The slow operation did not time out in time: " << spak::describe_io_return(timed_out.result()) << std::endl;
+            return false;
+        }
+        // Queued behind the call still running on the slow keyboard
+        spak::hid_io_future cancelled = reactor.set(slow, slow_leds[0], 1, std::chrono::seconds(10));
+        cancelled.cancel();
+        if (cancelled.result() != kIOReturnAborted) {
+            std::cerr << "The cancelled operation completed with " << spak::describe_io_return(cancelled.result()) << "." << std::endl;
+            return false;
+        }
+        for (unsigned i = 0; i < opts.warmup + opts.iterations; ++i) {
+            auto &target = devices[i % devices.size()];
+            spak::basic_hid_device_elements_enumerator<spak::fake_backend> elements = target.elements(kHIDPage_LEDs);
+            bench_clock::time_point const t1 = bench_clock::now();
+            IOReturn const res = reactor.set(target, elements[i % elements.size()], static_cast<CFIndex>(i & 1), std::chrono::seconds(10)).result();
+            bench_clock::time_point const t2 = bench_clock::now();
+            if (res != kIOReturnSuccess) {
+                std::cerr << "The reactor failed: " << spak::describe_io_return(res) << std::endl;
+                return false;
+            }
+            if (i >= opts.warmup) {
+                round_trip.samples.push_back(t2 - t1);
+            }
+        }
+        round_trip.count = round_trip.samples.size();
+    }
+    {
+        // Closed after the reactor is gone, like the slow keyboard
+        std::vector<spak::basic_hid_device<spak::fake_backend>> stuck;
+        std::vector<spak::basic_hid_device_opener<spak::fake_backend>> stuck_openers;
+        for (unsigned i = 0; i < 3; ++i) {
+            auto keyboard = spak::make_fake_keyboard(opts.devices + 1 + i, "Stuck Keyboard", "HIDLED");
+            keyboard->set_latency(slow_latency);
+            stuck.emplace_back(keyboard);
+            stuck_openers.push_back(stuck.back().open());
+        }
+        // One worker and one spare: the first timeout is replaced, the second is not, the third never starts
+        reactor_type reactor(1, 1);
+        std::vector<spak::hid_io_future> timed_out;
+        for (auto &keyboard : stuck) {
+            timed_out.push_back(reactor.get(keyboard, keyboard.elements(kHIDPage_LEDs)[0], std::chrono::milliseconds(20)));
+            // Each taken by a worker before the next is submitted
+            std::this_thread::sleep_for(slow_latency / 10);
+        }
+        for (auto const &future : timed_out) {
+            if (future.result() != kIOReturnTimeout) {
+                std::cerr << "An operation on a stuck keyboard completed with " << spak::describe_io_return(future.result()) << "." << std::endl;
+                return false;
+            }
+        }
+        if (reactor.stuck_workers() != 1) {
+            std::cerr << reactor.stuck_workers() << " replacement workers for 1 spare." << std::endl;
+            return false;
+        }
+        // Runs once a worker is back from its stuck keyboard
+        if (reactor.get(device, leds[1], std::chrono::seconds(10)).result() != kIOReturnSuccess) {
+            std::cerr << "The reactor did not recover from the stuck keyboards." << std::endl;
+            return false;
+        }
+        bench_clock::time_point const deadline = bench_clock::now() + 4 * slow_latency;
+        while (reactor.stuck_workers() != 0 and bench_clock::now() < deadline) {
+            std::this_thread::sleep_for(slow_latency / 10);
+        }
+        if (reactor.stuck_workers() != 0) {
+            std::cerr << "A replacement worker did not give its spare back." << std::endl;
+            return false;
+        }
+    }
+    spak::hid_io_future running;
+    bench_clock::time_point t0;
+    {
+        reactor_type reactor;
+        running = reactor.get(slow, slow_leds[1], std::chrono::seconds(10));
+        // Long enough for a worker to take it, well short of the latency
+        std::this_thread::sleep_for(slow_latency / 10);
+        t0 = bench_clock::now();
+    }
+    if (not running.wait_for(std::chrono::seconds(0)) or running.result() != kIOReturnAborted or bench_clock::now() - t0 > slow_latency / 2) {
+        std::cerr << "Destroying the reactor did not complete the running operation." << std::endl;
+        return false;
+    }
+    measures.push_back(std::move(round_trip));
+    return true;
+}
+
+
+/// basic_hid_elements_sink on a fake keyboard that records its reports, and when each commit ended.
+struct recording_sink {
+    spak::basic_hid_elements_sink<spak::fake_backend> sink;
+    std::vector<bench_clock::time_point> commits;
+
+    recording_sink(spak::basic_hid_device<spak::fake_backend> &device, std::vector<spak::basic_hid_device_element<spak::fake_backend>> elements) :
+        sink(device, std::move(elements)) {}
+
+    void stage(std::size_t track, CFIndex value) {
+        sink.stage(track, value);
+    }
+
+    IOReturn commit() {
+        IOReturn const res = sink.commit();
+        commits.push_back(bench_clock::now());
+        return res;
+    }
+};
+
+
+/** animation_player at 100 Hz on a fake keyboard recording its reports:
+ * a steady LED is written once and then skipped, a LED blinking every tick
+ * gets a report per tick, alternating, and the ticks are 10 ms apart on
+ * average; the intervals between commits are the samples. A value whose
+ * write fails is written again on the next tick. Then, with every write
+ * taking 35 ms, each deadline is either played or counted missed.
+ * False if any of that fails.
+ */
+bool run_animation(options const &, std::vector<measure> &measures) {
+    using player_type = spak::animation_player<recording_sink>;
+    auto const tick = std::chrono::milliseconds(10);
+    unsigned const deadlines = 30;
+    auto keyboard = spak::make_fake_keyboard(0, "Animated Keyboard", "HIDLED");
+    keyboard->set_recording(true);
+    spak::basic_hid_device<spak::fake_backend> device(keyboard);
+    spak::basic_hid_device_opener<spak::fake_backend> const opener = device.open();
+    spak::basic_hid_device_elements_enumerator<spak::fake_backend> leds = device.elements(kHIDPage_LEDs);
+    if (not opener.is_open() or leds.size() < 2) {
+        std::cerr << "No LEDs to animate." << std::endl;
+        return false;
+    }
+    measure spacing{"animation.tick", {}, ""};
+    {
+        recording_sink sink(device, {leds[0], leds[1]});
+        player_type player(sink, tick);
+        player.add_track(spak::led_pattern::constant(1));
+        player.add_track(spak::led_pattern::blink(0, 1, tick, tick));
+        player.run(tick * deadlines);
+        spak::animation_stats const stats = player.stats();
+        std::vector<spak::fake_hid_report> const reports = keyboard->reports();
+        if (stats.ticks == 0 or stats.writes != stats.ticks + 1 or stats.skipped_writes != stats.ticks - 1
+            or reports.size() != stats.ticks or sink.commits.size() != stats.ticks)
+        {
+            std::cerr << "The animation wrote " << stats.writes << " values in " << reports.size() << " reports over "
+                << stats.ticks << " ticks, skipping " << stats.skipped_writes << "." << std::endl;
+            return false;
+        }
+        for (std::size_t r = 0; r < reports.size(); ++r) {
+            std::size_t const values = r == 0 ? 2 : 1;
+            // Missed deadlines skip ticks, and so break the alternation
+            CFIndex const blinking = stats.missed_deadlines == 0 ? static_cast<CFIndex>(r % 2 == 0 ? 1 : 0) : reports[r].values.back().second;
+            if (reports[r].values.size() != values or reports[r].values.back().second != blinking) {
+                std::cerr << "Report " << r << " of the animation is wrong." << std::endl;
+                return false;
+            }
+        }
+        for (std::size_t c = 1; c < sink.commits.size(); ++c) {
+            spacing.samples.push_back(sink.commits[c] - sink.commits[c - 1]);
+        }
+        spacing.count = reports.size();
+        if (stats.missed_deadlines == 0 and sink.commits.size() > 1) {
+            auto const average = (sink.commits.back() - sink.commits.front()) / static_cast<int>(sink.commits.size() - 1);
+            if (average < tick - std::chrono::milliseconds(1) or average > tick + std::chrono::milliseconds(1)) {
+                std::cerr << "The animation ticked every " << std::chrono::duration_cast<std::chrono::microseconds>(average).count()
+                    << " us instead of 10 ms." << std::endl;
+                return false;
+            }
+        }
+    }
+    {
+        keyboard->clear_reports();
+        keyboard->fail(spak::fake_hid_op::set, kIOReturnIOError, 0, 2);
+        recording_sink sink(device, {leds[0]});
+        player_type player(sink, tick);
+        player.add_track(spak::led_pattern::constant(0));
+        player.run(tick * 5);
+        spak::animation_stats const stats = player.stats();
+        std::vector<spak::fake_hid_report> const reports = keyboard->reports();
+        if (stats.failed_commits != 2 or stats.writes != 1 or stats.skipped_writes + 3 != stats.ticks or reports.size() != 1) {
+            std::cerr << "After " << stats.failed_commits << " failed commits, the animation wrote " << stats.writes
+                << " values in " << reports.size() << " reports over " << stats.ticks << " ticks." << std::endl;
+            return false;
+        }
+    }
+    keyboard->set_latency(std::chrono::milliseconds(35));
+    {
+        recording_sink sink(device, {leds[1]});
+        player_type player(sink, tick);
+        player.add_track(spak::led_pattern::blink(0, 1, tick, tick));
+        player.run(tick * deadlines);
+        spak::animation_stats const stats = player.stats();
+        if (stats.missed_deadlines <= stats.ticks or stats.ticks + stats.missed_deadlines + 3 < deadlines
+            or stats.ticks + stats.missed_deadlines > deadlines + 3)
+        {
+            std::cerr << "Of " << deadlines << " deadlines, the slow animation played " << stats.ticks << " and missed "
+                << stats.missed_deadlines << "." << std::endl;
+            return false;
+        }
+    }
+    measures.push_back(std::move(spacing));
+    return true;
+}
+
+
+/** A device pool lending a keyboard that takes 200 ms to open: borrowing
+ * another keyboard meanwhile must not wait for that open, and a second
+ * borrower of the slow one must share it rather than open it again. The
+ * samples are the borrows of the fast keyboard. False otherwise.
+ */
+bool run_pool(options const &opts, std::vector<measure> &measures) {
+    auto const slow_open = std::chrono::milliseconds(200);
+    auto slow = spak::make_fake_keyboard(0, "Slow Keyboard", "HIDLED");
+    auto fast = spak::make_fake_keyboard(1, "Fast Keyboard", "HIDLED");
+    slow->set_latency(slow_open);
+    spak::basic_hid_device_pool<spak::fake_backend> pool(std::chrono::seconds(10));
+    measure borrow{"pool.borrow_beside_slow_open", {}, ""};
+    std::vector<std::thread> slow_borrowers;
+    std::mutex slow_mutex;
+    std::vector<IOReturn> slow_results;
+    bench_clock::time_point const t0 = bench_clock::now();
+    for (int i = 0; i < 2; ++i) {
+        slow_borrowers.emplace_back([&] {
+            spak::basic_hid_device_handle<spak::fake_backend> const handle = pool.borrow(slow);
+            std::lock_guard<std::mutex> lock(slow_mutex);
+            slow_results.push_back(handle.result());
+        });
+    }
+    // Let the slow open start
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    unsigned const borrows = std::min(opts.iterations, 100u);
+    for (unsigned i = 0; i < borrows; ++i) {
+        bench_clock::time_point const b0 = bench_clock::now();
+        spak::basic_hid_device_handle<spak::fake_backend> const handle = pool.borrow(fast);
+        borrow.samples.push_back(bench_clock::now() - b0);
+        if (not handle.is_open()) {
+            std::cerr << "The fast keyboard could not be borrowed." << std::endl;
+            return false;
+        }
+    }
+    bench_clock::time_point const fast_done = bench_clock::now();
+    for (auto &borrower : slow_borrowers) {
+        borrower.join();
+    }
+    if (fast_done - t0 >= slow_open) {
+        std::cerr << "Borrowing the fast keyboard waited for the slow one to open." << std::endl;
+        return false;
+    }
+    if (slow->counters().opens != 1 or fast->counters().opens != 1
+        or std::count(slow_results.begin(), slow_results.end(), kIOReturnSuccess) != 2)
+    {
+        std::cerr << "The pool opened the slow keyboard " << slow->counters().opens << " times and the fast one "
+            << fast->counters().opens << " times." << std::endl;
+        return false;
+    }
+    borrow.count = borrows;
+    measures.push_back(std::move(borrow));
+    return true;
+}
+
+
+/** A registry on a bus of its own: fake keyboards are plugged and
+ * unplugged, and the LED values remembered for one of them must be written
+ * again to each keyboard coming back with its identity, before it shows
+ * up, and to no other. The samples are the pumps that bring a keyboard
+ * back. False if the values are not there.
+ */
+bool run_registry(options const &opts, std::vector<measure> &measures) {
+    spak::fake_hid_bus bus;
+    spak::basic_hid_device_registry<spak::fake_backend> registry(kHIDPage_GenericDesktop, kHIDUsage_GD_Keyboard, bus);
+    auto const plug = [&](uint64_t native_id, uint32_t location_id) {
+        auto keyboard = spak::make_fake_keyboard(native_id, "Registered Keyboard", "HIDLED");
+        keyboard->set_identity(0x05AC, 0x0250, location_id);
+        bus.plug(keyboard);
+        return keyboard;
+    };
+    plug(0, 0x100);
+    plug(1, 0x200);
+    registry.pump(std::chrono::milliseconds(0));
+    auto const devices = registry.devices();
+    if (devices->size() != 2) {
+        std::cerr << "The registry has " << devices->size() << " keyboards instead of 2." << std::endl;
+        return false;
+    }
+    spak::hid_device_identity const identity = devices->front().native_id == 0 ? devices->front().device.identity() : devices->back().device.identity();
+    registry.remember(identity, 1, 1);
+    registry.remember(identity, 2, 1);
+    measure reconnect{"registry.reconnect", {}, ""};
+    uint64_t next_id = 2;
+    unsigned const rounds = std::min(opts.iterations, 100u);
+    for (unsigned i = 0; i < rounds; ++i) {
+        bus.unplug(i == 0 ? 0 : next_id - 2);
+        bus.unplug(i == 0 ? 1 : next_id - 1);
+        registry.pump(std::chrono::milliseconds(0));
+        if (not registry.devices()->empty()) {
+            std::cerr << "Unplugged keyboards stay in the registry." << std::endl;
+            return false;
+        }
+        // Fresh devices, as after a real reconnect: only the identity carries over
+        auto const returning = plug(next_id++, 0x100);
+        auto const other = plug(next_id++, 0x200);
+        bench_clock::time_point const t0 = bench_clock::now();
+        registry.pump(std::chrono::milliseconds(0));
+        reconnect.samples.push_back(bench_clock::now() - t0);
+        if (returning->peek(kHIDPage_LEDs, kHIDUsage_LED_CapsLock) != 1 or returning->peek(kHIDPage_LEDs, kHIDUsage_LED_ScrollLock) != 1
+            or returning->peek(kHIDPage_LEDs, kHIDUsage_LED_NumLock) != 0 or other->counters().sets != 0)
+        {
+            std::cerr << "The remembered LEDs were not re-applied to the returning keyboard alone." << std::endl;
+            return false;
+        }
+        if (registry.devices()->size() != 2) {
+            std::cerr << "Replugged keyboards are missing from the registry." << std::endl;
+            return false;
+        }
+        reconnect.count += returning->counters().reports;
+    }
+    measures.push_back(std::move(reconnect));
+    return true;
+}
+
+
+/// A recorded report descriptor, an LED state for it and the output reports it must encode to.
+struct recorded_descriptor {
+    char const *name;
+    std::vector<uint8_t> descriptor;
+    std::vector<CFIndex> state;
+    std::vector<std::vector<uint8_t>> reports;
+};
+
+
+std::vector<recorded_descriptor> recorded_descriptors() {
+    return {
+        // Boot protocol keyboard, HID 1.11 appendix E.6: five LED bits and three of padding, no report ID
+        {"boot_keyboard", {
+            0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7, 0x15, 0x00, 0x25, 0x01,
+            0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01, 0x75, 0x08, 0x81, 0x01, 0x95, 0x05, 0x75, 0x01,
+            0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x01, 0x95, 0x06,
+            0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00, 0xC0},
+            {1, 0, 1, 0, 0},
+            {{0x00, 0x05}}},
+        // Numbered reports: the lock LEDs in report 1, an 8 bit backlight level in report 2
+        {"numbered_keyboard", {
+            0x05, 0x01, 0x09, 0x06, 0xA1, 0x01,
+            0x85, 0x01, 0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x05,
+            0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x01,
+            0x85, 0x02, 0x05, 0x08, 0x09, 0x4B, 0x15, 0x00, 0x26, 0xFF, 0x00, 0x75, 0x08, 0x95, 0x01, 0x91, 0x02,
+            0xC0},
+            {1, 1, 0, 0, 1, 200},
+            {{0x01, 0x13}, {0x02, 0xC8}}}
+    };
+}
+
+
+/** Parses the recorded descriptors and encodes their LED states, checking
+ * the bytes against the recorded reports first; false if any differ.
+ */
+bool run_report_encoding(options const &opts, std::vector<measure> &measures) {
+    measure parse{"report.parse", {}, ""};
+    measure encode{"report.encode", {}, ""};
+    for (recorded_descriptor const &recorded : recorded_descriptors()) {
+        spak::hid_led_layout layout;
+        if (not layout.parse(recorded.descriptor) or layout.fields().size() != recorded.state.size()
+            or layout.reports().size() != recorded.reports.size()) {
+            std::cerr << "Wrong layout for " << recorded.name << std::endl;
+            return false;
+        }
+        std::vector<uint8_t> buffer(layout.max_report_size());
+        for (std::size_t r = 0; r < layout.reports().size(); ++r) {
+            std::size_t const size = layout.encode(r, recorded.state.data(), buffer.data());
+            if (std::vector<uint8_t>(buffer.begin(), buffer.begin() + static_cast<std::ptrdiff_t>(size)) != recorded.reports[r]) {
+                std::cerr << "Wrong encoding of report " << r << " for " << recorded.name << std::endl;
+                return false;
+            }
+        }
+        for (unsigned i = 0; i < opts.warmup + opts.iterations; ++i) {
+            bench_clock::time_point const t0 = bench_clock::now();
+            layout.parse(recorded.descriptor);
+            bench_clock::time_point const t1 = bench_clock::now();
+            for (std::size_t r = 0; r < layout.reports().size(); ++r) {
+                layout.encode(r, recorded.state.data(), buffer.data());
+            }
+            bench_clock::time_point const t2 = bench_clock::now();
+            if (i >= opts.warmup) {
+                parse.samples.push_back(t1 - t0);
+                encode.samples.push_back(t2 - t1);
+            }
+        }
+    }
+    measures.push_back(std::move(parse));
+    measures.push_back(std::move(encode));
+    return true;
+}
+
+
+/// Whole runs of the program in opts.exec, process start-up included.
+bool run_exec(options const &opts, std::vector<measure> &measures) {
+    std::vector<char *> argv;
+    for (std::string const &arg : opts.exec) {
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    measure m{"exec.end_to_end", {}, ""};
+    // Process creation is far slower than the rest, keep the count sensible
+    unsigned const runs = std::min(opts.iterations, 200u);
+    for (unsigned i = 0; i < runs; ++i) {
+        bench_clock::time_point const t0 = bench_clock::now();
+        pid_t pid = 0;
+        if (::posix_spawn(&pid, argv[0], nullptr, nullptr, argv.data(), environ) != 0) {
+            std::cerr << "Cannot run '" << opts.exec.front() << "'" << std::endl;
+            return false;
+        }
+        int status = 0;
+        ::waitpid(pid, &status, 0);
+        bench_clock::time_point const t1 = bench_clock::now();
+        if (not WIFEXITED(status) or WEXITSTATUS(status) != 0) {
+            std::cerr << "'" << opts.exec.front() << "' failed with status " << status << std::endl;
+            return false;
+        }
+        m.samples.push_back(t1 - t0);
+    }
+    measures.push_back(std::move(m));
+    return true;
+}
+
+
+#if not defined(__APPLE__)
+namespace sysfs_fixture {
+
+    bool write_file(std::string const &path, std::string const &contents) {
+        std::ofstream file(path);
+        file << contents << "\n";
+        return static_cast<bool>(file);
+    }
+
+    std::string read_file(std::string const &path) {
+        std::ifstream file(path);
+        std::stringstream ss;
+        ss << file.rdbuf();
+        std::string retval = ss.str();
+        while (not retval.empty() and retval.back() == '\n') {
+            retval.pop_back();
+        }
+        return retval;
+    }
+
+    bool make_dirs(std::string const &path) {
+        for (std::size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+            std::string const dir = path.substr(0, slash);
+            if (::mkdir(dir.c_str(), 0755) != 0 and errno != EEXIST) {
+                return false;
+            }
+            if (slash == std::string::npos) {
+                return true;
+            }
+        }
+    }
+
+    /** Lays out input<number> as the kernel does for a keyboard: its
+     * attributes and its event<number> under /sys/class/input, the LED class
+     * nodes beneath it with links from /sys/class/leds, and a stand-in for
+     * the event node under /dev/input.
+     */
+    bool add_keyboard(std::string const &root, unsigned number, std::string const &name) {
+        std::string const input = "input" + std::to_string(number);
+        std::string const event = "event" + std::to_string(number);
+        std::string const dir = root + "/sys/class/input/" + input;
+        bool ok = make_dirs(dir + "/id") and make_dirs(dir + "/capabilities") and make_dirs(dir + "/" + event)
+            and make_dirs(root + "/sys/class/leds") and make_dirs(root + "/dev/input")
+            and write_file(dir + "/name", name)
+            and write_file(dir + "/id/vendor", "046d") and write_file(dir + "/id/product", "c31c")
+            and write_file(dir + "/capabilities/ev", "120013") and write_file(dir + "/capabilities/led", "7")
+            and write_file(root + "/dev/input/" + event, "")
+            and ::symlink((input + "/" + event).c_str(), (root + "/sys/class/input/" + event).c_str()) == 0;
+        for (char const *led : {"numlock", "capslock", "scrolllock"}) {
+            std::string const node = input + "::" + led;
+            ok = ok and make_dirs(dir + "/" + node)
+                and write_file(dir + "/" + node + "/brightness", "0") and write_file(dir + "/" + node + "/max_brightness", "1")
+                and ::symlink(("../input/" + input + "/" + node).c_str(), (root + "/sys/class/leds/" + node).c_str()) == 0;
+        }
+        return ok;
+    }
+
+    std::string brightness(std::string const &root, unsigned number, char const *led) {
+        std::string const input = "input" + std::to_string(number);
+        return read_file(root + "/sys/class/leds/" + input + "::" + led + "/brightness");
+    }
+
+    /// Runs @p program with @p args in the fixture, its standard output in @p output.
+    bool run(std::string const &root, std::string const &program, std::vector<std::string> const &args, std::string &output) {
+        std::vector<std::string> env{"HIDLED_ROOT=" + root, "HIDLED_INDEX=" + root + "/cache/hidled.index"};
+        for (char **var = environ; *var != nullptr; ++var) {
+            if (std::strncmp(*var, "HIDLED_ROOT=", 12) != 0 and std::strncmp(*var, "HIDLED_INDEX=", 13) != 0) {
+                env.emplace_back(*var);
+            }
+        }
+        std::vector<char *> envp;
+        for (std::string &var : env) {
+            envp.push_back(&var[0]);
+        }
+        envp.push_back(nullptr);
+        std::vector<std::string> all{program};
+        all.insert(all.end(), args.begin(), args.end());
+        std::vector<char *> argv;
+        for (std::string &arg : all) {
+            argv.push_back(&arg[0]);
+        }
+        argv.push_back(nullptr);
+        std::string const output_path = root + "/stdout";
+        posix_spawn_file_actions_t actions;
+        ::posix_spawn_file_actions_init(&actions);
+        ::posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        pid_t pid = 0;
+        int const spawned = ::posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), envp.data());
+        ::posix_spawn_file_actions_destroy(&actions);
+        if (spawned != 0) {
+            std::cerr << "Cannot run '" << program << "'" << std::endl;
+            return false;
+        }
+        int status = 0;
+        ::waitpid(pid, &status, 0);
+        output = read_file(output_path);
+        if (not WIFEXITED(status) or WEXITSTATUS(status) != 0) {
+            std::cerr << "'" << program << "' failed with status " << status << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    std::vector<uint8_t> read_bytes(std::string const &path) {
+        std::ifstream file(path, std::ios::binary);
+        return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+    /** Lays out hidraw<number> with @p descriptor as its report descriptor
+     * and an empty file for its dev node, which collects the reports.
+     */
+    bool add_hidraw(std::string const &root, unsigned number, std::string const &name, std::vector<uint8_t> const &descriptor) {
+        std::string const hidraw = "hidraw" + std::to_string(number);
+        std::string const dir = root + "/sys/class/hidraw/" + hidraw + "/device";
+        if (not make_dirs(dir) or not make_dirs(root + "/dev") or not std::ofstream(root + "/dev/" + hidraw)
+            or not write_file(dir + "/uevent", "HID_ID=0003:0000046D:0000C31C\nHID_NAME=" + name + "\nHID_PHYS=usb-bench/input0"))
+        {
+            return false;
+        }
+        std::ofstream file(dir + "/report_descriptor", std::ios::binary);
+        file.write(reinterpret_cast<char const *>(descriptor.data()), static_cast<std::streamsize>(descriptor.size()));
+        return static_cast<bool>(file);
+    }
+
+    void remove_tree(std::string const &path) {
+        struct stat st;
+        if (::lstat(path.c_str(), &st) == 0 and S_ISDIR(st.st_mode)) {
+            for (std::string const &entry : spak::sysfs::list_dir(path)) {
+                remove_tree(path + "/" + entry);
+            }
+            ::rmdir(path.c_str());
+        } else {
+            ::unlink(path.c_str());
+        }
+    }
+
+}
+
+
+/** --list, --set and --toggle of the program in opts.sysfs, run on the Linux
+ * backend against a sysfs tree made up in a temporary directory, with two
+ * keyboards so that the one matched has to be told from the other.
+ */
+bool run_sysfs(options const &opts, std::vector<measure> &measures) {
+    using namespace sysfs_fixture;
+    char root_template[] = "/tmp/hidled-sysfs.XXXXXX";
+    if (::mkdtemp(root_template) == nullptr) {
+        std::cerr << "Cannot create the sysfs tree" << std::endl;
+        return false;
+    }
+    std::string const root = root_template;
+    auto fail = [&](std::string const &what) {
+        std::cerr << "sysfs: " << what << std::endl;
+        remove_tree(root);
+        return false;
+    };
+    if (not add_keyboard(root, 3, "AT Translated Set 2 keyboard") or not add_keyboard(root, 10, "Bench Keyboard")) {
+        return fail("cannot lay out the tree");
+    }
+    std::string output;
+    measure list{"sysfs.list", {}, ""};
+    bench_clock::time_point t0 = bench_clock::now();
+    if (not run(root, opts.sysfs, {"--list"}, output)) {
+        return fail("--list failed");
+    }
+    list.samples.push_back(bench_clock::now() - t0);
+    std::string const expected = "Device 'AT Translated Set 2 keyboard' by <unknown>\n"
+                                 "    Element 0 \"numlock\" [0..1]: 0\n"
+                                 "    Element 1 \"capslock\" [0..1]: 0\n"
+                                 "    Element 2 \"scrolllock\" [0..1]: 0\n"
+                                 "Device 'Bench Keyboard' by <unknown>\n"
+                                 "    Element 0 \"numlock\" [0..1]: 0\n"
+                                 "    Element 1 \"capslock\" [0..1]: 0\n"
+                                 "    Element 2 \"scrolllock\" [0..1]: 0";
+    if (output != expected) {
+        return fail("--list printed\n" + output);
+    }
+    measure set{"sysfs.set", {}, ""};
+    t0 = bench_clock::now();
+    if (not run(root, opts.sysfs, {"--product", "Bench Keyboard", "--set", "1", "1"}, output)) {
+        return fail("--set failed");
+    }
+    set.samples.push_back(bench_clock::now() - t0);
+    if (brightness(root, 10, "capslock") != "1" or brightness(root, 3, "capslock") != "0") {
+        return fail("--set 1 1 did not light the caps lock of the matching keyboard alone");
+    }
+    // By index and by usage name, back and forth; an odd count leaves it on
+    measure toggle{"sysfs.toggle", {}, ""};
+    unsigned const runs = std::min(opts.iterations, 51u) | 1u;
+    for (unsigned i = 0; i < runs; ++i) {
+        t0 = bench_clock::now();
+        if (not run(root, opts.sysfs, {"--product", "Bench Keyboard", "--toggle", i % 2 == 0 ? "0" : "num_lock"}, output)) {
+            return fail("--toggle failed");
+        }
+        toggle.samples.push_back(bench_clock::now() - t0);
+        std::string const expected_numlock = i % 2 == 0 ? "1" : "0";
+        if (brightness(root, 10, "numlock") != expected_numlock) {
+            return fail("--toggle " + std::to_string(i + 1) + " left the num lock at " + brightness(root, 10, "numlock"));
+        }
+    }
+    if (brightness(root, 3, "numlock") != "0" or brightness(root, 10, "capslock") != "1" or brightness(root, 10, "scrolllock") != "0") {
+        return fail("--toggle touched another LED");
+    }
+    measures.push_back(std::move(list));
+    measures.push_back(std::move(set));
+    measures.push_back(std::move(toggle));
+    remove_tree(root);
+    return true;
+}
+
+
+/** hidraw_backend over a hidraw tree made up from the recorded descriptors:
+ * a transaction setting every LED of a keyboard writes exactly the recorded
+ * reports to its dev node, while one setting a single LED is refused, since
+ * a plain file can tell neither HIDIOCGOUTPUT nor EVIOCGLED the others.
+ * The time of a whole-keyboard commit is the sample.
+ */
+bool run_hidraw(options const &opts, std::vector<measure> &measures) {
+    using namespace sysfs_fixture;
+    using device_type = spak::basic_hid_device<spak::hidraw_backend>;
+    char root_template[] = "/tmp/hidled-hidraw.XXXXXX";
+    if (::mkdtemp(root_template) == nullptr) {
+        std::cerr << "Cannot create the hidraw tree" << std::endl;
+        return false;
+    }
+    std::string const root = root_template;
+    auto fail = [&](std::string const &what) {
+        std::cerr << "hidraw: " << what << std::endl;
+        remove_tree(root);
+        return false;
+    };
+    std::vector<recorded_descriptor> const recorded = recorded_descriptors();
+    for (std::size_t i = 0; i < recorded.size(); ++i) {
+        if (not add_hidraw(root, static_cast<unsigned>(i), recorded[i].name, recorded[i].descriptor)) {
+            return fail("cannot lay out the tree");
+        }
+    }
+    spak::basic_hid_device_enumerator<spak::hidraw_backend> enumerator(kHIDPage_GenericDesktop, kHIDUsage_GD_Keyboard,
+                                                                       spak::hidraw_backend::manager(root));
+    measure commit{"hidraw.commit", {}, ""};
+    for (std::size_t i = 0; i < recorded.size(); ++i) {
+        device_type *device = enumerator.find(spak::basic_hid_device_matcher<spak::hidraw_backend>(recorded[i].name, ""));
+        if (device == nullptr) {
+            return fail(std::string("no device for ") + recorded[i].name);
+        }
+        std::string const dev_path = root + "/dev/hidraw" + std::to_string(i);
+        spak::basic_hid_device_opener<spak::hidraw_backend> const opener = device->open();
+        spak::basic_hid_device_elements_enumerator<spak::hidraw_backend> leds = device->elements(kHIDPage_LEDs);
+        if (not opener.is_open() or leds.size() != recorded[i].state.size()) {
+            return fail(std::string("cannot open ") + recorded[i].name + " or it has the wrong LEDs");
+        }
+        auto commit_all = [&] {
+            spak::basic_hid_device_transaction<spak::hidraw_backend> transaction = device->transaction();
+            for (std::size_t l = 0; l < leds.size(); ++l) {
+                transaction.stage(leds[l], recorded[i].state[l]);
+            }
+            return transaction.commit();
+        };
+        IOReturn const res = commit_all();
+        std::vector<uint8_t> expected;
+        for (auto const &report : recorded[i].reports) {
+            expected.insert(expected.end(), report.begin(), report.end());
+        }
+        if (res != kIOReturnSuccess or read_bytes(dev_path) != expected) {
+            return fail(std::string("wrong reports written for ") + recorded[i].name + ": " + spak::describe_io_return(res));
+        }
+        spak::basic_hid_device_transaction<spak::hidraw_backend> partial = device->transaction();
+        partial.stage(leds[0], 1 - recorded[i].state[0]);
+        if (partial.commit() != kIOReturnUnsupported or read_bytes(dev_path).size() != expected.size()) {
+            return fail(std::string("a one LED write went through on ") + recorded[i].name);
+        }
+        for (unsigned n = 0; n < opts.warmup + opts.iterations; ++n) {
+            bench_clock::time_point const t0 = bench_clock::now();
+            IOReturn const timed_res = commit_all();
+            bench_clock::time_point const t1 = bench_clock::now();
+            if (timed_res != kIOReturnSuccess) {
+                return fail(std::string("commit failed on ") + recorded[i].name);
+            }
+            if (n >= opts.warmup) {
+                commit.samples.push_back(t1 - t0);
+            }
+        }
+        ++commit.count;
+    }
+    measures.push_back(std::move(commit));
+    remove_tree(root);
+    return true;
+}
+#endif
+
+
+void usage(std::ostream &os) {
+    os << "Usage: <program> --help" << std::endl;
+    os << "       <program> [--iterations <n>] [--warmup <n>] [--devices <n>] [--latency <us>]" << std::endl;
+    os << "                 [--native] [--product <product>] [--manufacturer <manufacturer>]" << std::endl;
+    os << "                 [--output <file>] [--sysfs <hidled>] [-- <program> <args>...]" << std::endl;
+    os << std::endl;
+    os << "  --iterations <n>      timed samples per measure (default 1000)" << std::endl;
+    os << "  --warmup <n>          untimed runs before the samples (default 50)" << std::endl;
+    os << "  --devices <n>         fake keyboards on the bus, the one looked for last (default 8)" << std::endl;
+    os << "  --latency <us>        time each fake device operation takes (default 0)" << std::endl;
+    os << "  --native              measure the real devices rather than fake ones" << std::endl;
+    os << "  --product <product>, --manufacturer <manufacturer>" << std::endl;
+    os << "                        the keyboard to measure (default: the fake \"Bench Keyboard\")" << std::endl;
+    os << "  --output <file>       write the JSON results there rather than to stdout" << std::endl;
+    os << "  --sysfs <hidled>      check --list, --set and --toggle of that binary against a" << std::endl;
+    os << "                        made-up sysfs tree (Linux only)" << std::endl;
+    os << "  -- <program> <args>   time whole runs of the program, e.g. -- hidled --toggle 1" << std::endl;
+}
+
+
+int main(int argc, const char * argv[]) {
+    options opts;
+    if (not opts.parse(argc, argv)) {
+        usage(std::cerr);
+        return 1;
+    }
+    if (opts.help) {
+        usage(std::cout);
+        return 0;
+    }
+    std::vector<measure> measures;
+    std::string backend;
+    bool ok = true;
+    if (opts.native) {
+        backend = "native";
+        ok = run_pipeline<spak::native_backend>(opts, measures);
+        if (ok) {
+            run_match<spak::native_backend>(opts, measures);
+            run_device_strings<spak::native_backend>(opts, measures);
+        }
+    } else {
+        backend = "fake";
+        // The keyboard looked for comes last, like the worst case of a real scan
+        for (unsigned i = 0; i < opts.devices; ++i) {
+            bool const target = i + 1 == opts.devices;
+            auto keyboard = spak::make_fake_keyboard(i, target ? "Bench Keyboard" : "Keyboard " + std::to_string(i), "HIDLED");
+            keyboard->set_latency(std::chrono::microseconds(opts.latency_us));
+            spak::fake_hid_bus::shared().plug(std::move(keyboard));
+        }
+        if (opts.product.empty() and opts.manufacturer.empty()) {
+            opts.product = "Bench Keyboard";
+        }
+        ok = run_pipeline<spak::fake_backend>(opts, measures);
+        if (ok) {
+            run_match<spak::fake_backend>(opts, measures);
+            run_device_strings<spak::fake_backend>(opts, measures);
+            run_command_queue(opts, measures);
+            ok = run_reactor(opts, measures) and run_animation(opts, measures) and run_registry(opts, measures)
+                and run_pool(opts, measures);
+        }
+    }
+    run_copy_cf_string(opts, measures);
+    ok = ok and run_report_encoding(opts, measures);
+#if defined(__APPLE__)
+    measures.push_back(measure{"hidraw.commit", {}, "hidraw is Linux only"});
+#else
+    ok = ok and run_hidraw(opts, measures);
+#endif
+    if (ok and not opts.exec.empty()) {
+        ok = run_exec(opts, measures);
+    }
+    if (ok and not opts.sysfs.empty()) {
+#if defined(__APPLE__)
+        measures.push_back(measure{"sysfs", {}, "sysfs is Linux only"});
+#else
+        ok = run_sysfs(opts, measures);
+#endif
+    }
+    if (not ok) {
+        return 1;
+    }
+    if (opts.output.empty()) {
+        write_json(std::cout, opts, backend, measures);
+    } else {
+        std::ofstream file(opts.output);
+        write_json(file, opts, backend, measures);
+        if (not file) {
+            std::cerr << "Cannot write " << opts.output << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
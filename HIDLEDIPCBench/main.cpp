@@ -0,0 +1,196 @@
+//
+//  main.cpp
+//  HIDLEDIPCBench
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to
+//  deal in the Software without restriction, including without limitation the
+//  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+//  sell copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+//  IN THE SOFTWARE.
+//
+
+// Load generator for the IPC server: spawns an in-process ipc_server in front
+// of the led_server of --serve, over fake keyboards, then hammers it from
+// several clients, each keeping a window of requests in flight, and reports
+// latency percentiles and throughput. Every request takes the path it takes
+// in the tool: shadow sync, read of the LED and, for writes, a transaction.
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include "../HIDLED/fake_hid.hpp"
+#include "../HIDLED/ipc.hpp"
+#include "../HIDLED/led_server.hpp"
+
+using bench_clock = std::chrono::steady_clock;
+
+
+struct options {
+    unsigned clients = 4;
+    unsigned window = 16;
+    unsigned requests = 100000;
+    unsigned devices = 1;
+    long latency_us = 0;
+    std::string socket_path;
+
+    bool parse(int argc, const char * argv[]) {
+        for (int argn = 1; argn < argc; ++argn) {
+            std::string const arg = argv[argn];
+            if (argn >= argc - 1) {
+                std::cerr << "Missing argument for '" << arg << "'" << std::endl;
+                return false;
+            }
+            std::stringstream ss(argv[++argn]);
+            bool ok = true;
+            if (arg == "--clients") {
+                ok = static_cast<bool>(ss >> clients) and clients > 0;
+            } else if (arg == "--window") {
+                ok = static_cast<bool>(ss >> window) and window > 0;
+            } else if (arg == "--requests") {
+                ok = static_cast<bool>(ss >> requests);
+            } else if (arg == "--devices") {
+                ok = static_cast<bool>(ss >> devices) and devices > 0;
+            } else if (arg == "--latency") {
+                ok = static_cast<bool>(ss >> latency_us) and latency_us >= 0;
+            } else if (arg == "--socket") {
+                socket_path = ss.str();
+            } else {
+                std::cerr << "Unknown switch '" << arg << "'" << std::endl;
+                return false;
+            }
+            if (not ok) {
+                std::cerr << "Invalid value '" << ss.str() << "' for '" << arg << "'" << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+
+/** Sends @p count requests to keyboard @p device, keeping up to @p window of
+ * them in flight: toggles of the first three LEDs, and every fourth a get.
+ * Appends one latency per request.
+ */
+bool run_client(std::string const &path, unsigned device, unsigned count, unsigned window, std::vector<bench_clock::duration> &latencies) {
+    spak::ipc_client client;
+    if (client.connect(path) != kIOReturnSuccess) {
+        return false;
+    }
+    std::vector<bench_clock::time_point> sent_at(window);
+    std::vector<spak::ipc_request> requests;
+    spak::ipc_response response;
+    unsigned sent = 0;
+    unsigned received = 0;
+    while (received < count) {
+        requests.clear();
+        for (; sent < count and sent - received < window; ++sent) {
+            spak::ipc_op const op = sent % 4 == 3 ? spak::ipc_op::get : spak::ipc_op::toggle;
+            requests.push_back(spak::ipc_request{sent, op, static_cast<uint8_t>(sent % 3), static_cast<uint16_t>(device), 0});
+            sent_at[sent % window] = bench_clock::now();
+        }
+        if (not requests.empty() and not client.send(requests.data(), requests.size())) {
+            return false;
+        }
+        if (not client.receive(&response, 1) or response.id != received or response.status != kIOReturnSuccess) {
+            return false;
+        }
+        latencies.push_back(bench_clock::now() - sent_at[received % window]);
+        ++received;
+    }
+    return true;
+}
+
+
+double to_us(bench_clock::duration d) {
+    return std::chrono::duration<double, std::micro>(d).count();
+}
+
+
+int main(int argc, const char * argv[]) {
+    options opts;
+    if (not opts.parse(argc, argv)) {
+        std::cerr << "Usage: <program> [--clients <n>] [--window <n>] [--requests <per client>] [--devices <n>] [--latency <us>]" << std::endl;
+        std::cerr << "                 [--socket <path>]" << std::endl;
+        return 1;
+    }
+    if (opts.socket_path.empty()) {
+        opts.socket_path = "/tmp/hidled-bench-" + std::to_string(::getpid()) + ".sock";
+    }
+    for (unsigned i = 0; i < opts.devices; ++i) {
+        auto keyboard = spak::make_fake_keyboard(i, "IPC Keyboard " + std::to_string(i), "HIDLED");
+        keyboard->set_latency(std::chrono::microseconds(opts.latency_us));
+        spak::fake_hid_bus::shared().plug(std::move(keyboard));
+    }
+    spak::basic_hid_device_enumerator<spak::fake_backend> enumerator(kHIDPage_GenericDesktop, kHIDUsage_GD_Keyboard);
+    spak::basic_led_server<spak::fake_backend> handler(enumerator, spak::basic_hid_device_matcher<spak::fake_backend>("", "HIDLED"));
+    if (handler.size() != opts.devices) {
+        std::cerr << "The server holds " << handler.size() << " of the " << opts.devices << " keyboards." << std::endl;
+        return 1;
+    }
+    spak::ipc_server<spak::basic_led_server<spak::fake_backend>> server(handler, opts.socket_path);
+    IOReturn const res = server.listen();
+    if (res != kIOReturnSuccess) {
+        std::cerr << "Could not listen on " << opts.socket_path << ": " << spak::describe_io_return(res) << std::endl;
+        return 1;
+    }
+    std::thread server_thread([&] {
+        server.run();
+    });
+
+    std::vector<std::vector<bench_clock::duration>> latencies(opts.clients);
+    std::vector<char> succeeded(opts.clients, 0);
+    std::vector<std::thread> clients;
+    bench_clock::time_point const start = bench_clock::now();
+    for (unsigned i = 0; i < opts.clients; ++i) {
+        latencies[i].reserve(opts.requests);
+        clients.emplace_back([&, i] {
+            succeeded[i] = run_client(opts.socket_path, i % opts.devices, opts.requests, opts.window, latencies[i]);
+        });
+    }
+    for (auto &client : clients) {
+        client.join();
+    }
+    bench_clock::duration const elapsed = bench_clock::now() - start;
+    server.stop();
+    server_thread.join();
+
+    if (std::count(succeeded.begin(), succeeded.end(), 0) > 0) {
+        std::cerr << "Some clients failed." << std::endl;
+        return 1;
+    }
+    std::vector<bench_clock::duration> all;
+    for (auto const &l : latencies) {
+        all.insert(all.end(), l.begin(), l.end());
+    }
+    if (all.empty()) {
+        std::cerr << "No requests were sent." << std::endl;
+        return 1;
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [&](double p) {
+        return all[std::min(all.size() - 1, static_cast<std::size_t>(p * static_cast<double>(all.size())))];
+    };
+    std::cout << opts.clients << " clients x " << opts.requests << " requests, window " << opts.window
+        << ", " << opts.devices << " keyboard(s), latency " << opts.latency_us << " us" << std::endl;
+    std::cout << "ops/sec: " << static_cast<double>(all.size()) / std::chrono::duration<double>(elapsed).count() << std::endl;
+    std::cout << "p50: " << to_us(percentile(0.50)) << " us" << std::endl;
+    std::cout << "p99: " << to_us(percentile(0.99)) << " us" << std::endl;
+    std::cout << "max: " << to_us(all.back()) << " us" << std::endl;
+    return 0;
+}